@@ -133,6 +133,60 @@ enum nvme_log_facility {
 
 };
 
+/**
+ * @brief Memory pool pre-population request
+ */
+struct nvme_mem_prefill {
+
+	/**
+	 * Size in Bytes of the objects.
+	 */
+	size_t			size;
+
+	/**
+	 * Number of objects to pre-allocate memory for.
+	 */
+	size_t			nr_objs;
+
+};
+
+/**
+ * @brief Library options
+ *
+ * Allow the user to request non-default options.
+ */
+struct nvme_lib_opts {
+
+	/**
+	 * Number of hugepages to reserve on each NUMA node.
+	 * Reserved hugepages are allocated at initialization, in
+	 * addition to the hugepages used to pre-populate memory pools,
+	 * and are not released when unused.
+	 * (default: 0)
+	 */
+	unsigned int			nr_reserved_hugepages;
+
+	/**
+	 * Memory pools to pre-populate at initialization: memory
+	 * for the specified number of objects is allocated and kept
+	 * in the memory pool of the objects size on each NUMA node.
+	 * (default: none)
+	 */
+	unsigned int			nr_prefill;
+	const struct nvme_mem_prefill	*prefill;
+
+	/**
+	 * Interval in milliseconds of the background thread reclaiming
+	 * free memory from memory pools above their high watermark
+	 * (see nvme_mem_set_watermarks()). If 0, no thread is started
+	 * and free memory is reclaimed only when other memory pools
+	 * grow or when nvme_mem_reclaim() is called.
+	 * (default: 0)
+	 */
+	unsigned int			reclaim_interval;
+
+};
+
 /**
  * @brief Initialize libnvme
  *
@@ -150,6 +204,25 @@ enum nvme_log_facility {
 extern int nvme_lib_init(enum nvme_log_level level,
 			 enum nvme_log_facility facility, const char *path);
 
+/**
+ * @brief Initialize libnvme with non-default options
+ *
+ * @param level	Library log level
+ * @param facility	Facility code
+ * @param path		File name for the NVME_LOG_FILE facility
+ * @param opts		Library options (NULL for default options)
+ *
+ * Same as nvme_lib_init(), but also allows reserving hugepages and
+ * pre-populating memory pools so that later memory allocations do
+ * not need to allocate hugepages from the system, which is slow.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_lib_init_opts(enum nvme_log_level level,
+			      enum nvme_log_facility facility,
+			      const char *path,
+			      const struct nvme_lib_opts *opts);
+
 /**
  * @brief Set the library log level
  *
@@ -185,6 +258,18 @@ extern int nvme_set_log_facility(enum nvme_log_facility facility,
  */
 extern enum nvme_log_facility nvme_get_log_facility(void);
 
+/**
+ * @brief Notify the library of CPU affinity changes
+ *
+ * The library caches the CPU and NUMA node of each thread to avoid
+ * looking them up on every memory allocation. This function must be
+ * called after changing the CPU affinity of a thread using the library
+ * (e.g. with pthread_setaffinity_np()) so that all threads get their
+ * identity again. Unnotified changes are detected only after many
+ * lookups.
+ */
+extern void nvme_cpu_affinity_changed(void);
+
 /**
  * @brief Opaque handle to a controller returned by nvme_ctrlr_open().
  */
@@ -200,6 +285,21 @@ struct nvme_ns;
  */
 struct nvme_qpair;
 
+/**
+ * @brief Opaque handle to a poll group
+ */
+struct nvme_poll_group;
+
+/**
+ * @brief Opaque handle to a QoS I/O queue pairs pool
+ */
+struct nvme_qos;
+
+/**
+ * @brief Opaque handle to a registered buffer
+ */
+struct nvme_buf;
+
 /**
  * @brief Capabilities register of a controller
  */
@@ -279,6 +379,13 @@ struct nvme_ctrlr_stat {
 	 */
 	unsigned int		func;
 
+	/**
+	 * NUMA node the PCI device is attached to, or NVME_NODE_ID_ANY
+	 * if unknown. I/O queue pairs memory is allocated on this node
+	 * by default.
+	 */
+	unsigned int		node_id;
+
 	/**
 	 * Serial number
 	 */
@@ -334,6 +441,19 @@ struct nvme_ctrlr_stat {
 	 * IO qpairs maximum entries
 	 */
 	unsigned int		max_qd;
+
+	/**
+	 * The controller was opened as a secondary process
+	 * of a shared controller.
+	 */
+	bool			secondary;
+
+	/**
+	 * Number of secondary processes attached to the controller,
+	 * if the controller is shared and this process is its
+	 * primary process.
+	 */
+	unsigned int		nr_secondaries;
 };
 
 /**
@@ -361,6 +481,25 @@ struct nvme_ctrlr_opts {
 	 */
 	enum nvme_cc_ams	arb_mechanism;
 
+	/**
+	 * Share the controller with other processes.
+	 * The first process opening the controller with this option
+	 * becomes the controller primary process: it initializes the
+	 * controller and executes the admin commands of the processes
+	 * opening the controller afterwards, which become secondary
+	 * processes. Secondary processes get their own I/O qpairs,
+	 * which the primary process deletes if a secondary process
+	 * terminates without closing the controller. The other options
+	 * are ignored for secondary processes. Only processes of the
+	 * primary process user (or of root) can become secondary
+	 * processes, and their admin commands are limited to identify,
+	 * get log page, get features and abort. Secondary processes
+	 * I/O qpairs are re-created after a controller reset like the
+	 * primary process ones.
+	 * (default: false)
+	 */
+	bool			shared;
+
 };
 
 /**
@@ -462,6 +601,129 @@ struct nvme_qpair_stat {
 	 * Qpair priority
 	 */
 	unsigned int		qprio;
+
+	/**
+	 * Backpressure submission mode is enabled
+	 */
+	bool			backpressure;
+
+	/**
+	 * Number of commands currently queued waiting for a free entry
+	 */
+	unsigned int		queued;
+
+	/**
+	 * Maximum number of commands queued at the same time
+	 */
+	unsigned int		max_queued;
+
+	/**
+	 * Total number of commands queued
+	 */
+	unsigned long long	total_queued;
+
+	/**
+	 * Number of submissions rejected with -EAGAIN in backpressure mode
+	 */
+	unsigned long long	rejected;
+
+	/**
+	 * Number of commands currently deferred by rate limiting
+	 */
+	unsigned int		throttled;
+};
+
+/**
+ * @brief I/O rate limits
+ */
+struct nvme_rate_limit {
+
+	/**
+	 * Maximum number of commands per second (0 for no limit)
+	 */
+	unsigned long long	iops;
+
+	/**
+	 * Maximum number of bytes transferred per second (0 for no limit)
+	 */
+	unsigned long long	bps;
+};
+
+/**
+ * @brief Arbitration burst value for no burst size limit
+ */
+#define NVME_ARB_BURST_UNLIMITED	7
+
+/**
+ * @brief Controller command arbitration parameters
+ */
+struct nvme_arbitration {
+
+	/**
+	 * Arbitration burst: maximum number of commands (2^burst) the
+	 * controller may fetch at once from a submission queue. Use
+	 * NVME_ARB_BURST_UNLIMITED for no limit.
+	 */
+	unsigned int		burst;
+
+	/**
+	 * Weighted round robin arbitration weights (1 to 256) of the
+	 * high, medium and low priority classes: number of commands
+	 * fetched from a class per arbitration round.
+	 */
+	unsigned int		high_weight;
+	unsigned int		medium_weight;
+	unsigned int		low_weight;
+};
+
+/**
+ * @brief Number of I/O queue priority classes (see enum nvme_qprio)
+ */
+#define NVME_QOS_CLASSES	4
+
+/**
+ * @brief Poll group member information
+ */
+struct nvme_poll_group_stat {
+
+	/**
+	 * Member I/O queue pair
+	 */
+	struct nvme_qpair	*qpair;
+
+	/**
+	 * Number of completions processed by the last poll
+	 */
+	unsigned int		completions;
+
+	/**
+	 * Total number of completions processed
+	 */
+	unsigned long long	total_completions;
+};
+
+/**
+ * @brief Command completion record
+ *
+ * Filled by nvme_ioqp_reap() for each completed command.
+ */
+struct nvme_cpl_rec {
+
+	/**
+	 * Callback argument specified when the command was submitted
+	 */
+	void			*cb_arg;
+
+	/**
+	 * Command specific completion result (dword 0)
+	 */
+	uint32_t		cdw0;
+
+	/**
+	 * Command completion status
+	 */
+	struct nvme_status	status;
+
 };
 
 /**
@@ -473,6 +735,16 @@ struct nvme_qpair_stat {
 typedef void (*nvme_cmd_cb)(void *cmd_cb_arg,
 			    const struct nvme_cpl *cpl_status);
 
+/**
+ * @brief Command timeout callback function signature
+ *
+ * @param arg		Callback function input argument.
+ * @param qpair		I/O queue pair of the command.
+ * @param cmd_cb_arg	Completion callback input argument of the command.
+ */
+typedef void (*nvme_timeout_cb)(void *arg, struct nvme_qpair *qpair,
+				void *cmd_cb_arg);
+
 /**
  * @brief Asynchronous error request completion callback
  *
@@ -511,7 +783,8 @@ typedef int (*nvme_req_next_sge_cb)(void *cb_arg,
  *
  * Obtain a handle for an NVMe controller specified as a PCI device URL,
  * e.g. pci://[DDDD:]BB:DD.F. If called more than once for the same
- * controller, NULL is returned.
+ * controller, NULL is returned. A controller can be opened by several
+ * processes only with the shared option (see struct nvme_ctrlr_opts).
  * To stop using the the controller and release its associated resources,
  * call nvme_ctrlr_close() with the handle returned by this function.
  *
@@ -526,7 +799,9 @@ extern struct nvme_ctrlr * nvme_ctrlr_open(const char *url,
  * @param ctrlr	Controller handle
  *
  * This function should be called while no other threads
- * are actively using the controller.
+ * are actively using the controller. For a shared controller,
+ * the primary process should close the controller after its
+ * secondary processes.
  *
  * @return 0 on success and a negative error code on failure.
  */
@@ -601,6 +876,39 @@ extern int nvme_ctrlr_set_feature(struct nvme_ctrlr *ctrlr,
 				  uint32_t cdw11, uint32_t cdw12,
 				  uint32_t *attributes);
 
+/**
+ * @brief Get the command arbitration parameters of a controller
+ *
+ * @param ctrlr	Controller handle
+ * @param arb	Arbitration parameters to fill
+ *
+ * This function is thread safe and can be called at any point while
+ * the controller is attached.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ctrlr_get_arbitration(struct nvme_ctrlr *ctrlr,
+				      struct nvme_arbitration *arb);
+
+/**
+ * @brief Set the command arbitration parameters of a controller
+ *
+ * @param ctrlr	Controller handle
+ * @param arb	Arbitration parameters
+ *
+ * Program the arbitration burst and, if the controller was opened
+ * with the weighted round robin arbitration mechanism (NVME_CC_AMS_WRR),
+ * the weights of the high, medium and low priority classes. Weights
+ * are ignored with the default round robin arbitration mechanism.
+ * The controller recommended arbitration burst is reported by
+ * nvme_ctrlr_data() (rab field). This function is thread safe and
+ * can be called at any point while the controller is attached.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ctrlr_set_arbitration(struct nvme_ctrlr *ctrlr,
+				      const struct nvme_arbitration *arb);
+
 /**
  * @brief Attach the specified namespace to controllers
  *
@@ -682,9 +990,18 @@ extern int nvme_ctrlr_update_firmware(struct nvme_ctrlr *ctrlr,
  * @param qprio I/O queue pair priority for weighted round robin arbitration
  * @param qd 	I/O queue pair maximum submission queue depth
  *
- * A queue depth of 0 will result in the maximum hardware defined queue
- * depth being used. The use of a queue pair is not thread safe. Applications
- * must ensure mutual exclusion access to the queue pair during I/O processing.
+ * A queue depth of 0 will result in the default queue depth of 1024
+ * entries being used, or in the maximum hardware defined queue depth if
+ * it is smaller. Larger queue depths, up to the controller maximum
+ * (see struct nvme_ctrlr_stat max_qd), may be requested.
+ * The queue pair is owned by the calling thread: command
+ * submission and completion polling on the queue pair do not use any lock
+ * and must only be executed by this thread. Applications using multiple
+ * threads should get one queue pair per thread. Libraries built with
+ * debug checks enabled (--enable-debug) abort on cross-thread use.
+ * After a controller reset, the queue pair is re-created by the next
+ * command submission or completion polling of its owner thread, and
+ * the commands outstanding at the time of the reset are aborted.
  *
  * @return An I/O queue pair handle on success and NULL in case of failure.
  */
@@ -692,12 +1009,58 @@ extern struct nvme_qpair * nvme_ioqp_get(struct nvme_ctrlr *ctrlr,
 					 enum nvme_qprio qprio,
 					 unsigned int qd);
 
+/**
+ * @brief Get an I/O queue pair with memory on a NUMA node
+ *
+ * @param ctrlr	Controller handle
+ * @param qprio I/O queue pair priority for weighted round robin arbitration
+ * @param qd 	I/O queue pair maximum submission queue depth
+ * @param node_id	NUMA node for the queue pair memory
+ *
+ * Same as nvme_ioqp_get(), but the queue pair submission and completion
+ * queues, trackers and requests are allocated on the specified NUMA node
+ * instead of the controller NUMA node (see struct nvme_ctrlr_stat
+ * node_id). A node_id of NVME_NODE_ID_ANY selects the controller node.
+ *
+ * @return An I/O queue pair handle on success and NULL in case of failure.
+ */
+extern struct nvme_qpair * nvme_ioqp_get_node(struct nvme_ctrlr *ctrlr,
+					      enum nvme_qprio qprio,
+					      unsigned int qd,
+					      unsigned int node_id);
+
+/**
+ * @brief Get the local I/O queue pair of the calling thread
+ *
+ * @param ctrlr	Controller handle
+ *
+ * Return the I/O queue pair bound to the calling thread for the
+ * controller. On the first call from a thread, a new queue pair with
+ * the default queue depth and priority is allocated on the thread NUMA
+ * node. Once all the controller I/O queue pairs are used (see struct
+ * nvme_ctrlr_opts io_queues), threads are spread evenly over the local
+ * queue pairs already allocated, preferably on their NUMA node.
+ *
+ * Local queue pairs may thus be shared by several threads: submission
+ * and completion polling use a lock, and a thread polling a shared queue
+ * pair may process the completions of commands submitted by other
+ * threads. Local queue pairs are released automatically when all their
+ * threads have exited and must not be released with nvme_ioqp_release().
+ *
+ * @return An I/O queue pair handle on success and NULL in case of failure.
+ */
+extern struct nvme_qpair * nvme_ioqp_get_local(struct nvme_ctrlr *ctrlr);
+
 /**
  * @brief Release an I/O queue pair
  *
  * @param qpair	I/O queue pair handle
  *
- * @return 0 on success and a negative error code on failure.
+ * A queue pair belonging to a poll group must first be removed from
+ * its group with nvme_poll_group_remove(), by the group owner thread.
+ *
+ * @return 0 on success and a negative error code on failure
+ * (-EBUSY if the queue pair belongs to a poll group).
  */
 extern int nvme_ioqp_release(struct nvme_qpair *qpair);
 
@@ -727,6 +1090,7 @@ extern int nvme_qpair_stat(struct nvme_qpair *qpair,
  *
  * When constructing the nvme_command it is not necessary to fill out the PRP
  * list/SGL or the CID. The driver will handle both of those for you.
+ * This function must be called from the thread owning the queue pair.
  *
  * @return 0 on success and a negative error code on failure.
  */
@@ -747,7 +1111,7 @@ extern int nvme_ioqp_submit_cmd(struct nvme_qpair *qpair,
  * For each completed command, the request callback function will
  * be called if specified as non-NULL when the request was submitted.
  * This function may be called at any point after the command submission
- * while the controller is open
+ * while the controller is open, from the thread owning the queue pair.
  *
  * @return The number of completions processed (may be 0).
  *
@@ -756,6 +1120,282 @@ extern int nvme_ioqp_submit_cmd(struct nvme_qpair *qpair,
 extern unsigned int nvme_ioqp_poll(struct nvme_qpair *qpair,
 				   unsigned int max_completions);
 
+/**
+ * @brief Reap I/O command completions
+ *
+ * @param qpair		I/O queue pair handle
+ * @param recs		Array of completion records to fill
+ * @param max_recs	Number of records in @recs
+ *
+ * This call is non-blocking and, similarly to nvme_ioqp_poll(), processes
+ * completions ready at the time of the call. But instead of calling the
+ * completion callback function of each completed command, the command
+ * callback argument and completion status are returned in @recs, allowing
+ * applications to process completions in batch. The command callback
+ * function is not called for commands completed with this function.
+ * Commands completed by the library itself rather than by the controller
+ * (e.g. commands failing at submission due to an invalid buffer address,
+ * or commands aborted or failed by a controller reset or failure) have
+ * their callback function called if one was specified, and are otherwise
+ * returned in @recs by the next call to this function.
+ * This function must be called from the thread owning the queue pair.
+ *
+ * @return The number of completion records filled (may be 0).
+ */
+extern unsigned int nvme_ioqp_reap(struct nvme_qpair *qpair,
+				   struct nvme_cpl_rec *recs,
+				   unsigned int max_recs);
+
+/**
+ * @brief Start batching submissions on an I/O queue pair
+ *
+ * @param qpair	I/O queue pair handle
+ *
+ * While a queue pair is plugged, commands submitted to the queue pair
+ * (e.g. with nvme_ns_read() or nvme_ns_write()) are only written to the
+ * submission queue and are not seen by the controller until
+ * nvme_ioqp_unplug() is called. This allows publishing a batch of
+ * commands with a single doorbell write.
+ */
+extern void nvme_ioqp_plug(struct nvme_qpair *qpair);
+
+/**
+ * @brief Stop batching submissions on an I/O queue pair
+ *
+ * @param qpair	I/O queue pair handle
+ *
+ * Publish to the controller all commands submitted since the queue pair
+ * was plugged and all processed completions not yet released to the
+ * controller.
+ */
+extern void nvme_ioqp_unplug(struct nvme_qpair *qpair);
+
+/**
+ * @brief Set an I/O queue pair completion doorbell batch
+ *
+ * @param qpair	I/O queue pair handle
+ * @param batch	Number of completions
+ *
+ * Defer releasing completion queue entries to the controller until
+ * at least @batch completions have been processed. The default is 1,
+ * that is, the completion queue head doorbell is written by every call
+ * to nvme_ioqp_poll() processing completions. The batch size is limited
+ * so that the controller always has room to post completions for all
+ * outstanding commands. nvme_ioqp_unplug() releases deferred entries.
+ *
+ * @return The batch size set on success and a negative error code
+ * on failure.
+ */
+extern int nvme_ioqp_set_cq_batch(struct nvme_qpair *qpair,
+				  unsigned int batch);
+
+/**
+ * @brief Set an I/O queue pair command timeout
+ *
+ * @param qpair		I/O queue pair handle
+ * @param timeout_ms	Command timeout in milliseconds (0 to disable)
+ * @param cb_fn		Timeout callback function (may be NULL)
+ * @param cb_arg	Timeout callback function argument
+ *
+ * Commands submitted to the queue pair and outstanding for longer than
+ * @timeout_ms are aborted, and @cb_fn is called, which allows the
+ * application to resubmit the command elsewhere. The abort is delayed
+ * to a later poll while the controller executes an admin command, so
+ * that polling does not wait for it. If an aborted command
+ * is still not completed after another @timeout_ms, the controller is
+ * reset by nvme_ioqp_poll() once it has processed the queue pair
+ * completions. Timeouts are checked by nvme_ioqp_poll(), including
+ * when called through nvme_poll_group_poll() and nvme_qos_poll(), with
+ * a resolution of a few milliseconds. The timeout callback is executed
+ * from nvme_ioqp_poll() and may submit commands but must not poll the
+ * queue pair. Timeouts are disabled by default.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ioqp_set_timeout(struct nvme_qpair *qpair,
+				 unsigned int timeout_ms,
+				 nvme_timeout_cb cb_fn, void *cb_arg);
+
+/**
+ * @brief Set an I/O queue pair backpressure submission mode
+ *
+ * @param qpair		I/O queue pair handle
+ * @param enable	true to enable backpressure, false to disable it
+ *
+ * By default, a command submitted while all queue pair entries are in
+ * use is queued internally and sent to the controller once an outstanding
+ * command completes. With backpressure enabled, such submission instead
+ * fails with -EAGAIN, without calling the command callback, and must be
+ * retried by the application after polling the queue pair for
+ * completions. A command split into multiple commands is accepted only
+ * if all of them can be submitted immediately. Commands submitted while
+ * the queue pair is disabled by a controller reset are still queued.
+ * The number of queued and rejected commands are reported by
+ * nvme_qpair_stat(), and are not reset by changing the mode.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ioqp_set_backpressure(struct nvme_qpair *qpair, bool enable);
+
+/**
+ * @brief Set an I/O queue pair rate limits
+ *
+ * @param qpair	I/O queue pair handle
+ * @param limit	IOPS and bandwidth limits (NULL for no limit)
+ *
+ * Limit the rate of commands submitted to the queue pair. Commands
+ * exceeding the limits are not failed but deferred to a software queue
+ * and submitted by nvme_ioqp_poll() once within the limits. Limits can
+ * be changed at any time and there are no limits by default.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ioqp_set_rate_limit(struct nvme_qpair *qpair,
+				    const struct nvme_rate_limit *limit);
+
+/**
+ * @brief Create a poll group
+ *
+ * A poll group allows polling with a single call I/O queue pairs of
+ * any number of controllers. The poll group is owned by the calling
+ * thread, which must also own all I/O queue pairs added to the group.
+ *
+ * @return A poll group handle on success and NULL in case of failure.
+ */
+extern struct nvme_poll_group *nvme_poll_group_create(void);
+
+/**
+ * @brief Destroy a poll group
+ *
+ * @param pg	Poll group handle
+ *
+ * The I/O queue pairs of the group are removed from the group
+ * but not released.
+ */
+extern void nvme_poll_group_destroy(struct nvme_poll_group *pg);
+
+/**
+ * @brief Add an I/O queue pair to a poll group
+ *
+ * @param pg	Poll group handle
+ * @param qpair	I/O queue pair handle
+ *
+ * An I/O queue pair can belong to a single poll group, and must be
+ * removed from its group before being released with nvme_ioqp_release().
+ * Closing the controller releases its queue pairs without removing them
+ * from their group, as only the group owner thread may change the group:
+ * remove the queue pairs or destroy the group before closing the
+ * controller.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_poll_group_add(struct nvme_poll_group *pg,
+			       struct nvme_qpair *qpair);
+
+/**
+ * @brief Remove an I/O queue pair from a poll group
+ *
+ * @param pg	Poll group handle
+ * @param qpair	I/O queue pair handle
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_poll_group_remove(struct nvme_poll_group *pg,
+				  struct nvme_qpair *qpair);
+
+/**
+ * @brief Poll for completions the I/O queue pairs of a poll group
+ *
+ * @param pg		Poll group handle
+ * @param budget	Maximum number of completions to process
+ *
+ * Process at most @budget completions (0 means no limit) of the I/O
+ * queue pairs of a poll group. Idle queue pairs are skipped and the
+ * budget is evenly shared between the queue pairs with completions.
+ * Any budget left unused by some queue pairs is given to the others.
+ * The number of completions processed for each queue pair can be
+ * obtained with nvme_poll_group_stat().
+ *
+ * @return The number of completions processed.
+ */
+extern unsigned int nvme_poll_group_poll(struct nvme_poll_group *pg,
+					 unsigned int budget);
+
+/**
+ * @brief Get information on the members of a poll group
+ *
+ * @param pg		Poll group handle
+ * @param stats	Array of member information to fill
+ * @param max_stats	Size of the @stats array
+ *
+ * @return The number of members of the poll group.
+ */
+extern unsigned int nvme_poll_group_stat(struct nvme_poll_group *pg,
+					 struct nvme_poll_group_stat *stats,
+					 unsigned int max_stats);
+
+/**
+ * @brief Create a QoS I/O queue pairs pool
+ *
+ * @param ctrlr		Controller handle
+ * @param nr_qpairs	Number of I/O queue pairs of each priority class,
+ *			indexed by enum nvme_qprio
+ * @param qd		Number of entries of the queue pairs (0 for default)
+ *
+ * A QoS pool allocates I/O queue pairs of each priority class so that
+ * commands can be routed by class, e.g. latency critical reads through
+ * NVME_QPRIO_URGENT or NVME_QPRIO_HIGH queue pairs and background writes
+ * through NVME_QPRIO_LOW queue pairs. Classes other than NVME_QPRIO_URGENT
+ * require the controller to be opened with the weighted round robin
+ * arbitration mechanism (NVME_CC_AMS_WRR), see nvme_ctrlr_set_arbitration().
+ * The pool and its queue pairs are owned by the calling thread.
+ *
+ * @return A QoS pool handle on success and NULL in case of failure.
+ */
+extern struct nvme_qos *nvme_qos_create(struct nvme_ctrlr *ctrlr,
+					const unsigned int *nr_qpairs,
+					unsigned int qd);
+
+/**
+ * @brief Destroy a QoS I/O queue pairs pool
+ *
+ * @param qos	QoS pool handle
+ *
+ * Release all I/O queue pairs of the pool. All commands submitted
+ * to the pool queue pairs must be completed.
+ */
+extern void nvme_qos_destroy(struct nvme_qos *qos);
+
+/**
+ * @brief Get an I/O queue pair of a QoS pool priority class
+ *
+ * @param qos	QoS pool handle
+ * @param qprio	Priority class
+ *
+ * Get the least loaded I/O queue pair of the @qprio class. If the pool
+ * has no queue pair of this class, a queue pair of the closest lower
+ * priority class is returned, or of the closest higher priority class
+ * if there is none.
+ *
+ * @return An I/O queue pair handle.
+ */
+extern struct nvme_qpair *nvme_qos_get_qpair(struct nvme_qos *qos,
+					     enum nvme_qprio qprio);
+
+/**
+ * @brief Poll for completions the I/O queue pairs of a QoS pool
+ *
+ * @param qos		QoS pool handle
+ * @param budget	Maximum number of completions to process
+ *
+ * Process at most @budget completions (0 means no limit) of the
+ * I/O queue pairs of a QoS pool, in priority class order, so that
+ * the completions of higher priority commands are processed first.
+ *
+ * @return The number of completions processed.
+ */
+extern unsigned int nvme_qos_poll(struct nvme_qos *qos, unsigned int budget);
+
 /**
  * @brief Open a name space
  *
@@ -798,6 +1438,24 @@ extern int nvme_ns_stat(struct nvme_ns *ns,
 extern int nvme_ns_data(struct nvme_ns *ns,
 			struct nvme_ns_data *nsdata);
 
+/**
+ * @brief Set a name space rate limits
+ *
+ * @param ns	Namspace handle
+ * @param limit	IOPS and bandwidth limits (NULL for no limit)
+ *
+ * Limit the rate of I/O commands issued to the name space through
+ * any I/O queue pair. Commands exceeding the limits are deferred to
+ * the software queue of their queue pair and submitted by
+ * nvme_ioqp_poll() once within the limits. Limits are shared by all
+ * threads, can be changed at any time and there are no limits by
+ * default.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_ns_set_rate_limit(struct nvme_ns *ns,
+				  const struct nvme_rate_limit *limit);
+
 /**
  * @brief Submit a write I/O
  *
@@ -840,6 +1498,30 @@ extern int nvme_ns_writev(struct nvme_ns *ns, struct nvme_qpair *qpair,
 			  nvme_req_reset_sgl_cb reset_sgl_fn,
 			  nvme_req_next_sge_cb next_sge_fn);
 
+/**
+ * @brief Submit a write I/O using a registered buffer
+ *
+ * @param ns		Namespace handle
+ * @param qpair		I/O queue pair handle
+ * @param buf		Registered buffer handle
+ * @param offset	Offset in bytes of the data to write in the buffer
+ * @param lba		Starting LBA to write to
+ * @param lba_count	Number of LBAs to write
+ * @param cb_fn		Completion callback
+ * @param cb_arg	Argument to pass to the completion callback
+ * @param io_flags	I/O flags (NVME_IO_FLAGS_*)
+ *
+ * The data to write must be within the buffer.
+ * See nvme_buf_register().
+ *
+ * @return 0 on success and a negative error code in case of failure.
+ */
+extern int nvme_ns_write_buf(struct nvme_ns *ns, struct nvme_qpair *qpair,
+			     struct nvme_buf *buf, size_t offset,
+			     uint64_t lba, uint32_t lba_count,
+			     nvme_cmd_cb cb_fn, void *cb_arg,
+			     unsigned int io_flags);
+
 /**
  * @brief Submits a write I/O with metadata
  *
@@ -924,6 +1606,30 @@ extern int nvme_ns_readv(struct nvme_ns *ns, struct nvme_qpair *qpair,
 			 nvme_req_reset_sgl_cb reset_sgl_fn,
 			 nvme_req_next_sge_cb next_sge_fn);
 
+/**
+ * @brief Submit a read I/O using a registered buffer
+ *
+ * @param ns		Namespace handle
+ * @param qpair		I/O queue pair handle
+ * @param buf		Registered buffer handle
+ * @param offset	Offset in bytes in the buffer of the data read
+ * @param lba		Starting LBA to read from
+ * @param lba_count	Number of LBAs to read
+ * @param cb_fn		Completion callback
+ * @param cb_arg	Argument to pass to the completion callback
+ * @param io_flags	I/O flags (NVME_IO_FLAGS_*)
+ *
+ * The data read must be within the buffer.
+ * See nvme_buf_register().
+ *
+ * @return 0 on success and a negative error code in case of failure.
+ */
+extern int nvme_ns_read_buf(struct nvme_ns *ns, struct nvme_qpair *qpair,
+			    struct nvme_buf *buf, size_t offset,
+			    uint64_t lba, uint32_t lba_count,
+			    nvme_cmd_cb cb_fn, void *cb_arg,
+			    unsigned int io_flags);
+
 /**
  * @brief Submit a read I/O with metadata
  *
@@ -1084,6 +1790,11 @@ extern int nvme_ns_reservation_report(struct nvme_ns *ns,
  * on the requested NUMA node if node_id is not NVME_NODE_ID_ANY.
  * Otherwise, allocation will take preferrably on the node of the
  * function call context, or any other node if that fails.
+ * Allocations larger than the smallest hugepage size are made of
+ * a hugepage or of physically contiguous hugepages of the size best
+ * fitting the allocation among the sizes of the hugetlbfs mounts
+ * (e.g. 2 MB and 1 GB pages). The alignment may not exceed the
+ * largest hugepage size.
  *
  * @return The address of the allocated memory on success and NULL on failure.
  */
@@ -1185,28 +1896,166 @@ static inline void *nvme_calloc(size_t num, size_t size, size_t align)
  */
 extern void nvme_free(void *addr);
 
+/**
+ * @brief Register a user memory region
+ *
+ * @param addr	Start address of the memory region
+ * @param size	Size in bytes of the memory region
+ *
+ * Lock in memory the pages of a memory region not allocated with
+ * nvme_malloc() and translate once their virtual addresses to physical
+ * addresses, so that I/O payloads in the region can be used without
+ * any system call. The region must not overlap an already registered
+ * region and must not be freed or unmapped before being unregistered.
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_mem_register(void *addr, size_t size);
+
+/**
+ * @brief Unregister a user memory region
+ *
+ * @param addr	Start address of the memory region, as registered
+ *
+ * The region pages are unlocked. No I/O using the region memory
+ * may be in progress.
+ *
+ * @return 0 on success and -ENOENT if the region is not registered.
+ */
+extern int nvme_mem_unregister(void *addr);
+
+/**
+ * @brief Register an I/O buffer
+ *
+ * @param addr	Buffer address
+ * @param size	Buffer size in bytes
+ *
+ * Translate once the virtual addresses of a buffer used for I/Os to
+ * physical addresses, so that I/Os using the buffer through
+ * nvme_ns_read_buf() and nvme_ns_write_buf() do not need any address
+ * translation. The buffer must be memory allocated with nvme_malloc()
+ * or in a region registered with nvme_mem_register(), which cannot be
+ * reclaimed or migrated, and must not be freed or unregistered while
+ * the buffer is registered.
+ *
+ * @return A registered buffer handle on success and NULL on failure
+ * (including for buffers in other memory).
+ */
+extern struct nvme_buf *nvme_buf_register(void *addr, size_t size);
+
+/**
+ * @brief Unregister an I/O buffer
+ *
+ * @param buf	Registered buffer handle
+ *
+ * No I/O using the buffer may be in progress.
+ */
+extern void nvme_buf_unregister(struct nvme_buf *buf);
+
 /**
  * Structure to hold memory statistics.
  */
+#define NVME_MEM_HP_SIZES_MAX	4
+
+/**
+ * @brief Hugepage size usage information
+ */
+struct nvme_hp_size_stats {
+
+	/**
+	 * Hugepage size in bytes.
+	 */
+	size_t		size;
+
+	/**
+	 * Number of hugepages of this size allocated.
+	 */
+	size_t		nr_hugepages;
+
+	/**
+	 * Number of hugepages of this size available in the system
+	 * (or on the requested NUMA node).
+	 */
+	size_t		nr_free_hugepages;
+
+};
+
 struct nvme_mem_stats {
 
 	/**
-	 * Number of huge pages allocated.
+	 * Number of huge pages allocated (all sizes).
 	 */
 	size_t		nr_hugepages;
 
+	/**
+	 * Usage of each hugepage size (one per hugetlbfs mount
+	 * page size), in increasing size order. Memory pools use
+	 * the smallest hugepage size.
+	 */
+	unsigned int			nr_hp_sizes;
+	struct nvme_hp_size_stats	hp_sizes[NVME_MEM_HP_SIZES_MAX];
+
+	/**
+	 * Number of hugepages reserved and number of reserved
+	 * hugepages not in use (see struct nvme_lib_opts).
+	 */
+	size_t		nr_reserved_hugepages;
+	size_t		nr_free_reserved_hugepages;
+
 	/**
 	 * Total bytes in memory pools.
 	 */
 	size_t		total_bytes;
 
 	/**
-	 * Total free bytes in memory pools.
+	 * Total free bytes in memory pools, including
+	 * the free memory cached by threads.
 	 */
 	size_t		free_bytes;
 
+	/**
+	 * Free bytes cached by threads.
+	 */
+	size_t		cached_bytes;
+
+	/**
+	 * Number of large objects (allocations larger than
+	 * the memory pools largest object size) and their total size.
+	 * Large objects are hugepages or physically contiguous runs
+	 * of hugepages and are not included in the memory pools.
+	 */
+	size_t		nr_large_objs;
+	size_t		large_bytes;
+
 };
 
+/**
+ * @brief Set memory pools free memory watermarks
+ *
+ * @param size		Memory pool objects size, or 0 for all memory pools
+ * @param low		Low watermark in Bytes
+ * @param high		High watermark in Bytes
+ *
+ * Freeing memory never releases memory from memory pools. Instead, once
+ * the free memory of a memory pool exceeds its high watermark, its empty
+ * hugepages are reclaimed down to its low watermark, either by other
+ * memory pools growing, or by nvme_mem_reclaim(). The default
+ * watermarks are one hugepage (low) and four hugepages (high).
+ *
+ * @return 0 on success and a negative error code on failure.
+ */
+extern int nvme_mem_set_watermarks(size_t size, size_t low, size_t high);
+
+/**
+ * @brief Reclaim memory pools free memory
+ *
+ * Free the empty hugepages of the memory pools with free memory above
+ * their high watermark, down to their low watermark. This may be called
+ * by applications when idle or is called periodically by a background
+ * thread if the reclaim_interval library option is set.
+ */
+extern void nvme_mem_reclaim(void);
+
 /**
  * @brief Get memory usage information
  *
@@ -1222,6 +2071,88 @@ struct nvme_mem_stats {
 extern int nvme_memstat(struct nvme_mem_stats *stats,
 			unsigned int node_id);
 
+/**
+ * @brief Memory pool statistics
+ *
+ * Memory pools hold the objects of a power of 2 size, from 128 B to
+ * 2 MB, of a NUMA node. Their memory is divided in heaps of one hugepage.
+ */
+struct nvme_mempool_stats {
+
+	/**
+	 * NUMA node of the memory pool.
+	 */
+	unsigned int		node_id;
+
+	/**
+	 * Size in Bytes of the memory pool objects.
+	 */
+	size_t			size;
+
+	/**
+	 * Total number of objects of the memory pool, number of objects
+	 * allocated by the application, number of free objects in the
+	 * memory pool and number of free objects cached by threads.
+	 */
+	size_t			nr_objs;
+	size_t			nr_used_objs;
+	size_t			nr_free_objs;
+	size_t			nr_cached_objs;
+
+	/**
+	 * Highest number of objects taken from the memory pool
+	 * (allocated or cached by threads) since initialization.
+	 */
+	size_t			peak_used_objs;
+
+	/**
+	 * Number of heaps and number of empty heaps.
+	 */
+	size_t			nr_heaps;
+	size_t			nr_empty_heaps;
+
+	/**
+	 * Fragmentation: number of free objects in heaps which also
+	 * hold allocated objects. The memory of these objects cannot be
+	 * reclaimed.
+	 */
+	size_t			nr_frag_objs;
+
+	/**
+	 * Number of heaps added to and freed from the memory pool.
+	 */
+	unsigned long long	nr_grows;
+	unsigned long long	nr_shrinks;
+
+	/**
+	 * Number of memory pool lock acquisitions and number of
+	 * acquisitions which had to wait for another thread.
+	 */
+	unsigned long long	nr_locks;
+	unsigned long long	nr_contended;
+
+};
+
+/**
+ * @brief Get memory pools statistics
+ *
+ * @param stats		Array of memory pool statistics to fill
+ * @param max_stats	Number of entries of stats
+ * @param node_id	NUMA node ID or NVME_NODE_ID_ANY
+ *
+ * Fill stats with the statistics of the memory pools of the specified
+ * NUMA node, or of all nodes if node_id is NVME_NODE_ID_ANY, in increasing
+ * node and object size order. At most max_stats entries are filled.
+ * Statistics are maintained by the allocation paths and only read here,
+ * so that they can be sampled periodically at little cost.
+ *
+ * @return The number of memory pools on success (which may be larger than
+ * max_stats) and a negative error code on failure.
+ */
+extern int nvme_mempool_stat(struct nvme_mempool_stats *stats,
+			     unsigned int max_stats,
+			     unsigned int node_id);
+
 /**
  * @}
  */
@@ -838,6 +838,28 @@ enum nvme_feat_sel {
 	NVME_FEAT_SUPPORTED	= 0x3,
 };
 
+/*
+ * Arbitration feature (\ref NVME_FEAT_ARBITRATION) attributes.
+ */
+union nvme_feat_arbitration {
+
+	uint32_t	raw;
+
+	struct {
+		/* Arbitration burst: 2^ab commands (7: no limit) */
+		uint32_t ab		: 3;
+		uint32_t reserved	: 5;
+
+		/* Low, medium and high priority weights (0's based) */
+		uint32_t lpw		: 8;
+		uint32_t mpw		: 8;
+		uint32_t hpw		: 8;
+	} bits;
+
+};
+nvme_static_assert(sizeof(union nvme_feat_arbitration) == 4,
+		   "Incorrect size");
+
 enum nvme_dsm_attribute {
 	NVME_DSM_ATTR_INTEGRAL_READ		= 0x1,
 	NVME_DSM_ATTR_INTEGRAL_WRITE		= 0x2,
@@ -231,6 +231,17 @@ void __nvme_panic(const char *funcname, const char *format, ...)
 int nvme_lib_init(enum nvme_log_level level,
 		  enum nvme_log_facility facility, const char *path)
 {
+	return nvme_lib_init_opts(level, facility, path, NULL);
+}
+
+/**
+ * Library initialization with non-default options.
+ */
+int nvme_lib_init_opts(enum nvme_log_level level,
+		       enum nvme_log_facility facility, const char *path,
+		       const struct nvme_lib_opts *opts)
+{
+	unsigned int i;
 	int ret;
 
 	/* Set log level and facility first */
@@ -253,8 +264,44 @@ int nvme_lib_init(enum nvme_log_level level,
 
 	/* Initialize memory management */
 	ret = nvme_mem_init();
-	if (ret != 0)
+	if (ret != 0) {
 		nvme_crit("Memory management initialization failed\n");
+		goto out;
+	}
+
+	if (!opts)
+		goto out;
+
+	/* Pre-populate memory pools */
+	for (i = 0; i < opts->nr_prefill; i++) {
+		ret = nvme_mem_prefill(opts->prefill[i].size,
+				       opts->prefill[i].nr_objs);
+		if (ret != 0) {
+			nvme_crit("Pre-allocate %zu x %zu B objects failed\n",
+				  opts->prefill[i].nr_objs,
+				  opts->prefill[i].size);
+			goto out;
+		}
+	}
+
+	/* Reserve hugepages */
+	if (opts->nr_reserved_hugepages) {
+		ret = nvme_mem_reserve(opts->nr_reserved_hugepages);
+		if (ret != 0) {
+			nvme_crit("Reserve %u hugepages per node failed\n",
+				  opts->nr_reserved_hugepages);
+			goto out;
+		}
+	}
+
+	/* Start background memory reclaim */
+	if (opts->reclaim_interval) {
+		ret = nvme_mem_reclaim_start(opts->reclaim_interval);
+		if (ret != 0) {
+			nvme_crit("Start memory reclaim failed\n");
+			goto out;
+		}
+	}
 
 out:
 
@@ -271,4 +318,6 @@ __attribute__((destructor)) void nvme_lib_exit(void)
 
 	nvme_mem_cleanup();
 
+	nvme_cpu_cleanup();
+
 }
@@ -162,6 +162,33 @@ static inline unsigned long long nvme_time_nsec(void)
 		+ (unsigned long long) ts.tv_nsec;
 }
 
+/*
+ * Get a monotonic time in nano seconds.
+ */
+static inline unsigned long long nvme_time_mono_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000ULL
+		+ (unsigned long long) ts.tv_nsec;
+}
+
+/*
+ * Get a cheap monotonic time in milli seconds, with
+ * the resolution of the kernel timer tick.
+ */
+static inline unsigned long long nvme_time_msec_coarse(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000ULL
+		+ (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
 /*
  * Get current time in micro seconds.
  */
@@ -35,47 +35,95 @@
 #include "nvme_cpu.h"
 
 #include <dirent.h>
+#include <sched.h>
 
 struct nvme_cpu_info cpui;
+__thread struct nvme_cpu_cache nvme_cpu_cache;
 
 /*
- * Check if a cpu is present by the presence
- * of the cpu information for it.
+ * Read a sysfs CPU or node list file (e.g. "0-3,8-11").
  */
-static bool nvme_cpu_present(unsigned int cpu_id)
+static int nvme_cpu_read_list(const char *path, char *buf, size_t len)
 {
-	char path[128];
+	FILE *f;
 
-	snprintf(path, sizeof(path),
-		 "/sys/devices/system/cpu/cpu%u/topology/core_id",
-		 cpu_id);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
 
-	return access(path, F_OK) == 0;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -EIO;
+	}
+
+	fclose(f);
+	nvme_str_trim(buf);
+
+	return 0;
 }
 
 /*
- * Count the number of sockets.
+ * Parse the next range of a CPU or node list. Return a pointer
+ * to the remaining of the list, or NULL if the list is empty.
  */
-static unsigned int nvme_socket_count(void)
+static char *nvme_cpu_list_next(char *list, unsigned int *first,
+				unsigned int *last)
 {
-	unsigned int socket;
-	char path[128];
-	unsigned int n = 0;
+	char *end;
 
-	for (socket = 0; socket < NVME_SOCKET_MAX; socket++) {
-		snprintf(path, sizeof(path),
-			 "/sys/devices/system/node/node%u",
-			 socket);
-		if (!access(path, F_OK) == 0)
-			break;
-		n++;
+	while (*list == ',' || isspace(*list))
+		list++;
+	if (!isdigit(*list))
+		return NULL;
+
+	*first = strtoul(list, &end, 10);
+	*last = *first;
+	if (*end == '-') {
+		list = end + 1;
+		*last = strtoul(list, &end, 10);
+		if (end == list || *last < *first)
+			return NULL;
 	}
 
-	return n;
+	return end;
 }
 
 /*
- * Get the socket ID (NUMA node) of a CPU.
+ * Return the highest ID of a CPU or node list + 1.
+ */
+static unsigned int nvme_cpu_list_max(const char *path)
+{
+	unsigned int first, last, max = 0;
+	char buf[4096], *list = buf;
+
+	if (nvme_cpu_read_list(path, buf, sizeof(buf)) != 0) {
+		nvme_err("Read %s failed\n", path);
+		return 0;
+	}
+
+	while ((list = nvme_cpu_list_next(list, &first, &last)))
+		max = nvme_max(max, last + 1);
+
+	return max;
+}
+
+/*
+ * Check if a cpu is present by the presence
+ * of the cpu information for it.
+ */
+static bool nvme_cpu_present(unsigned int cpu_id)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%u/topology/core_id",
+		 cpu_id);
+
+	return access(path, F_OK) == 0;
+}
+
+/*
+ * Get the socket ID (physical package) of a CPU.
  */
 static unsigned int nvme_cpu_socket_id(unsigned int cpu_id)
 {
@@ -113,20 +161,107 @@ static unsigned int nvme_cpu_core_id(unsigned int cpu_id)
 }
 
 /*
- * Get the thread ID of a CPU.
+ * Get the thread ID of a CPU and its system-wide core number:
+ * sibling threads of a core share the core number of the first
+ * thread of the core. core_ids holds the core ID of each CPU.
  */
-static unsigned int nvme_cpu_thread_id(unsigned int cpu_id)
+static void nvme_cpu_thread_id(struct nvme_cpu *cpu,
+			       const unsigned int *core_ids)
 {
-	struct nvme_cpu *cpu = &cpui.cpu[cpu_id];
-	unsigned int i, thid = 0;
+	unsigned int i;
 
-	for (i = 0; i < cpui.nr_cpus; i++) {
-		if (cpui.cpu[i].socket == cpu->socket &&
-		    cpui.cpu[i].core == cpu->core)
-			thid++;
+	cpu->thread = 0;
+	cpu->core = cpui.nr_cores;
+
+	for (i = 0; i < cpu->id; i++) {
+		if (!cpui.cpu[i].present ||
+		    cpui.cpu[i].socket != cpu->socket ||
+		    core_ids[i] != core_ids[cpu->id])
+			continue;
+		if (cpu->thread == 0)
+			cpu->core = cpui.cpu[i].core;
+		cpu->thread++;
 	}
+}
+
+/*
+ * Get the last level cache domain of a CPU: CPUs sharing their L3
+ * cache with a lower numbered CPU belong to the domain of that CPU.
+ * If no L3 cache is reported, sockets are used as domains.
+ */
+static void nvme_cpu_llc_id(struct nvme_cpu *cpu)
+{
+	unsigned int i, first, last;
+	unsigned long level;
+	char path[128], buf[4096];
+
+	for (i = 0; ; i++) {
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%u/cache/index%u/level",
+			 cpu->id, i);
+		if (nvme_parse_sysfs_value(path, &level) != 0)
+			break;
+		if (level != 3)
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list",
+			 cpu->id, i);
+		if (nvme_cpu_read_list(path, buf, sizeof(buf)) != 0 ||
+		    !nvme_cpu_list_next(buf, &first, &last))
+			break;
+
+		if (first < cpu->id && cpui.cpu[first].present) {
+			cpu->llc = cpui.cpu[first].llc;
+			return;
+		}
 
-	return thid;
+		cpu->llc = cpui.nr_llcs++;
+		return;
+
+	}
+
+	for (i = 0; i < cpu->id; i++) {
+		if (cpui.cpu[i].present &&
+		    cpui.cpu[i].socket == cpu->socket) {
+			cpu->llc = cpui.cpu[i].llc;
+			return;
+		}
+	}
+
+	cpu->llc = cpui.nr_llcs++;
+}
+
+/*
+ * Set the NUMA node of CPUs from the node CPU lists.
+ */
+static void nvme_cpu_init_nodes(void)
+{
+	unsigned int node, first, last, i;
+	char path[128], buf[4096], *list;
+
+	cpui.nr_nodes = nvme_cpu_list_max("/sys/devices/system/node/possible");
+	if (!cpui.nr_nodes) {
+		/* Kernel without NUMA support */
+		cpui.nr_nodes = 1;
+		return;
+	}
+
+	for (node = 0; node < cpui.nr_nodes; node++) {
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%u/cpulist", node);
+		if (nvme_cpu_read_list(path, buf, sizeof(buf)) != 0)
+			continue;
+
+		list = buf;
+		while ((list = nvme_cpu_list_next(list, &first, &last))) {
+			for (i = first; i <= last && i < cpui.max_cpus; i++)
+				cpui.cpu[i].node = node;
+		}
+
+	}
 }
 
 /*
@@ -135,54 +270,155 @@ static unsigned int nvme_cpu_thread_id(unsigned int cpu_id)
 int nvme_cpu_init(void)
 {
 	struct nvme_cpu *cpu;
+	unsigned int *core_ids;
 	unsigned int i;
+	int32_t gen = nvme_atomic_read(&cpui.gen);
 
+	free(cpui.cpu);
 	memset(&cpui, 0, sizeof(struct nvme_cpu_info));
-	cpui.nr_sockets = nvme_socket_count();
 
-	for (i = 0; i < NVME_CPU_MAX; i++) {
+	cpui.max_cpus = nvme_cpu_list_max("/sys/devices/system/cpu/possible");
+	if (!cpui.max_cpus)
+		return -ENODEV;
+
+	cpui.cpu = calloc(cpui.max_cpus, sizeof(struct nvme_cpu));
+	if (!cpui.cpu) {
+		nvme_err("Allocate %u CPUs information failed\n",
+			 cpui.max_cpus);
+		return -ENOMEM;
+	}
+
+	core_ids = calloc(cpui.max_cpus, sizeof(unsigned int));
+	if (!core_ids) {
+		free(cpui.cpu);
+		cpui.cpu = NULL;
+		return -ENOMEM;
+	}
+
+	nvme_cpu_init_nodes();
+
+	for (i = 0; i < cpui.max_cpus; i++) {
 
 		cpu = &cpui.cpu[i];
-		cpu->id = -1;
+		cpu->id = i;
 
-		/* init cpuset for per lcore config */
+		/* Offline CPUs have no topology information */
 		cpu->present = nvme_cpu_present(i);
-		if (!cpu->present) {
+		if (!cpu->present)
 			continue;
-		}
 
-		cpu->id = i;
 		cpu->socket = nvme_cpu_socket_id(i);
-		cpu->core = nvme_cpu_core_id(i);
-		cpu->thread = nvme_cpu_thread_id(i);
+		core_ids[i] = nvme_cpu_core_id(i);
+		nvme_cpu_thread_id(cpu, core_ids);
+		nvme_cpu_llc_id(cpu);
 
 		cpui.nr_cpus++;
+		cpui.nr_sockets = nvme_max(cpui.nr_sockets, cpu->socket + 1);
 		if (cpu->thread == 0)
 			cpui.nr_cores++;
+		if (cpu->node >= cpui.nr_nodes)
+			cpui.nr_nodes = cpu->node + 1;
 
-		nvme_debug("CPU %02u: socket %02u, core %02u, thread %u\n",
-			   cpu->id, cpu->socket, cpu->core, cpu->thread);
+		nvme_debug("CPU %03u: socket %02u, node %02u, core %03u, "
+			   "thread %u, LLC %03u\n",
+			   cpu->id, cpu->socket, cpu->node, cpu->core,
+			   cpu->thread, cpu->llc);
 
 	}
 
-	nvme_info("Detected %u CPUs: %u sockets, %u cores, %u threads\n",
+	free(core_ids);
+
+	/* Invalidate the identity cached by threads */
+	nvme_atomic_set(&cpui.gen, gen + 1);
+
+	nvme_info("Detected %u CPUs: %u sockets, %u NUMA nodes, "
+		  "%u cores, %u L3 domains\n",
 		  cpui.nr_cpus,
 		  cpui.nr_sockets,
+		  cpui.nr_nodes,
 		  cpui.nr_cores,
-		  cpui.nr_cpus);
+		  cpui.nr_llcs);
 
 	return 0;
 }
 
+/*
+ * Free CPU information.
+ */
+void nvme_cpu_cleanup(void)
+{
+	int32_t gen = nvme_atomic_read(&cpui.gen);
+
+	free(cpui.cpu);
+	memset(&cpui, 0, sizeof(struct nvme_cpu_info));
+	nvme_atomic_set(&cpui.gen, gen + 1);
+}
+
+/*
+ * Rebuild the calling thread cached identity from its CPU affinity:
+ * a thread bound to a single CPU or to the CPUs of a single NUMA node
+ * does not need to lookup its CPU to get its node.
+ */
+void nvme_cpu_cache_update(void)
+{
+	struct nvme_cpu_cache *cc = &nvme_cpu_cache;
+	unsigned int i, nr_cpus = 0, cpu_id = 0;
+	unsigned int node_id = NVME_NODE_ID_ANY;
+	cpu_set_t *set;
+	size_t setsize;
+
+	cc->gen = nvme_atomic_read(&cpui.gen);
+	cc->cpu = NULL;
+	cc->node_id = NVME_NODE_ID_ANY;
+
+	if (!cpui.cpu) {
+		/* Not initialized: check again on next lookup */
+		cc->nr_lookups = 1;
+		return;
+	}
+
+	cc->nr_lookups = NVME_CPU_CACHE_LOOKUPS;
+
+	set = CPU_ALLOC(cpui.max_cpus);
+	if (!set)
+		return;
+	setsize = CPU_ALLOC_SIZE(cpui.max_cpus);
+
+	if (sched_getaffinity(0, setsize, set) != 0) {
+		nvme_err("sched_getaffinity failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto out;
+	}
+
+	for (i = 0; i < cpui.max_cpus; i++) {
+		if (!CPU_ISSET_S(i, setsize, set) || !cpui.cpu[i].present)
+			continue;
+		if (!nr_cpus) {
+			cpu_id = i;
+			node_id = cpui.cpu[i].node;
+		} else if (cpui.cpu[i].node != node_id) {
+			node_id = NVME_NODE_ID_ANY;
+		}
+		nr_cpus++;
+	}
+
+	if (nr_cpus == 1)
+		cc->cpu = &cpui.cpu[cpu_id];
+	cc->node_id = node_id;
+
+out:
+	CPU_FREE(set);
+}
+
 /*
  * Get caller current CPU.
  */
-struct nvme_cpu *nvme_get_cpu(void)
+struct nvme_cpu *nvme_cpu_lookup(void)
 {
 	int cpu;
 
 	/*
-	 * Get current CPU. If trhe caller thread is not pinned down
+	 * Get current CPU. If the caller thread is not pinned down
 	 * to a particular CPU using sched_setaffinity, this result
 	 * may be only temporary.
 	 */
@@ -193,13 +429,19 @@ struct nvme_cpu *nvme_get_cpu(void)
 		return NULL;
 	}
 
-	if (cpu >= (int)cpui.nr_cpus) {
+	if (cpu >= (int)cpui.max_cpus) {
 		nvme_err("Invalid CPU number %d (Max %u)\n",
-			 cpu, cpui.nr_cpus - 1);
+			 cpu, cpui.max_cpus - 1);
 		return NULL;
 	}
 
 	return &cpui.cpu[cpu];
 }
 
-
+/*
+ * Invalidate the CPU identity cached by all threads.
+ */
+void nvme_cpu_affinity_changed(void)
+{
+	nvme_atomic_inc(&cpui.gen);
+}
@@ -35,28 +35,26 @@
 #define __NVME_CPU_H__
 
 #include "nvme_common.h"
+#include "nvme_atomic.h"
 
 #include <pthread.h>
 
-/*
- * Maximum number of CPU supported.
- */
-#define NVME_CPU_MAX	        64
-
 /*
  * Undefined CPU ID.
  */
 #define NVME_CPU_ID_ANY	        UINT_MAX
 
 /*
- * Maximum number of sockets supported.
+ * Undefined SOCKET ID.
  */
-#define NVME_SOCKET_MAX	        32
+#define NVME_SOCKET_ID_ANY	UINT_MAX
 
 /*
- * Undefined SOCKET ID.
+ * Number of CPU lookups of a thread after which the thread
+ * CPU affinity is checked again, in case it changed without
+ * nvme_cpu_affinity_changed() being called.
  */
-#define NVME_SOCKET_ID_ANY	UINT_MAX
+#define NVME_CPU_CACHE_LOOKUPS	65536
 
 /*
  * System CPU descriptor.
@@ -74,7 +72,12 @@ struct nvme_cpu {
 	unsigned int		socket;
 
 	/*
-	 * Core number.
+	 * NUMA node.
+	 */
+	unsigned int		node;
+
+	/*
+	 * Core number (unique within the system).
 	 */
 	unsigned int		core;
 
@@ -83,6 +86,11 @@ struct nvme_cpu {
 	 */
 	unsigned int		thread;
 
+	/*
+	 * Last level cache (L3) domain number.
+	 */
+	unsigned int		llc;
+
 	/*
 	 * CPU preset.
 	 */
@@ -101,24 +109,75 @@ struct nvme_cpu_info {
 	unsigned int		nr_cpus;
 
 	/*
-	 * CPU information.
+	 * Number of entries of the cpu array, that is,
+	 * the highest possible CPU ID + 1.
 	 */
-	struct nvme_cpu		cpu[NVME_CPU_MAX];
+	unsigned int		max_cpus;
+
+	/*
+	 * CPU information, indexed by CPU ID.
+	 */
+	struct nvme_cpu		*cpu;
 
 	/*
 	 * Number of sockets.
 	 */
 	unsigned int		nr_sockets;
 
+	/*
+	 * Number of NUMA nodes (highest node ID + 1).
+	 */
+	unsigned int		nr_nodes;
+
 	/*
 	 * Number of CPU cores.
 	 */
 	unsigned int		nr_cores;
 
+	/*
+	 * Number of last level cache domains.
+	 */
+	unsigned int		nr_llcs;
+
+	/*
+	 * Generation number, incremented to invalidate
+	 * the CPU information cached by threads.
+	 */
+	nvme_atomic_t		gen;
+
+};
+
+/*
+ * Per-thread cached CPU identity.
+ */
+struct nvme_cpu_cache {
+
+	/*
+	 * CPU information generation the cache is valid for.
+	 */
+	int32_t			gen;
+
+	/*
+	 * Lookups left before checking the thread affinity again.
+	 */
+	unsigned int		nr_lookups;
+
+	/*
+	 * CPU the thread is bound to, or NULL if the thread
+	 * may run on several CPUs.
+	 */
+	struct nvme_cpu		*cpu;
+
+	/*
+	 * NUMA node the thread is bound to, or NVME_NODE_ID_ANY
+	 * if the thread may run on CPUs of different nodes.
+	 */
+	unsigned int		node_id;
 
 };
 
 extern struct nvme_cpu_info cpui;
+extern __thread struct nvme_cpu_cache nvme_cpu_cache;
 
 /*
  * Initialize system CPU information.
@@ -126,9 +185,49 @@ extern struct nvme_cpu_info cpui;
 extern int nvme_cpu_init(void);
 
 /*
- * Return the CPU of the caller.
+ * Free system CPU information.
+ */
+extern void nvme_cpu_cleanup(void);
+
+/*
+ * Rebuild the calling thread cached CPU identity.
  */
-extern struct nvme_cpu *nvme_get_cpu(void);
+extern void nvme_cpu_cache_update(void);
+
+/*
+ * Return the CPU the caller is currently running on.
+ */
+extern struct nvme_cpu *nvme_cpu_lookup(void);
+
+/*
+ * Get the calling thread cached CPU identity, checking it first.
+ */
+static inline struct nvme_cpu_cache *nvme_cpu_cache_get(void)
+{
+	struct nvme_cpu_cache *cc = &nvme_cpu_cache;
+
+	if (unlikely(cc->gen != nvme_atomic_read(&cpui.gen) ||
+		     !cc->nr_lookups))
+		nvme_cpu_cache_update();
+
+	cc->nr_lookups--;
+
+	return cc;
+}
+
+/*
+ * Return the CPU of the caller. Unless the caller thread is bound
+ * to a single CPU, the result may be only temporary.
+ */
+static inline struct nvme_cpu *nvme_get_cpu(void)
+{
+	struct nvme_cpu_cache *cc = nvme_cpu_cache_get();
+
+	if (cc->cpu)
+		return cc->cpu;
+
+	return nvme_cpu_lookup();
+}
 
 /*
  * Return the CPU ID of the caller.
@@ -150,4 +249,30 @@ static inline unsigned int nvme_socket_id(void)
 	return cpu ? cpu->socket : NVME_SOCKET_ID_ANY;
 }
 
+/*
+ * Return the NUMA node of the caller. This does not need a CPU lookup
+ * if all the CPUs the caller thread may run on belong to the same node.
+ */
+static inline unsigned int nvme_node_id(void)
+{
+	struct nvme_cpu_cache *cc = nvme_cpu_cache_get();
+	struct nvme_cpu *cpu;
+
+	if (cc->node_id != NVME_NODE_ID_ANY)
+		return cc->node_id;
+
+	cpu = cc->cpu ? cc->cpu : nvme_cpu_lookup();
+
+	return cpu ? cpu->node : NVME_NODE_ID_ANY;
+}
+
+/*
+ * Return the NUMA node the caller thread is bound to,
+ * or NVME_NODE_ID_ANY if the thread may run on several nodes.
+ */
+static inline unsigned int nvme_node_id_bound(void)
+{
+	return nvme_cpu_cache_get()->node_id;
+}
+
 #endif /* __NVME_CPU_H__ */
@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <numaif.h>
 
 /*
@@ -19,17 +20,142 @@
 static struct nvme_mem mm;
 
 /*
- * Find where hugetlbfs is mounted.
+ * Get the NUMA node to allocate memory from: the specified node if it
+ * is valid, or the node of the calling CPU.
  */
-static int nvme_mem_get_hp_dir(void)
+static inline unsigned int nvme_mem_node(unsigned int node_id)
+{
+	if (node_id < nvme_node_max())
+		return node_id;
+
+	node_id = nvme_node_id();
+
+	return node_id < nvme_node_max() ? node_id : 0;
+}
+
+/*
+ * Determine the default size of hugepages.
+ */
+static size_t nvme_mem_get_hp_size(void)
+{
+	char buf[256];
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL) {
+		nvme_err("Open /proc/meminfo failed\n");
+		return 0;
+	}
+
+	while(fgets(buf, sizeof(buf), f)) {
+		if (strncmp(buf, "Hugepagesize:", 13) == 0) {
+			size = nvme_str2size(&buf[13]);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	nvme_debug("Default hugepage size is %zu B\n", size);
+
+	return size;
+}
+
+/*
+ * Get the page size of a hugetlbfs mount from its mount options.
+ */
+static size_t nvme_mem_get_mount_hp_size(char *opts, size_t dflt_size)
+{
+	char *opt;
+
+	for (opt = strtok(opts, ","); opt; opt = strtok(NULL, ",")) {
+		if (strncmp(opt, "pagesize=", 9) == 0)
+			return nvme_str2size(opt + 9);
+	}
+
+	return dflt_size;
+}
+
+/*
+ * Setup a hugepage size using a hugetlbfs mount point.
+ */
+static int nvme_mem_add_hp_size(const char *mntdir, size_t size)
+{
+	struct nvme_hp_size *hps;
+	unsigned int i;
+	int ret;
+
+	/* Use the first mount point found for each size */
+	for (i = 0; i < mm.nr_hp_sizes; i++) {
+		if (mm.hp_sizes[i].size == size)
+			return 0;
+	}
+
+	if (mm.nr_hp_sizes == NVME_MEM_HP_SIZES_MAX) {
+		nvme_info("Ignoring hugetlbfs mount %s: too many page sizes\n",
+			  mntdir);
+		return 0;
+	}
+
+	/* Keep sizes sorted */
+	for (i = mm.nr_hp_sizes; i > 0; i--) {
+		if (mm.hp_sizes[i - 1].size < size)
+			break;
+		mm.hp_sizes[i] = mm.hp_sizes[i - 1];
+	}
+
+	hps = &mm.hp_sizes[i];
+	memset(hps, 0, sizeof(struct nvme_hp_size));
+	hps->size = size;
+	hps->size_bits = nvme_log2(size);
+	hps->dd = -1;
+	nvme_atomic_init(&hps->nr_hp);
+	mm.nr_hp_sizes++;
+
+	nvme_debug("hugetlbfs mounted at %s, %zu B pages\n", mntdir, size);
+
+	/* Create a unique subdirectory in the mount point for this process */
+	if (asprintf(&hps->dir, "%s/libnvme.%d.XXXXXX", mntdir, getpid()) < 0) {
+		hps->dir = NULL;
+		return -ENOMEM;
+	}
+	if (!mkdtemp(hps->dir)) {
+		ret = -errno;
+		nvme_err("Create hugepage directory %s failed %d (%s)\n",
+			 hps->dir, errno, strerror(errno));
+		free(hps->dir);
+		hps->dir = NULL;
+		return ret;
+	}
+
+	hps->dd = open(hps->dir, O_RDONLY | O_DIRECTORY);
+	if (hps->dd < 0) {
+		ret = -errno;
+		nvme_crit("Open hugepage directory %s failed %d (%s)\n",
+			  hps->dir, errno, strerror(errno));
+		return ret;
+	}
+
+	nvme_debug("Using hugepage directory %s\n", hps->dir);
+
+	return 0;
+}
+
+/*
+ * Find all hugetlbfs mount points and their page size.
+ */
+static int nvme_mem_get_hp_sizes(void)
 {
 	char dev[64], dir[PATH_MAX];
-	char type[64], opts[128];
-	char *mntdir = NULL;
-	int n, tmp1, tmp2;
+	char type[64], opts[256];
+	size_t dflt_size, size;
+	int n, tmp1, tmp2, ret = 0;
 	char buf[512];
 	FILE *f;
 
+	dflt_size = nvme_mem_get_hp_size();
+
 	f = fopen("/proc/mounts", "r");
 	if (!f) {
 		nvme_err("Open /proc/mounts failed\n");
@@ -37,81 +163,205 @@ static int nvme_mem_get_hp_dir(void)
 	}
 
 	while (fgets(buf, sizeof(buf), f)) {
-		n = sscanf(buf, "%s %s %s %s %d %d",
+		n = sscanf(buf, "%63s %4095s %63s %255s %d %d",
 			   dev, dir, type, opts, &tmp1, &tmp2);
-		if (n != 6)
+		if (n != 6 || strcmp(type, "hugetlbfs") != 0)
 			continue;
 
-		if (strcmp(type, "hugetlbfs") == 0) {
-			mntdir = dir;
-			break;
+		size = nvme_mem_get_mount_hp_size(opts, dflt_size);
+		if (!size || !nvme_is_pow2(size)) {
+			nvme_info("Ignoring hugetlbfs mount %s: "
+				  "invalid page size\n", dir);
+			continue;
 		}
+
+		ret = nvme_mem_add_hp_size(dir, size);
+		if (ret != 0)
+			break;
 	}
 
 	fclose(f);
 
-	if (!mntdir) {
+	if (ret == 0 && !mm.nr_hp_sizes) {
 		nvme_err("hugetlbfs mount not found\n");
-		return -ENOENT;
+		ret = -ENOENT;
 	}
 
-	nvme_debug("hugetlbfs mounted at %s\n", mntdir);
+	return ret;
+}
+
+/*
+ * Add a hugepage, or a hugepage run, to the translation map.
+ * Must be called with the hugepage lock held.
+ */
+static int nvme_mem_map_hp(struct nvme_hugepage *hp)
+{
+	unsigned long hpn = hp->vaddr >> mm.hp_size_bits;
+	unsigned long last = (hp->vaddr + hp->size - 1) >> mm.hp_size_bits;
+	struct nvme_hp_map_leaf *leaf;
+	unsigned long idx;
+
+	if ((last >> NVME_HP_MAP_LEAF_BITS) >= mm.hp_map_size)
+		return -ERANGE;
+
+	/* Make the hugepage descriptor visible before the hugepage */
+	nvme_smp_wmb();
+
+	for (; hpn <= last; hpn++) {
+
+		idx = hpn >> NVME_HP_MAP_LEAF_BITS;
+		leaf = mm.hp_map[idx];
+		if (!leaf) {
+			leaf = calloc(1, sizeof(struct nvme_hp_map_leaf));
+			if (!leaf)
+				goto err;
+			/* Make the leaf initialization visible first */
+			nvme_smp_wmb();
+			mm.hp_map[idx] = leaf;
+		}
 
-	/* Create a unique subdirectory in the mount point for this process */
-	asprintf(&mm.hp_dir, "%s/libnvme.%d.XXXXXX", mntdir, getpid());
-	if (!mm.hp_dir)
-		return -ENOMEM;
-	if (!mkdtemp(mm.hp_dir)) {
-		nvme_err("Create hugepage directory %s failed %d (%s)\n",
-			 mm.hp_dir, errno, strerror(errno));
-		free(mm.hp_dir);
-		mm.hp_dir = NULL;
-		return -errno;
-	}
+		leaf->hp[hpn & NVME_HP_MAP_LEAF_MASK] = hp;
 
-	nvme_debug("Using hugepage directory %s\n",
-		   mm.hp_dir);
+	}
 
 	return 0;
+
+err:
+	while (hpn-- > (hp->vaddr >> mm.hp_size_bits))
+		mm.hp_map[hpn >> NVME_HP_MAP_LEAF_BITS]->hp[hpn & NVME_HP_MAP_LEAF_MASK] = NULL;
+
+	return -ENOMEM;
 }
 
 /*
- * Determine the size of hugepages.
+ * Remove a hugepage, or a hugepage run, from the translation map.
+ * Must be called with the hugepage lock held.
  */
-static size_t nvme_mem_get_hp_size(void)
+static void nvme_mem_unmap_hp(struct nvme_hugepage *hp)
 {
-	char buf[256];
-	size_t size = 0;
-	FILE *f;
+	unsigned long hpn = hp->vaddr >> mm.hp_size_bits;
+	unsigned long last = (hp->vaddr + hp->size - 1) >> mm.hp_size_bits;
 
-	f = fopen("/proc/meminfo", "r");
-	if (f == NULL) {
-		nvme_err("Open /proc/meminfo failed\n");
-		return 0;
+	for (; hpn <= last; hpn++)
+		mm.hp_map[hpn >> NVME_HP_MAP_LEAF_BITS]->hp[hpn & NVME_HP_MAP_LEAF_MASK] = NULL;
+}
+
+/*
+ * Get a free hugepage offset in the arena of a hugepage size and
+ * NUMA node, creating the arena file if needed.
+ */
+static struct nvme_hp_arena *nvme_mem_arena_get(struct nvme_hp_size *hps,
+						unsigned int node_id,
+						off_t *ofst)
+{
+	struct nvme_hp_arena *arena;
+	char fname[32];
+	size_t idx;
+
+	if (node_id >= NVME_NODE_MAX)
+		node_id = 0;
+	arena = &hps->arena[node_id];
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (arena->fd < 0) {
+		sprintf(fname, "node%u", node_id);
+		arena->fd = openat(hps->dd, fname,
+				   O_RDWR | O_LARGEFILE | O_EXCL | O_CREAT,
+				   S_IRUSR | S_IWUSR);
+		if (arena->fd < 0) {
+			nvme_err("Open hugepage file %s/%s failed %d (%s)\n",
+				 hps->dir, fname, errno, strerror(errno));
+			goto err;
+		}
 	}
 
-	while(fgets(buf, sizeof(buf), f)) {
-		if (strncmp(buf, "Hugepagesize:", 13) == 0) {
-			size = nvme_str2size(&buf[13]);
-			break;
+	if (arena->nr_free) {
+		idx = arena->free[--arena->nr_free];
+	} else {
+		idx = arena->nr_pages;
+		if (ftruncate(arena->fd, (idx + 1) << hps->size_bits) < 0) {
+			nvme_err("Extend hugepage file %s/node%u failed %d (%s)\n",
+				 hps->dir, node_id, errno, strerror(errno));
+			goto err;
 		}
+		arena->nr_pages++;
 	}
 
-	fclose(f);
+	pthread_mutex_unlock(&arena->lock);
 
-	nvme_debug("Hugepage size is %zu B\n", size);
+	*ofst = (off_t)idx << hps->size_bits;
 
-	return size;
+	return arena;
+
+err:
+	pthread_mutex_unlock(&arena->lock);
+
+	return NULL;
+}
+
+/*
+ * Return a hugepage offset to its arena, releasing the hugepage
+ * to the system.
+ */
+static void nvme_mem_arena_put(struct nvme_hp_size *hps,
+			       struct nvme_hp_arena *arena, off_t ofst)
+{
+	size_t *free_idx;
+
+	if (fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      ofst, hps->size) < 0)
+		nvme_warning("Release hugepage at offset 0x%llx failed %d (%s)\n",
+			     (unsigned long long)ofst, errno, strerror(errno));
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (arena->nr_free == arena->max_free) {
+		free_idx = realloc(arena->free, sizeof(size_t) *
+				   nvme_max(arena->max_free << 1, 64UL));
+		if (!free_idx) {
+			/* Lose the offset: the file will grow instead */
+			nvme_err("Grow hugepage arena free list failed\n");
+			goto out;
+		}
+		arena->free = free_idx;
+		arena->max_free = nvme_max(arena->max_free << 1, 64UL);
+	}
+
+	arena->free[arena->nr_free++] = ofst >> hps->size_bits;
+
+out:
+	pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Destroy a hugepage: unmap the hugepage, return it to its arena
+ * and free its descriptor.
+ */
+static void nvme_mem_hp_destroy(struct nvme_hugepage *hp)
+{
+	if (munlock((void *)hp->vaddr, hp->size) < 0)
+		nvme_crit("Unlock hugepage 0x%lx failed %d (%s)\n",
+			  hp->vaddr, errno, strerror(errno));
+
+	if (munmap((void *)hp->vaddr, hp->size) < 0)
+		nvme_crit("Unmap hugepage 0x%lx failed %d (%s)\n",
+			  hp->vaddr, errno, strerror(errno));
+
+	nvme_mem_arena_put(hp->hps, hp->arena, hp->ofst);
+
+	free(hp);
 }
 
 /*
- * Allocate a hugepage descriptor and create its backing file
- * in hugetlbfs.
+ * Create a hugepage: allocate its descriptor, get a page from the
+ * hugepage arena of the node, map, fault in and lock the page.
+ * The arena file is mapped shared so that the page can be remapped.
  */
-static struct nvme_hugepage *nvme_mem_alloc_hp(unsigned int node_id)
+static struct nvme_hugepage *nvme_mem_hp_create(struct nvme_hp_size *hps,
+						unsigned int node_id)
 {
 	unsigned long nodemask, maxnodes;
-	unsigned int hphash;
 	struct nvme_hugepage *hp;
 	void *vaddr = MAP_FAILED;
 	int ret;
@@ -121,30 +371,24 @@ static struct nvme_hugepage *nvme_mem_alloc_hp(unsigned int node_id)
 	if (!hp)
 		return NULL;
 
-	hp->size = mm.hp_size;
-	hp->size_bits = mm.hp_size_bits;
+	hp->size = hps->size;
+	hp->size_bits = hps->size_bits;
+	hp->hps = hps;
 	hp->node_id = node_id;
 
-	/* Create the hugepage file */
-	sprintf(hp->fname, "libnvme.%d-%zu",
-		getpid(),
-		nvme_atomic64_add_return(&mm.hp_tmp, 1));
-
-	hp->fd = openat(mm.hp_dd, hp->fname,
-			O_RDWR | O_LARGEFILE | O_EXCL | O_CREAT,
-			S_IRUSR | S_IWUSR);
-	if (hp->fd < 0) {
-		nvme_err("Open hugepage file %s failed %d (%s)\n",
-			 hp->fname, errno, strerror(errno));
-		goto err;
+	/* Get a page from the arena */
+	hp->arena = nvme_mem_arena_get(hps, node_id, &hp->ofst);
+	if (!hp->arena) {
+		free(hp);
+		return NULL;
 	}
 
-	/* Mmap the file */
+	/* Mmap the page */
 	vaddr = mmap(NULL, hp->size, PROT_READ | PROT_WRITE,
-		     MAP_PRIVATE, hp->fd, 0);
+		     MAP_SHARED, hp->arena->fd, hp->ofst);
 	if (vaddr == MAP_FAILED) {
-		nvme_err("mmap hugepage file %s failed %d (%s)\n",
-			 hp->fname, errno, strerror(errno));
+		nvme_err("mmap hugepage at offset 0x%llx failed %d (%s)\n",
+			 (unsigned long long)hp->ofst, errno, strerror(errno));
 		goto err;
 	}
 
@@ -159,8 +403,8 @@ static struct nvme_hugepage *nvme_mem_alloc_hp(unsigned int node_id)
 		maxnodes = 0;
 	} else {
 		nvme_debug("Allocating hugepage on node %u\n", node_id);
-		nodemask = node_id;
-		maxnodes = 1;
+		nodemask = 1UL << node_id;
+		maxnodes = node_id + 2;
 	}
 
 	ret = mbind(vaddr, hp->size, MPOL_PREFERRED, &nodemask, maxnodes, 0);
@@ -189,199 +433,669 @@ static struct nvme_hugepage *nvme_mem_alloc_hp(unsigned int node_id)
 		goto err;
 	}
 
-	/* Add the hugepage to the hash table */
-	hphash = (hp->vaddr >> mm.hp_size_bits) & NVME_HP_HASH_MASK;
+	return hp;
+
+err:
+	if (vaddr != MAP_FAILED)
+		munmap(vaddr, hp->size);
+	nvme_mem_arena_put(hps, hp->arena, hp->ofst);
+
+	free(hp);
+
+	return NULL;
+}
+
+/*
+ * Add a hugepage, or a hugepage run, to the translation map
+ * and to the list of allocated hugepages.
+ */
+static int nvme_mem_add_hp(struct nvme_hugepage *hp)
+{
+	int ret;
+
 	nvme_spin_lock(&mm.hp_lock);
 
-	LIST_INSERT_HEAD(&mm.hp_list[hphash], hp, link);
-	nvme_atomic_inc(&mm.nr_hp);
+	ret = nvme_mem_map_hp(hp);
+	if (ret != 0) {
+		nvme_spin_unlock(&mm.hp_lock);
+		nvme_err("Map hugepage 0x%lx failed\n", hp->vaddr);
+		return ret;
+	}
+
+	LIST_INSERT_HEAD(&mm.hp_list, hp, link);
+	nvme_atomic_add(&mm.nr_hp, hp->size >> hp->size_bits);
+	nvme_atomic_add(&hp->hps->nr_hp, hp->size >> hp->size_bits);
 
-	nvme_debug("Allocated hugepage %s (%u, hash %u, 0x%lx / 0x%lx)\n",
-		   hp->fname, nvme_atomic_read(&mm.nr_hp),
-		   hphash, hp->vaddr, hp->paddr);
+	nvme_debug("Allocated hugepage (%u, 0x%lx / 0x%lx, %zu B)\n",
+		   nvme_atomic_read(&mm.nr_hp),
+		   hp->vaddr, hp->paddr, hp->size);
 
 	nvme_spin_unlock(&mm.hp_lock);
 
-	return hp;
+	return 0;
+}
 
-err:
-	if (hp->fd >= 0) {
-		if (vaddr != MAP_FAILED)
-			munmap(vaddr, hp->size);
-		close(hp->fd);
-		unlinkat(mm.hp_dd, hp->fname, 0);
-	}
+/*
+ * Allocate a hugepage.
+ */
+static struct nvme_hugepage *nvme_mem_alloc_hp(struct nvme_hp_size *hps,
+					       unsigned int node_id)
+{
+	struct nvme_hugepage *hp;
 
-	free(hp);
+	hp = nvme_mem_hp_create(hps, node_id);
+	if (!hp)
+		return NULL;
 
-	return NULL;
+	if (nvme_mem_add_hp(hp) != 0) {
+		nvme_mem_hp_destroy(hp);
+		return NULL;
+	}
+
+	return hp;
 }
 
 /*
- * Free an allocated hugepage.
- * Close and unlink the hugepage backing file and free its descriptor.
+ * Free an allocated hugepage or hugepage run.
  */
 static void nvme_mem_free_hp(struct nvme_hugepage *hp)
 {
+	unsigned int i;
 
 	if (!hp)
 		return;
 
-	/* Remove the hugepage from the hash table */
+	/* Remove the hugepage from the translation map */
 	nvme_spin_lock(&mm.hp_lock);
 
-	nvme_debug("Free hugepage %s (%u, 0x%lx / 0x%lx)\n",
-		   hp->fname, nvme_atomic_read(&mm.nr_hp),
-		   hp->vaddr, hp->paddr);
+	nvme_debug("Free hugepage (%u, 0x%lx / 0x%lx, %zu B)\n",
+		   nvme_atomic_read(&mm.nr_hp),
+		   hp->vaddr, hp->paddr, hp->size);
 
+	nvme_mem_unmap_hp(hp);
 	LIST_REMOVE(hp, link);
-	nvme_atomic_dec(&mm.nr_hp);
+	nvme_atomic_sub(&mm.nr_hp, hp->size >> hp->size_bits);
+	nvme_atomic_sub(&hp->hps->nr_hp, hp->size >> hp->size_bits);
 
 	nvme_spin_unlock(&mm.hp_lock);
 
-	/* Unmap, close and unlink the hugepage file */
-	if (munlock((void *)hp->vaddr, hp->size) < 0)
-		nvme_crit("Unlock hugepage %s failed %d (%s)\n",
-			  hp->fname, errno, strerror(errno));
-
-	if (munmap((void *)hp->vaddr, hp->size) < 0)
-		nvme_crit("Unmap hugepage file %s failed %d (%s)\n",
-			  hp->fname, errno, strerror(errno));
-
-	if (close(hp->fd) < 0)
-		nvme_crit("Close hugepage file %s failed %d (%s)\n",
-			  hp->fname, errno, strerror(errno));
-
-	if (unlinkat(mm.hp_dd, hp->fname, 0) < 0)
-		nvme_crit("Unlink hugepage file %s failed %d (%s)\n",
-			  hp->fname, errno, strerror(errno));
+	if (!hp->nr_run) {
+		nvme_mem_hp_destroy(hp);
+		return;
+	}
 
+	for (i = 0; i < hp->nr_run; i++)
+		nvme_mem_hp_destroy(hp->run[i]);
+	free(hp->run);
 	free(hp);
 }
 
 /*
- * Search the hugepage containing the specified address.
+ * Get a hugepage of the smallest size for a NUMA node, using first
+ * the hugepages reserved on the node.
  */
-struct nvme_hugepage *nvme_mem_search_hp(unsigned long vaddr)
+static struct nvme_hugepage *nvme_mem_get_hp(unsigned int node_id)
 {
-	unsigned long hpn = vaddr >> mm.hp_size_bits;
-	unsigned long hphash = hpn & NVME_HP_HASH_MASK;
-	struct nvme_hugepage *hp, *res = NULL;
+	struct nvme_hp_reserve *rsv;
+	struct nvme_hugepage *hp = NULL;
+
+	if (node_id < NVME_NODE_MAX) {
+		rsv = &mm.hp_rsv[node_id];
+		nvme_spin_lock(&mm.hp_lock);
+		hp = LIST_FIRST(&rsv->free_list);
+		if (hp) {
+			LIST_REMOVE(hp, rsv_link);
+			rsv->nr_free--;
+		}
+		nvme_spin_unlock(&mm.hp_lock);
+		if (hp)
+			return hp;
+	}
 
-	/* Search the hash table */
-	nvme_spin_lock(&mm.hp_lock);
+	return nvme_mem_alloc_hp(&mm.hp_sizes[0], node_id);
+}
 
-	LIST_FOREACH(hp, &mm.hp_list[hphash], link) {
-		if ((hp->vaddr >> mm.hp_size_bits) == hpn) {
-			res = hp;
-			break;
+/*
+ * Release a hugepage: if the hugepage reservation of the hugepage node
+ * is not full, keep the hugepage in the reservation. Otherwise, free it.
+ */
+static void nvme_mem_put_hp(struct nvme_hugepage *hp)
+{
+	struct nvme_hp_reserve *rsv;
+
+	hp->mp = NULL;
+	hp->heap = NULL;
+
+	if (hp->hps == &mm.hp_sizes[0] && !hp->nr_run &&
+	    hp->node_id < NVME_NODE_MAX) {
+		rsv = &mm.hp_rsv[hp->node_id];
+		nvme_spin_lock(&mm.hp_lock);
+		if (rsv->nr_free < rsv->nr_hp) {
+			LIST_INSERT_HEAD(&rsv->free_list, hp, rsv_link);
+			rsv->nr_free++;
+			hp = NULL;
 		}
+		nvme_spin_unlock(&mm.hp_lock);
+		if (!hp)
+			return;
 	}
 
-	nvme_spin_unlock(&mm.hp_lock);
-
-	return res;
+	nvme_mem_free_hp(hp);
 }
 
 /*
- * Initialize hugepages management.
+ * Compare hugepages physical addresses (for sorting).
  */
-static int nvme_mem_hp_init(void)
+static int nvme_mem_hp_cmp(const void *a, const void *b)
 {
-	int i, ret;
+	const struct nvme_hugepage *hpa = *(struct nvme_hugepage * const *)a;
+	const struct nvme_hugepage *hpb = *(struct nvme_hugepage * const *)b;
 
-	/* Initialize hugepages management data */
-	nvme_atomic64_init(&mm.hp_tmp);
-	nvme_atomic_init(&mm.nr_hp);
-	for (i = 0; i < NVME_HP_HASH_SIZE; i++) {
-		LIST_INIT(&mm.hp_list[i]);
-		nvme_spinlock_init(&mm.hp_lock);
-	}
+	if (hpa->paddr < hpb->paddr)
+		return -1;
 
-	/* Find out where hugetlbfs is mounted */
-	ret = nvme_mem_get_hp_dir();
-	if (ret < 0) {
-		nvme_crit("hugetlbfs mount point not found\n");
-		return ret;
-	}
+	return hpa->paddr > hpb->paddr;
+}
 
-	/* Determine the size of hugepages */
-	mm.hp_size = nvme_mem_get_hp_size();
-	if (!mm.hp_size) {
-		nvme_crit("Failed to determine the size of hugepages\n");
-		return -ENOMEM;
-	}
-	mm.hp_size_bits = nvme_log2(mm.hp_size);
+/*
+ * Search nr physically contiguous hugepages in an array
+ * of hugepages sorted by physical address.
+ */
+static int nvme_mem_find_run(struct nvme_hugepage **hps, unsigned int nr_hps,
+			     unsigned int nr)
+{
+	unsigned int i, n = 1;
 
-	/* Open hugetlbfs directory */
-	ret = open(mm.hp_dir, O_RDONLY | O_DIRECTORY);
-	if (ret < 0) {
-		nvme_crit("Open hugepage directory %s failed %d (%s)\n",
-			  mm.hp_dir, errno, strerror(errno));
-		return -errno;
+	for (i = 1; i < nr_hps && n < nr; i++) {
+		if (hps[i]->paddr == hps[i - 1]->paddr + hps[i]->size)
+			n++;
+		else
+			n = 1;
 	}
 
-	mm.hp_dd = ret;
-
-	return 0;
+	return n == nr ? (int)(i - nr) : -1;
 }
 
 /*
- * Cleanup hugepages management.
+ * Remap the hugepages of a run in a single virtual address range.
  */
-static void nvme_mem_hp_cleanup(void)
+static void *nvme_mem_remap_run(struct nvme_hugepage **run, unsigned int nr)
 {
-	struct nvme_hugepage *hp;
-	int i;
+	size_t hp_size = run[0]->size, hp_size_bits = run[0]->size_bits;
+	size_t size = (size_t)nr << hp_size_bits;
+	unsigned long base, addr;
+	unsigned int i;
+	void *vaddr;
 
-	/* Free hugepages still in use */
-	for (i = 0; i < NVME_HP_HASH_SIZE; i++) {
-		while ((hp = LIST_FIRST(&mm.hp_list[i])))
-			nvme_mem_free_hp(hp);
+	/* Reserve a hugepage aligned virtual address range */
+	vaddr = mmap(NULL, size + hp_size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (vaddr == MAP_FAILED) {
+		nvme_err("Reserve %zu B of address space failed %d (%s)\n",
+			 size, errno, strerror(errno));
+		return NULL;
+	}
+
+	base = nvme_align_up((unsigned long)vaddr, hp_size);
+	if (base > (unsigned long)vaddr)
+		munmap(vaddr, base - (unsigned long)vaddr);
+	munmap((void *)(base + size),
+	       (unsigned long)vaddr + hp_size - base);
+
+	for (i = 0; i < nr; i++) {
+
+		addr = base + ((unsigned long)i << hp_size_bits);
+		vaddr = mmap((void *)addr, hp_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_FIXED, run[i]->arena->fd,
+			     run[i]->ofst);
+		if (vaddr == MAP_FAILED || mlock(vaddr, hp_size) != 0) {
+			nvme_err("Remap hugepage 0x%lx failed %d (%s)\n",
+				 run[i]->paddr, errno, strerror(errno));
+			munmap((void *)base, size);
+			return NULL;
+		}
+
+	}
+
+	/* Drop the original mappings */
+	for (i = 0; i < nr; i++) {
+		munlock((void *)run[i]->vaddr, hp_size);
+		munmap((void *)run[i]->vaddr, hp_size);
+		run[i]->vaddr = base + ((unsigned long)i << hp_size_bits);
 	}
 
-	if (mm.hp_dd != -1)
-		close(mm.hp_dd);
-	rmdir(mm.hp_dir);
-	free(mm.hp_dir);
+	return (void *)base;
 }
 
 /*
- * Add a heap to the specified mempool.
+ * Allocate a run of nr physically contiguous hugepages mapped at
+ * contiguous virtual addresses. Hugepages are allocated until nr of
+ * them are found physically contiguous, up to twice the size of the
+ * run plus NVME_MEM_RUN_EXTRA_SIZE, since each hugepage is faulted in
+ * and locked. Hugepages not part of the run are then freed.
  */
-static struct nvme_heap *nvme_mem_pool_grow(struct nvme_mempool *mp)
+static struct nvme_hugepage *nvme_mem_alloc_run(struct nvme_hp_size *hps,
+						unsigned int nr,
+						unsigned int node_id)
 {
-	struct nvme_hugepage *hp;
-	struct nvme_heap *heap = NULL;
-
-	/* Allocate a hugepage */
-	hp = nvme_mem_alloc_hp(mp->node_id);
-	if (!hp)
+	unsigned int i, nr_hps = 0;
+	unsigned int max_hps = nr * 2 +
+		(NVME_MEM_RUN_EXTRA_SIZE >> hps->size_bits);
+	struct nvme_hugepage **hpa, *hp = NULL;
+	int first = -1;
+
+	hpa = calloc(max_hps, sizeof(struct nvme_hugepage *));
+	if (!hpa)
 		return NULL;
 
-	/* Allocate a heap descriptor */
-	heap = calloc(1, sizeof(struct nvme_heap));
-	if (!heap)
-		goto err;
+	while (nr_hps < max_hps) {
 
-	hp->mp = mp;
-	hp->heap = heap;
+		hpa[nr_hps] = nvme_mem_hp_create(hps, node_id);
+		if (!hpa[nr_hps])
+			break;
+		nr_hps++;
 
-	heap->hp = hp;
-	heap->nr_objs = hp->size >> mp->size_bits;
-	heap->nr_free_objs = heap->nr_objs;
+		if (nr_hps < nr)
+			continue;
 
-	/* Allocate the heap bitmap */
-	heap->bitmap = calloc(nvme_align_up(heap->nr_objs, 64) >> 6,
-			      sizeof(__u64));
-	if (!heap->bitmap)
-		goto err;
+		qsort(hpa, nr_hps, sizeof(struct nvme_hugepage *),
+		      nvme_mem_hp_cmp);
+		first = nvme_mem_find_run(hpa, nr_hps, nr);
+		if (first >= 0)
+			break;
+
+	}
+
+	if (first < 0) {
+		nvme_err("No %u physically contiguous hugepages found "
+			 "in %u hugepages\n", nr, nr_hps);
+		goto out;
+	}
+
+	/* Allocate and initialize the run descriptor */
+	hp = calloc(1, sizeof(struct nvme_hugepage));
+	if (!hp)
+		goto out;
+
+	hp->run = calloc(nr, sizeof(struct nvme_hugepage *));
+	if (!hp->run)
+		goto err;
+	memcpy(hp->run, &hpa[first], sizeof(struct nvme_hugepage *) * nr);
+
+	if (!nvme_mem_remap_run(hp->run, nr))
+		goto err;
+
+	hp->nr_run = nr;
+	hp->size = (size_t)nr << hps->size_bits;
+	hp->size_bits = hps->size_bits;
+	hp->hps = hps;
+	hp->vaddr = hp->run[0]->vaddr;
+	hp->paddr = hp->run[0]->paddr;
+	hp->node_id = node_id;
+
+	if (nvme_mem_add_hp(hp) != 0)
+		goto err;
+
+	/* The run hugepages are now owned by the run descriptor */
+	for (i = 0; i < nr; i++)
+		hpa[first + i] = NULL;
+
+	goto out;
+
+err:
+	free(hp->run);
+	free(hp);
+	hp = NULL;
+
+out:
+	for (i = 0; i < nr_hps; i++) {
+		if (hpa[i])
+			nvme_mem_hp_destroy(hpa[i]);
+	}
+	free(hpa);
+
+	return hp;
+}
+
+/*
+ * Search the hugepage containing the specified address.
+ * This does not take any lock: the translation map leaves are never
+ * freed and a hugepage can be freed only once the memory it backs
+ * is not used anymore.
+ */
+struct nvme_hugepage *nvme_mem_search_hp(unsigned long vaddr)
+{
+	unsigned long hpn = vaddr >> mm.hp_size_bits;
+	unsigned long idx = hpn >> NVME_HP_MAP_LEAF_BITS;
+	struct nvme_hp_map_leaf *leaf;
+
+	if (idx >= mm.hp_map_size)
+		return NULL;
+
+	leaf = mm.hp_map[idx];
+	if (!leaf)
+		return NULL;
+
+	nvme_smp_rmb();
+
+	return leaf->hp[hpn & NVME_HP_MAP_LEAF_MASK];
+}
+
+/*
+ * Initialize hugepages management.
+ */
+static int nvme_mem_hp_init(void)
+{
+	struct nvme_hp_arena *arena;
+	unsigned int i, n;
+	int ret;
+
+	/* Initialize hugepages management data */
+	nvme_atomic_init(&mm.nr_hp);
+	nvme_atomic_init(&mm.nr_large);
+	nvme_atomic64_init(&mm.large_bytes);
+	LIST_INIT(&mm.hp_list);
+	nvme_spinlock_init(&mm.hp_lock);
+	for (i = 0; i < NVME_NODE_MAX; i++)
+		LIST_INIT(&mm.hp_rsv[i].free_list);
+
+	/* Find out where hugetlbfs is mounted and the hugepage sizes */
+	ret = nvme_mem_get_hp_sizes();
+	if (ret < 0) {
+		nvme_crit("No usable hugetlbfs mount point found\n");
+		return ret;
+	}
+	mm.hp_size = mm.hp_sizes[0].size;
+	mm.hp_size_bits = mm.hp_sizes[0].size_bits;
+
+	/* Initialize the hugepage arenas (created when first used) */
+	for (i = 0; i < mm.nr_hp_sizes; i++) {
+		for (n = 0; n < NVME_NODE_MAX; n++) {
+			arena = &mm.hp_sizes[i].arena[n];
+			pthread_mutex_init(&arena->lock, NULL);
+			arena->fd = -1;
+		}
+	}
+
+	/* Allocate the translation map first level */
+	mm.hp_map_size = 1UL << (NVME_VADDR_BITS - mm.hp_size_bits -
+				 NVME_HP_MAP_LEAF_BITS);
+	mm.hp_map = calloc(mm.hp_map_size,
+			   sizeof(struct nvme_hp_map_leaf *));
+	if (!mm.hp_map) {
+		nvme_crit("Allocate hugepage translation map failed\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Cleanup hugepages management.
+ */
+static void nvme_mem_hp_cleanup(void)
+{
+	struct nvme_hp_arena *arena;
+	struct nvme_hugepage *hp;
+	struct nvme_hp_size *hps;
+	char fname[32];
+	unsigned int n;
+	size_t i;
+
+	/* Drop hugepage reservations */
+	for (i = 0; i < NVME_NODE_MAX; i++) {
+		mm.hp_rsv[i].nr_hp = 0;
+		mm.hp_rsv[i].nr_free = 0;
+		LIST_INIT(&mm.hp_rsv[i].free_list);
+	}
+
+	/* Free hugepages still in use */
+	while ((hp = LIST_FIRST(&mm.hp_list)))
+		nvme_mem_free_hp(hp);
+
+	/* Free the translation map */
+	if (mm.hp_map) {
+		for (i = 0; i < mm.hp_map_size; i++)
+			free(mm.hp_map[i]);
+		free((void *)mm.hp_map);
+		mm.hp_map = NULL;
+	}
+
+	for (i = 0; i < mm.nr_hp_sizes; i++) {
+		hps = &mm.hp_sizes[i];
+		for (n = 0; n < NVME_NODE_MAX; n++) {
+			arena = &hps->arena[n];
+			if (arena->fd < 0)
+				continue;
+			close(arena->fd);
+			sprintf(fname, "node%u", n);
+			unlinkat(hps->dd, fname, 0);
+			free(arena->free);
+			memset(arena, 0, sizeof(struct nvme_hp_arena));
+			arena->fd = -1;
+		}
+		if (hps->dd != -1)
+			close(hps->dd);
+		if (hps->dir) {
+			rmdir(hps->dir);
+			free(hps->dir);
+		}
+	}
+	mm.nr_hp_sizes = 0;
+}
+
+/*
+ * Remove the hugepage directories of a terminated process, releasing
+ * the hugepages which the process did not free.
+ */
+void nvme_mem_remove_pid(pid_t pid)
+{
+	char prefix[32], mntdir[PATH_MAX], *p;
+	struct dirent *de, *hde;
+	size_t prefix_len;
+	DIR *d, *hd;
+	unsigned int i;
+	int dd;
+
+	prefix_len = sprintf(prefix, "libnvme.%d.", (int)pid);
+
+	for (i = 0; i < mm.nr_hp_sizes; i++) {
+
+		/* The process directories are in the same mount point */
+		strncpy(mntdir, mm.hp_sizes[i].dir, PATH_MAX - 1);
+		mntdir[PATH_MAX - 1] = '\0';
+		p = strrchr(mntdir, '/');
+		if (!p)
+			continue;
+		*p = '\0';
+
+		d = opendir(mntdir);
+		if (!d)
+			continue;
+
+		while ((de = readdir(d))) {
+
+			if (strncmp(de->d_name, prefix, prefix_len) != 0)
+				continue;
+
+			dd = openat(dirfd(d), de->d_name,
+				    O_RDONLY | O_DIRECTORY);
+			if (dd < 0)
+				continue;
+
+			hd = fdopendir(dd);
+			if (!hd) {
+				close(dd);
+				continue;
+			}
+
+			while ((hde = readdir(hd))) {
+				if (hde->d_name[0] != '.')
+					unlinkat(dd, hde->d_name, 0);
+			}
+
+			closedir(hd);
+
+			if (unlinkat(dirfd(d), de->d_name, AT_REMOVEDIR) == 0)
+				nvme_info("Removed hugepage directory %s/%s\n",
+					  mntdir, de->d_name);
+
+		}
+
+		closedir(d);
+
+	}
+}
+
+/*
+ * Test if a heap can be freed: the heap must be empty and freeing it
+ * must not lower the mempool free memory below its low watermark nor
+ * its number of objects below the number of pre-allocated objects.
+ */
+static inline bool nvme_mem_pool_heap_excess(struct nvme_mempool *mp,
+					     struct nvme_heap *heap)
+{
+	return nvme_heap_empty(heap) &&
+		((mp->nr_free_objs - heap->nr_objs) << mp->size_bits)
+		>= mp->low_wmark &&
+		mp->nr_objs - heap->nr_objs >= mp->nr_min_objs;
+}
+
+/*
+ * Remove a heap from a mempool use list and free the heap descriptor.
+ * Return the heap hugepage.
+ * Must be called with the mempool lock held.
+ */
+static struct nvme_hugepage *nvme_mem_pool_remove_heap(struct nvme_mempool *mp,
+						       struct nvme_heap *heap)
+{
+	struct nvme_hugepage *hp = heap->hp;
+
+	nvme_debug("Mempool %zu B: Freed heap %p, %zu objects (%zu heaps)\n",
+		   mp->size, heap, heap->nr_objs,
+		   mp->nr_use + mp->nr_full);
+
+	if (!nvme_heap_empty(heap))
+		nvme_warning("Mempool %zu B: Free non-empty heap %p, %zu / %zu objects in use\n",
+			     mp->size, heap,
+			     mp->nr_objs - mp->nr_free_objs, mp->nr_objs);
+
+	LIST_REMOVE(heap, link);
+	mp->nr_use--;
+	if (nvme_heap_empty(heap))
+		mp->nr_empty--;
+	mp->nr_objs -= heap->nr_objs;
+	mp->nr_free_objs -= heap->nr_free_objs;
+	mp->nr_shrinks++;
+
+	free(heap->bitmap);
+	free(heap);
+
+	hp->mp = NULL;
+	hp->heap = NULL;
+
+	return hp;
+}
+
+/*
+ * Shrink a mempool: free empty heaps down to the mempool low
+ * watermark, or all heaps if force is true.
+ * Must be called with the mempool lock held.
+ */
+static void nvme_mem_pool_shrink(struct nvme_mempool *mp,
+				 bool force)
+{
+	struct nvme_heap *heap, *next;
+
+	heap = LIST_FIRST(&mp->use_list);
+	while (heap) {
+		next = LIST_NEXT(heap, link);
+		if (force || nvme_mem_pool_heap_excess(mp, heap))
+			nvme_mem_put_hp(nvme_mem_pool_remove_heap(mp, heap));
+		heap = next;
+	}
+}
+
+/*
+ * Take the hugepage of an empty heap from a mempool waiting for
+ * reclaim, to grow the mempool mp. The caller holds the lock of mp,
+ * so the other mempools locks are only tried.
+ */
+static struct nvme_hugepage *nvme_mem_pool_steal_hp(struct nvme_mempool *mp)
+{
+	struct nvme_hugepage *hp = NULL;
+	struct nvme_mempool *smp;
+	struct nvme_heap *heap;
+	int i;
+
+	for (i = 0; i < NVME_MP_NUM && !hp; i++) {
+
+		smp = &mm.mp[mp->node_id][i];
+		if (smp == mp || !smp->reclaim)
+			continue;
+
+		if (pthread_mutex_trylock(&smp->lock) != 0)
+			continue;
+
+		LIST_FOREACH(heap, &smp->use_list, link) {
+			if (nvme_mem_pool_heap_excess(smp, heap)) {
+				hp = nvme_mem_pool_remove_heap(smp, heap);
+				break;
+			}
+		}
+		if (!hp)
+			smp->reclaim = false;
+
+		pthread_mutex_unlock(&smp->lock);
+
+	}
+
+	return hp;
+}
+
+/*
+ * Add a heap to the specified mempool.
+ */
+static struct nvme_heap *nvme_mem_pool_grow(struct nvme_mempool *mp)
+{
+	struct nvme_hugepage *hp;
+	struct nvme_heap *heap = NULL;
+
+	/*
+	 * Get a hugepage of the smallest size, from a mempool with
+	 * free memory waiting to be reclaimed if possible.
+	 */
+	hp = nvme_mem_pool_steal_hp(mp);
+	if (!hp)
+		hp = nvme_mem_get_hp(mp->node_id);
+	if (!hp)
+		return NULL;
+
+	/* Allocate a heap descriptor */
+	heap = calloc(1, sizeof(struct nvme_heap));
+	if (!heap)
+		goto err;
+
+	hp->mp = mp;
+	hp->heap = heap;
+
+	heap->hp = hp;
+	heap->nr_objs = hp->size >> mp->size_bits;
+	heap->nr_free_objs = heap->nr_objs;
+
+	/* Allocate the heap bitmap */
+	heap->bitmap = calloc(nvme_align_up(heap->nr_objs, 64) >> 6,
+			      sizeof(__u64));
+	if (!heap->bitmap)
+		goto err;
 
 	/* Add the heap to the memory pool use list */
 	LIST_INSERT_HEAD(&mp->use_list, heap, link);
 	mp->nr_use++;
+	mp->nr_empty++;
 	mp->nr_objs += heap->nr_objs;
 	mp->nr_free_objs += heap->nr_free_objs;
+	mp->nr_grows++;
 
 	nvme_debug("Mempool %zu B: Created heap %p, %zu objects (%zu heaps)\n",
 		   mp->size, heap, heap->nr_objs,
@@ -391,23 +1105,35 @@ static struct nvme_heap *nvme_mem_pool_grow(struct nvme_mempool *mp)
 
 err:
 	free(heap);
-	nvme_mem_free_hp(hp);
+	nvme_mem_put_hp(hp);
 
 	return NULL;
 }
 
+/*
+ * Lock a mempool, counting the acquisitions which had to wait.
+ */
+static inline void nvme_mem_pool_lock(struct nvme_mempool *mp)
+{
+	if (pthread_mutex_trylock(&mp->lock) != 0) {
+		pthread_mutex_lock(&mp->lock);
+		mp->nr_contended++;
+	}
+	mp->nr_locks++;
+}
+
 /*
  * Allocate an object from a mempool.
+ * Must be called with the mempool lock held.
  */
-static void *nvme_mem_pool_alloc(struct nvme_mempool *mp, unsigned long *paddr)
+static void *_nvme_mem_pool_alloc(struct nvme_mempool *mp,
+				  unsigned long *paddr)
 {
 	struct nvme_heap *heap;
 	void *obj = NULL;
 	size_t ofst;
 	int bit;
 
-	pthread_mutex_lock(&mp->lock);
-
 	/*
 	 * Get a heap to allocate from: If there are heaps in use,
 	 * keep using them until full. Otherwise, grow the mempool.
@@ -437,8 +1163,12 @@ static void *nvme_mem_pool_alloc(struct nvme_mempool *mp, unsigned long *paddr)
 	if (paddr)
 		*paddr = heap->hp->paddr + ofst;
 
+	if (nvme_heap_empty(heap))
+		mp->nr_empty--;
 	mp->nr_free_objs--;
 	heap->nr_free_objs--;
+	if (mp->nr_objs - mp->nr_free_objs > mp->peak_used_objs)
+		mp->peak_used_objs = mp->nr_objs - mp->nr_free_objs;
 	if (nvme_heap_full(heap)) {
 		LIST_REMOVE(heap, link);
 		mp->nr_use--;
@@ -451,79 +1181,38 @@ static void *nvme_mem_pool_alloc(struct nvme_mempool *mp, unsigned long *paddr)
 		   mp->nr_objs - mp->nr_free_objs, mp->nr_objs);
 
 out:
-	pthread_mutex_unlock(&mp->lock);
-
 	return obj;
 }
 
 /*
- * Shrink a mempool.
+ * Allocate an object from a mempool.
  */
-static void nvme_mem_pool_shrink(struct nvme_mempool *mp,
-				 bool force)
+static void *nvme_mem_pool_alloc(struct nvme_mempool *mp, unsigned long *paddr)
 {
-	struct nvme_heap *heap, *next;
-	int n = 0;
-
-	/*
-	 * Scan the use list and free unused heaps, but skip
-	 * the first empty one.
-	 */
-	heap = LIST_FIRST(&mp->use_list);
-	while (heap) {
-
-		if (!force) {
-			if (nvme_heap_empty(heap))
-				n++;
-			if (!nvme_heap_empty(heap) || n == 1) {
-				heap = LIST_NEXT(heap, link);
-				continue;
-			}
-		}
+	void *obj;
 
-		nvme_debug("Mempool %zu B: Freed heap %p, %zu objects (%zu heaps)\n",
-			   mp->size, heap, heap->nr_objs,
-			   mp->nr_use + mp->nr_full);
-
-		if (!nvme_heap_empty(heap))
-			nvme_warning("Mempool %zu B: Free non-empty heap %p, %zu / %zu objects in use\n",
-				     mp->size, heap,
-				     mp->nr_objs - mp->nr_free_objs, mp->nr_objs);
-
-		next = LIST_NEXT(heap, link);
-
-		/* Remove the heap from the meory pool empty list */
-		LIST_REMOVE(heap, link);
-		mp->nr_use--;
-		mp->nr_objs -= heap->nr_objs;
-		mp->nr_free_objs -= heap->nr_free_objs;
-
-		/* Free resources */
-		free(heap->bitmap);
-		nvme_mem_free_hp(heap->hp);
-		free(heap);
-
-		heap = next;
+	nvme_mem_pool_lock(mp);
+	obj = _nvme_mem_pool_alloc(mp, paddr);
+	pthread_mutex_unlock(&mp->lock);
 
-	}
+	return obj;
 }
 
 /*
  * Free a mempool object.
+ * Must be called with the mempool lock held.
  */
-static void nvme_mem_pool_free(struct nvme_mempool *mp, struct nvme_heap *heap,
-			       void *vaddr)
+static void _nvme_mem_pool_free(struct nvme_mempool *mp,
+				struct nvme_heap *heap, void *vaddr)
 {
 	struct nvme_hugepage *hp = heap->hp;
 	unsigned long obj = (unsigned long)vaddr;
 	int bit;
 
-	pthread_mutex_lock(&mp->lock);
-
 	if (obj < hp->vaddr || obj >= hp->vaddr + hp->size) {
 		nvme_crit("Object %p does not belong to heap 0x%lx + %zu\n",
 			   vaddr, hp->vaddr, hp->size);
-		goto out;
+		return;
 	}
 
 	bit = (obj - hp->vaddr) >> mp->size_bits;
@@ -531,7 +1220,7 @@ static void nvme_mem_pool_free(struct nvme_mempool *mp, struct nvme_heap *heap,
 	    !test_bit(heap->bitmap, bit)) {
 		nvme_crit("Double free on object %p in heap size %zu (%zu / %zu)\n",
 			  vaddr, mp->size, heap->nr_free_objs, heap->nr_objs);
-		goto out;
+		return;
 	}
 
 	clear_bit(heap->bitmap, bit);
@@ -546,25 +1235,359 @@ static void nvme_mem_pool_free(struct nvme_mempool *mp, struct nvme_heap *heap,
 	heap->nr_free_objs++;
 	mp->nr_free_objs++;
 
-	if (nvme_heap_empty(heap))
-		nvme_mem_pool_shrink(mp, false);
+	/*
+	 * Do not free empty heaps here: flag the mempool for reclaim
+	 * once its free memory exceeds its high watermark.
+	 */
+	if (nvme_heap_empty(heap)) {
+		mp->nr_empty++;
+		if ((mp->nr_free_objs << mp->size_bits) > mp->high_wmark)
+			mp->reclaim = true;
+	}
 
 	nvme_debug("Mempool %zu B: freed object %p (%p / %d), %zu / %zu objects in use\n",
 		   mp->size, (void *)obj, heap, bit,
 		   mp->nr_objs - mp->nr_free_objs, mp->nr_objs);
+}
 
-out:
+/*
+ * Free a mempool object.
+ */
+static void nvme_mem_pool_free(struct nvme_mempool *mp, struct nvme_heap *heap,
+			       void *vaddr)
+{
+	nvme_mem_pool_lock(mp);
+	_nvme_mem_pool_free(mp, heap, vaddr);
 	pthread_mutex_unlock(&mp->lock);
 }
 
 /*
- * Allocate memory on the specified NUMA node.
+ * Per-thread caches. These are not part of the memory management data
+ * as threads may keep their cache across a library cleanup.
+ */
+static __thread struct nvme_mem_tcache *nvme_tcache;
+static pthread_key_t nvme_tcache_key;
+static pthread_once_t nvme_tcache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t nvme_tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, nvme_mem_tcache) nvme_tcache_list =
+	LIST_HEAD_INITIALIZER(nvme_tcache_list);
+
+/*
+ * Get the index of the magazine caching a mempool objects.
+ */
+static inline unsigned int nvme_mem_mag_idx(struct nvme_mempool *mp)
+{
+	return mp->size_bits - NVME_MP_SIZE_BITS_MIN;
+}
+
+/*
+ * Move up to nr objects from a mempool to a magazine.
+ */
+static void nvme_mem_mag_refill(struct nvme_mempool *mp,
+				struct nvme_mag *mag, unsigned int nr)
+{
+	void *obj;
+
+	nvme_mem_pool_lock(mp);
+
+	while (nr-- && mag->nr_objs < mag->max_objs) {
+		obj = _nvme_mem_pool_alloc(mp, NULL);
+		if (!obj)
+			break;
+		mag->objs[mag->nr_objs++] = obj;
+	}
+
+	pthread_mutex_unlock(&mp->lock);
+}
+
+/*
+ * Move up to nr objects from a magazine back to its mempool,
+ * starting from the least recently freed objects.
+ */
+static void nvme_mem_mag_drain(struct nvme_mempool *mp,
+			       struct nvme_mag *mag, unsigned int nr)
+{
+	struct nvme_hugepage *hp;
+	unsigned int i;
+
+	nr = nvme_min(nr, mag->nr_objs);
+	if (!nr)
+		return;
+
+	nvme_mem_pool_lock(mp);
+
+	for (i = 0; i < nr; i++) {
+		hp = nvme_mem_search_hp((unsigned long)mag->objs[i]);
+		_nvme_mem_pool_free(mp, hp->heap, mag->objs[i]);
+	}
+
+	pthread_mutex_unlock(&mp->lock);
+
+	mag->nr_objs -= nr;
+	memmove(&mag->objs[0], &mag->objs[nr], sizeof(void *) * mag->nr_objs);
+}
+
+/*
+ * Return all objects of a thread cache to their mempool.
+ */
+static void nvme_mem_tcache_drain(struct nvme_mem_tcache *tc)
+{
+	unsigned int i;
+
+	for (i = 0; i < NVME_MAG_NUM; i++)
+		nvme_mem_mag_drain(&mm.mp[tc->node_id][i], &tc->mag[i],
+				   tc->mag[i].nr_objs);
+}
+
+/*
+ * Move a thread cache to another NUMA node.
+ */
+static void nvme_mem_tcache_move(struct nvme_mem_tcache *tc,
+				 unsigned int node_id)
+{
+	pthread_mutex_lock(&nvme_tcache_lock);
+	nvme_mem_tcache_drain(tc);
+	tc->node_id = node_id;
+	pthread_mutex_unlock(&nvme_tcache_lock);
+}
+
+/*
+ * Thread exit: free the thread cache.
+ */
+static void nvme_mem_tcache_destroy(void *arg)
+{
+	struct nvme_mem_tcache *tc = arg;
+
+	pthread_mutex_lock(&nvme_tcache_lock);
+	nvme_mem_tcache_drain(tc);
+	LIST_REMOVE(tc, link);
+	pthread_mutex_unlock(&nvme_tcache_lock);
+
+	nvme_tcache = NULL;
+	free(tc);
+}
+
+static void nvme_mem_tcache_key_init(void)
+{
+	if (pthread_key_create(&nvme_tcache_key, nvme_mem_tcache_destroy))
+		nvme_crit("Create thread cache key failed\n");
+}
+
+/*
+ * Create the calling thread cache.
+ */
+static struct nvme_mem_tcache *nvme_mem_tcache_create(void)
+{
+	struct nvme_mem_tcache *tc;
+	unsigned int i;
+
+	pthread_once(&nvme_tcache_once, nvme_mem_tcache_key_init);
+
+	tc = calloc(1, sizeof(struct nvme_mem_tcache));
+	if (!tc)
+		return NULL;
+
+	tc->node_id = nvme_mem_node(NVME_NODE_ID_ANY);
+
+	for (i = 0; i < NVME_MAG_NUM; i++)
+		tc->mag[i].max_objs =
+			nvme_min(NVME_MAG_OBJS_MAX,
+				 NVME_MAG_BYTES >> (NVME_MP_SIZE_BITS_MIN + i));
+
+	if (pthread_setspecific(nvme_tcache_key, tc)) {
+		free(tc);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&nvme_tcache_lock);
+	LIST_INSERT_HEAD(&nvme_tcache_list, tc, link);
+	pthread_mutex_unlock(&nvme_tcache_lock);
+
+	nvme_tcache = tc;
+
+	return tc;
+}
+
+static inline struct nvme_mem_tcache *nvme_mem_tcache_get(void)
+{
+	if (likely(nvme_tcache != NULL))
+		return nvme_tcache;
+
+	return nvme_mem_tcache_create();
+}
+
+/*
+ * Allocate an object of the mempool of index idx from the calling
+ * thread cache, if the cache node is suitable.
+ */
+static void *nvme_mem_tcache_alloc(unsigned int idx, unsigned int node_id,
+				   unsigned long *paddr)
+{
+	struct nvme_mem_tcache *tc = nvme_mem_tcache_get();
+	struct nvme_mempool *mp;
+	struct nvme_mag *mag;
+	unsigned int bound_id;
+	void *obj;
+
+	if (!tc)
+		return NULL;
+
+	if (node_id >= nvme_node_max()) {
+		/* Follow the thread if it was bound to another node */
+		bound_id = nvme_node_id_bound();
+		if (unlikely(bound_id != tc->node_id &&
+			     bound_id < nvme_node_max()))
+			nvme_mem_tcache_move(tc, bound_id);
+	} else if (node_id != tc->node_id) {
+		return NULL;
+	}
+
+	mp = &mm.mp[tc->node_id][idx];
+	mag = &tc->mag[idx];
+	if (!mag->nr_objs) {
+		nvme_mem_mag_refill(mp, mag, mag->max_objs / 2);
+		if (!mag->nr_objs)
+			return NULL;
+	}
+
+	obj = mag->objs[--mag->nr_objs];
+	if (paddr)
+		*paddr = nvme_mem_vtophys(obj);
+
+	return obj;
+}
+
+/*
+ * Free an object to the calling thread cache.
+ */
+static bool nvme_mem_tcache_free(struct nvme_mempool *mp, void *obj)
+{
+	struct nvme_mem_tcache *tc = nvme_mem_tcache_get();
+	struct nvme_mag *mag;
+#ifdef NVME_DEBUG
+	unsigned int i;
+#endif
+
+	if (!tc || mp->node_id != tc->node_id)
+		return false;
+
+	mag = &tc->mag[nvme_mem_mag_idx(mp)];
+
+#ifdef NVME_DEBUG
+	for (i = 0; i < mag->nr_objs; i++) {
+		if (mag->objs[i] == obj) {
+			nvme_crit("Double free on object %p in mempool %zu B\n",
+				  obj, mp->size);
+			return true;
+		}
+	}
+#endif
+
+	if (mag->nr_objs == mag->max_objs)
+		nvme_mem_mag_drain(mp, mag, mag->max_objs / 2);
+
+	mag->objs[mag->nr_objs++] = obj;
+
+	return true;
+}
+
+/*
+ * Allocate a large object using hugepages of the specified size.
+ */
+static struct nvme_hugepage *nvme_mem_alloc_large_hp(struct nvme_hp_size *hps,
+						     size_t size,
+						     unsigned int node_id)
+{
+	unsigned int nr = nvme_align_up(size, hps->size) >> hps->size_bits;
+
+	if (nr == 1) {
+		if (hps == &mm.hp_sizes[0])
+			return nvme_mem_get_hp(node_id);
+		return nvme_mem_alloc_hp(hps, node_id);
+	}
+
+	return nvme_mem_alloc_run(hps, nr, node_id);
+}
+
+/*
+ * Allocate a large object: a whole hugepage or a run of
+ * physically contiguous hugepages. The hugepage size used first is the
+ * largest one less than twice the object size, that is, using less
+ * hugepages with less than half of the allocated memory unused.
+ * If that fails, larger then smaller hugepage sizes are tried: a larger
+ * hugepage is a single allocation while a run of smaller hugepages
+ * may need searching through many more of them.
+ */
+static void *nvme_mem_alloc_large(size_t size, size_t align,
+				  unsigned int node_id, unsigned long *paddr)
+{
+	struct nvme_hugepage *hp = NULL;
+	struct nvme_hp_size *hps;
+	unsigned int best, i;
+	int n;
+
+	node_id = nvme_mem_node(node_id);
+
+	for (best = mm.nr_hp_sizes - 1; best > 0; best--) {
+		if (mm.hp_sizes[best].size < size * 2)
+			break;
+	}
+
+	for (i = best; i < mm.nr_hp_sizes && !hp; i++) {
+		hps = &mm.hp_sizes[i];
+		if (align <= hps->size)
+			hp = nvme_mem_alloc_large_hp(hps, size, node_id);
+	}
+
+	for (n = (int)best - 1; n >= 0 && !hp; n--) {
+		hps = &mm.hp_sizes[n];
+		if (align <= hps->size)
+			hp = nvme_mem_alloc_large_hp(hps, size, node_id);
+	}
+
+	if (!hp) {
+		nvme_err("Allocate %zu B large object (align %zu B) failed\n",
+			 size, align);
+		return NULL;
+	}
+
+	nvme_atomic_inc(&mm.nr_large);
+	nvme_atomic64_add(&mm.large_bytes, hp->size);
+
+	nvme_debug("Allocated %zu B large object 0x%lx (%zu x %zu B hugepages)\n",
+		   size, hp->vaddr, hp->size >> hp->size_bits, hp->hps->size);
+
+	if (paddr)
+		*paddr = hp->paddr;
+
+	return (void *)hp->vaddr;
+}
+
+/*
+ * Free a large object.
+ */
+static void nvme_mem_free_large(struct nvme_hugepage *hp, void *addr)
+{
+	if ((unsigned long)addr != hp->vaddr) {
+		nvme_crit("Invalid address %p for large object free\n", addr);
+		return;
+	}
+
+	nvme_atomic_dec(&mm.nr_large);
+	nvme_atomic64_sub(&mm.large_bytes, hp->size);
+
+	nvme_mem_put_hp(hp);
+}
+
+/*
+ * Allocate memory on the specified NUMA node.
  */
 void *nvme_mem_alloc_node(size_t size, size_t align, unsigned int node_id,
 			  unsigned long *paddr)
 {
-	unsigned int size_bits;
+	unsigned int size_bits, idx;
 	struct nvme_mempool *mp;
+	void *obj;
 
 	if (size == 0 || (align && !nvme_is_pow2(align))) {
 		nvme_err("Invalid allocation request %zu / %zu\n",
@@ -572,26 +1595,35 @@ void *nvme_mem_alloc_node(size_t size, size_t align, unsigned int node_id,
 		return NULL;
 	}
 
-	if (node_id == NVME_NODE_ID_ANY ||
-	    node_id >= nvme_node_max())
-		node_id = nvme_node_id();
-
-	nvme_debug("Allocation from CPU %u, NUMA node %u\n",
-		   nvme_cpu_id(),
-		   nvme_node_id());
-
 	/* Get a suitable memory pool for the allocation */
 	size_bits = nvme_log2(nvme_align_pow2(nvme_max(size, align)));
 	if (size_bits <= NVME_MP_SIZE_BITS_MIN) {
-		mp = &mm.mp[0];
+		idx = 0;
 	} else if (size_bits <= NVME_MP_SIZE_BITS_MAX) {
-		mp = &mm.mp[size_bits - NVME_MP_SIZE_BITS_MIN];
+		idx = size_bits - NVME_MP_SIZE_BITS_MIN;
 	} else {
 		nvme_debug("No memory pool for %zu B (align %zu B)\n",
 			   size, align);
-		return NULL;
+		return nvme_mem_alloc_large(size, align, node_id, paddr);
 	}
 
+	/*
+	 * Small objects come first from the calling thread cache,
+	 * if the cache belongs to the requested node.
+	 */
+	if (size_bits <= NVME_MAG_SIZE_BITS_MAX) {
+		obj = nvme_mem_tcache_alloc(idx, node_id, paddr);
+		if (obj)
+			return obj;
+	}
+
+	node_id = nvme_mem_node(node_id);
+	mp = &mm.mp[node_id][idx];
+
+	nvme_debug("Allocation from CPU %u, NUMA node %u\n",
+		   nvme_cpu_id(),
+		   node_id);
+
 	nvme_debug("Allocate %zu B, align %zu B => mempool %zu B (order %zu)\n",
 		   size, align,
 		   mp->size, mp->size_bits);
@@ -614,6 +1646,7 @@ void *nvme_malloc_node(size_t size, size_t align,
 void nvme_free(void *addr)
 {
 	struct nvme_hugepage *hp;
+	struct nvme_mempool *mp;
 
 	if (!addr)
 		return;
@@ -624,7 +1657,135 @@ void nvme_free(void *addr)
 		return;
 	}
 
-	nvme_mem_pool_free(hp->mp, hp->heap, addr);
+	mp = hp->mp;
+	if (!mp) {
+		nvme_mem_free_large(hp, addr);
+		return;
+	}
+
+	if (mp->size_bits <= NVME_MAG_SIZE_BITS_MAX &&
+	    !(((unsigned long)addr - hp->vaddr) & (mp->size - 1)) &&
+	    nvme_mem_tcache_free(mp, addr))
+		return;
+
+	nvme_mem_pool_free(mp, hp->heap, addr);
+}
+
+/*
+ * Allocate zeroed memory not used for DMA on the specified NUMA node.
+ * Memory pools are used when possible. Larger allocations do not need
+ * physically contiguous hugepages and use regular memory, with the
+ * node set as the preferred node of the memory pages.
+ */
+void *nvme_mem_zalloc_host(size_t size, unsigned int node_id)
+{
+	unsigned long nodemask, start, end;
+	void *addr;
+
+	node_id = nvme_mem_node(node_id);
+
+	if (size <= (1UL << NVME_MP_SIZE_BITS_MAX)) {
+		addr = nvme_mem_alloc_node(size, 0, node_id, NULL);
+		if (addr) {
+			memset(addr, 0, size);
+			return addr;
+		}
+	}
+
+	addr = malloc(size);
+	if (!addr)
+		return NULL;
+
+	start = nvme_align_up((unsigned long)addr, mm.pg_size);
+	end = nvme_align_down((unsigned long)addr + size, mm.pg_size);
+	if (end > start) {
+		nodemask = 1UL << node_id;
+		if (mbind((void *)start, end - start, MPOL_PREFERRED,
+			  &nodemask, node_id + 2, MPOL_MF_MOVE) != 0)
+			nvme_debug("mbind %p to node %u failed %d (%s)\n",
+				   addr, node_id, errno, strerror(errno));
+	}
+
+	memset(addr, 0, size);
+
+	return addr;
+}
+
+/*
+ * Free memory allocated with nvme_mem_zalloc_host().
+ */
+void nvme_mem_free_host(void *addr)
+{
+	if (addr && nvme_mem_search_hp((unsigned long)addr))
+		nvme_free(addr);
+	else
+		free(addr);
+}
+
+/*
+ * Search the registered memory region containing the specified address
+ * and return the address physical address.
+ */
+static unsigned long nvme_mem_search_region(unsigned long vaddr)
+{
+	struct nvme_mem_region *reg;
+	unsigned long paddr = NVME_VTOPHYS_ERROR;
+	unsigned long ofst;
+
+	nvme_rwlock_read_lock(&mm.reg_lock);
+
+	LIST_FOREACH(reg, &mm.reg_list, link) {
+		if (vaddr >= reg->vaddr && vaddr - reg->vaddr < reg->size) {
+			ofst = vaddr - reg->vaddr;
+			paddr = reg->paddr[ofst >> mm.pg_size_bits] +
+				(ofst & mm.pg_size_mask);
+			break;
+		}
+	}
+
+	nvme_rwlock_read_unlock(&mm.reg_lock);
+
+	return paddr;
+}
+
+/*
+ * Translate a range of system pages with a single read
+ * of /proc/self/pagemap.
+ */
+static int nvme_mem_pagemap_read(unsigned long vaddr, size_t nr_pages,
+				 phys_addr_t *paddr)
+{
+	size_t len = nr_pages << NVME_PFN_SIZE_SHIFT, done = 0;
+	off_t ofst = (vaddr >> mm.pg_size_bits) << NVME_PFN_SIZE_SHIFT;
+	ssize_t ret;
+	size_t i;
+
+	/* Page frame entries have the same size as physical addresses */
+	while (done < len) {
+		ret = pread(mm.pg_mapfd, (char *)paddr + done, len - done,
+			    ofst + done);
+		if (ret <= 0) {
+			if (ret < 0)
+				nvme_err("Read /proc/self/pagemap failed %d (%s)\n",
+					 errno, strerror(errno));
+			else
+				nvme_err("Partial read from /proc/self/pagemap\n");
+			return -EIO;
+		}
+		done += ret;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		if (!(paddr[i] & NVME_PFN_PRESENT) ||
+		    !(paddr[i] & NVME_PFN_MASK)) {
+			nvme_err("No physical page for address 0x%lx\n",
+				 vaddr + (i << mm.pg_size_bits));
+			return -EFAULT;
+		}
+		paddr[i] = (paddr[i] & NVME_PFN_MASK) << mm.pg_size_bits;
+	}
+
+	return 0;
 }
 
 /*
@@ -634,7 +1795,7 @@ unsigned long nvme_mem_vtophys(void *addr)
 {
 	unsigned long vaddr = (unsigned long) addr;
 	struct nvme_hugepage *hp;
-	unsigned long ofst;
+	unsigned long ofst, paddr;
 	ssize_t ret;
 	__u64 ppfn, vpn;
 
@@ -643,6 +1804,13 @@ unsigned long nvme_mem_vtophys(void *addr)
 	if (hp)
 		return hp->paddr + vaddr - hp->vaddr;
 
+	/* Or if the address is in a registered memory region */
+	if (nvme_atomic_read(&mm.nr_regions)) {
+		paddr = nvme_mem_search_region(vaddr);
+		if (paddr != NVME_VTOPHYS_ERROR)
+			return paddr;
+	}
+
 	/* Read the page frame entry (8B per entry) */
 	vpn = (unsigned long)vaddr >> mm.pg_size_bits;
 	ofst = (unsigned long)vaddr & mm.pg_size_mask;
@@ -661,45 +1829,379 @@ unsigned long nvme_mem_vtophys(void *addr)
 	return ((ppfn & NVME_PFN_MASK) << mm.pg_size_bits) + ofst;
 }
 
+/*
+ * Search a registered memory region overlapping the specified range.
+ * Must be called with the registration mutex held.
+ */
+static struct nvme_mem_region *nvme_mem_overlap_region(unsigned long vaddr,
+						       size_t size)
+{
+	struct nvme_mem_region *reg;
+
+	LIST_FOREACH(reg, &mm.reg_list, link) {
+		if (vaddr < reg->vaddr + reg->size &&
+		    reg->vaddr < vaddr + size)
+			return reg;
+	}
+
+	return NULL;
+}
+
+/*
+ * Register a user memory region: lock it in memory and
+ * translate all its pages once.
+ */
+int nvme_mem_register(void *addr, size_t size)
+{
+	unsigned long vaddr = (unsigned long)addr & ~mm.pg_size_mask;
+	struct nvme_mem_region *reg;
+	size_t nr_pages;
+	int ret;
+
+	if (!addr || !size)
+		return -EINVAL;
+
+	nr_pages = ((unsigned long)addr - vaddr + size + mm.pg_size_mask)
+		>> mm.pg_size_bits;
+	reg = malloc(sizeof(struct nvme_mem_region) +
+		     sizeof(phys_addr_t) * nr_pages);
+	if (!reg) {
+		nvme_err("Allocate memory region descriptor failed\n");
+		return -ENOMEM;
+	}
+
+	reg->vaddr = vaddr;
+	reg->nr_pages = nr_pages;
+	reg->size = nr_pages << mm.pg_size_bits;
+
+	pthread_mutex_lock(&mm.reg_mutex);
+
+	/*
+	 * Memory locks do not stack: check for overlaps before locking
+	 * so that a failed registration does not unlock the pages of
+	 * a registered region.
+	 */
+	if (nvme_mem_overlap_region(reg->vaddr, reg->size)) {
+		nvme_err("Memory %p, %zu B overlaps a registered region\n",
+			 addr, size);
+		ret = -EEXIST;
+		goto out;
+	}
+
+	/* Lock the pages: this also faults in all of them */
+	if (mlock((void *)reg->vaddr, reg->size) != 0) {
+		ret = -errno;
+		nvme_err("Lock memory %p, %zu B failed %d (%s)\n",
+			 addr, size, errno, strerror(errno));
+		goto out;
+	}
+
+	ret = nvme_mem_pagemap_read(reg->vaddr, nr_pages, reg->paddr);
+	if (ret != 0) {
+		munlock((void *)reg->vaddr, reg->size);
+		goto out;
+	}
+
+	nvme_rwlock_write_lock(&mm.reg_lock);
+	LIST_INSERT_HEAD(&mm.reg_list, reg, link);
+	nvme_atomic_inc(&mm.nr_regions);
+	nvme_rwlock_write_unlock(&mm.reg_lock);
+
+	nvme_debug("Registered memory 0x%lx, %zu pages\n",
+		   reg->vaddr, nr_pages);
+
+	reg = NULL;
+
+out:
+	pthread_mutex_unlock(&mm.reg_mutex);
+	free(reg);
+
+	return ret;
+}
+
+/*
+ * Unregister a user memory region.
+ */
+int nvme_mem_unregister(void *addr)
+{
+	unsigned long vaddr = (unsigned long)addr & ~mm.pg_size_mask;
+	struct nvme_mem_region *reg;
+
+	pthread_mutex_lock(&mm.reg_mutex);
+
+	LIST_FOREACH(reg, &mm.reg_list, link) {
+		if (reg->vaddr == vaddr)
+			break;
+	}
+
+	if (!reg) {
+		pthread_mutex_unlock(&mm.reg_mutex);
+		return -ENOENT;
+	}
+
+	nvme_rwlock_write_lock(&mm.reg_lock);
+	LIST_REMOVE(reg, link);
+	nvme_atomic_dec(&mm.nr_regions);
+	nvme_rwlock_write_unlock(&mm.reg_lock);
+
+	if (munlock((void *)reg->vaddr, reg->size) < 0)
+		nvme_crit("Unlock memory 0x%lx failed %d (%s)\n",
+			  reg->vaddr, errno, strerror(errno));
+
+	pthread_mutex_unlock(&mm.reg_mutex);
+
+	nvme_debug("Unregistered memory 0x%lx, %zu pages\n",
+		   reg->vaddr, reg->nr_pages);
+
+	free(reg);
+
+	return 0;
+}
+
+/*
+ * Register a buffer: translate all its pages once. The buffer must be
+ * in hugepages or in a registered memory region, so that its pages
+ * cannot be reclaimed or migrated while their translation is cached.
+ */
+struct nvme_buf *nvme_buf_register(void *addr, size_t size)
+{
+	unsigned long vaddr = (unsigned long) addr;
+	unsigned long base = vaddr & ~((unsigned long)PAGE_SIZE - 1);
+	unsigned long page;
+	struct nvme_hugepage *hp;
+	struct nvme_buf *buf;
+	size_t i, nr_pages;
+
+	if (!addr || !size) {
+		nvme_err("Invalid buffer %p, %zu B\n", addr, size);
+		return NULL;
+	}
+
+	nr_pages = (vaddr - base + size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	buf = malloc(sizeof(struct nvme_buf) + sizeof(phys_addr_t) * nr_pages);
+	if (!buf) {
+		nvme_err("Allocate registered buffer failed\n");
+		return NULL;
+	}
+
+	buf->vaddr = addr;
+	buf->size = size;
+	buf->ofst = vaddr - base;
+	buf->nr_pages = nr_pages;
+
+	for (i = 0; i < nr_pages; i++) {
+		page = base + (i << PAGE_SHIFT);
+		hp = nvme_mem_search_hp(page);
+		if (hp)
+			buf->paddr[i] = hp->paddr + page - hp->vaddr;
+		else if (nvme_atomic_read(&mm.nr_regions))
+			buf->paddr[i] = nvme_mem_search_region(page);
+		else
+			buf->paddr[i] = NVME_VTOPHYS_ERROR;
+		if (buf->paddr[i] == NVME_VTOPHYS_ERROR) {
+			nvme_err("Buffer %p page %zu is not in hugepages "
+				 "or in a registered memory region\n",
+				 addr, i);
+			goto err;
+		}
+	}
+
+	return buf;
+
+err:
+	free(buf);
+
+	return NULL;
+}
+
+/*
+ * Unregister a buffer.
+ */
+void nvme_buf_unregister(struct nvme_buf *buf)
+{
+	free(buf);
+}
+
+/*
+ * Get the number of hugepages of a size used and available.
+ */
+static void nvme_mem_hp_size_stats(struct nvme_hp_size *hps,
+				   struct nvme_hp_size_stats *stats,
+				   unsigned int node_id)
+{
+	char path[PATH_MAX];
+	unsigned long val;
+
+	stats->size = hps->size;
+	stats->nr_hugepages = nvme_atomic_read(&hps->nr_hp);
+
+	if (node_id == NVME_NODE_ID_ANY)
+		snprintf(path, sizeof(path),
+			 "/sys/kernel/mm/hugepages/hugepages-%zukB/"
+			 "free_hugepages", hps->size >> 10);
+	else
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%u/hugepages/"
+			 "hugepages-%zukB/free_hugepages",
+			 node_id, hps->size >> 10);
+
+	if (nvme_parse_sysfs_value(path, &val) == 0)
+		stats->nr_free_hugepages = val;
+	else
+		stats->nr_free_hugepages = 0;
+}
+
 /*
  * Get memory usage statistics for the specified socket.
  */
 int nvme_memstat(struct nvme_mem_stats *stats, unsigned int node_id)
 {
+	struct nvme_mem_tcache *tc;
 	struct nvme_mempool *mp;
-	unsigned int i;
+	unsigned int i, n;
 
 	if (!stats)
 		return -EFAULT;
 
 	if (node_id != NVME_NODE_ID_ANY &&
-	    node_id > NVME_NODE_MAX)
+	    node_id >= NVME_NODE_MAX)
 		return -EINVAL;
 
 	/* Get stats */
 	stats->nr_hugepages = nvme_atomic_read(&mm.nr_hp);
+	stats->nr_hp_sizes = mm.nr_hp_sizes;
+	for (i = 0; i < mm.nr_hp_sizes; i++)
+		nvme_mem_hp_size_stats(&mm.hp_sizes[i], &stats->hp_sizes[i],
+				       node_id);
+	stats->nr_reserved_hugepages = 0;
+	stats->nr_free_reserved_hugepages = 0;
+	nvme_spin_lock(&mm.hp_lock);
+	for (i = 0; i < NVME_NODE_MAX; i++) {
+		if (node_id != NVME_NODE_ID_ANY && i != node_id)
+			continue;
+		stats->nr_reserved_hugepages += mm.hp_rsv[i].nr_hp;
+		stats->nr_free_reserved_hugepages += mm.hp_rsv[i].nr_free;
+	}
+	nvme_spin_unlock(&mm.hp_lock);
+	stats->nr_large_objs = nvme_atomic_read(&mm.nr_large);
+	stats->large_bytes = nvme_atomic64_read(&mm.large_bytes);
 	stats->total_bytes = 0;
 	stats->free_bytes = 0;
+	stats->cached_bytes = 0;
 
-	for(i = 0; i < NVME_MP_NUM; i++) {
-		mp = &mm.mp[i];
-		pthread_mutex_lock(&mp->lock);
-		stats->total_bytes += mp->nr_objs << mp->size_bits;
-		stats->free_bytes += mp->nr_free_objs << mp->size_bits;
-		pthread_mutex_unlock(&mp->lock);
+	for (n = 0; n < nvme_node_max(); n++) {
+		if (node_id != NVME_NODE_ID_ANY && n != node_id)
+			continue;
+		for (i = 0; i < NVME_MP_NUM; i++) {
+			mp = &mm.mp[n][i];
+			pthread_mutex_lock(&mp->lock);
+			stats->total_bytes += mp->nr_objs << mp->size_bits;
+			stats->free_bytes += mp->nr_free_objs << mp->size_bits;
+			pthread_mutex_unlock(&mp->lock);
+		}
 	}
 
+	/* Add the free objects held in thread caches */
+	pthread_mutex_lock(&nvme_tcache_lock);
+	LIST_FOREACH(tc, &nvme_tcache_list, link) {
+		if (node_id != NVME_NODE_ID_ANY && tc->node_id != node_id)
+			continue;
+		for (i = 0; i < NVME_MAG_NUM; i++)
+			stats->cached_bytes += (size_t)tc->mag[i].nr_objs
+				<< (NVME_MP_SIZE_BITS_MIN + i);
+	}
+	pthread_mutex_unlock(&nvme_tcache_lock);
+	stats->free_bytes += stats->cached_bytes;
+
         return 0;
 }
 
+/*
+ * Get the statistics of the mempools of a node, or of all nodes.
+ */
+int nvme_mempool_stat(struct nvme_mempool_stats *stats,
+		      unsigned int max_stats, unsigned int node_id)
+{
+	struct nvme_mempool_stats *st;
+	struct nvme_mem_tcache *tc;
+	struct nvme_mempool *mp;
+	unsigned int first, nr_nodes, nr_stats, i, n;
+
+	if (!stats && max_stats)
+		return -EFAULT;
+
+	if (node_id == NVME_NODE_ID_ANY) {
+		first = 0;
+		nr_nodes = nvme_node_max();
+	} else if (node_id < nvme_node_max()) {
+		first = node_id;
+		nr_nodes = 1;
+	} else {
+		return -EINVAL;
+	}
+
+	nr_stats = nvme_min(max_stats, nr_nodes * NVME_MP_NUM);
+
+	for (n = 0; n < nr_nodes; n++) {
+		for (i = 0; i < NVME_MP_NUM; i++) {
+
+			if (n * NVME_MP_NUM + i >= nr_stats)
+				break;
+
+			st = &stats[n * NVME_MP_NUM + i];
+			mp = &mm.mp[first + n][i];
+
+			pthread_mutex_lock(&mp->lock);
+			st->node_id = mp->node_id;
+			st->size = mp->size;
+			st->nr_objs = mp->nr_objs;
+			st->nr_free_objs = mp->nr_free_objs;
+			st->nr_cached_objs = 0;
+			st->peak_used_objs = mp->peak_used_objs;
+			st->nr_heaps = mp->nr_use + mp->nr_full;
+			st->nr_empty_heaps = mp->nr_empty;
+			st->nr_frag_objs = mp->nr_free_objs -
+				(mp->nr_empty << (mm.hp_size_bits - mp->size_bits));
+			st->nr_grows = mp->nr_grows;
+			st->nr_shrinks = mp->nr_shrinks;
+			st->nr_locks = mp->nr_locks;
+			st->nr_contended = mp->nr_contended;
+			pthread_mutex_unlock(&mp->lock);
+
+		}
+	}
+
+	/* Add the free objects held in thread caches */
+	pthread_mutex_lock(&nvme_tcache_lock);
+	LIST_FOREACH(tc, &nvme_tcache_list, link) {
+		if (tc->node_id < first || tc->node_id >= first + nr_nodes)
+			continue;
+		n = tc->node_id - first;
+		for (i = 0; i < NVME_MAG_NUM; i++) {
+			if (n * NVME_MP_NUM + i < nr_stats)
+				stats[n * NVME_MP_NUM + i].nr_cached_objs +=
+					tc->mag[i].nr_objs;
+		}
+	}
+	pthread_mutex_unlock(&nvme_tcache_lock);
+
+	for (i = 0; i < nr_stats; i++) {
+		st = &stats[i];
+		st->nr_used_objs = st->nr_objs - st->nr_free_objs -
+			nvme_min(st->nr_cached_objs,
+				 st->nr_objs - st->nr_free_objs);
+	}
+
+	return nr_nodes * NVME_MP_NUM;
+}
+
 /*
  * Initialize memory management.
  */
 int nvme_mem_init(void)
 {
 	struct nvme_mempool *mp;
-	int size_bits = NVME_MP_SIZE_BITS_MIN;
-	int i, ret;
+	int i, n, ret;
 
 	memset(&mm, 0, sizeof(struct nvme_mem));
 	mm.pg_size = sysconf(_SC_PAGESIZE);
@@ -710,6 +2212,11 @@ int nvme_mem_init(void)
 		   mm.pg_size,
 		   mm.pg_size_bits);
 
+	if (cpui.nr_nodes > NVME_NODE_MAX)
+		nvme_warning("%u NUMA nodes, memory of nodes %u and above "
+			     "will be allocated from node 0\n",
+			     cpui.nr_nodes, NVME_NODE_MAX);
+
 	mm.pg_mapfd = open("/proc/self/pagemap", O_RDONLY);
 	if (mm.pg_mapfd < 0) {
 		nvme_err("Open /proc/self/pagemap failed %d (%s)\n",
@@ -717,54 +2224,305 @@ int nvme_mem_init(void)
 		return -errno;
 	}
 
+	/* Initialize background reclaim */
+	pthread_mutex_init(&mm.reclaim_mutex, NULL);
+	pthread_cond_init(&mm.reclaim_cond, NULL);
+
+	/* Initialize registered memory regions */
+	pthread_mutex_init(&mm.reg_mutex, NULL);
+	nvme_rwlock_init(&mm.reg_lock);
+	nvme_atomic_init(&mm.nr_regions);
+	LIST_INIT(&mm.reg_list);
+
 	/* Initialize hugepages management */
 	ret = nvme_mem_hp_init();
 	if (ret != 0)
 		return ret;
 
 	/* Initialize memory pools */
-	for(i = 0; i < NVME_MP_NUM; i++) {
+	for (n = 0; n < NVME_NODE_MAX; n++) {
+		for (i = 0; i < NVME_MP_NUM; i++) {
 
-		mp = &mm.mp[i];
+			mp = &mm.mp[n][i];
 
-		mp->size_bits = size_bits;
-		mp->size = 1UL << size_bits;
+			mp->size_bits = NVME_MP_SIZE_BITS_MIN + i;
+			mp->size = 1UL << mp->size_bits;
+			mp->node_id = n;
+			mp->low_wmark = mm.hp_size * NVME_MP_LOW_WMARK;
+			mp->high_wmark = mm.hp_size * NVME_MP_HIGH_WMARK;
 
-		pthread_mutex_init(&mp->lock, NULL);
-		LIST_INIT(&mp->use_list);
-		LIST_INIT(&mp->full_list);
+			pthread_mutex_init(&mp->lock, NULL);
+			LIST_INIT(&mp->use_list);
+			LIST_INIT(&mp->full_list);
 
-		size_bits++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Reclaim the free memory of mempools above their high watermark.
+ */
+void nvme_mem_reclaim(void)
+{
+	struct nvme_mempool *mp;
+	unsigned int n;
+	int i;
+
+	for (n = 0; n < nvme_node_max(); n++) {
+		for (i = 0; i < NVME_MP_NUM; i++) {
+
+			mp = &mm.mp[n][i];
+			if (!mp->reclaim)
+				continue;
+
+			nvme_mem_pool_lock(mp);
+			nvme_mem_pool_shrink(mp, false);
+			mp->reclaim = false;
+			pthread_mutex_unlock(&mp->lock);
+
+		}
+	}
+}
+
+/*
+ * Set the free memory watermarks of the mempool of the specified
+ * object size, or of all mempools if size is 0.
+ */
+int nvme_mem_set_watermarks(size_t size, size_t low, size_t high)
+{
+	struct nvme_mempool *mp;
+	unsigned int size_bits, n;
+	int i;
+
+	if (low > high) {
+		nvme_err("Invalid mempool watermarks %zu / %zu B\n",
+			 low, high);
+		return -EINVAL;
+	}
+
+	size_bits = nvme_log2(nvme_align_pow2(nvme_max(size, 1UL)));
+	if (size_bits > NVME_MP_SIZE_BITS_MAX) {
+		nvme_err("No memory pool for %zu B objects\n", size);
+		return -EINVAL;
+	}
+	if (size_bits < NVME_MP_SIZE_BITS_MIN)
+		size_bits = NVME_MP_SIZE_BITS_MIN;
+
+	for (n = 0; n < NVME_NODE_MAX; n++) {
+		for (i = 0; i < NVME_MP_NUM; i++) {
+
+			mp = &mm.mp[n][i];
+			if (size && mp->size_bits != size_bits)
+				continue;
+
+			nvme_mem_pool_lock(mp);
+			mp->low_wmark = low;
+			mp->high_wmark = high;
+			mp->reclaim =
+				(mp->nr_free_objs << mp->size_bits) > high;
+			pthread_mutex_unlock(&mp->lock);
+
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Background reclaim thread.
+ */
+static void *nvme_mem_reclaim_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mm.reclaim_mutex);
+
+	while (!mm.reclaim_stop) {
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += mm.reclaim_interval / 1000;
+		ts.tv_nsec += (mm.reclaim_interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&mm.reclaim_cond,
+				       &mm.reclaim_mutex, &ts);
+		if (mm.reclaim_stop)
+			break;
+
+		pthread_mutex_unlock(&mm.reclaim_mutex);
+		nvme_mem_reclaim();
+		pthread_mutex_lock(&mm.reclaim_mutex);
+
+	}
+
+	pthread_mutex_unlock(&mm.reclaim_mutex);
+
+	return NULL;
+}
+
+/*
+ * Start the background reclaim thread.
+ */
+int nvme_mem_reclaim_start(unsigned int interval)
+{
+	int ret;
 
+	mm.reclaim_interval = interval;
+	mm.reclaim_stop = false;
+
+	ret = pthread_create(&mm.reclaim_thread, NULL,
+			     nvme_mem_reclaim_thread, NULL);
+	if (ret != 0) {
+		nvme_err("Create memory reclaim thread failed %d (%s)\n",
+			 ret, strerror(ret));
+		return -ret;
 	}
 
+	mm.reclaim_started = true;
+
 	return 0;
 }
 
+/*
+ * Stop the background reclaim thread.
+ */
+static void nvme_mem_reclaim_stop(void)
+{
+	if (!mm.reclaim_started)
+		return;
+
+	pthread_mutex_lock(&mm.reclaim_mutex);
+	mm.reclaim_stop = true;
+	pthread_cond_signal(&mm.reclaim_cond);
+	pthread_mutex_unlock(&mm.reclaim_mutex);
+
+	pthread_join(mm.reclaim_thread, NULL);
+	mm.reclaim_started = false;
+}
+
+/*
+ * Reserve hugepages on each NUMA node.
+ */
+int nvme_mem_reserve(unsigned int nr_hp)
+{
+	struct nvme_hp_reserve *rsv;
+	struct nvme_hugepage *hp;
+	unsigned int node_id, i;
+
+	for (node_id = 0; node_id < nvme_node_max(); node_id++) {
+
+		rsv = &mm.hp_rsv[node_id];
+
+		for (i = 0; i < nr_hp; i++) {
+			hp = nvme_mem_alloc_hp(&mm.hp_sizes[0], node_id);
+			if (!hp) {
+				nvme_err("Reserve hugepage %u/%u on node %u failed\n",
+					 i + 1, nr_hp, node_id);
+				return -ENOMEM;
+			}
+			nvme_spin_lock(&mm.hp_lock);
+			LIST_INSERT_HEAD(&rsv->free_list, hp, rsv_link);
+			rsv->nr_free++;
+			rsv->nr_hp++;
+			nvme_spin_unlock(&mm.hp_lock);
+		}
+
+		nvme_info("Reserved %u hugepages of %zu B on node %u\n",
+			  nr_hp, mm.hp_size, node_id);
+
+	}
+
+	return 0;
+}
+
+/*
+ * Pre-allocate objects in the memory pool of the specified size
+ * of each NUMA node.
+ */
+int nvme_mem_prefill(size_t size, size_t nr_objs)
+{
+	unsigned int size_bits, n;
+	struct nvme_mempool *mp;
+	int ret = 0;
+
+	size_bits = nvme_log2(nvme_align_pow2(size));
+	if (size_bits > NVME_MP_SIZE_BITS_MAX) {
+		nvme_err("No memory pool for %zu B objects\n", size);
+		return -EINVAL;
+	}
+	if (size_bits < NVME_MP_SIZE_BITS_MIN)
+		size_bits = NVME_MP_SIZE_BITS_MIN;
+
+	for (n = 0; n < nvme_node_max() && !ret; n++) {
+
+		mp = &mm.mp[n][size_bits - NVME_MP_SIZE_BITS_MIN];
+
+		nvme_mem_pool_lock(mp);
+
+		mp->nr_min_objs += nr_objs;
+		while (mp->nr_objs < mp->nr_min_objs) {
+			if (!nvme_mem_pool_grow(mp)) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		nvme_info("Mempool %zu B, node %u: pre-allocated %zu objects\n",
+			  mp->size, n, mp->nr_objs);
+
+		pthread_mutex_unlock(&mp->lock);
+
+	}
+
+	return ret;
+}
+
 /*
  * Cleanup memory resources on exit.
  */
 void nvme_mem_cleanup(void)
 {
+	struct nvme_mem_tcache *tc;
+	struct nvme_mem_region *reg;
 	struct nvme_mempool *mp;
 	struct nvme_heap *heap;
-	int i;
+	int i, n;
+
+	/* Stop background reclaim */
+	nvme_mem_reclaim_stop();
+
+	/* Return the objects cached by all threads to their mempool */
+	pthread_mutex_lock(&nvme_tcache_lock);
+	LIST_FOREACH(tc, &nvme_tcache_list, link)
+		nvme_mem_tcache_drain(tc);
+	pthread_mutex_unlock(&nvme_tcache_lock);
 
 	/* Cleanup memory pools */
-	for(i = 0; i < NVME_MP_NUM; i++) {
+	for (n = 0; n < NVME_NODE_MAX; n++) {
+		for (i = 0; i < NVME_MP_NUM; i++) {
 
-		mp = &mm.mp[i];
+			mp = &mm.mp[n][i];
 
-		while ((heap = LIST_FIRST(&mp->full_list))) {
-			LIST_REMOVE(heap, link);
-			LIST_INSERT_HEAD(&mp->use_list, heap, link);
-			printf("full heap %d\n", i);
-		}
-		while ((heap = LIST_FIRST(&mp->use_list)))
+			while ((heap = LIST_FIRST(&mp->full_list))) {
+				LIST_REMOVE(heap, link);
+				LIST_INSERT_HEAD(&mp->use_list, heap, link);
+				printf("full heap %d\n", i);
+			}
 			nvme_mem_pool_shrink(mp, true);
+			mp->reclaim = false;
 
+		}
 	}
 
+	/* Cleanup registered memory regions */
+	while ((reg = LIST_FIRST(&mm.reg_list)))
+		nvme_mem_unregister((void *)reg->vaddr);
+
 	/* Cleanup hugepages */
 	nvme_mem_hp_cleanup();
 
@@ -10,6 +10,7 @@
 
 #include "nvme_common.h"
 #include "nvme_spinlock.h"
+#include "nvme_rwlock.h"
 #include "nvme_atomic.h"
 #include "nvme_cpu.h"
 
@@ -36,9 +37,70 @@ typedef __u64 phys_addr_t;
 #define NVME_PFN_MASK		0x7fffffffffffffULL
 
 /*
- * Maximum number of NUMA nodes.
+ * Page present bit of page frame entries.
  */
-#define NVME_NODE_MAX		NVME_SOCKET_MAX
+#define NVME_PFN_PRESENT	(1ULL << 63)
+
+/*
+ * Maximum number of NUMA nodes memory is managed for.
+ * Memory of nodes above this limit is allocated from node 0.
+ */
+#define NVME_NODE_MAX		64
+
+/*
+ * Hugepage arena: a single hugetlbfs file per hugepage size and
+ * NUMA node, from which hugepages are allocated by offset. The
+ * offsets of freed hugepages are kept for reuse.
+ */
+struct nvme_hp_arena {
+
+	pthread_mutex_t			lock;
+
+	/*
+	 * Arena file descriptor (-1 if not created yet)
+	 * and file size in number of hugepages.
+	 */
+	int				fd;
+	size_t				nr_pages;
+
+	/*
+	 * Free hugepage indexes within the file.
+	 */
+	size_t				nr_free;
+	size_t				max_free;
+	size_t				*free;
+
+};
+
+/*
+ * Hugepage size descriptor: one per hugetlbfs mount page size.
+ */
+struct nvme_hp_size {
+
+	/*
+	 * Hugepage size in Bytes.
+	 */
+	size_t				size;
+	size_t				size_bits;
+
+	/*
+	 * Directory where to store hugepage files
+	 * (within the hugetlbfs mount).
+	 */
+	char 				*dir;
+	int				dd;
+
+	/*
+	 * Number of hugepages of this size currently allocated.
+	 */
+	nvme_atomic_t			nr_hp;
+
+	/*
+	 * Per NUMA node arenas.
+	 */
+	struct nvme_hp_arena		arena[NVME_NODE_MAX];
+
+};
 
 /*
  * Huge-page descriptor.
@@ -51,10 +113,17 @@ struct nvme_hugepage {
 	LIST_ENTRY(nvme_hugepage)	link;
 
 	/*
-	 * This hugepage size in Bytes.
+	 * For listing in the reserved hugepages free list.
+	 */
+	LIST_ENTRY(nvme_hugepage)	rsv_link;
+
+	/*
+	 * This hugepage size in Bytes (the size of all the hugepages
+	 * of a run) and the size of its hugepages.
 	 */
 	size_t				size;
 	size_t				size_bits;
+	struct nvme_hp_size		*hps;
 
 	/*
 	 * Virtual and physical address of the page.
@@ -67,11 +136,11 @@ struct nvme_hugepage {
 	 */
 	unsigned int			node_id;
 
-        /*
-	 * The page file path and descriptor.
+	/*
+	 * The arena of the page and the page offset in the arena file.
 	 */
-	int 				fd;
-	char 				fname[128];
+	struct nvme_hp_arena		*arena;
+	off_t				ofst;
 
 	/*
 	 * The memory pool owing this hugepage.
@@ -83,8 +152,33 @@ struct nvme_hugepage {
 	 */
 	struct nvme_heap		*heap;
 
+	/*
+	 * For a run of physically contiguous hugepages
+	 * (large allocations), the hugepages of the run.
+	 */
+	unsigned int			nr_run;
+	struct nvme_hugepage		**run;
+
+};
+
+/*
+ * Hugepages reserved on a NUMA node: up to nr_hp unused hugepages
+ * of the smallest size are kept in the free list instead of
+ * being released.
+ */
+struct nvme_hp_reserve {
+	unsigned int			nr_hp;
+	unsigned int			nr_free;
+	LIST_HEAD(, nvme_hugepage)	free_list;
 };
 
+/*
+ * Amount of memory allocated in excess of twice the size of a run
+ * when searching physically contiguous hugepages. Hugepages larger
+ * than this are searched up to twice the number needed only.
+ */
+#define NVME_MEM_RUN_EXTRA_SIZE	(32UL * 1024 * 1024)
+
 /*
  * Per hugepage heap descriptor.
  */
@@ -152,6 +246,21 @@ struct nvme_mempool {
 	 */
 	size_t				nr_free_objs;
 
+	/*
+	 * Number of objects pre-allocated: heaps are not freed
+	 * if that would lower the number of objects below this.
+	 */
+	size_t				nr_min_objs;
+
+	/*
+	 * Free memory watermarks: when the free memory exceeds the high
+	 * watermark, the mempool is flagged for reclaim, which frees
+	 * empty heaps down to the low watermark.
+	 */
+	size_t				low_wmark;
+	size_t				high_wmark;
+	bool				reclaim;
+
 	/*
 	 * The NUMA node this memory pool belongs to.
 	 */
@@ -169,6 +278,23 @@ struct nvme_mempool {
 	size_t				nr_full;
 	LIST_HEAD(, nvme_heap)		full_list;
 
+	/*
+	 * Number of empty heaps (in the use list).
+	 */
+	size_t				nr_empty;
+
+	/*
+	 * Statistics: peak number of objects out of the mempool
+	 * (in use or cached by threads), number of heaps added and
+	 * freed, and number of lock acquisitions which did and did
+	 * not have to wait for another thread.
+	 */
+	size_t				peak_used_objs;
+	unsigned long long		nr_grows;
+	unsigned long long		nr_shrinks;
+	unsigned long long		nr_locks;
+	unsigned long long		nr_contended;
+
 };
 
 /*
@@ -188,10 +314,102 @@ enum nvme_mempool_size {
 };
 
 /*
- * Hugepage hash table size.
+ * Default mempools free memory watermarks, in number of heaps.
+ */
+#define NVME_MP_LOW_WMARK	1
+#define NVME_MP_HIGH_WMARK	4
+
+/*
+ * Per-thread caches (magazines) of mempool objects: only objects of up
+ * to 64 KB are cached, each magazine holding at most NVME_MAG_OBJS_MAX
+ * objects and NVME_MAG_BYTES of memory. Empty magazines are refilled
+ * and full magazines drained by half in a single mempool lock section.
+ */
+#define NVME_MAG_SIZE_BITS_MAX	16
+#define NVME_MAG_NUM		(NVME_MAG_SIZE_BITS_MAX - \
+				 NVME_MP_SIZE_BITS_MIN + 1)
+#define NVME_MAG_OBJS_MAX	64
+#define NVME_MAG_BYTES		(512 * 1024)
+
+struct nvme_mag {
+	unsigned int			nr_objs;
+	unsigned int			max_objs;
+	void				*objs[NVME_MAG_OBJS_MAX];
+};
+
+struct nvme_mem_tcache {
+
+	/*
+	 * For listing all thread caches.
+	 */
+	LIST_ENTRY(nvme_mem_tcache)	link;
+
+	/*
+	 * The NUMA node of the thread when the cache was created:
+	 * the cached objects belong to this node mempools.
+	 */
+	unsigned int			node_id;
+
+	/*
+	 * One magazine per cached mempool.
+	 */
+	struct nvme_mag			mag[NVME_MAG_NUM];
+
+};
+
+/*
+ * Hugepage translation map: a two level table indexed with the
+ * hugepage number of virtual addresses. The first level is sized at
+ * initialization to cover the user address space. Second level
+ * tables (leaves) are allocated when a hugepage is first mapped in
+ * their range and are never freed until cleanup, so that lookups
+ * can be done without any lock.
+ */
+#define NVME_VADDR_BITS		48
+#define NVME_HP_MAP_LEAF_BITS	12
+#define NVME_HP_MAP_LEAF_SIZE	(1UL << NVME_HP_MAP_LEAF_BITS)
+#define NVME_HP_MAP_LEAF_MASK	(NVME_HP_MAP_LEAF_SIZE - 1)
+
+struct nvme_hp_map_leaf {
+	struct nvme_hugepage * volatile	hp[NVME_HP_MAP_LEAF_SIZE];
+};
+
+/*
+ * Registered buffer: physical address of the buffer 4 KB pages,
+ * the first page containing the buffer start at offset ofst.
+ */
+struct nvme_buf {
+	void				*vaddr;
+	size_t				size;
+	size_t				ofst;
+	size_t				nr_pages;
+	phys_addr_t			paddr[];
+};
+
+/*
+ * Registered user memory region: the physical addresses of
+ * the region system pages.
  */
-#define NVME_HP_HASH_SIZE	32
-#define NVME_HP_HASH_MASK	(NVME_HP_HASH_SIZE - 1)
+struct nvme_mem_region {
+
+	/*
+	 * For listing internally.
+	 */
+	LIST_ENTRY(nvme_mem_region)	link;
+
+	/*
+	 * Page aligned start address and size in Bytes of the region.
+	 */
+	unsigned long			vaddr;
+	size_t				size;
+
+	/*
+	 * Physical address of each page of the region.
+	 */
+	size_t				nr_pages;
+	phys_addr_t			paddr[];
+
+};
 
 /*
  * Memory managament data.
@@ -211,25 +429,20 @@ struct nvme_mem {
 	int				pg_mapfd;
 
 	/*
-	 * Directory where to store hugepage files
-	 * (within hugetlbfs mount).
+	 * Hugepage sizes, in increasing size order.
 	 */
-	char 				*hp_dir;
-	int				hp_dd;
+	unsigned int			nr_hp_sizes;
+	struct nvme_hp_size		hp_sizes[NVME_MEM_HP_SIZES_MAX];
 
 	/*
-	 * Huge page size.
+	 * Smallest hugepage size: the size of mempools heaps
+	 * and the translation map granularity.
 	 */
 	size_t				hp_size;
 	size_t				hp_size_bits;
 
 	/*
-	 * For generating huge-page file names.
-	 */
-	nvme_atomic64_t			hp_tmp;
-
-	/*
-	 * Hugepage management spinlock.
+	 * Hugepage management spinlock (not needed for lookups).
 	 */
 	nvme_spinlock_t			hp_lock;
 
@@ -239,14 +452,50 @@ struct nvme_mem {
 	nvme_atomic_t			nr_hp;
 
 	/*
-	 * Hugepage hash table (array of lists).
+	 * Number and total size of large objects.
+	 */
+	nvme_atomic_t			nr_large;
+	nvme_atomic64_t			large_bytes;
+
+	/*
+	 * List of allocated hugepages.
+	 */
+	LIST_HEAD(, nvme_hugepage)	hp_list;
+
+	/*
+	 * Per NUMA node reserved hugepages (protected by hp_lock).
 	 */
-	LIST_HEAD(, nvme_hugepage)	hp_list[NVME_HP_HASH_SIZE];
+	struct nvme_hp_reserve		hp_rsv[NVME_NODE_MAX];
 
 	/*
-	 * Static memory pools.
+	 * Hugepage translation map.
 	 */
-	struct nvme_mempool		mp[NVME_MP_NUM];
+	size_t				hp_map_size;
+	struct nvme_hp_map_leaf * volatile *hp_map;
+
+	/*
+	 * Registered memory regions: the mutex serializes registrations
+	 * and the rwlock protects the list against lookups.
+	 */
+	pthread_mutex_t			reg_mutex;
+	nvme_rwlock_t			reg_lock;
+	nvme_atomic_t			nr_regions;
+	LIST_HEAD(, nvme_mem_region)	reg_list;
+
+	/*
+	 * Static memory pools of each NUMA node.
+	 */
+	struct nvme_mempool		mp[NVME_NODE_MAX][NVME_MP_NUM];
+
+	/*
+	 * Background reclaim thread and reclaim interval in ms.
+	 */
+	pthread_t			reclaim_thread;
+	pthread_mutex_t			reclaim_mutex;
+	pthread_cond_t			reclaim_cond;
+	unsigned int			reclaim_interval;
+	bool				reclaim_started;
+	bool				reclaim_stop;
 
 };
 
@@ -260,6 +509,26 @@ extern int nvme_mem_init(void);
  */
 extern void nvme_mem_cleanup(void);
 
+/*
+ * Reserve hugepages on each NUMA node.
+ */
+extern int nvme_mem_reserve(unsigned int nr_hp);
+
+/*
+ * Pre-allocate objects in a memory pool.
+ */
+extern int nvme_mem_prefill(size_t size, size_t nr_objs);
+
+/*
+ * Start the background memory reclaim thread.
+ */
+extern int nvme_mem_reclaim_start(unsigned int interval);
+
+/*
+ * Remove the hugepage files of a terminated process.
+ */
+extern void nvme_mem_remove_pid(pid_t pid);
+
 /*
  * Allocate memory on the specified NUMA node.
  */
@@ -267,18 +536,20 @@ extern void *nvme_mem_alloc_node(size_t size, size_t align,
 				 unsigned int node_id, unsigned long *paddr);
 
 /*
- * Return the physical address of the specifed virtual address.
+ * Allocate and free zeroed memory not used for DMA
+ * on the specified NUMA node.
  */
-extern unsigned long nvme_mem_vtophys(void *vaddr);
+extern void *nvme_mem_zalloc_host(size_t size, unsigned int node_id);
+extern void nvme_mem_free_host(void *addr);
 
 /*
- * Maximum number of NUMA nodes.
+ * Return the physical address of the specifed virtual address.
  */
-#define nvme_node_max()		(cpui.nr_sockets)
+extern unsigned long nvme_mem_vtophys(void *vaddr);
 
 /*
- * Current NUMA node.
+ * Number of NUMA nodes memory is managed for.
  */
-#define nvme_node_id()		nvme_socket_id()
+#define nvme_node_max()		nvme_min(cpui.nr_nodes, (unsigned int)NVME_NODE_MAX)
 
 #endif /* __NVME_MEMORY_H_ */
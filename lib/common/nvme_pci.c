@@ -153,6 +153,27 @@ int nvme_pci_device_get_serial_number(struct pci_device *dev,
 	return -1;
 }
 
+/*
+ * Get the NUMA node of a PCI device, or NVME_NODE_ID_ANY if the
+ * device is not attached to a particular node.
+ */
+unsigned int nvme_pci_device_get_node(struct pci_device *dev)
+{
+	char filename[NVME_PCI_PATH_MAX];
+	unsigned long node_id;
+
+	snprintf(filename, sizeof(filename),
+		 "/sys/bus/pci/devices/%04x:%02x:%02x.%1u/numa_node",
+		 dev->domain, dev->bus, dev->dev, dev->func);
+
+	/* A device with no node reports -1 */
+	if (nvme_parse_sysfs_value(filename, &node_id) != 0 ||
+	    node_id >= NVME_NODE_ID_ANY)
+		return NVME_NODE_ID_ANY;
+
+	return node_id;
+}
+
 /*
  * Reset a PCI device.
  */
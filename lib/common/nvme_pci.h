@@ -135,6 +135,11 @@ nvme_pci_device_probe(const struct pci_slot_match *slot);
  */
 extern int nvme_pci_device_reset(struct pci_device *dev);
 
+/*
+ * Get the NUMA node of a device.
+ */
+extern unsigned int nvme_pci_device_get_node(struct pci_device *dev);
+
 /*
  * Get a device serial number.
  */
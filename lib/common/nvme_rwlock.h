@@ -77,8 +77,7 @@ static inline void nvme_rwlock_read_lock(nvme_rwlock_t *rwl)
 			nvme_pause();
 			continue;
 		}
-		success = nvme_atomic32_cmpset((volatile uint32_t *)&rwl->cnt,
-					       x, x + 1);
+		success = __sync_bool_compare_and_swap(&rwl->cnt, x, x + 1);
 	}
 }
 
@@ -87,7 +86,7 @@ static inline void nvme_rwlock_read_lock(nvme_rwlock_t *rwl)
  */
 static inline void nvme_rwlock_read_unlock(nvme_rwlock_t *rwl)
 {
-	nvme_atomic32_dec((nvme_atomic32_t *)(intptr_t)&rwl->cnt);
+	__sync_fetch_and_sub(&rwl->cnt, 1);
 }
 
 /*
@@ -105,8 +104,7 @@ static inline void nvme_rwlock_write_lock(nvme_rwlock_t *rwl)
 			nvme_pause();
 			continue;
 		}
-		success = nvme_atomic32_cmpset((volatile uint32_t *)&rwl->cnt,
-					       0, -1);
+		success = __sync_bool_compare_and_swap(&rwl->cnt, 0, -1);
 	}
 }
 
@@ -115,7 +113,7 @@ static inline void nvme_rwlock_write_lock(nvme_rwlock_t *rwl)
  */
 static inline void nvme_rwlock_write_unlock(nvme_rwlock_t *rwl)
 {
-	nvme_atomic32_inc((nvme_atomic32_t *)(intptr_t)&rwl->cnt);
+	__sync_fetch_and_add(&rwl->cnt, 1);
 }
 
 #endif /* __NVME_RWLOCK_H__ */
@@ -195,7 +195,10 @@ struct nvme_ctrlr *nvme_ctrlr_open(const char *url,
 	}
 
 	/* Attach the device */
-	ctrlr = nvme_ctrlr_attach(pdev, opts);
+	if (opts && opts->shared)
+		ctrlr = nvme_ctrlr_attach_shared(pdev, opts);
+	else
+		ctrlr = nvme_ctrlr_attach(pdev, opts);
 	if (!ctrlr) {
 		nvme_err("Attach %s failed\n", url);
 		goto out;
@@ -272,6 +275,7 @@ int nvme_ctrlr_stat(struct nvme_ctrlr *ctrlr, struct nvme_ctrlr_stat *cstat)
 	cstat->bus = pdev->bus;
 	cstat->dev = pdev->dev;
 	cstat->func = pdev->func;
+	cstat->node_id = ctrlr->node_id;
 
 	/* Maximum transfer size */
 	cstat->max_xfer_size = ctrlr->max_xfer_size;
@@ -293,11 +297,16 @@ int nvme_ctrlr_stat(struct nvme_ctrlr *ctrlr, struct nvme_ctrlr_stat *cstat)
 	cstat->io_qpairs = ctrlr->io_queues;
 
 	/* Enabled io qpairs */
-	cstat->enabled_io_qpairs = ctrlr->enabled_io_qpairs;
+	cstat->enabled_io_qpairs =
+		nvme_atomic_read(&ctrlr->enabled_io_qpairs);
 
 	/* Max queue depth */
 	cstat->max_qd = ctrlr->io_qpairs_max_entries;
 
+	/* Controller sharing */
+	cstat->secondary = ctrlr->secondary;
+	cstat->nr_secondaries = nvme_shared_nr_secondaries(ctrlr);
+
 	pthread_mutex_unlock(&ctrlr->lock);
 
 	return 0;
@@ -355,6 +364,12 @@ int nvme_qpair_stat(struct nvme_qpair *qpair, struct nvme_qpair_stat *qpstat)
 	qpstat->qd = qpair->entries;
 	qpstat->enabled = qpair->enabled;
 	qpstat->qprio = qpair->qprio;
+	qpstat->backpressure = qpair->backpressure;
+	qpstat->queued = qpair->nr_queued;
+	qpstat->max_queued = qpair->max_queued;
+	qpstat->total_queued = qpair->nr_queued_total;
+	qpstat->rejected = qpair->nr_rejected;
+	qpstat->throttled = qpair->nr_throttled;
 
 	pthread_mutex_unlock(&ctrlr->lock);
 
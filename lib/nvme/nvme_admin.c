@@ -44,6 +44,11 @@ static int nvme_admin_submit_cmd(struct nvme_ctrlr *ctrlr,
 {
 	struct nvme_request *req;
 
+	/* Secondary processes have the primary process execute the command */
+	if (ctrlr->secondary)
+		return nvme_shared_admin_cmd(ctrlr, cmd, buf, len,
+					     cb_fn, cb_arg);
+
 	if (buf)
 		req = nvme_request_allocate_contig(&ctrlr->adminq, buf, len,
 						   cb_fn, cb_arg);
@@ -99,6 +104,35 @@ static int nvme_admin_exec_cmd(struct nvme_ctrlr *ctrlr,
 	return nvme_admin_wait_cmd(ctrlr, &status);
 }
 
+/*
+ * Execute an admin command and return its completion, whether
+ * the command failed or not.
+ */
+int nvme_admin_passthru(struct nvme_ctrlr *ctrlr,
+			struct nvme_cmd *cmd,
+			void *buf, uint32_t len,
+			struct nvme_cpl *cpl)
+{
+	struct nvme_completion_poll_status status;
+	int ret;
+
+	/* Submit the command */
+	status.done = false;
+	ret = nvme_admin_submit_cmd(ctrlr, cmd, buf, len,
+				    nvme_request_completion_poll_cb,
+				    &status);
+	if (ret != 0)
+		return ret;
+
+	/* Wait for the command completion */
+	while (status.done == false)
+		nvme_qpair_poll(&ctrlr->adminq, 0);
+
+	memcpy(cpl, &status.cpl, sizeof(struct nvme_cpl));
+
+	return 0;
+}
+
 /*
  * Get a controller information.
  */
@@ -203,12 +237,17 @@ int nvme_admin_create_ioq(struct nvme_ctrlr *ctrlr,
 	switch(io_qtype) {
 	case NVME_IO_SUBMISSION_QUEUE:
 		cmd.opc = NVME_OPC_CREATE_IO_SQ;
-		cmd.cdw11 = (qpair->id << 16) | (qpair->qprio << 1) | 0x1;
+		cmd.cdw11 = (qpair->id << 16) | (qpair->qprio << 1);
+		/* Physically contiguous queue or PRP list */
+		if (!qpair->sq_segs)
+			cmd.cdw11 |= 0x1;
 		cmd.dptr.prp.prp1 = qpair->cmd_bus_addr;
 		break;
 	case NVME_IO_COMPLETION_QUEUE:
 		cmd.opc = NVME_OPC_CREATE_IO_CQ;
-		cmd.cdw11 = 0x1;
+		cmd.cdw11 = 0x0;
+		if (!qpair->cq_segs)
+			cmd.cdw11 |= 0x1;
 		cmd.dptr.prp.prp1 = qpair->cpl_bus_addr;
 		break;
 	default:
@@ -403,10 +442,13 @@ int nvme_admin_get_log_page(struct nvme_ctrlr *ctrlr,
 }
 
 /*
- * Abort an admin or an I/O command.
+ * Abort an admin or an I/O command. If cb_fn is NULL, wait for
+ * the abort command completion. Otherwise, only submit the abort
+ * command, cb_fn being called when the admin queue is next polled.
  */
 int nvme_admin_abort_cmd(struct nvme_ctrlr *ctrlr,
-			 uint16_t cid, uint16_t sqid)
+			 uint16_t cid, uint16_t sqid,
+			 nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct nvme_cmd cmd;
 
@@ -415,6 +457,10 @@ int nvme_admin_abort_cmd(struct nvme_ctrlr *ctrlr,
 	cmd.opc = NVME_OPC_ABORT;
 	cmd.cdw10 = (cid << 16) | sqid;
 
+	if (cb_fn)
+		return nvme_admin_submit_cmd(ctrlr, &cmd, NULL, 0,
+					     cb_fn, cb_arg);
+
 	/* Execute the command */
 	return nvme_admin_exec_cmd(ctrlr, &cmd, NULL, 0);
 }
@@ -259,11 +259,19 @@ static int nvme_ctrlr_init_io_qpairs(struct nvme_ctrlr *ctrlr)
 	/*
 	 * NVMe spec sets a hard limit of 64K max entries, but
 	 * devices may specify a smaller limit, so we need to check
-	 * the MQES field in the capabilities register.
+	 * the MQES field in the capabilities register. If the controller
+	 * requires physically contiguous queues, the queue size is also
+	 * limited by the largest contiguous memory allocation.
 	 */
 	cap.raw = nvme_reg_mmio_read_8(ctrlr, cap.raw);
-	ctrlr->io_qpairs_max_entries =
-		nvme_min(NVME_IO_ENTRIES, (unsigned int)cap.bits.mqes + 1);
+	ctrlr->io_qpairs_max_entries = (unsigned int)cap.bits.mqes + 1;
+	if (cap.bits.cqr) {
+		ctrlr->flags |= NVME_CTRLR_CONTIG_QUEUES;
+		ctrlr->io_qpairs_max_entries =
+			nvme_min(ctrlr->io_qpairs_max_entries,
+				 NVME_QUEUE_CONTIG_MAX_SIZE /
+				 sizeof(struct nvme_cmd));
+	}
 
 	ctrlr->ioq = calloc(ctrlr->io_queues, sizeof(struct nvme_qpair));
 	if (!ctrlr->ioq)
@@ -711,6 +719,34 @@ static int nvme_ctrlr_start(struct nvme_ctrlr *ctrlr)
 	return 0;
 }
 
+/*
+ * Start a controller in a secondary process: the controller was
+ * initialized by the primary process, so only get its information.
+ */
+static int nvme_ctrlr_start_secondary(struct nvme_ctrlr *ctrlr)
+{
+
+	if (nvme_ctrlr_identify(ctrlr) != 0)
+		return -1;
+
+	if (nvme_ctrlr_get_max_io_qpairs(ctrlr) != 0)
+		return -1;
+
+	if (nvme_ctrlr_init_io_qpairs(ctrlr))
+		return -1;
+
+	if (nvme_ctrlr_construct_namespaces(ctrlr) != 0)
+		return -1;
+
+	nvme_ctrlr_set_supported_log_pages(ctrlr);
+	nvme_ctrlr_set_supported_features(ctrlr);
+
+	if (ctrlr->cdata.sgls.supported)
+		ctrlr->flags |= NVME_CTRLR_SGL_SUPPORTED;
+
+	return 0;
+}
+
 /*
  * Memory map the controller side buffer.
  */
@@ -807,7 +843,10 @@ static int nvme_ctrlr_map_bars(struct nvme_ctrlr *ctrlr)
 	nvme_debug("Controller BAR mapped at %p\n", addr);
 
 	ctrlr->regs = (volatile struct nvme_registers *)addr;
-	nvme_ctrlr_map_cmb(ctrlr);
+
+	/* The controller memory buffer is managed by the primary process */
+	if (!ctrlr->secondary)
+		nvme_ctrlr_map_cmb(ctrlr);
 
 	return 0;
 }
@@ -842,14 +881,19 @@ static int nvme_ctrlr_unmap_bars(struct nvme_ctrlr *ctrlr)
  */
 static void nvme_ctrlr_fail(struct nvme_ctrlr *ctrlr)
 {
-	unsigned int i;
+	struct nvme_qpair *qpair;
 
 	ctrlr->failed = true;
 
 	nvme_qpair_fail(&ctrlr->adminq);
-	if (ctrlr->ioq)
-		for (i = 0; i < ctrlr->io_queues; i++)
-			nvme_qpair_fail(&ctrlr->ioq[i]);
+
+	/* I/O qpairs are failed by their owner thread */
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq)
+		nvme_atomic_set(&qpair->reset_pending, 1);
+
+	/* Secondary processes were notified of a reset */
+	if (ctrlr->shared && !ctrlr->resetting)
+		nvme_shared_notify_reset(ctrlr);
 }
 
 /*
@@ -986,12 +1030,20 @@ static int nvme_ctrlr_init(struct nvme_ctrlr *ctrlr)
 }
 
 /*
- * Reset a controller.
+ * Reset a controller. The controller lock must be held.
+ * I/O qpairs are used without lock by their owner thread, so they are
+ * not touched here: they are only flagged for their owner to re-create
+ * them once the reset is done (see nvme_ctrlr_reset_qpair()).
  */
-static int nvme_ctrlr_reset(struct nvme_ctrlr *ctrlr)
+int nvme_ctrlr_reset(struct nvme_ctrlr *ctrlr)
 {
 	struct nvme_qpair *qpair;
-	unsigned int i;
+
+	if (ctrlr->secondary) {
+		nvme_err("Controller reset must be done by the "
+			 "primary process\n");
+		return -EPERM;
+	}
 
 	if (ctrlr->resetting || ctrlr->failed)
 		/*
@@ -1005,8 +1057,16 @@ static int nvme_ctrlr_reset(struct nvme_ctrlr *ctrlr)
 
 	/* Disable all queues before disabling the controller hardware. */
 	nvme_qpair_disable(&ctrlr->adminq);
-	for (i = 0; i < ctrlr->io_queues; i++)
-		nvme_qpair_disable(&ctrlr->ioq[i]);
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq)
+		nvme_atomic_set(&qpair->reset_pending, 1);
+
+	/*
+	 * Secondary processes I/O qpairs are flagged the same way. They
+	 * cannot be re-created before the reset is done, as the primary
+	 * process executes their admin commands with the controller lock.
+	 */
+	if (ctrlr->shared)
+		nvme_shared_notify_reset(ctrlr);
 
 	/* Set the state back to INIT to cause a full hardware reset. */
 	nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_INIT,
@@ -1016,20 +1076,57 @@ static int nvme_ctrlr_reset(struct nvme_ctrlr *ctrlr)
 		if (nvme_ctrlr_init(ctrlr) != 0) {
 			nvme_crit("Controller reset failed\n");
 			nvme_ctrlr_fail(ctrlr);
-			goto out;
+			break;
 		}
 	}
 
-	/* Reinitialize qpairs */
-	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
-		if (nvme_ctrlr_create_qpair(ctrlr, qpair) != 0)
+	ctrlr->resetting = false;
+
+	return ctrlr->failed ? -1 : 0;
+}
+
+/*
+ * Re-create an I/O qpair on the controller after a controller reset,
+ * or fail its commands if the controller failed. This is called by
+ * the qpair owner thread, with the qpair lock held for local qpairs.
+ * In a secondary process, the reset is done by the primary process,
+ * and a failure to re-create the qpair only fails the qpair.
+ */
+void nvme_ctrlr_reset_qpair(struct nvme_ctrlr *ctrlr,
+			    struct nvme_qpair *qpair)
+{
+	bool failed;
+
+	if (qpair->enabled)
+		nvme_qpair_disable(qpair);
+
+	/* This waits for an in-progress reset to complete */
+	pthread_mutex_lock(&ctrlr->lock);
+
+	nvme_atomic_set(&qpair->reset_pending, 0);
+
+	/*
+	 * The queues were deleted by the reset, unless the reset
+	 * notification raced with the qpair creation.
+	 */
+	if (ctrlr->secondary) {
+		nvme_admin_delete_ioq(ctrlr, qpair, NVME_IO_SUBMISSION_QUEUE);
+		nvme_admin_delete_ioq(ctrlr, qpair, NVME_IO_COMPLETION_QUEUE);
+	}
+
+	failed = ctrlr->failed;
+	if (!failed && nvme_ctrlr_create_qpair(ctrlr, qpair) != 0) {
+		nvme_crit("Re-create I/O qpair %u failed\n", qpair->id);
+		if (!ctrlr->secondary)
 			nvme_ctrlr_fail(ctrlr);
+		nvme_atomic_set(&qpair->reset_pending, 0);
+		failed = true;
 	}
 
-out:
-	ctrlr->resetting = false;
+	pthread_mutex_unlock(&ctrlr->lock);
 
-	return ctrlr->failed ? -1 : 0;
+	if (failed)
+		nvme_qpair_fail(qpair);
 }
 
 /*
@@ -1054,15 +1151,14 @@ static void nvme_ctrlr_set_opts(struct nvme_ctrlr *ctrlr,
 }
 
 /*
- * Attach a PCI controller.
+ * Allocate and initialize a controller handle and map the controller
+ * registers.
  */
-struct nvme_ctrlr *
-nvme_ctrlr_attach(struct pci_device *pci_dev,
-		  struct nvme_ctrlr_opts *opts)
+static struct nvme_ctrlr *nvme_ctrlr_alloc(struct pci_device *pci_dev,
+					   bool secondary)
 {
 	struct nvme_ctrlr *ctrlr;
 	union nvme_cap_register	cap;
-	uint32_t cmd_reg;
 	int ret;
 
 	/* Get a new controller handle */
@@ -1077,10 +1173,13 @@ nvme_ctrlr_attach(struct pci_device *pci_dev,
 	/* Initialize the handle */
 	memset(ctrlr, 0, sizeof(struct nvme_ctrlr));
 	ctrlr->pci_dev = pci_dev;
+	ctrlr->node_id = nvme_pci_device_get_node(pci_dev);
 	ctrlr->resetting = false;
 	ctrlr->failed = false;
+	ctrlr->secondary = secondary;
 	TAILQ_INIT(&ctrlr->free_io_qpairs);
 	TAILQ_INIT(&ctrlr->active_io_qpairs);
+	LIST_INIT(&ctrlr->local_qpairs);
 	pthread_mutex_init(&ctrlr->lock, NULL);
 	ctrlr->quirks = nvme_ctrlr_get_quirks(pci_dev);
 
@@ -1096,11 +1195,6 @@ nvme_ctrlr_attach(struct pci_device *pci_dev,
 		return NULL;
 	}
 
-	/* Enable PCI busmaster and disable INTx */
-	nvme_pcicfg_read32(pci_dev, &cmd_reg, 4);
-	cmd_reg |= 0x0404;
-	nvme_pcicfg_write32(pci_dev, cmd_reg, 4);
-
 	/*
 	 * Doorbell stride is 2 ^ (dstrd + 2),
 	 * but we want multiples of 4, so drop the + 2.
@@ -1112,9 +1206,33 @@ nvme_ctrlr_attach(struct pci_device *pci_dev,
 	/* Set default transfer size */
 	ctrlr->max_xfer_size = NVME_MAX_XFER_SIZE;
 
+	return ctrlr;
+}
+
+/*
+ * Attach a PCI controller.
+ */
+struct nvme_ctrlr *
+nvme_ctrlr_attach(struct pci_device *pci_dev,
+		  struct nvme_ctrlr_opts *opts)
+{
+	struct nvme_ctrlr *ctrlr;
+	uint32_t cmd_reg;
+	int ret;
+
+	ctrlr = nvme_ctrlr_alloc(pci_dev, false);
+	if (!ctrlr)
+		return NULL;
+
+	/* Enable PCI busmaster and disable INTx */
+	nvme_pcicfg_read32(pci_dev, &cmd_reg, 4);
+	cmd_reg |= 0x0404;
+	nvme_pcicfg_write32(pci_dev, cmd_reg, 4);
+
 	/* Create the admin queue pair */
 	ret = nvme_qpair_construct(ctrlr, &ctrlr->adminq, 0,
-				   NVME_ADMIN_ENTRIES, NVME_ADMIN_TRACKERS);
+				   NVME_ADMIN_ENTRIES, NVME_ADMIN_TRACKERS,
+				   ctrlr->node_id);
 	if (ret != 0) {
 		nvme_err("Initialize admin queue pair failed\n");
 		goto err;
@@ -1136,6 +1254,118 @@ err:
 	return NULL;
 }
 
+/*
+ * Attach a PCI controller owned by a primary process, using
+ * the connection fd to the primary process. The connection
+ * is closed if the attach fails.
+ */
+struct nvme_ctrlr *
+nvme_ctrlr_attach_secondary(struct pci_device *pci_dev,
+			    struct nvme_ctrlr_opts *opts, int fd)
+{
+	struct nvme_ctrlr *ctrlr;
+	int ret;
+
+	ctrlr = nvme_ctrlr_alloc(pci_dev, true);
+	if (!ctrlr) {
+		close(fd);
+		return NULL;
+	}
+
+	/* The I/O queues were setup by the primary process */
+	nvme_ctrlr_set_opts(ctrlr, opts);
+	ctrlr->opts.use_cmb_sqs = false;
+
+	ret = nvme_shared_connect(ctrlr, fd);
+	if (ret < 0)
+		goto err;
+	ctrlr->io_queues = ret;
+
+	ret = nvme_ctrlr_start_secondary(ctrlr);
+	if (ret != 0) {
+		nvme_err("Start controller failed\n");
+		goto err;
+	}
+
+	nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_READY,
+			     NVME_TIMEOUT_INFINITE);
+
+	return ctrlr;
+
+err:
+	nvme_ctrlr_detach(ctrlr);
+
+	return NULL;
+}
+
+/*
+ * Free an I/O queue pair. On controller detach (@detach is true), the
+ * qpair is freed even if it belongs to a poll group or if its queues
+ * cannot be deleted. A poll group is only used by its owner thread, so
+ * the qpair is not removed from its group: the group skips the qpair
+ * once freed (see nvme_poll_group_poll()).
+ */
+static int nvme_ctrlr_release_qpair(struct nvme_qpair *qpair, bool detach)
+{
+	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
+	int ret;
+
+	if (qpair->local && qpair->nr_local_users) {
+		nvme_err("Local qpair %u is in use\n", qpair->id);
+		return -EBUSY;
+	}
+
+	if (qpair->poll_group && !detach) {
+		nvme_err("I/O qpair %u belongs to a poll group\n", qpair->id);
+		return -EBUSY;
+	}
+
+	pthread_mutex_lock(&ctrlr->lock);
+
+	/*
+	 * Delete the I/O submission and completion queues. Without
+	 * its primary process, a secondary process cannot delete its
+	 * queues: only free them.
+	 */
+	if (nvme_atomic_read(&qpair->reset_pending)) {
+		/*
+		 * The queues were deleted by a controller reset, unless
+		 * the reset notification of a secondary process raced
+		 * with the qpair creation.
+		 */
+		if (ctrlr->secondary) {
+			nvme_admin_delete_ioq(ctrlr, qpair,
+					      NVME_IO_SUBMISSION_QUEUE);
+			nvme_admin_delete_ioq(ctrlr, qpair,
+					      NVME_IO_COMPLETION_QUEUE);
+		}
+		ret = 0;
+	} else {
+		ret = nvme_ctrlr_delete_qpair(ctrlr, qpair);
+	}
+	if (ret == -ENOTCONN && ctrlr->secondary)
+		ret = 0;
+	if (ret != 0)
+		nvme_notice("Delete queue pair %u failed\n", qpair->id);
+	if (ret != 0 && detach)
+		ret = 0;
+	if (ret == 0) {
+		nvme_qpair_destroy(qpair);
+		if (qpair->local) {
+			pthread_mutex_destroy(&qpair->lock);
+			qpair->local = false;
+		}
+		if (ctrlr->secondary)
+			nvme_shared_qpair_put(ctrlr, qpair);
+		TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
+		TAILQ_INSERT_HEAD(&ctrlr->free_io_qpairs, qpair, tailq);
+	}
+
+	pthread_mutex_unlock(&ctrlr->lock);
+
+	return ret;
+}
+
 /*
  * Detach a PCI controller.
  */
@@ -1144,12 +1374,18 @@ void nvme_ctrlr_detach(struct nvme_ctrlr *ctrlr)
 	struct nvme_qpair *qpair;
 	uint32_t i;
 
+	nvme_ioqp_local_detach(ctrlr);
+
 	while (!TAILQ_EMPTY(&ctrlr->active_io_qpairs)) {
 		qpair = TAILQ_FIRST(&ctrlr->active_io_qpairs);
-		nvme_ioqp_release(qpair);
+		nvme_ctrlr_release_qpair(qpair, true);
 	}
 
-	nvme_ctrlr_shutdown(ctrlr);
+	if (ctrlr->shared)
+		nvme_shared_detach(ctrlr);
+
+	if (!ctrlr->secondary)
+		nvme_ctrlr_shutdown(ctrlr);
 
 	nvme_ctrlr_destruct_namespaces(ctrlr);
 	if (ctrlr->ioq) {
@@ -1158,7 +1394,8 @@ void nvme_ctrlr_detach(struct nvme_ctrlr *ctrlr)
 		free(ctrlr->ioq);
 	}
 
-	nvme_qpair_destroy(&ctrlr->adminq);
+	if (!ctrlr->secondary)
+		nvme_qpair_destroy(&ctrlr->adminq);
 
 	nvme_ctrlr_unmap_bars(ctrlr);
 
@@ -1211,6 +1448,68 @@ int nvme_ctrlr_set_feature(struct nvme_ctrlr *ctrlr,
 	return ret;
 }
 
+/*
+ * Get a controller arbitration parameters.
+ */
+int nvme_ctrlr_get_arbitration(struct nvme_ctrlr *ctrlr,
+			       struct nvme_arbitration *arb)
+{
+	union nvme_feat_arbitration feat;
+	int ret;
+
+	ret = nvme_ctrlr_get_feature(ctrlr, NVME_FEAT_CURRENT,
+				     NVME_FEAT_ARBITRATION, 0, &feat.raw);
+	if (ret != 0)
+		return ret;
+
+	arb->burst = feat.bits.ab;
+	arb->high_weight = feat.bits.hpw + 1;
+	arb->medium_weight = feat.bits.mpw + 1;
+	arb->low_weight = feat.bits.lpw + 1;
+
+	return 0;
+}
+
+/*
+ * Set a controller arbitration parameters.
+ */
+int nvme_ctrlr_set_arbitration(struct nvme_ctrlr *ctrlr,
+			       const struct nvme_arbitration *arb)
+{
+	union nvme_feat_arbitration feat;
+	union nvme_cc_register cc;
+
+	if (arb->burst > NVME_ARB_BURST_UNLIMITED) {
+		nvme_err("Invalid arbitration burst %u\n", arb->burst);
+		return -EINVAL;
+	}
+
+	feat.raw = 0;
+	feat.bits.ab = arb->burst;
+
+	/* Weights are only used by weighted round robin arbitration */
+	cc.raw = nvme_reg_mmio_read_4(ctrlr, cc.raw);
+	if (cc.bits.ams == NVME_CC_AMS_WRR) {
+
+		if (arb->high_weight < 1 || arb->high_weight > 256 ||
+		    arb->medium_weight < 1 || arb->medium_weight > 256 ||
+		    arb->low_weight < 1 || arb->low_weight > 256) {
+			nvme_err("Invalid arbitration weights %u/%u/%u\n",
+				 arb->high_weight, arb->medium_weight,
+				 arb->low_weight);
+			return -EINVAL;
+		}
+
+		feat.bits.hpw = arb->high_weight - 1;
+		feat.bits.mpw = arb->medium_weight - 1;
+		feat.bits.lpw = arb->low_weight - 1;
+
+	}
+
+	return nvme_ctrlr_set_feature(ctrlr, false, NVME_FEAT_ARBITRATION,
+				      feat.raw, 0, NULL);
+}
+
 /*
  * Attach a namespace.
  */
@@ -1402,6 +1701,16 @@ out:
  */
 struct nvme_qpair *nvme_ioqp_get(struct nvme_ctrlr *ctrlr,
 				 enum nvme_qprio qprio, unsigned int qd)
+{
+	return nvme_ioqp_get_node(ctrlr, qprio, qd, NVME_NODE_ID_ANY);
+}
+
+/*
+ * Get an unused I/O queue pair with memory on the specified NUMA node.
+ */
+struct nvme_qpair *nvme_ioqp_get_node(struct nvme_ctrlr *ctrlr,
+				      enum nvme_qprio qprio, unsigned int qd,
+				      unsigned int node_id)
 {
 	struct nvme_qpair *qpair = NULL;
 	union nvme_cc_register cc;
@@ -1424,26 +1733,34 @@ struct nvme_qpair *nvme_ioqp_get(struct nvme_ctrlr *ctrlr,
 		return NULL;
 	}
 
-	/* I/O qpairs number of entries belong to [2, io_qpairs_max_entries] */
+	/*
+	 * I/O qpairs number of entries belong to [2, io_qpairs_max_entries],
+	 * with a default of NVME_IO_ENTRIES.
+	 */
 	if (qd == 1) {
 		nvme_err("Invalid queue depth\n");
 		return NULL;
 	}
 
-	if (qd == 0 || qd > ctrlr->io_qpairs_max_entries)
+	if (qd == 0)
+		qd = nvme_min(NVME_IO_ENTRIES, ctrlr->io_qpairs_max_entries);
+	else if (qd > ctrlr->io_qpairs_max_entries)
 		qd = ctrlr->io_qpairs_max_entries;
 
 	/*
-	 * No need to have more trackers than entries in the submit queue.
-	 * Note also that for a queue size of N, we can only have (N-1)
-	 * commands outstanding, hence the "-1" here.
+	 * Use all entries of the submit queue. Note that for a queue
+	 * size of N, we can only have (N-1) commands outstanding,
+	 * hence the "-1" here.
 	 */
-	trackers = nvme_min(NVME_IO_TRACKERS, (qd - 1));
+	trackers = qd - 1;
 
 	pthread_mutex_lock(&ctrlr->lock);
 
 	/* Get the first available qpair structure */
-	qpair = TAILQ_FIRST(&ctrlr->free_io_qpairs);
+	if (ctrlr->secondary)
+		qpair = nvme_shared_qpair_get(ctrlr);
+	else
+		qpair = TAILQ_FIRST(&ctrlr->free_io_qpairs);
 	if (qpair == NULL) {
 		/* No free queue IDs */
 		nvme_err("No free I/O queue pairs\n");
@@ -1451,9 +1768,15 @@ struct nvme_qpair *nvme_ioqp_get(struct nvme_ctrlr *ctrlr,
 	}
 
 	/* Construct the qpair */
-	ret = nvme_qpair_construct(ctrlr, qpair, qprio, qd, trackers);
+	/* Default to the controller node */
+	if (node_id == NVME_NODE_ID_ANY)
+		node_id = ctrlr->node_id;
+
+	ret = nvme_qpair_construct(ctrlr, qpair, qprio, qd, trackers,
+				   node_id);
 	if (ret != 0) {
-		nvme_qpair_destroy(qpair);
+		if (ctrlr->secondary)
+			nvme_shared_qpair_put(ctrlr, qpair);
 		qpair = NULL;
 		goto out;
 	}
@@ -1468,10 +1791,15 @@ struct nvme_qpair *nvme_ioqp_get(struct nvme_ctrlr *ctrlr,
 	if (nvme_ctrlr_create_qpair(ctrlr, qpair) != 0) {
 		nvme_err("Create queue pair on the controller failed\n");
 		nvme_qpair_destroy(qpair);
+		if (ctrlr->secondary)
+			nvme_shared_qpair_put(ctrlr, qpair);
 		qpair = NULL;
 		goto out;
 	}
 
+	/* The calling thread is now the qpair owner */
+	qpair->owner = pthread_self();
+
 	TAILQ_REMOVE(&ctrlr->free_io_qpairs, qpair, tailq);
 	TAILQ_INSERT_TAIL(&ctrlr->active_io_qpairs, qpair, tailq);
 
@@ -1486,28 +1814,10 @@ out:
  */
 int nvme_ioqp_release(struct nvme_qpair *qpair)
 {
-	struct nvme_ctrlr *ctrlr;
-	int ret;
-
 	if (qpair == NULL)
 		return 0;
 
-	ctrlr = qpair->ctrlr;
-
-	pthread_mutex_lock(&ctrlr->lock);
-
-	/* Delete the I/O submission and completion queues */
-	ret = nvme_ctrlr_delete_qpair(ctrlr, qpair);
-	if (ret != 0) {
-		nvme_notice("Delete queue pair %u failed\n", qpair->id);
-	} else {
-		TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
-		TAILQ_INSERT_HEAD(&ctrlr->free_io_qpairs, qpair, tailq);
-	}
-
-	pthread_mutex_unlock(&ctrlr->lock);
-
-	return ret;
+	return nvme_ctrlr_release_qpair(qpair, false);
 }
 
 /*
@@ -1518,21 +1828,24 @@ int nvme_ioqp_submit_cmd(struct nvme_qpair *qpair,
 			 void *buf, size_t len,
 			 nvme_cmd_cb cb_fn, void *cb_arg)
 {
-	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
 	struct nvme_request *req;
-	int ret = -ENOMEM;
-
-	pthread_mutex_lock(&ctrlr->lock);
 
 	req = nvme_request_allocate_contig(qpair, buf, len, cb_fn, cb_arg);
-	if (req) {
-		memcpy(&req->cmd, cmd, sizeof(req->cmd));
-		ret = nvme_qpair_submit_request(qpair, req);
-	}
+	if (!req)
+		return -ENOMEM;
 
-	pthread_mutex_unlock(&ctrlr->lock);
+	memcpy(&req->cmd, cmd, sizeof(req->cmd));
 
-	return ret;
+	/*
+	 * A qpair owned by the calling thread can be checked without
+	 * locking. Local qpairs may be shared by several threads, so
+	 * their rate limit state is checked under the qpair lock.
+	 */
+	if (unlikely(qpair->local || qpair->rate_limited ||
+		     !STAILQ_EMPTY(&qpair->throttled_req)))
+		return nvme_qpair_submit_limited_request(qpair, NULL, req);
+
+	return nvme_qpair_submit_request(qpair, req);
 }
 
 /*
@@ -1542,12 +1855,66 @@ int nvme_ioqp_submit_cmd(struct nvme_qpair *qpair,
 unsigned int nvme_ioqp_poll(struct nvme_qpair *qpair,
 			    unsigned int max_completions)
 {
-	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
-	int ret;
+	return nvme_qpair_poll(qpair, max_completions);
+}
 
-	pthread_mutex_lock(&ctrlr->lock);
-	ret = nvme_qpair_poll(qpair, max_completions);
-	pthread_mutex_unlock(&ctrlr->lock);
+/*
+ * Reap completions of NVMe commands submitted to the
+ * specified I/O queue pair.
+ */
+unsigned int nvme_ioqp_reap(struct nvme_qpair *qpair,
+			    struct nvme_cpl_rec *recs,
+			    unsigned int max_recs)
+{
+	return nvme_qpair_reap(qpair, recs, max_recs);
+}
 
-	return ret;
+/*
+ * Start batching doorbell writes on an I/O queue pair.
+ */
+void nvme_ioqp_plug(struct nvme_qpair *qpair)
+{
+	nvme_qpair_plug(qpair);
+}
+
+/*
+ * Flush batched doorbell writes on an I/O queue pair.
+ */
+void nvme_ioqp_unplug(struct nvme_qpair *qpair)
+{
+	nvme_qpair_unplug(qpair);
+}
+
+/*
+ * Set the completion queue head doorbell batch of an I/O queue pair.
+ */
+int nvme_ioqp_set_cq_batch(struct nvme_qpair *qpair, unsigned int batch)
+{
+	return nvme_qpair_set_cq_batch(qpair, batch);
+}
+
+/*
+ * Set the command timeout of an I/O queue pair.
+ */
+int nvme_ioqp_set_timeout(struct nvme_qpair *qpair, unsigned int timeout_ms,
+			  nvme_timeout_cb cb_fn, void *cb_arg)
+{
+	return nvme_qpair_set_timeout(qpair, timeout_ms, cb_fn, cb_arg);
+}
+
+/*
+ * Set the backpressure submission mode of an I/O queue pair.
+ */
+int nvme_ioqp_set_backpressure(struct nvme_qpair *qpair, bool enable)
+{
+	return nvme_qpair_set_backpressure(qpair, enable);
+}
+
+/*
+ * Set the IOPS and bandwidth limits of an I/O queue pair.
+ */
+int nvme_ioqp_set_rate_limit(struct nvme_qpair *qpair,
+			     const struct nvme_rate_limit *limit)
+{
+	return nvme_qpair_set_rate_limit(qpair, limit);
 }
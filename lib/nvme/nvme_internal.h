@@ -106,16 +106,49 @@
 #define NVME_ADMIN_ENTRIES	        (128)
 
 /*
- * NVME_IO_ENTRIES defines the size of an I/O qpair's submission and completion
- * queues, while NVME_IO_TRACKERS defines the maximum number of I/O that we
- * will allow outstanding on an I/O qpair at any time. The only advantage in
- * having IO_ENTRIES > IO_TRACKERS is for debugging purposes - when dumping
- * the contents of the submission and completion queues, it will show a longer
- * history of data.
+ * NVME_IO_ENTRIES defines the default size of an I/O qpair's
+ * submission and completion queues. Larger queues, up to the
+ * controller CAP.MQES limit, can be explicitly requested. An I/O qpair
+ * has one tracker per queue entry (minus one), that is, all queue
+ * entries can be used by outstanding commands.
  */
 #define NVME_IO_ENTRIES		        (1024U)
-#define NVME_IO_TRACKERS	        (128U)
-#define NVME_IO_ENTRIES_VS_TRACKERS_RATIO (NVME_IO_ENTRIES / NVME_IO_TRACKERS)
+
+/*
+ * Largest physically contiguous queue: the largest queue (64K entries
+ * of 64 B). Allocations larger than a hugepage need physically contiguous
+ * hugepages. Unless the controller requires physically contiguous
+ * queues (CAP.CQR), I/O queues for which contiguous memory cannot be
+ * allocated are made of NVME_QUEUE_SEG_SIZE segments described to the
+ * controller with a PRP list.
+ */
+#define NVME_QUEUE_CONTIG_MAX_SIZE	(4UL * 1024 * 1024)
+#define NVME_QUEUE_SEG_SHIFT		(18)
+#define NVME_QUEUE_SEG_SIZE		(1UL << NVME_QUEUE_SEG_SHIFT)
+
+/*
+ * Number of entries of submission queue (64 B entries) and
+ * completion queue (16 B entries) segments.
+ */
+#define NVME_SQ_SEG_SHIFT		(NVME_QUEUE_SEG_SHIFT - 6)
+#define NVME_SQ_SEG_ENTRIES		(1U << NVME_SQ_SEG_SHIFT)
+#define NVME_CQ_SEG_SHIFT		(NVME_QUEUE_SEG_SHIFT - 4)
+#define NVME_CQ_SEG_ENTRIES		(1U << NVME_CQ_SEG_SHIFT)
+
+/*
+ * Number of requests per tracker in a qpair request pool. Requests in
+ * excess of the number of trackers are used for split requests and for
+ * requests queued waiting for a free tracker. For large queues, the
+ * number of excess requests is limited to NVME_IO_ENTRIES.
+ */
+#define NVME_REQS_PER_TRACKER		(8)
+
+/*
+ * PRP lists and SGL descriptors are allocated on demand from a per qpair
+ * pool of DMA-able lists. The pool grows by chunks of NVME_PRP_SGL_LISTS_CHUNK
+ * lists, up to one list per tracker.
+ */
+#define NVME_PRP_SGL_LISTS_CHUNK	(8)
 
 /*
  * NVME_MAX_SGL_DESCRIPTORS defines the maximum number of descriptors in one SGL
@@ -165,6 +198,11 @@ enum nvme_payload_type {
 	 * nvme_request::u.sgl is valid for this request
 	 */
 	NVME_PAYLOAD_TYPE_SGL,
+
+	/*
+	 * nvme_request::u.buf is valid for this request
+	 */
+	NVME_PAYLOAD_TYPE_BUF,
 };
 
 /*
@@ -177,6 +215,11 @@ enum nvme_ctrlr_flags {
 	 */
 	NVME_CTRLR_SGL_SUPPORTED = 0x1,
 
+	/*
+	 * I/O queues must be physically contiguous (CAP.CQR).
+	 */
+	NVME_CTRLR_CONTIG_QUEUES = 0x2,
+
 };
 
 /*
@@ -202,6 +245,15 @@ struct __attribute__((packed)) nvme_payload {
 			nvme_req_next_sge_cb next_sge_fn;
 			void *cb_arg;
 		} sgl;
+
+		/*
+		 * Registered buffer and offset of the
+		 * payload in the buffer.
+		 */
+		struct {
+			struct nvme_buf *buf;
+			size_t offset;
+		} buf;
 	} u;
 
 	/*
@@ -289,6 +341,11 @@ struct nvme_request {
 	 */
 	struct nvme_cpl		         parent_status;
 
+	/*
+	 * Namespace of a request deferred by rate limiting.
+	 */
+	struct nvme_ns			 *ns;
+
 } __attribute__((aligned(64)));
 
 struct nvme_completion_poll_status {
@@ -302,44 +359,133 @@ struct nvme_async_event_request {
 	struct nvme_cpl		cpl;
 };
 
-struct nvme_tracker {
+/*
+ * PRP list or SGL descriptors of a command.
+ */
+struct nvme_prp_sgl_list {
+
+	union {
+		uint64_t			prp[NVME_MAX_PRP_LIST_ENTRIES];
+		struct nvme_sgl_descriptor	sgl[NVME_MAX_SGL_DESCRIPTORS];
+	} u;
+
+	uint8_t				rsvd[48];
+};
+
+/*
+ * struct nvme_prp_sgl_list must be exactly 4K so that the lists do not
+ * cross a page boundery and so that there is no padding required to meet
+ * alignment requirements.
+ */
+nvme_static_assert(sizeof(struct nvme_prp_sgl_list) == 4096,
+		   "nvme_prp_sgl_list is not 4K");
 
-	LIST_ENTRY(nvme_tracker)	list;
+#define NVME_PRP_SGL_LIST_NONE		0xFFFFFFFF
+
+/*
+ * Invalid command ID, terminating timer wheel slot lists.
+ */
+#define NVME_CID_NONE			0xFFFF
+
+/*
+ * Tracker command timeout state.
+ */
+enum nvme_tracker_timeout {
+	NVME_TRACKER_TIMEOUT_NONE = 0,
+	NVME_TRACKER_TIMEOUT_ARMED,
+	NVME_TRACKER_TIMEOUT_ABORTED,
+};
+
+struct nvme_tracker {
 
 	struct nvme_request		*req;
-#if INTPTR_MAX == INT32_MAX
-	/* We need to add 12 bytes on 32-bit systems so this structure is exactly 4096 bytes. */
-	int8_t __pad[12];
-#elif !defined(INTPTR_MAX)
-#error Need definition of INTPTR_MAX!
-#endif
 
 	uint16_t			cid;
 
-	uint16_t			rsvd1: 15;
-	uint16_t			active: 1;
+	/*
+	 * Timer wheel slot list links (command IDs), timeout
+	 * state and expiry tick (lower 32 bits).
+	 */
+	uint16_t			tw_next;
+	uint16_t			tw_prev;
+	uint8_t				tw_state;
+
+	/*
+	 * Index of the PRP list / SGL descriptors in the qpair
+	 * lists pool, or NVME_PRP_SGL_LIST_NONE.
+	 */
+	uint32_t			list;
+
+	uint32_t			tw_expire;
+};
 
-	uint32_t			rsvd2;
+/*
+ * Command timeouts are tracked with a hashed timer wheel: a timeout
+ * period lasts NVME_TIMER_WHEEL_TICKS ticks and outstanding commands
+ * are listed in the wheel slot of the tick they expire at.
+ */
+#define NVME_TIMER_WHEEL_SLOTS		256
+#define NVME_TIMER_WHEEL_TICKS		64
 
-	uint64_t			prp_sgl_bus_addr;
+struct nvme_timer_wheel {
 
-	union {
-		uint64_t			prp[NVME_MAX_PRP_LIST_ENTRIES];
-		struct nvme_sgl_descriptor	sgl[NVME_MAX_SGL_DESCRIPTORS];
-	} u;
+	nvme_timeout_cb			cb_fn;
+	void				*cb_arg;
 
-	uint64_t			rsvd3;
+	unsigned int			timeout_ms;
+	unsigned int			tick_ms;
+
+	/*
+	 * Number of ticks until a command expires.
+	 */
+	unsigned int			ticks;
+
+	/*
+	 * Next tick to process.
+	 */
+	uint64_t			tick;
+
+	/*
+	 * Number of outstanding aborted commands.
+	 */
+	unsigned int			nr_aborts;
+
+	/*
+	 * An aborted command did not complete: reset the
+	 * controller once the qpair poll is done.
+	 */
+	bool				reset;
+
+	uint16_t			slots[NVME_TIMER_WHEEL_SLOTS];
 };
 
 /*
- * struct nvme_tracker must be exactly 4K so that the prp[] array does not
- * cross a page boundery and so that there is no padding required to meet
- * alignment requirements.
+ * Rate limiter burst window: up to this many nanoseconds worth
+ * of tokens can be accumulated.
  */
-nvme_static_assert(sizeof(struct nvme_tracker) == 4096,
-		   "nvme_tracker is not 4K");
-nvme_static_assert((offsetof(struct nvme_tracker, u.sgl) & 7) == 0,
-		   "SGL must be Qword aligned");
+#define NVME_RL_BURST_NSEC		10000000ULL
+
+/*
+ * Rate limiter token bucket: tokens are refilled at @rate per second,
+ * up to @burst tokens. A command is admitted if the bucket has tokens
+ * and may leave it in debt so that commands larger than the burst
+ * are not starved. A rate of 0 means no limit.
+ */
+struct nvme_token_bucket {
+	uint64_t			rate;
+	int64_t				burst;
+	int64_t				tokens;
+	uint64_t			rem;
+};
+
+/*
+ * IOPS and bandwidth rate limiter.
+ */
+struct nvme_rate_limiter {
+	uint64_t			last;
+	struct nvme_token_bucket	iops;
+	struct nvme_token_bucket	bps;
+};
 
 struct nvme_qpair {
 
@@ -356,8 +502,12 @@ struct nvme_qpair {
 	 */
 	struct nvme_cpl		        *cpl;
 
-	LIST_HEAD(, nvme_tracker)	free_tr;
-	LIST_HEAD(, nvme_tracker)	outstanding_tr;
+	/*
+	 * Segments of non-contiguous submission and completion
+	 * queues (NULL for physically contiguous queues).
+	 */
+	struct nvme_cmd			**sq_segs;
+	struct nvme_cpl			**cq_segs;
 
 	/*
 	 * Array of trackers indexed by command ID.
@@ -365,22 +515,101 @@ struct nvme_qpair {
 	uint16_t			trackers;
 	struct nvme_tracker		*tr;
 
+	/*
+	 * Stack of free command IDs (LIFO reuse so that recently
+	 * used trackers, still cache hot, are reused first) and
+	 * bitmap of active command IDs.
+	 */
+	uint16_t			nr_free_cids;
+	uint16_t			*free_cids;
+	uint64_t			*active_cids;
+
+	/*
+	 * PRP lists / SGL descriptors pool: lists are allocated
+	 * only for commands needing them.
+	 */
+	unsigned int			nr_lists;
+	unsigned int			nr_free_lists;
+	uint32_t			*free_lists;
+	struct nvme_prp_sgl_list	**lists;
+	phys_addr_t			*lists_bus_addr;
+
 	struct nvme_request		*reqs;
 	unsigned int			num_reqs;
 	STAILQ_HEAD(, nvme_request)	free_req;
 	STAILQ_HEAD(, nvme_request)	queued_req;
 
+	/*
+	 * Queued requests accounting: current and maximum number of
+	 * requests in queued_req, total number of requests queued and
+	 * number of requests rejected with -EAGAIN in backpressure mode.
+	 */
+	unsigned int			nr_queued;
+	unsigned int			max_queued;
+	uint64_t			nr_queued_total;
+	uint64_t			nr_rejected;
+
+	/*
+	 * Requests deferred by rate limiting.
+	 */
+	STAILQ_HEAD(, nvme_request)	throttled_req;
+	unsigned int			nr_throttled;
+
+	/*
+	 * Completions of commands without callback function completed
+	 * by the library itself, returned by the next nvme_qpair_reap()
+	 * call (ring of num_reqs records, allocated on first use).
+	 */
+	struct nvme_cpl_rec		*cpl_recs;
+	unsigned int			cpl_recs_head;
+	unsigned int			nr_cpl_recs;
+
 	uint16_t			id;
 
-	uint16_t			entries;
-	uint16_t			sq_tail;
-	uint16_t			cq_head;
+	uint32_t			entries;
+	uint32_t			sq_tail;
+	uint32_t			cq_head;
 
 	uint8_t				phase;
 
 	bool				enabled;
 	bool				sq_in_cmb;
 
+	/*
+	 * Set by a controller reset or failure: the qpair owner
+	 * re-creates or fails the qpair on its next submission or
+	 * poll (see nvme_ctrlr_reset_qpair()).
+	 */
+	nvme_atomic_t			reset_pending;
+
+	/*
+	 * Backpressure mode: fail submissions with -EAGAIN instead
+	 * of queueing requests when no tracker is available.
+	 */
+	bool				backpressure;
+
+	/*
+	 * The qpair rate limiter is enabled.
+	 */
+	bool				rate_limited;
+
+	/*
+	 * Doorbells batching: while plugged, submitted commands are
+	 * only copied to the submission queue. sq_tail_db and cq_head_db
+	 * are the last values written to the doorbells, and the completion
+	 * queue head doorbell is written only once cq_db_batch completions
+	 * have been processed.
+	 */
+	bool				plugged;
+	uint32_t			sq_tail_db;
+	uint32_t			cq_head_db;
+	uint32_t			cq_db_batch;
+
+	/*
+	 * Command timeouts timer wheel (NULL if timeouts are disabled).
+	 */
+	struct nvme_timer_wheel		*tw;
+
 	/*
 	 * Fields below this point should not be touched on the
 	 * normal I/O happy path.
@@ -390,11 +619,117 @@ struct nvme_qpair {
 
 	struct nvme_ctrlr		*ctrlr;
 
+	/*
+	 * NUMA node of the qpair queues, trackers and requests.
+	 */
+	unsigned int			node_id;
+
 	/* List entry for nvme_ctrlr::free_io_qpairs and active_io_qpairs */
 	TAILQ_ENTRY(nvme_qpair)		tailq;
 
+	/*
+	 * Bus address of the queues, or of the queues PRP list
+	 * for non-contiguous queues.
+	 */
 	phys_addr_t			cmd_bus_addr;
 	phys_addr_t			cpl_bus_addr;
+	uint64_t			*sq_prp_list;
+	uint64_t			*cq_prp_list;
+
+	/*
+	 * Thread owning an I/O qpair. Set by nvme_ioqp_get(), only
+	 * this thread may submit commands to and poll the qpair.
+	 */
+	pthread_t			owner;
+
+	/*
+	 * Local qpair (see nvme_ioqp_get_local()): the qpair may be
+	 * shared by several threads, which serialize its use with lock.
+	 * Users is the number of threads bound to the qpair.
+	 */
+	bool				local;
+	unsigned int			nr_local_users;
+	pthread_mutex_t			lock;
+
+	/*
+	 * Poll group the qpair belongs to.
+	 */
+	struct nvme_poll_group		*poll_group;
+
+	/*
+	 * Qpair IOPS and bandwidth limits.
+	 */
+	struct nvme_rate_limiter	rl;
+};
+
+/*
+ * Poll group member.
+ */
+struct nvme_poll_group_member {
+
+	struct nvme_qpair		*qpair;
+
+	/*
+	 * The member completion queue had completions
+	 * pending when last checked.
+	 */
+	bool				pending;
+
+	/*
+	 * Completions processed by the last poll and in total.
+	 */
+	unsigned int			completions;
+	unsigned long long		total_completions;
+};
+
+/*
+ * Poll group: a set of I/O qpairs polled together by the thread
+ * owning them.
+ */
+struct nvme_poll_group {
+
+	/*
+	 * Array of members.
+	 */
+	unsigned int			nr_members;
+	unsigned int			max_members;
+	struct nvme_poll_group_member	*members;
+
+	/*
+	 * First member polled by the next poll: rotated
+	 * on every poll for fairness.
+	 */
+	unsigned int			next;
+
+	pthread_t			owner;
+};
+
+/*
+ * Binding of a thread to a local I/O qpair of a controller. Bindings
+ * are linked to both their thread and their controller. A binding
+ * with a NULL controller was invalidated by the controller detach.
+ */
+struct nvme_local_qpair {
+
+	struct nvme_ctrlr		*ctrlr;
+	struct nvme_qpair		*qpair;
+
+	LIST_ENTRY(nvme_local_qpair)	thread_link;
+	LIST_ENTRY(nvme_local_qpair)	ctrlr_link;
+};
+
+/*
+ * QoS I/O qpairs pool: qpairs are sorted by priority class, the
+ * qpairs of class c being qpairs[start[c]] to qpairs[start[c + 1] - 1].
+ */
+struct nvme_qos {
+
+	struct nvme_ctrlr		*ctrlr;
+
+	pthread_t			owner;
+
+	unsigned int			start[NVME_QOS_CLASSES + 1];
+	struct nvme_qpair		*qpairs[];
 };
 
 struct nvme_ns {
@@ -415,6 +750,14 @@ struct nvme_ns {
 
 	int				open_count;
 
+	/*
+	 * Namespace IOPS and bandwidth limits, shared by all qpairs
+	 * and protected by rl_lock.
+	 */
+	bool				rate_limited;
+	nvme_spinlock_t			rl_lock;
+	struct nvme_rate_limiter	rl;
+
 };
 
 /*
@@ -478,9 +821,10 @@ struct nvme_ctrlr {
 	unsigned int			max_io_queues;
 
 	/*
-	 * Number of I/O queue pairs enabled
+	 * Number of I/O queue pairs enabled. I/O qpairs are enabled
+	 * lazily from their owner thread I/O path, hence atomic.
 	 */
-	unsigned int			enabled_io_qpairs;
+	nvme_atomic_t			enabled_io_qpairs;
 
 	/*
 	 * Maximum entries for I/O qpairs
@@ -525,6 +869,11 @@ struct nvme_ctrlr {
 	 */
 	struct pci_device		*pci_dev;
 
+	/*
+	 * NUMA node of the PCI device (NVME_NODE_ID_ANY if unknown).
+	 */
+	unsigned int			node_id;
+
 	/*
 	 * Maximum i/o size in bytes.
 	 */
@@ -572,6 +921,11 @@ struct nvme_ctrlr {
 	TAILQ_HEAD(, nvme_qpair)	free_io_qpairs;
 	TAILQ_HEAD(, nvme_qpair)	active_io_qpairs;
 
+	/*
+	 * Bindings of threads to local I/O qpairs.
+	 */
+	LIST_HEAD(, nvme_local_qpair)	local_qpairs;
+
 	/*
 	 * Controller option set on open.
 	 */
@@ -602,6 +956,15 @@ struct nvme_ctrlr {
 	 */
 	unsigned int			quirks;
 
+	/*
+	 * Controller shared between processes: set for the primary
+	 * process serving the secondary processes, and for secondary
+	 * processes which have their admin commands executed by the
+	 * primary process.
+	 */
+	bool				secondary;
+	struct nvme_shared		*shared;
+
 	/*
 	 * For controller list.
 	 */
@@ -635,7 +998,8 @@ extern int nvme_admin_get_log_page(struct nvme_ctrlr *ctrlr,
 				   void *payload, uint32_t payload_size);
 
 extern int nvme_admin_abort_cmd(struct nvme_ctrlr *ctrlr,
-				uint16_t cid, uint16_t sqid);
+				uint16_t cid, uint16_t sqid,
+				nvme_cmd_cb cb_fn, void *cb_arg);
 
 extern int nvme_admin_create_ioq(struct nvme_ctrlr *ctrlr,
 				 struct nvme_qpair *io_que,
@@ -670,17 +1034,49 @@ extern int nvme_admin_fw_commit(struct nvme_ctrlr *ctrlr,
 extern int nvme_admin_fw_image_dl(struct nvme_ctrlr *ctrlr,
 				  void *fw, uint32_t size, uint32_t offset);
 
+extern int nvme_admin_passthru(struct nvme_ctrlr *ctrlr,
+			       struct nvme_cmd *cmd,
+			       void *buf, uint32_t len,
+			       struct nvme_cpl *cpl);
+
 extern void nvme_request_completion_poll_cb(void *arg,
 					    const struct nvme_cpl *cpl);
 
 extern struct nvme_ctrlr *nvme_ctrlr_attach(struct pci_device *pci_dev,
 					    struct nvme_ctrlr_opts *opts);
+extern struct nvme_ctrlr *
+nvme_ctrlr_attach_secondary(struct pci_device *pci_dev,
+			    struct nvme_ctrlr_opts *opts, int fd);
 
 extern void nvme_ctrlr_detach(struct nvme_ctrlr *ctrlr);
+extern void nvme_ioqp_local_detach(struct nvme_ctrlr *ctrlr);
+
+extern int nvme_ctrlr_reset(struct nvme_ctrlr *ctrlr);
+
+extern void nvme_ctrlr_reset_qpair(struct nvme_ctrlr *ctrlr,
+				   struct nvme_qpair *qpair);
+
+/*
+ * Controllers shared between processes.
+ */
+extern struct nvme_ctrlr *nvme_ctrlr_attach_shared(struct pci_device *pci_dev,
+						   struct nvme_ctrlr_opts *opts);
+extern int nvme_shared_connect(struct nvme_ctrlr *ctrlr, int fd);
+extern void nvme_shared_detach(struct nvme_ctrlr *ctrlr);
+extern unsigned int nvme_shared_nr_secondaries(struct nvme_ctrlr *ctrlr);
+extern void nvme_shared_notify_reset(struct nvme_ctrlr *ctrlr);
+extern int nvme_shared_admin_cmd(struct nvme_ctrlr *ctrlr,
+				 struct nvme_cmd *cmd,
+				 void *buf, uint32_t len,
+				 nvme_cmd_cb cb_fn, void *cb_arg);
+extern struct nvme_qpair *nvme_shared_qpair_get(struct nvme_ctrlr *ctrlr);
+extern void nvme_shared_qpair_put(struct nvme_ctrlr *ctrlr,
+				  struct nvme_qpair *qpair);
 
 extern int nvme_qpair_construct(struct nvme_ctrlr *ctrlr,
 				struct nvme_qpair *qpair, enum nvme_qprio qprio,
-				uint16_t entries, uint16_t trackers);
+				uint32_t entries, uint16_t trackers,
+				unsigned int node_id);
 
 extern void nvme_qpair_destroy(struct nvme_qpair *qpair);
 extern void nvme_qpair_enable(struct nvme_qpair *qpair);
@@ -689,10 +1085,105 @@ extern int  nvme_qpair_submit_request(struct nvme_qpair *qpair,
 				      struct nvme_request *req);
 extern void nvme_qpair_reset(struct nvme_qpair *qpair);
 extern void nvme_qpair_fail(struct nvme_qpair *qpair);
+extern void nvme_qpair_plug(struct nvme_qpair *qpair);
+extern void nvme_qpair_unplug(struct nvme_qpair *qpair);
+extern int nvme_qpair_set_cq_batch(struct nvme_qpair *qpair,
+				   unsigned int batch);
+extern int nvme_qpair_set_timeout(struct nvme_qpair *qpair,
+				  unsigned int timeout_ms,
+				  nvme_timeout_cb cb_fn, void *cb_arg);
+extern int nvme_qpair_set_backpressure(struct nvme_qpair *qpair,
+				       bool enable);
+extern int nvme_qpair_set_rate_limit(struct nvme_qpair *qpair,
+				     const struct nvme_rate_limit *limit);
+extern int nvme_qpair_submit_limited_request(struct nvme_qpair *qpair,
+					     struct nvme_ns *ns,
+					     struct nvme_request *req);
+
+extern bool nvme_rl_set(struct nvme_rate_limiter *rl,
+			const struct nvme_rate_limit *limit, uint64_t now);
+extern void nvme_rl_refill(struct nvme_rate_limiter *rl, uint64_t now);
+
+/*
+ * Test if a rate limiter has tokens available.
+ */
+static inline bool nvme_rl_check(struct nvme_rate_limiter *rl)
+{
+	return rl->iops.tokens > 0 && rl->bps.tokens > 0;
+}
 
+/*
+ * Consume the tokens of a command transferring @bytes.
+ */
+static inline void nvme_rl_consume(struct nvme_rate_limiter *rl,
+				   uint32_t bytes)
+{
+	if (rl->iops.rate)
+		rl->iops.tokens--;
+	if (rl->bps.rate)
+		rl->bps.tokens -= bytes;
+}
+
+extern unsigned int nvme_qpair_reap(struct nvme_qpair *qpair,
+				    struct nvme_cpl_rec *recs,
+				    unsigned int max_recs);
 extern unsigned int nvme_qpair_poll(struct nvme_qpair *qpair,
 				    unsigned int max_completions);
 
+/*
+ * Get a submission queue entry.
+ */
+static inline struct nvme_cmd *nvme_qpair_sq_entry(struct nvme_qpair *qpair,
+						   uint32_t i)
+{
+	if (likely(!qpair->sq_segs))
+		return &qpair->cmd[i];
+
+	return &qpair->sq_segs[i >> NVME_SQ_SEG_SHIFT]
+		[i & (NVME_SQ_SEG_ENTRIES - 1)];
+}
+
+/*
+ * Get a completion queue entry.
+ */
+static inline struct nvme_cpl *nvme_qpair_cq_entry(struct nvme_qpair *qpair,
+						   uint32_t i)
+{
+	if (likely(!qpair->cq_segs))
+		return &qpair->cpl[i];
+
+	return &qpair->cq_segs[i >> NVME_CQ_SEG_SHIFT]
+		[i & (NVME_CQ_SEG_ENTRIES - 1)];
+}
+
+/*
+ * Current timer wheel tick.
+ */
+static inline uint64_t nvme_qpair_tw_now(struct nvme_timer_wheel *tw)
+{
+	return nvme_time_msec_coarse() / tw->tick_ms;
+}
+
+/*
+ * Test if a qpair has completions to process. This only reads the
+ * completion queue entry at the head of the queue, which allows
+ * skipping idle qpairs cheaply. Disabled qpairs and qpairs to
+ * re-create after a controller reset are reported as having
+ * completions so that polling them re-enables them, and so are
+ * qpairs with command timeouts to check, since a timed out command
+ * has no completion, and qpairs with requests deferred by rate
+ * limiting, which are submitted by polling.
+ */
+static inline bool nvme_qpair_cpl_pending(struct nvme_qpair *qpair)
+{
+	return !qpair->enabled ||
+		nvme_atomic_read(&qpair->reset_pending) ||
+		nvme_qpair_cq_entry(qpair, qpair->cq_head)->status.p ==
+		qpair->phase ||
+		!STAILQ_EMPTY(&qpair->throttled_req) ||
+		(qpair->tw && nvme_qpair_tw_now(qpair->tw) >= qpair->tw->tick);
+}
+
 extern int nvme_request_pool_construct(struct nvme_qpair *qpair);
 
 extern void nvme_request_pool_destroy(struct nvme_qpair *qpair);
@@ -715,6 +1206,27 @@ extern void nvme_request_free(struct nvme_request *req);
 extern void nvme_request_add_child(struct nvme_request *parent,
 				   struct nvme_request *child);
 
+/*
+ * Serialize the use of local I/O qpairs, which may be shared by
+ * several threads. Other qpairs are lockless. The lock is recursive
+ * as completion callbacks may submit commands to the same qpair.
+ */
+static inline void nvme_qpair_lock(struct nvme_qpair *qpair)
+{
+	if (unlikely(qpair->local))
+		pthread_mutex_lock(&qpair->lock);
+}
+
+static inline void nvme_qpair_unlock(struct nvme_qpair *qpair)
+{
+	if (unlikely(qpair->local))
+		pthread_mutex_unlock(&qpair->lock);
+}
+
+extern bool nvme_request_is_child(struct nvme_request *req);
+extern struct nvme_request *
+nvme_request_complete_child(struct nvme_request *child,
+			    const struct nvme_cpl *cpl);
 extern void nvme_request_remove_child(struct nvme_request *parent,
 				      struct nvme_request *child);
 
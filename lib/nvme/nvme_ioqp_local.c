@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+#include "nvme_internal.h"
+
+/*
+ * Local I/O qpairs bindings of a thread.
+ */
+struct nvme_local_thread {
+	LIST_HEAD(, nvme_local_qpair)	bindings;
+};
+
+/*
+ * The calling thread bindings. The bindings list is only modified
+ * by its thread, which can thus look it up without locking.
+ */
+static __thread struct nvme_local_thread *nvme_local_thread;
+static pthread_key_t nvme_local_key;
+static pthread_once_t nvme_local_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Protects the controllers bindings lists and the local
+ * qpairs users count.
+ */
+static pthread_mutex_t nvme_local_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Unbind a thread from its local qpair, releasing the qpair
+ * if it has no other user. Called with nvme_local_lock held.
+ */
+static void nvme_ioqp_local_put(struct nvme_local_qpair *lqp)
+{
+	struct nvme_qpair *qpair = lqp->qpair;
+
+	LIST_REMOVE(lqp, ctrlr_link);
+	lqp->ctrlr = NULL;
+	lqp->qpair = NULL;
+
+	if (--qpair->nr_local_users)
+		return;
+
+	nvme_debug("Release local I/O qpair %u\n", qpair->id);
+
+	if (nvme_ioqp_release(qpair) != 0)
+		nvme_err("Release local I/O qpair %u failed\n", qpair->id);
+}
+
+/*
+ * Thread exit: release the thread local qpairs.
+ */
+static void nvme_ioqp_local_exit(void *arg)
+{
+	struct nvme_local_thread *lt = arg;
+	struct nvme_local_qpair *lqp;
+
+	pthread_mutex_lock(&nvme_local_lock);
+
+	while ((lqp = LIST_FIRST(&lt->bindings))) {
+		LIST_REMOVE(lqp, thread_link);
+		if (lqp->ctrlr)
+			nvme_ioqp_local_put(lqp);
+		free(lqp);
+	}
+
+	pthread_mutex_unlock(&nvme_local_lock);
+
+	nvme_local_thread = NULL;
+	free(lt);
+}
+
+static void nvme_ioqp_local_key_init(void)
+{
+	if (pthread_key_create(&nvme_local_key, nvme_ioqp_local_exit))
+		nvme_crit("Create local qpairs key failed\n");
+}
+
+/*
+ * Get the calling thread bindings, creating them if needed.
+ */
+static struct nvme_local_thread *nvme_ioqp_local_thread(void)
+{
+	struct nvme_local_thread *lt;
+
+	if (nvme_local_thread)
+		return nvme_local_thread;
+
+	pthread_once(&nvme_local_once, nvme_ioqp_local_key_init);
+
+	lt = calloc(1, sizeof(struct nvme_local_thread));
+	if (!lt)
+		return NULL;
+
+	LIST_INIT(&lt->bindings);
+
+	if (pthread_setspecific(nvme_local_key, lt)) {
+		free(lt);
+		return NULL;
+	}
+
+	nvme_local_thread = lt;
+
+	return lt;
+}
+
+/*
+ * Get a new I/O qpair on the specified node and make it a local qpair.
+ * Return NULL if the controller has no free I/O qpair left.
+ */
+static struct nvme_qpair *nvme_ioqp_local_create(struct nvme_ctrlr *ctrlr,
+						 unsigned int node_id)
+{
+	struct nvme_qpair *qpair;
+	pthread_mutexattr_t attr;
+	bool have_free;
+
+	pthread_mutex_lock(&ctrlr->lock);
+	have_free = !TAILQ_EMPTY(&ctrlr->free_io_qpairs);
+	pthread_mutex_unlock(&ctrlr->lock);
+
+	if (!have_free)
+		return NULL;
+
+	qpair = nvme_ioqp_get_node(ctrlr, NVME_QPRIO_URGENT, 0, node_id);
+	if (!qpair)
+		return NULL;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&qpair->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	qpair->nr_local_users = 0;
+	qpair->local = true;
+
+	nvme_debug("Created local I/O qpair %u on node %u\n",
+		   qpair->id, qpair->node_id);
+
+	return qpair;
+}
+
+/*
+ * Select the local qpair to share: the qpair with the least users,
+ * preferably on the specified node.
+ */
+static struct nvme_qpair *nvme_ioqp_local_select(struct nvme_ctrlr *ctrlr,
+						 unsigned int node_id)
+{
+	struct nvme_qpair *qpair, *best = NULL;
+
+	pthread_mutex_lock(&ctrlr->lock);
+
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		if (!qpair->local)
+			continue;
+		if (!best ||
+		    qpair->nr_local_users < best->nr_local_users ||
+		    (qpair->nr_local_users == best->nr_local_users &&
+		     qpair->node_id == node_id && best->node_id != node_id))
+			best = qpair;
+	}
+
+	pthread_mutex_unlock(&ctrlr->lock);
+
+	return best;
+}
+
+/*
+ * Bind the calling thread to a local qpair of a controller.
+ */
+static struct nvme_qpair *nvme_ioqp_local_bind(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_local_qpair *lqp, *tmp, *next;
+	struct nvme_local_thread *lt;
+	struct nvme_qpair *qpair;
+	unsigned int node_id;
+
+	lt = nvme_ioqp_local_thread();
+	if (!lt) {
+		nvme_err("Allocate thread local qpairs failed\n");
+		return NULL;
+	}
+
+	lqp = calloc(1, sizeof(struct nvme_local_qpair));
+	if (!lqp) {
+		nvme_err("Allocate local qpair binding failed\n");
+		return NULL;
+	}
+
+	/* Allocate the qpair on the thread node, if known */
+	node_id = nvme_node_id();
+	if (node_id >= cpui.nr_nodes)
+		node_id = NVME_NODE_ID_ANY;
+
+	pthread_mutex_lock(&nvme_local_lock);
+
+	/* Forget the bindings to detached controllers */
+	LIST_FOREACH_SAFE(tmp, &lt->bindings, thread_link, next) {
+		if (!tmp->ctrlr) {
+			LIST_REMOVE(tmp, thread_link);
+			free(tmp);
+		}
+	}
+
+	qpair = nvme_ioqp_local_create(ctrlr, node_id);
+	if (!qpair)
+		qpair = nvme_ioqp_local_select(ctrlr, node_id);
+	if (!qpair) {
+		nvme_err("No I/O qpair available\n");
+		pthread_mutex_unlock(&nvme_local_lock);
+		free(lqp);
+		return NULL;
+	}
+
+	qpair->nr_local_users++;
+	lqp->ctrlr = ctrlr;
+	lqp->qpair = qpair;
+	LIST_INSERT_HEAD(&ctrlr->local_qpairs, lqp, ctrlr_link);
+	LIST_INSERT_HEAD(&lt->bindings, lqp, thread_link);
+
+	pthread_mutex_unlock(&nvme_local_lock);
+
+	nvme_debug("Thread bound to local I/O qpair %u (%u users)\n",
+		   qpair->id, qpair->nr_local_users);
+
+	return qpair;
+}
+
+/*
+ * Get the local I/O qpair of the calling thread.
+ */
+struct nvme_qpair *nvme_ioqp_get_local(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_local_thread *lt = nvme_local_thread;
+	struct nvme_local_qpair *lqp;
+
+	if (likely(lt != NULL)) {
+		LIST_FOREACH(lqp, &lt->bindings, thread_link) {
+			if (lqp->ctrlr == ctrlr)
+				return lqp->qpair;
+		}
+	}
+
+	return nvme_ioqp_local_bind(ctrlr);
+}
+
+/*
+ * Controller detach: invalidate the bindings of all threads
+ * to the controller local qpairs, which can then be released.
+ */
+void nvme_ioqp_local_detach(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_local_qpair *lqp;
+
+	pthread_mutex_lock(&nvme_local_lock);
+
+	while ((lqp = LIST_FIRST(&ctrlr->local_qpairs))) {
+		LIST_REMOVE(lqp, ctrlr_link);
+		lqp->qpair->nr_local_users--;
+		lqp->ctrlr = NULL;
+		lqp->qpair = NULL;
+	}
+
+	pthread_mutex_unlock(&nvme_local_lock);
+}
@@ -221,6 +221,62 @@ int nvme_ns_data(struct nvme_ns *ns, struct nvme_ns_data *nsdata)
 	return 0;
 }
 
+/*
+ * Set namespace IOPS and bandwidth limits.
+ */
+int nvme_ns_set_rate_limit(struct nvme_ns *ns,
+			   const struct nvme_rate_limit *limit)
+{
+	struct nvme_ctrlr *ctrlr;
+
+	ctrlr = nvme_ns_ctrlr_lock(ns);
+	if (!ctrlr) {
+		nvme_err("Invalid name space handle\n");
+		return -EINVAL;
+	}
+
+	nvme_spin_lock(&ns->rl_lock);
+	ns->rate_limited = nvme_rl_set(&ns->rl, limit, nvme_time_mono_nsec());
+	nvme_spin_unlock(&ns->rl_lock);
+
+	pthread_mutex_unlock(&ctrlr->lock);
+
+	return 0;
+}
+
+/*
+ * Get the size of the sectors transferred by an I/O: for extended
+ * LBAs, protection information is transferred with the data unless
+ * inserted and stripped by the controller.
+ */
+static inline uint32_t nvme_ns_io_sector_size(struct nvme_ns *ns,
+					      uint32_t io_flags)
+{
+	if ((ns->flags & NVME_NS_DPS_PI_SUPPORTED) &&
+	    (ns->flags & NVME_NS_EXTENDED_LBA_SUPPORTED) &&
+	    !(io_flags & NVME_IO_FLAGS_PRACT))
+		return ns->sector_size + ns->md_size;
+
+	return ns->sector_size;
+}
+
+/*
+ * Submit an I/O request, applying the namespace and qpair rate limits.
+ * The qpair state can only be checked unlocked if the qpair is owned
+ * by the calling thread: local qpairs are checked under their lock.
+ */
+static inline int nvme_ns_submit_request(struct nvme_ns *ns,
+					 struct nvme_qpair *qpair,
+					 struct nvme_request *req)
+{
+	if (unlikely(qpair->local || ns->rate_limited ||
+		     qpair->rate_limited ||
+		     !STAILQ_EMPTY(&qpair->throttled_req)))
+		return nvme_qpair_submit_limited_request(qpair, ns, req);
+
+	return nvme_qpair_submit_request(qpair, req);
+}
+
 static struct nvme_request *_nvme_ns_rw(struct nvme_ns *ns,
 			struct nvme_qpair *qpair,
 			const struct nvme_payload *payload, uint64_t lba,
@@ -242,20 +298,13 @@ _nvme_ns_split_request(struct nvme_ns *ns,
 		       uint16_t apptag_mask,
 		       uint16_t apptag)
 {
-	uint32_t sector_size = ns->sector_size;
+	uint32_t sector_size = nvme_ns_io_sector_size(ns, io_flags);
 	uint32_t md_size = ns->md_size;
 	uint32_t remaining_lba_count = lba_count;
 	uint32_t offset = 0;
 	uint32_t md_offset = 0;
 	struct nvme_request *child, *tmp;
 
-	if (ns->flags & NVME_NS_DPS_PI_SUPPORTED) {
-		/* for extended LBA only */
-		if ((ns->flags & NVME_NS_EXTENDED_LBA_SUPPORTED)
-		    && !(io_flags & NVME_IO_FLAGS_PRACT))
-			sector_size += ns->md_size;
-	}
-
 	while (remaining_lba_count > 0) {
 
 		lba_count = sectors_per_max_io - (lba & sector_mask);
@@ -314,16 +363,10 @@ static struct nvme_request *_nvme_ns_rw(struct nvme_ns *ns,
 	if (io_flags & 0xFFFF)
 		return NULL;
 
-	sector_size = ns->sector_size;
+	sector_size = nvme_ns_io_sector_size(ns, io_flags);
 	sectors_per_max_io = ns->sectors_per_max_io;
 	sectors_per_stripe = ns->sectors_per_stripe;
 
-	if (ns->flags & NVME_NS_DPS_PI_SUPPORTED)
-		/* for extended LBA only */
-		if ((ns->flags & NVME_NS_EXTENDED_LBA_SUPPORTED) &&
-		    !(io_flags & NVME_IO_FLAGS_PRACT))
-			sector_size += ns->md_size;
-
 	req = nvme_request_allocate(qpair, payload,
 				    lba_count * sector_size, cb_fn, cb_arg);
 	if (req == NULL)
@@ -390,7 +433,7 @@ int nvme_ns_read(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_READ, io_flags, 0, 0);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
@@ -412,7 +455,7 @@ int nvme_ns_read_with_md(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_READ, io_flags, apptag_mask, apptag);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
@@ -439,11 +482,51 @@ int nvme_ns_readv(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_READ, io_flags, 0, 0);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
+
+	return -ENOMEM;
+}
+
+/*
+ * Read or write using a registered buffer.
+ */
+static int nvme_ns_rw_buf(struct nvme_ns *ns, struct nvme_qpair *qpair,
+			  struct nvme_buf *buf, size_t offset,
+			  uint64_t lba, uint32_t lba_count,
+			  nvme_cmd_cb cb_fn, void *cb_arg,
+			  uint32_t opc, unsigned int io_flags)
+{
+	struct nvme_request *req;
+	struct nvme_payload payload;
+
+	if (offset > buf->size ||
+	    (uint64_t)lba_count * nvme_ns_io_sector_size(ns, io_flags) >
+	    buf->size - offset)
+		return -EINVAL;
+
+	payload.type = NVME_PAYLOAD_TYPE_BUF;
+	payload.u.buf.buf = buf;
+	payload.u.buf.offset = offset;
+	payload.md = NULL;
+
+	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
+			  opc, io_flags, 0, 0);
+	if (req != NULL)
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
 
+int nvme_ns_read_buf(struct nvme_ns *ns, struct nvme_qpair *qpair,
+		     struct nvme_buf *buf, size_t offset,
+		     uint64_t lba, uint32_t lba_count,
+		     nvme_cmd_cb cb_fn, void *cb_arg,
+		     unsigned int io_flags)
+{
+	return nvme_ns_rw_buf(ns, qpair, buf, offset, lba, lba_count,
+			      cb_fn, cb_arg, NVME_OPC_READ, io_flags);
+}
+
 int nvme_ns_write(struct nvme_ns *ns, struct nvme_qpair *qpair,
 		  void *buffer,
 		  uint64_t lba, uint32_t lba_count,
@@ -460,7 +543,7 @@ int nvme_ns_write(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_WRITE, io_flags, 0, 0);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
@@ -482,7 +565,7 @@ int nvme_ns_write_with_md(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_WRITE, io_flags, apptag_mask, apptag);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
@@ -509,11 +592,21 @@ int nvme_ns_writev(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	req = _nvme_ns_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg,
 			  NVME_OPC_WRITE, io_flags, 0, 0);
 	if (req != NULL)
-		return nvme_qpair_submit_request(qpair, req);
+		return nvme_ns_submit_request(ns, qpair, req);
 
 	return -ENOMEM;
 }
 
+int nvme_ns_write_buf(struct nvme_ns *ns, struct nvme_qpair *qpair,
+		     struct nvme_buf *buf, size_t offset,
+		     uint64_t lba, uint32_t lba_count,
+		     nvme_cmd_cb cb_fn, void *cb_arg,
+		     unsigned int io_flags)
+{
+	return nvme_ns_rw_buf(ns, qpair, buf, offset, lba, lba_count,
+			      cb_fn, cb_arg, NVME_OPC_WRITE, io_flags);
+}
+
 int nvme_ns_write_zeroes(struct nvme_ns *ns, struct nvme_qpair *qpair,
 			 uint64_t lba, uint32_t lba_count,
 			 nvme_cmd_cb cb_fn, void *cb_arg,
@@ -539,7 +632,7 @@ int nvme_ns_write_zeroes(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	cmd->cdw12 = lba_count - 1;
 	cmd->cdw12 |= io_flags;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_deallocate(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -566,7 +659,7 @@ int nvme_ns_deallocate(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	cmd->cdw10 = ranges - 1;
 	cmd->cdw11 = NVME_DSM_ATTR_DEALLOCATE;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_flush(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -583,7 +676,7 @@ int nvme_ns_flush(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	cmd->opc = NVME_OPC_FLUSH;
 	cmd->nsid = ns->id;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_reservation_register(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -613,7 +706,7 @@ int nvme_ns_reservation_register(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	/* Bits 30-31 */
 	cmd->cdw10 |= (uint32_t)cptpl << 30;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_reservation_release(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -643,7 +736,7 @@ int nvme_ns_reservation_release(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	/* Bits 8-15 */
 	cmd->cdw10 |= (uint32_t)type << 8;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_reservation_acquire(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -673,7 +766,7 @@ int nvme_ns_reservation_acquire(struct nvme_ns *ns, struct nvme_qpair *qpair,
 	/* Bits 8-15 */
 	cmd->cdw10 |= (uint32_t)type << 8;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
 
 int nvme_ns_reservation_report(struct nvme_ns *ns, struct nvme_qpair *qpair,
@@ -698,5 +791,5 @@ int nvme_ns_reservation_report(struct nvme_ns *ns, struct nvme_qpair *qpair,
 
 	cmd->cdw10 = num_dwords;
 
-	return nvme_qpair_submit_request(qpair, req);
+	return nvme_ns_submit_request(ns, qpair, req);
 }
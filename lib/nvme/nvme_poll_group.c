@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+#include "nvme_internal.h"
+
+/*
+ * Initial size of a poll group members array.
+ */
+#define NVME_POLL_GROUP_MEMBERS		8
+
+/*
+ * A poll group and its members are used without any lock:
+ * only the thread which created the group may use it.
+ */
+#ifdef NVME_DEBUG
+static inline void nvme_poll_group_assert_owner(struct nvme_poll_group *pg)
+{
+	if (!pthread_equal(pg->owner, pthread_self()))
+		nvme_panic("Poll group %p used by a non-owner thread\n", pg);
+}
+#else
+#define nvme_poll_group_assert_owner(pg)	do { } while (0)
+#endif
+
+/*
+ * Create a poll group.
+ */
+struct nvme_poll_group *nvme_poll_group_create(void)
+{
+	struct nvme_poll_group *pg;
+
+	pg = calloc(1, sizeof(struct nvme_poll_group));
+	if (!pg) {
+		nvme_err("Allocate poll group failed\n");
+		return NULL;
+	}
+
+	pg->owner = pthread_self();
+
+	return pg;
+}
+
+/*
+ * Destroy a poll group.
+ */
+void nvme_poll_group_destroy(struct nvme_poll_group *pg)
+{
+	unsigned int i;
+
+	if (!pg)
+		return;
+
+	nvme_poll_group_assert_owner(pg);
+
+	for (i = 0; i < pg->nr_members; i++)
+		pg->members[i].qpair->poll_group = NULL;
+
+	free(pg->members);
+	free(pg);
+}
+
+/*
+ * Add an I/O qpair to a poll group.
+ */
+int nvme_poll_group_add(struct nvme_poll_group *pg,
+			struct nvme_qpair *qpair)
+{
+	struct nvme_poll_group_member *members, *m;
+	unsigned int max_members;
+
+	nvme_poll_group_assert_owner(pg);
+
+	if (qpair->poll_group) {
+		nvme_err("qpair %u already belongs to a poll group\n",
+			 qpair->id);
+		return -EBUSY;
+	}
+
+	if (pg->nr_members == pg->max_members) {
+		if (pg->max_members)
+			max_members = pg->max_members << 1;
+		else
+			max_members = NVME_POLL_GROUP_MEMBERS;
+		members = realloc(pg->members,
+				  sizeof(struct nvme_poll_group_member)
+				  * max_members);
+		if (!members) {
+			nvme_err("Allocate poll group members failed\n");
+			return -ENOMEM;
+		}
+		pg->members = members;
+		pg->max_members = max_members;
+	}
+
+	m = &pg->members[pg->nr_members];
+	memset(m, 0, sizeof(struct nvme_poll_group_member));
+	m->qpair = qpair;
+	pg->nr_members++;
+
+	qpair->poll_group = pg;
+
+	return 0;
+}
+
+/*
+ * Remove an I/O qpair from a poll group.
+ */
+int nvme_poll_group_remove(struct nvme_poll_group *pg,
+			   struct nvme_qpair *qpair)
+{
+	unsigned int i;
+
+	nvme_poll_group_assert_owner(pg);
+
+	if (qpair->poll_group != pg)
+		return -ENOENT;
+
+	for (i = 0; i < pg->nr_members; i++)
+		if (pg->members[i].qpair == qpair)
+			break;
+
+	nvme_assert(i < pg->nr_members, "qpair not in its poll group\n");
+
+	pg->nr_members--;
+	memmove(&pg->members[i], &pg->members[i + 1],
+		sizeof(struct nvme_poll_group_member) * (pg->nr_members - i));
+	if (pg->next >= pg->nr_members)
+		pg->next = 0;
+
+	qpair->poll_group = NULL;
+
+	return 0;
+}
+
+/*
+ * Poll for completions the I/O qpairs of a poll group.
+ */
+unsigned int nvme_poll_group_poll(struct nvme_poll_group *pg,
+				  unsigned int budget)
+{
+	struct nvme_poll_group_member *m;
+	unsigned int i, n, nr_pending = 0, share = 0, max = 0, total = 0;
+	unsigned int nr_cpls;
+
+	nvme_poll_group_assert_owner(pg);
+
+	/*
+	 * Skip idle qpairs, and qpairs freed on controller detach,
+	 * which have no trackers (see nvme_ctrlr_release_qpair()).
+	 */
+	for (i = 0; i < pg->nr_members; i++) {
+		m = &pg->members[i];
+		m->completions = 0;
+		m->pending = m->qpair->tr &&
+			nvme_qpair_cpl_pending(m->qpair);
+		if (m->pending)
+			nr_pending++;
+	}
+
+	if (!nr_pending)
+		return 0;
+
+	/*
+	 * Share the budget evenly between the qpairs with completions,
+	 * starting from a different qpair on every call so that the
+	 * remainder of the division is also shared fairly.
+	 */
+	if (budget)
+		share = nvme_max(budget / nr_pending, 1U);
+
+	n = pg->next;
+	for (i = 0; i < pg->nr_members; i++) {
+
+		m = &pg->members[n];
+		if (++n == pg->nr_members)
+			n = 0;
+
+		if (!m->pending)
+			continue;
+
+		if (budget) {
+			if (total == budget)
+				break;
+			max = nvme_min(share, budget - total);
+		}
+
+		m->completions = nvme_qpair_poll(m->qpair, max);
+		total += m->completions;
+
+	}
+
+	/*
+	 * Give the budget left unused by qpairs with few completions
+	 * to the qpairs which used all of their share.
+	 */
+	n = pg->next;
+	for (i = 0; budget && total < budget && i < pg->nr_members; i++) {
+
+		m = &pg->members[n];
+		if (++n == pg->nr_members)
+			n = 0;
+
+		if (!m->pending || m->completions < share)
+			continue;
+
+		nr_cpls = nvme_qpair_poll(m->qpair, budget - total);
+		m->completions += nr_cpls;
+		total += nr_cpls;
+
+	}
+
+	for (i = 0; i < pg->nr_members; i++)
+		pg->members[i].total_completions += pg->members[i].completions;
+
+	if (++pg->next >= pg->nr_members)
+		pg->next = 0;
+
+	return total;
+}
+
+/*
+ * Get information on the members of a poll group.
+ */
+unsigned int nvme_poll_group_stat(struct nvme_poll_group *pg,
+				  struct nvme_poll_group_stat *stats,
+				  unsigned int max_stats)
+{
+	unsigned int i;
+
+	nvme_poll_group_assert_owner(pg);
+
+	for (i = 0; i < pg->nr_members && i < max_stats; i++) {
+		stats[i].qpair = pg->members[i].qpair;
+		stats[i].completions = pg->members[i].completions;
+		stats[i].total_completions =
+			pg->members[i].total_completions;
+	}
+
+	return pg->nr_members;
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+#include "nvme_internal.h"
+
+/*
+ * A QoS pool and its qpairs are used without any lock:
+ * only the thread which created the pool may use it.
+ */
+#ifdef NVME_DEBUG
+static inline void nvme_qos_assert_owner(struct nvme_qos *qos)
+{
+	if (!pthread_equal(qos->owner, pthread_self()))
+		nvme_panic("QoS pool %p used by a non-owner thread\n", qos);
+}
+#else
+#define nvme_qos_assert_owner(qos)	do { } while (0)
+#endif
+
+/*
+ * Create a QoS pool.
+ */
+struct nvme_qos *nvme_qos_create(struct nvme_ctrlr *ctrlr,
+				 const unsigned int *nr_qpairs,
+				 unsigned int qd)
+{
+	struct nvme_qos *qos;
+	unsigned int c, i, n = 0;
+
+	for (c = 0; c < NVME_QOS_CLASSES; c++)
+		n += nr_qpairs[c];
+	if (!n) {
+		nvme_err("No I/O qpair in QoS pool\n");
+		return NULL;
+	}
+
+	qos = calloc(1, sizeof(struct nvme_qos)
+		     + sizeof(struct nvme_qpair *) * n);
+	if (!qos) {
+		nvme_err("Allocate QoS pool failed\n");
+		return NULL;
+	}
+
+	qos->ctrlr = ctrlr;
+	qos->owner = pthread_self();
+
+	for (c = 0, n = 0; c < NVME_QOS_CLASSES; c++) {
+		qos->start[c] = n;
+		for (i = 0; i < nr_qpairs[c]; i++) {
+			qos->qpairs[n] = nvme_ioqp_get(ctrlr, c, qd);
+			if (!qos->qpairs[n]) {
+				nvme_err("Get class %u I/O qpair failed\n", c);
+				qos->start[NVME_QOS_CLASSES] = n;
+				nvme_qos_destroy(qos);
+				return NULL;
+			}
+			n++;
+		}
+	}
+	qos->start[NVME_QOS_CLASSES] = n;
+
+	return qos;
+}
+
+/*
+ * Destroy a QoS pool.
+ */
+void nvme_qos_destroy(struct nvme_qos *qos)
+{
+	unsigned int i;
+
+	if (!qos)
+		return;
+
+	nvme_qos_assert_owner(qos);
+
+	for (i = 0; i < qos->start[NVME_QOS_CLASSES]; i++)
+		nvme_ioqp_release(qos->qpairs[i]);
+
+	free(qos);
+}
+
+/*
+ * Get the least loaded qpair of a priority class.
+ */
+struct nvme_qpair *nvme_qos_get_qpair(struct nvme_qos *qos,
+				      enum nvme_qprio qprio)
+{
+	struct nvme_qpair *qpair;
+	unsigned int c = qprio, i;
+
+	nvme_qos_assert_owner(qos);
+
+	nvme_assert(c < NVME_QOS_CLASSES, "Invalid queue priority\n");
+
+	/*
+	 * If the class has no qpair, fallback to the closest lower
+	 * priority class, or to the closest higher priority class.
+	 */
+	while (c < NVME_QOS_CLASSES && qos->start[c] == qos->start[c + 1])
+		c++;
+	if (c == NVME_QOS_CLASSES) {
+		c = qprio;
+		while (qos->start[c] == qos->start[c + 1])
+			c--;
+	}
+
+	qpair = qos->qpairs[qos->start[c]];
+	for (i = qos->start[c] + 1; i < qos->start[c + 1]; i++)
+		if (qos->qpairs[i]->nr_free_cids > qpair->nr_free_cids)
+			qpair = qos->qpairs[i];
+
+	return qpair;
+}
+
+/*
+ * Poll for completions the qpairs of a QoS pool,
+ * higher priority classes first.
+ */
+unsigned int nvme_qos_poll(struct nvme_qos *qos, unsigned int budget)
+{
+	struct nvme_qpair *qpair;
+	unsigned int i, total = 0;
+
+	nvme_qos_assert_owner(qos);
+
+	for (i = 0; i < qos->start[NVME_QOS_CLASSES]; i++) {
+
+		if (budget && total == budget)
+			break;
+
+		qpair = qos->qpairs[i];
+		if (!nvme_qpair_cpl_pending(qpair))
+			continue;
+
+		total += nvme_qpair_poll(qpair, budget ? budget - total : 0);
+
+	}
+
+	return total;
+}
@@ -160,6 +160,29 @@ static inline bool nvme_qpair_is_io_queue(struct nvme_qpair *qpair)
 	return qpair->id != 0;
 }
 
+/*
+ * I/O qpairs submit and poll path is lockless: it must only be
+ * executed by the thread which obtained the qpair with nvme_ioqp_get().
+ * Debug builds check this. The admin qpair is protected by the
+ * controller lock and local qpairs by their own lock, so they are
+ * not concerned.
+ */
+#ifdef NVME_DEBUG
+static inline void nvme_qpair_assert_owner(struct nvme_qpair *qpair)
+{
+	if (nvme_qpair_is_io_queue(qpair) && !qpair->local &&
+	    !pthread_equal(qpair->owner, pthread_self()))
+		nvme_panic("I/O qpair %u used by a non-owner thread\n",
+			   qpair->id);
+}
+#else
+#define nvme_qpair_assert_owner(qpair)	do { } while (0)
+#endif
+
+static int _nvme_qpair_submit_request(struct nvme_qpair *qpair,
+				      struct nvme_request *req,
+				      bool requeue);
+
 static const char*nvme_qpair_get_string(const struct nvme_qpair_string *strings,
 					uint16_t value)
 {
@@ -309,13 +332,301 @@ static bool nvme_qpair_completion_retry(const struct nvme_cpl *cpl)
 }
 
 static void nvme_qpair_construct_tracker(struct nvme_tracker *tr,
-					 uint16_t cid, uint64_t phys_addr)
+					 uint16_t cid)
 {
-	tr->prp_sgl_bus_addr = phys_addr + offsetof(struct nvme_tracker, u.prp);
 	tr->cid = cid;
-	tr->active = false;
+	tr->list = NVME_PRP_SGL_LIST_NONE;
+	tr->tw_state = NVME_TRACKER_TIMEOUT_NONE;
+}
+
+/*
+ * Grow a qpair PRP lists / SGL descriptors pool by one chunk of lists.
+ */
+static int nvme_qpair_grow_lists(struct nvme_qpair *qpair)
+{
+	struct nvme_prp_sgl_list *lists;
+	unsigned long phys_addr;
+	unsigned int i;
+
+	if (qpair->nr_lists >= qpair->trackers)
+		return -ENOMEM;
+
+	lists = nvme_mem_alloc_node(sizeof(struct nvme_prp_sgl_list)
+				    * NVME_PRP_SGL_LISTS_CHUNK,
+				    sizeof(struct nvme_prp_sgl_list),
+				    qpair->node_id, &phys_addr);
+	if (!lists) {
+		nvme_notice("qpair %d: Allocate PRP/SGL lists failed\n",
+			    qpair->id);
+		return -ENOMEM;
+	}
+
+	nvme_debug("qpair %d: Allocated PRP/SGL lists %u..%u at %p / 0x%lx\n",
+		   qpair->id, qpair->nr_lists,
+		   qpair->nr_lists + NVME_PRP_SGL_LISTS_CHUNK - 1,
+		   lists, phys_addr);
+
+	for (i = 0; i < NVME_PRP_SGL_LISTS_CHUNK; i++) {
+		qpair->lists[qpair->nr_lists] = &lists[i];
+		qpair->lists_bus_addr[qpair->nr_lists] = phys_addr;
+		qpair->free_lists[qpair->nr_free_lists++] = qpair->nr_lists;
+		qpair->nr_lists++;
+		phys_addr += sizeof(struct nvme_prp_sgl_list);
+	}
+
+	return 0;
+}
+
+/*
+ * Free all PRP lists / SGL descriptors of a qpair.
+ */
+static void nvme_qpair_free_lists(struct nvme_qpair *qpair)
+{
+	unsigned int i;
+
+	if (qpair->lists) {
+		for (i = 0; i < qpair->nr_lists;
+		     i += NVME_PRP_SGL_LISTS_CHUNK)
+			nvme_free(qpair->lists[i]);
+		nvme_mem_free_host(qpair->lists);
+		qpair->lists = NULL;
+	}
+
+	nvme_mem_free_host(qpair->lists_bus_addr);
+	qpair->lists_bus_addr = NULL;
+	nvme_mem_free_host(qpair->free_lists);
+	qpair->free_lists = NULL;
+	qpair->nr_lists = 0;
+	qpair->nr_free_lists = 0;
+}
+
+/*
+ * Get a PRP list / SGL descriptors for a tracker. Return -EAGAIN if
+ * no list is available: the request must then wait for a command
+ * using a list to complete.
+ */
+static int nvme_qpair_get_tracker_list(struct nvme_qpair *qpair,
+				       struct nvme_tracker *tr)
+{
+	if (tr->list != NVME_PRP_SGL_LIST_NONE)
+		return 0;
+
+	if (!qpair->nr_free_lists &&
+	    nvme_qpair_grow_lists(qpair) != 0)
+		return -EAGAIN;
+
+	tr->list = qpair->free_lists[--qpair->nr_free_lists];
+
+	return 0;
+}
+
+static inline struct nvme_prp_sgl_list *
+nvme_qpair_tracker_list(struct nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	return qpair->lists[tr->list];
+}
+
+static inline uint64_t
+nvme_qpair_tracker_list_bus_addr(struct nvme_qpair *qpair,
+				 struct nvme_tracker *tr)
+{
+	return qpair->lists_bus_addr[tr->list];
+}
+
+/*
+ * Add a tracker to the timer wheel slot of the tick it expires at.
+ */
+static void nvme_qpair_tw_add(struct nvme_qpair *qpair,
+			      struct nvme_tracker *tr, uint64_t expire)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+	uint16_t *slot = &tw->slots[expire & (NVME_TIMER_WHEEL_SLOTS - 1)];
+
+	tr->tw_expire = expire;
+	tr->tw_prev = NVME_CID_NONE;
+	tr->tw_next = *slot;
+	if (*slot != NVME_CID_NONE)
+		qpair->tr[*slot].tw_prev = tr->cid;
+	*slot = tr->cid;
+}
+
+/*
+ * Remove a tracker from its timer wheel slot.
+ */
+static void nvme_qpair_tw_del(struct nvme_qpair *qpair,
+			      struct nvme_tracker *tr)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+
+	if (tr->tw_prev != NVME_CID_NONE)
+		qpair->tr[tr->tw_prev].tw_next = tr->tw_next;
+	else
+		tw->slots[tr->tw_expire & (NVME_TIMER_WHEEL_SLOTS - 1)] =
+			tr->tw_next;
+
+	if (tr->tw_next != NVME_CID_NONE)
+		qpair->tr[tr->tw_next].tw_prev = tr->tw_prev;
+}
+
+/*
+ * Start a submitted command timeout.
+ */
+static void nvme_qpair_arm_timeout(struct nvme_qpair *qpair,
+				   struct nvme_tracker *tr)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+
+	/* A retried command is already armed */
+	if (tr->tw_state != NVME_TRACKER_TIMEOUT_NONE) {
+		nvme_qpair_tw_del(qpair, tr);
+		if (tr->tw_state == NVME_TRACKER_TIMEOUT_ABORTED)
+			tw->nr_aborts--;
+	}
+
+	tr->tw_state = NVME_TRACKER_TIMEOUT_ARMED;
+	nvme_qpair_tw_add(qpair, tr, nvme_qpair_tw_now(tw) + tw->ticks);
+}
+
+/*
+ * Stop a completed command timeout.
+ */
+static void nvme_qpair_disarm_timeout(struct nvme_qpair *qpair,
+				      struct nvme_tracker *tr)
+{
+	nvme_qpair_tw_del(qpair, tr);
+	if (tr->tw_state == NVME_TRACKER_TIMEOUT_ABORTED)
+		qpair->tw->nr_aborts--;
+	tr->tw_state = NVME_TRACKER_TIMEOUT_NONE;
+}
+
+/*
+ * Test if a command ID is active, i.e. is used by an outstanding command.
+ */
+static inline bool nvme_qpair_cid_active(struct nvme_qpair *qpair,
+					 uint16_t cid)
+{
+	return cid < qpair->trackers &&
+		(qpair->active_cids[cid >> 6] & (1ULL << (cid & 63)));
+}
+
+/*
+ * Get a free tracker. Return NULL if all trackers are in use.
+ */
+static inline struct nvme_tracker *
+nvme_qpair_get_tracker(struct nvme_qpair *qpair)
+{
+	uint16_t cid;
+
+	if (!qpair->nr_free_cids)
+		return NULL;
+
+	cid = qpair->free_cids[--qpair->nr_free_cids];
+	qpair->active_cids[cid >> 6] |= 1ULL << (cid & 63);
+
+	return &qpair->tr[cid];
+}
+
+/*
+ * Return a tracker to the free command IDs stack.
+ */
+static inline void nvme_qpair_put_tracker(struct nvme_qpair *qpair,
+					  struct nvme_tracker *tr)
+{
+	uint16_t cid = tr->cid;
+
+	tr->req = NULL;
+	if (unlikely(tr->tw_state != NVME_TRACKER_TIMEOUT_NONE))
+		nvme_qpair_disarm_timeout(qpair, tr);
+	if (tr->list != NVME_PRP_SGL_LIST_NONE) {
+		qpair->free_lists[qpair->nr_free_lists++] = tr->list;
+		tr->list = NVME_PRP_SGL_LIST_NONE;
+	}
+	qpair->active_cids[cid >> 6] &= ~(1ULL << (cid & 63));
+	qpair->free_cids[qpair->nr_free_cids++] = cid;
+}
+
+/*
+ * Put a request on the qpair request queue, at the head of the
+ * queue to retry a request which was already dequeued.
+ */
+static void nvme_qpair_queue_request(struct nvme_qpair *qpair,
+				     struct nvme_request *req, bool head)
+{
+	if (head) {
+		STAILQ_INSERT_HEAD(&qpair->queued_req, req, stailq);
+	} else {
+		STAILQ_INSERT_TAIL(&qpair->queued_req, req, stailq);
+		qpair->nr_queued_total++;
+	}
+
+	if (++qpair->nr_queued > qpair->max_queued)
+		qpair->max_queued = qpair->nr_queued;
+}
+
+/*
+ * Remove the first request of the qpair request queue.
+ */
+static struct nvme_request *
+nvme_qpair_dequeue_request(struct nvme_qpair *qpair)
+{
+	struct nvme_request *req = STAILQ_FIRST(&qpair->queued_req);
+
+	STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+	qpair->nr_queued--;
+
+	return req;
+}
+
+/*
+ * Free a request and its children, if any.
+ */
+static void nvme_qpair_free_request(struct nvme_request *req)
+{
+	struct nvme_request *child_req, *tmp;
+
+	if (req->child_reqs) {
+		TAILQ_FOREACH_SAFE(child_req, &req->children,
+				   child_tailq, tmp) {
+			nvme_request_remove_child(req, child_req);
+			nvme_request_free(child_req);
+		}
+	}
+
+	nvme_request_free(req);
+}
+
+/*
+ * Get the first active tracker with a command ID equal to or greater
+ * than @cid. Return NULL if there is none.
+ */
+static struct nvme_tracker *
+nvme_qpair_next_active_tracker(struct nvme_qpair *qpair, unsigned int cid)
+{
+	unsigned int i = cid >> 6, nr_words = (qpair->trackers + 63) >> 6;
+	uint64_t w;
+
+	if (cid >= qpair->trackers)
+		return NULL;
+
+	w = qpair->active_cids[i] & (~0ULL << (cid & 63));
+	while (!w) {
+		if (++i >= nr_words)
+			return NULL;
+		w = qpair->active_cids[i];
+	}
+
+	return &qpair->tr[(i << 6) + __builtin_ctzll(w)];
 }
 
+/*
+ * Iterate over the trackers of outstanding commands. The trackers
+ * may be completed (and released) while iterating.
+ */
+#define nvme_qpair_foreach_active_tracker(qpair, tr)			\
+	for ((tr) = nvme_qpair_next_active_tracker((qpair), 0);		\
+	     (tr);							\
+	     (tr) = nvme_qpair_next_active_tracker((qpair), (tr)->cid + 1))
+
 static inline void nvme_qpair_copy_command(struct nvme_cmd *dst,
 					   const struct nvme_cmd *src)
 {
@@ -339,14 +650,50 @@ static inline void nvme_qpair_copy_command(struct nvme_cmd *dst,
 #endif
 }
 
+/*
+ * Publish to the controller all commands copied to the submission queue.
+ */
+static inline void nvme_qpair_ring_sq_doorbell(struct nvme_qpair *qpair)
+{
+	if (qpair->sq_tail == qpair->sq_tail_db)
+		return;
+
+	nvme_wmb();
+	nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	qpair->sq_tail_db = qpair->sq_tail;
+}
+
+/*
+ * Release to the controller all processed completion queue entries.
+ */
+static inline void nvme_qpair_ring_cq_doorbell(struct nvme_qpair *qpair)
+{
+	if (qpair->cq_head == qpair->cq_head_db)
+		return;
+
+	nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+	qpair->cq_head_db = qpair->cq_head;
+}
+
+/*
+ * Number of processed completion queue entries not yet
+ * released to the controller.
+ */
+static inline unsigned int nvme_qpair_cq_unacked(struct nvme_qpair *qpair)
+{
+	if (qpair->cq_head >= qpair->cq_head_db)
+		return qpair->cq_head - qpair->cq_head_db;
+
+	return qpair->entries - qpair->cq_head_db + qpair->cq_head;
+}
+
 static void nvme_qpair_submit_tracker(struct nvme_qpair *qpair,
 				      struct nvme_tracker *tr)
 {
 	struct nvme_request *req = tr->req;
 
 	/*
-	 * Set the tracker active and copy its command
-	 * to the submission queue.
+	 * Copy the tracker command to the submission queue.
 	 */
 	nvme_debug("qpair %d: Submit command, tail %d, cid %d / %d\n",
 		   qpair->id,
@@ -354,27 +701,122 @@ static void nvme_qpair_submit_tracker(struct nvme_qpair *qpair,
 		   (int)tr->cid,
 		   (int)tr->req->cmd.cid);
 
-	qpair->tr[tr->cid].active = true;
-	nvme_qpair_copy_command(&qpair->cmd[qpair->sq_tail], &req->cmd);
+	nvme_qpair_copy_command(nvme_qpair_sq_entry(qpair, qpair->sq_tail),
+				&req->cmd);
 
 	if (++qpair->sq_tail == qpair->entries)
 		qpair->sq_tail = 0;
 
-	nvme_wmb();
-	nvme_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	if (unlikely(qpair->tw != NULL))
+		nvme_qpair_arm_timeout(qpair, tr);
+
+	/* If the qpair is plugged, the doorbell is written on unplug */
+	if (!qpair->plugged)
+		nvme_qpair_ring_sq_doorbell(qpair);
+}
+
+/*
+ * Return completed trackers to the free list and use
+ * them for requests waiting for a free tracker.
+ */
+static void nvme_qpair_release_trackers(struct nvme_qpair *qpair,
+					struct nvme_tracker **trs,
+					unsigned int nr_trs)
+{
+	struct nvme_request *req;
+	unsigned int i;
+
+	for (i = 0; i < nr_trs; i++)
+		nvme_qpair_put_tracker(qpair, trs[i]);
+
+	/*
+	 * If the controller is in the middle of a reset, don't
+	 * try to submit queued requests here - let the reset logic
+	 * handle that instead.
+	 */
+	if (qpair->ctrlr->resetting)
+		return;
+
+	while (nr_trs-- && !STAILQ_EMPTY(&qpair->queued_req)) {
+		req = nvme_qpair_dequeue_request(qpair);
+		_nvme_qpair_submit_request(qpair, req, true);
+	}
+}
+
+/*
+ * Queue the completion of a command without callback function
+ * completed by the library itself, for nvme_qpair_reap() to return it.
+ */
+static void nvme_qpair_add_cpl_rec(struct nvme_qpair *qpair,
+				   void *cb_arg, const struct nvme_cpl *cpl)
+{
+	struct nvme_cpl_rec *rec;
+
+	if (!qpair->cpl_recs) {
+		qpair->cpl_recs = nvme_mem_zalloc_host(sizeof(*rec) *
+						       qpair->num_reqs,
+						       qpair->node_id);
+		if (!qpair->cpl_recs) {
+			nvme_err("QPair %u: allocate completion records "
+				 "failed\n", qpair->id);
+			return;
+		}
+	}
+
+	if (qpair->nr_cpl_recs == qpair->num_reqs) {
+		nvme_err("QPair %u: completion record lost\n", qpair->id);
+		return;
+	}
+
+	rec = &qpair->cpl_recs[(qpair->cpl_recs_head + qpair->nr_cpl_recs) %
+			       qpair->num_reqs];
+	rec->cb_arg = cb_arg;
+	rec->cdw0 = cpl->cdw0;
+	rec->status = cpl->status;
+	qpair->nr_cpl_recs++;
+}
+
+/*
+ * Call the callback function of a completed request. For commands
+ * completed by the library itself (@manual is true), the completion
+ * of a request without callback function is queued for nvme_qpair_reap().
+ */
+static void nvme_qpair_complete_request(struct nvme_qpair *qpair,
+					struct nvme_request *req,
+					const struct nvme_cpl *cpl,
+					bool manual)
+{
+	struct nvme_request *parent;
+
+	if (manual && nvme_request_is_child(req)) {
+		/* Only report completion of the parent request */
+		parent = nvme_request_complete_child(req, cpl);
+		if (parent) {
+			nvme_qpair_complete_request(qpair, parent,
+						    &parent->parent_status,
+						    true);
+			nvme_request_free(parent);
+		}
+		return;
+	}
+
+	if (req->cb_fn)
+		req->cb_fn(req->cb_arg, cpl);
+	else if (manual)
+		nvme_qpair_add_cpl_rec(qpair, req->cb_arg, cpl);
 }
 
 static void nvme_qpair_complete_tracker(struct nvme_qpair *qpair,
 					struct nvme_tracker *tr,
 					struct nvme_cpl *cpl,
-					bool print_on_error)
+					bool print_on_error,
+					bool manual)
 {
 	struct nvme_request *req = tr->req;
 	bool retry, error;
 
 	if (!req) {
 		nvme_crit("tracker has no request\n");
-		qpair->tr[cpl->cid].active = false;
 		goto done;
 	}
 
@@ -386,8 +828,6 @@ static void nvme_qpair_complete_tracker(struct nvme_qpair *qpair,
 		nvme_qpair_print_completion(qpair, cpl);
 	}
 
-	qpair->tr[cpl->cid].active = false;
-
 	if (cpl->cid != req->cmd.cid)
 		nvme_crit("cpl and command CID mismatch (%d / %d)\n",
 			  (int)cpl->cid, (int)req->cmd.cid);
@@ -398,28 +838,12 @@ static void nvme_qpair_complete_tracker(struct nvme_qpair *qpair,
 		return;
 	}
 
-	if (req->cb_fn)
-		req->cb_fn(req->cb_arg, cpl);
+	nvme_qpair_complete_request(qpair, req, cpl, manual);
 
 	nvme_request_free(req);
 
 done:
-	tr->req = NULL;
-
-	LIST_REMOVE(tr, list);
-	LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
-
-	/*
-	 * If the controller is in the middle of a reset, don't
-	 * try to submit queued requests here - let the reset logic
-	 * handle that instead.
-	 */
-	if (!STAILQ_EMPTY(&qpair->queued_req) &&
-	    !qpair->ctrlr->resetting) {
-		req = STAILQ_FIRST(&qpair->queued_req);
-		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
-		nvme_qpair_submit_request(qpair, req);
-	}
+	nvme_qpair_release_trackers(qpair, &tr, 1);
 }
 
 static void nvme_qpair_manual_complete_tracker(struct nvme_qpair *qpair,
@@ -438,7 +862,7 @@ static void nvme_qpair_manual_complete_tracker(struct nvme_qpair *qpair,
 	cpl.status.sc = sc;
 	cpl.status.dnr = dnr;
 
-	nvme_qpair_complete_tracker(qpair, tr, &cpl, print_on_error);
+	nvme_qpair_complete_tracker(qpair, tr, &cpl, print_on_error, true);
 }
 
 static void nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
@@ -461,29 +885,24 @@ static void nvme_qpair_manual_complete_request(struct nvme_qpair *qpair,
 		nvme_qpair_print_completion(qpair, &cpl);
 	}
 
-	if (req->cb_fn)
-		req->cb_fn(req->cb_arg, &cpl);
+	nvme_qpair_complete_request(qpair, req, &cpl, true);
 
-	nvme_request_free(req);
+	/* Children of a request deferred by rate limiting are unsubmitted */
+	nvme_qpair_free_request(req);
 }
 
 static void nvme_qpair_abort_aers(struct nvme_qpair *qpair)
 {
 	struct nvme_tracker *tr;
 
-	tr = LIST_FIRST(&qpair->outstanding_tr);
-	while (tr != NULL) {
+	nvme_qpair_foreach_active_tracker(qpair, tr) {
 		nvme_assert(tr->req != NULL,
 			    "tr->req == NULL in abort_aers\n");
-		if (tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST) {
+		if (tr->req->cmd.opc == NVME_OPC_ASYNC_EVENT_REQUEST)
 			nvme_qpair_manual_complete_tracker(qpair, tr,
 					      NVME_SCT_GENERIC,
 					      NVME_SC_ABORTED_SQ_DELETION,
 					      0, false);
-			tr = LIST_FIRST(&qpair->outstanding_tr);
-			continue;
-		}
-		tr = LIST_NEXT(tr, list);
 	}
 }
 
@@ -511,7 +930,7 @@ static int _nvme_qpair_build_contig_request(struct nvme_qpair *qpair,
 					    struct nvme_request *req,
 					    struct nvme_tracker *tr)
 {
-	uint64_t phys_addr;
+	uint64_t phys_addr, *prp;
 	void *seg_addr;
 	uint32_t nseg, cur_nseg, modulo, unaligned;
 	void *md_payload;
@@ -543,8 +962,12 @@ static int _nvme_qpair_build_contig_request(struct nvme_qpair *qpair,
 		seg_addr = payload + PAGE_SIZE - unaligned;
 		tr->req->cmd.dptr.prp.prp2 = nvme_mem_vtophys(seg_addr);
 	} else if (nseg > 2) {
+		if (nvme_qpair_get_tracker_list(qpair, tr) != 0)
+			return -EAGAIN;
+		prp = nvme_qpair_tracker_list(qpair, tr)->u.prp;
+		tr->req->cmd.dptr.prp.prp2 =
+			nvme_qpair_tracker_list_bus_addr(qpair, tr);
 		cur_nseg = 1;
-		tr->req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_sgl_bus_addr;
 		while (cur_nseg < nseg) {
 			seg_addr = payload + cur_nseg * PAGE_SIZE - unaligned;
 			phys_addr = nvme_mem_vtophys(seg_addr);
@@ -552,7 +975,7 @@ static int _nvme_qpair_build_contig_request(struct nvme_qpair *qpair,
 				_nvme_qpair_req_bad_phys(qpair, tr);
 				return -1;
 			}
-			tr->u.prp[cur_nseg - 1] = phys_addr;
+			prp[cur_nseg - 1] = phys_addr;
 			cur_nseg++;
 		}
 	}
@@ -560,6 +983,44 @@ static int _nvme_qpair_build_contig_request(struct nvme_qpair *qpair,
 	return 0;
 }
 
+/*
+ * Build PRP list describing a payload in a registered buffer,
+ * using the buffer pages pre-translated physical addresses.
+ */
+static int _nvme_qpair_build_buf_request(struct nvme_qpair *qpair,
+					 struct nvme_request *req,
+					 struct nvme_tracker *tr)
+{
+	struct nvme_buf *buf = req->payload.u.buf.buf;
+	size_t ofst = buf->ofst + req->payload.u.buf.offset +
+		req->payload_offset;
+	const phys_addr_t *paddr = &buf->paddr[ofst >> PAGE_SHIFT];
+	uint32_t nseg, cur_nseg, modulo, unaligned;
+	uint64_t *prp;
+
+	unaligned = ofst & (PAGE_SIZE - 1);
+	nseg = req->payload_size >> PAGE_SHIFT;
+	modulo = req->payload_size & (PAGE_SIZE - 1);
+	if (modulo || unaligned)
+		nseg += 1 + ((modulo + unaligned - 1) >> PAGE_SHIFT);
+
+	tr->req->cmd.psdt = NVME_PSDT_PRP;
+	tr->req->cmd.dptr.prp.prp1 = paddr[0] + unaligned;
+	if (nseg == 2) {
+		tr->req->cmd.dptr.prp.prp2 = paddr[1];
+	} else if (nseg > 2) {
+		if (nvme_qpair_get_tracker_list(qpair, tr) != 0)
+			return -EAGAIN;
+		prp = nvme_qpair_tracker_list(qpair, tr)->u.prp;
+		tr->req->cmd.dptr.prp.prp2 =
+			nvme_qpair_tracker_list_bus_addr(qpair, tr);
+		for (cur_nseg = 1; cur_nseg < nseg; cur_nseg++)
+			prp[cur_nseg - 1] = paddr[cur_nseg];
+	}
+
+	return 0;
+}
+
 /*
  * Build SGL list describing scattered payload buffer.
  */
@@ -567,7 +1028,7 @@ static int _nvme_qpair_build_hw_sgl_request(struct nvme_qpair *qpair,
 					    struct nvme_request *req,
 					    struct nvme_tracker *tr)
 {
-	struct nvme_sgl_descriptor *sgl;
+	struct nvme_sgl_descriptor *sgl, *sgl_list = NULL, sgl0;
 	uint64_t phys_addr;
 	uint32_t remaining_transfer_len, length, nseg = 0;
 	int ret;
@@ -586,7 +1047,11 @@ static int _nvme_qpair_build_hw_sgl_request(struct nvme_qpair *qpair,
 	req->payload.u.sgl.reset_sgl_fn(req->payload.u.sgl.cb_arg,
 					req->payload_offset);
 
-	sgl = tr->u.sgl;
+	/*
+	 * Build the first descriptor in place: a list is needed
+	 * only if the payload has more than one segment.
+	 */
+	sgl = &sgl0;
 	req->cmd.psdt = NVME_PSDT_SGL_MPTR_SGL;
 	req->cmd.dptr.sgl1.unkeyed.subtype = 0;
 
@@ -609,6 +1074,14 @@ static int _nvme_qpair_build_hw_sgl_request(struct nvme_qpair *qpair,
 		length = nvme_min(remaining_transfer_len, length);
 		remaining_transfer_len -= length;
 
+		if (nseg == 1) {
+			if (nvme_qpair_get_tracker_list(qpair, tr) != 0)
+				return -EAGAIN;
+			sgl_list = nvme_qpair_tracker_list(qpair, tr)->u.sgl;
+			sgl_list[0] = sgl0;
+			sgl = &sgl_list[1];
+		}
+
 		sgl->unkeyed.type = NVME_SGL_TYPE_DATA_BLOCK;
 		sgl->unkeyed.length = length;
 		sgl->address = phys_addr;
@@ -624,16 +1097,17 @@ static int _nvme_qpair_build_hw_sgl_request(struct nvme_qpair *qpair,
 		 * The whole transfer can be described by a single Scatter
 		 * Gather List descriptor. Use the special case described
 		 * by the spec where SGL1's type is Data Block.
-		 * This means the SGL in the tracker is not used at all,
-		 * so copy the first (and only) SGL element into SGL1.
+		 * This means no SGL list is used at all, so copy the
+		 * first (and only) SGL element into SGL1.
 		 */
 		req->cmd.dptr.sgl1.unkeyed.type = NVME_SGL_TYPE_DATA_BLOCK;
-		req->cmd.dptr.sgl1.address = tr->u.sgl[0].address;
-		req->cmd.dptr.sgl1.unkeyed.length = tr->u.sgl[0].unkeyed.length;
+		req->cmd.dptr.sgl1.address = sgl0.address;
+		req->cmd.dptr.sgl1.unkeyed.length = sgl0.unkeyed.length;
 	} else {
 		/* For now we only support 1 SGL segment in NVMe controller */
 		req->cmd.dptr.sgl1.unkeyed.type = NVME_SGL_TYPE_LAST_SEGMENT;
-		req->cmd.dptr.sgl1.address = tr->prp_sgl_bus_addr;
+		req->cmd.dptr.sgl1.address =
+			nvme_qpair_tracker_list_bus_addr(qpair, tr);
 		req->cmd.dptr.sgl1.unkeyed.length =
 			nseg * sizeof(struct nvme_sgl_descriptor);
 	}
@@ -648,7 +1122,7 @@ static int _nvme_qpair_build_prps_sgl_request(struct nvme_qpair *qpair,
 					      struct nvme_request *req,
 					      struct nvme_tracker *tr)
 {
-	uint64_t phys_addr, prp2 = 0;
+	uint64_t phys_addr, prp2 = 0, *prp = NULL;
 	uint32_t data_transferred, remaining_transfer_len, length;
 	uint32_t nseg, cur_nseg, total_nseg = 0, last_nseg = 0;
 	uint32_t modulo, unaligned, sge_count = 0;
@@ -727,16 +1201,22 @@ static int _nvme_qpair_build_prps_sgl_request(struct nvme_qpair *qpair,
 			else
 				cur_nseg = 0;
 
+			if (!prp) {
+				if (nvme_qpair_get_tracker_list(qpair, tr) != 0)
+					return -EAGAIN;
+				prp = nvme_qpair_tracker_list(qpair, tr)->u.prp;
+			}
+
 			tr->req->cmd.dptr.prp.prp2 =
-				(uint64_t)tr->prp_sgl_bus_addr;
+				nvme_qpair_tracker_list_bus_addr(qpair, tr);
 
 			while (cur_nseg < nseg) {
 				if (prp2) {
-					tr->u.prp[0] = prp2;
-					tr->u.prp[last_nseg + 1] = phys_addr +
+					prp[0] = prp2;
+					prp[last_nseg + 1] = phys_addr +
 						cur_nseg * PAGE_SIZE - unaligned;
 				} else {
-					tr->u.prp[last_nseg] = phys_addr +
+					prp[last_nseg] = phys_addr +
 						cur_nseg * PAGE_SIZE - unaligned;
 				}
 				last_nseg++;
@@ -750,7 +1230,7 @@ static int _nvme_qpair_build_prps_sgl_request(struct nvme_qpair *qpair,
 
 static void _nvme_qpair_admin_qpair_enable(struct nvme_qpair *qpair)
 {
-	struct nvme_tracker *tr, *tr_temp;
+	struct nvme_tracker *tr;
 
 	/*
 	 * Manually abort each outstanding admin command.  Do not retry
@@ -758,7 +1238,7 @@ static void _nvme_qpair_admin_qpair_enable(struct nvme_qpair *qpair)
 	 * a controller reset and its likely the context in which the
 	 * command was issued no longer applies.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	nvme_qpair_foreach_active_tracker(qpair, tr) {
 		nvme_info("Aborting outstanding admin command\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST,
@@ -770,17 +1250,16 @@ static void _nvme_qpair_admin_qpair_enable(struct nvme_qpair *qpair)
 
 static void _nvme_qpair_io_qpair_enable(struct nvme_qpair *qpair)
 {
-	struct nvme_tracker *tr, *temp;
+	struct nvme_tracker *tr;
 	struct nvme_request *req;
 
 	qpair->enabled = true;
 
-	qpair->ctrlr->enabled_io_qpairs++;
+	nvme_atomic_inc(&qpair->ctrlr->enabled_io_qpairs);
 
 	/* Manually abort each queued I/O. */
 	while (!STAILQ_EMPTY(&qpair->queued_req)) {
-		req = STAILQ_FIRST(&qpair->queued_req);
-		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+		req = nvme_qpair_dequeue_request(qpair);
 		nvme_info("Aborting queued I/O command\n");
 		nvme_qpair_manual_complete_request(qpair, req, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST,
@@ -788,7 +1267,7 @@ static void _nvme_qpair_io_qpair_enable(struct nvme_qpair *qpair)
 	}
 
 	/* Manually abort each outstanding I/O. */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, temp) {
+	nvme_qpair_foreach_active_tracker(qpair, tr) {
 		nvme_info("Aborting outstanding I/O command\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST,
@@ -806,43 +1285,175 @@ static inline void _nvme_qpair_io_qpair_disable(struct nvme_qpair *qpair)
 {
 	qpair->enabled = false;
 
-	qpair->ctrlr->enabled_io_qpairs--;
+	nvme_atomic_dec(&qpair->ctrlr->enabled_io_qpairs);
 }
 
 /*
- * Reserve room for the submission queue
- * in the controller memory buffer
+ * Free the segments (NULL terminated array) and
+ * the PRP list of a non-contiguous queue.
  */
-static int nvme_ctrlr_reserve_sq_in_cmb(struct nvme_ctrlr *ctrlr,
-					uint16_t entries,
-					uint64_t aligned, uint64_t *offset)
+static void nvme_qpair_free_queue_segs(void **segs, uint64_t *prp_list)
 {
-	uint64_t round_offset;
-	const uint64_t length = entries * sizeof(struct nvme_cmd);
+	unsigned int i;
 
-	round_offset = ctrlr->cmb_current_offset;
-	round_offset = (round_offset + (aligned - 1)) & ~(aligned - 1);
-
-	if (round_offset + length > ctrlr->cmb_size)
-		return -1;
-
-	*offset = round_offset;
-	ctrlr->cmb_current_offset = round_offset + length;
+	if (segs) {
+		for (i = 0; segs[i]; i++)
+			nvme_free(segs[i]);
+		free(segs);
+	}
 
-	return 0;
+	nvme_free(prp_list);
 }
 
 /*
- * Initialize a queue pair on the host side.
+ * Allocate a non-contiguous queue of @size bytes made of
+ * NVME_QUEUE_SEG_SIZE segments, and the PRP list describing
+ * the queue pages to the controller.
  */
-int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
-			 enum nvme_qprio qprio,
-			 uint16_t entries, uint16_t trackers)
+static void **nvme_qpair_alloc_queue_segs(struct nvme_qpair *qpair,
+					  size_t size,
+					  uint64_t **prp_list,
+					  phys_addr_t *prp_list_bus_addr)
 {
-	volatile uint32_t *doorbell_base;
-	struct nvme_tracker *tr;
-	uint64_t offset;
-	unsigned long phys_addr = 0;
+	unsigned int nr_segs = nvme_align_up(size, NVME_QUEUE_SEG_SIZE)
+		>> NVME_QUEUE_SEG_SHIFT;
+	size_t nr_pages = nvme_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+	unsigned long bus_addr;
+	size_t seg_size, ofst;
+	unsigned int i, p = 0;
+	void **segs;
+
+	segs = calloc(nr_segs + 1, sizeof(void *));
+	if (!segs)
+		return NULL;
+
+	/* A queue PRP list cannot be chained: allocate it contiguous */
+	*prp_list = nvme_mem_alloc_node(nr_pages * sizeof(uint64_t),
+					PAGE_SIZE, qpair->node_id,
+					&bus_addr);
+	if (!*prp_list)
+		goto err;
+	*prp_list_bus_addr = bus_addr;
+
+	for (i = 0; i < nr_segs; i++) {
+
+		seg_size = size - ((size_t)i << NVME_QUEUE_SEG_SHIFT);
+		if (seg_size > NVME_QUEUE_SEG_SIZE)
+			seg_size = NVME_QUEUE_SEG_SIZE;
+		seg_size = nvme_align_up(seg_size, PAGE_SIZE);
+
+		segs[i] = nvme_mem_alloc_node(seg_size, PAGE_SIZE,
+					      qpair->node_id, &bus_addr);
+		if (!segs[i])
+			goto err;
+		memset(segs[i], 0, seg_size);
+
+		for (ofst = 0; ofst < seg_size; ofst += PAGE_SIZE)
+			(*prp_list)[p++] = bus_addr + ofst;
+
+	}
+
+	nvme_debug("qpair %d: Allocated %zu B non-contiguous queue, "
+		   "%u segments, PRP list 0x%llx\n",
+		   qpair->id, size, nr_segs, *prp_list_bus_addr);
+
+	return segs;
+
+err:
+	nvme_qpair_free_queue_segs(segs, *prp_list);
+	*prp_list = NULL;
+
+	return NULL;
+}
+
+/*
+ * Allocate a submission or completion queue of @size bytes. The queue
+ * is physically contiguous if possible. Otherwise, if the controller
+ * allows it, the queue is made of segments.
+ */
+static int nvme_qpair_alloc_queue(struct nvme_qpair *qpair, size_t size,
+				  void **queue, void ***segs,
+				  uint64_t **prp_list, phys_addr_t *bus_addr)
+{
+	unsigned long paddr;
+
+	if (size <= NVME_QUEUE_CONTIG_MAX_SIZE) {
+		*queue = nvme_mem_alloc_node(size, PAGE_SIZE,
+					     qpair->node_id, &paddr);
+		if (*queue) {
+			memset(*queue, 0, size);
+			*bus_addr = paddr;
+			return 0;
+		}
+	}
+
+	/* The admin queue must always be contiguous */
+	if (nvme_qpair_is_admin_queue(qpair) ||
+	    (qpair->ctrlr->flags & NVME_CTRLR_CONTIG_QUEUES))
+		return -ENOMEM;
+
+	*segs = nvme_qpair_alloc_queue_segs(qpair, size, prp_list, bus_addr);
+	if (!*segs)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Zero a submission or completion queue.
+ */
+static void nvme_qpair_zero_queue(void *queue, void **segs, size_t size)
+{
+	size_t len;
+	unsigned int i;
+
+	if (!segs) {
+		memset(queue, 0, size);
+		return;
+	}
+
+	for (i = 0; size; i++) {
+		len = size > NVME_QUEUE_SEG_SIZE ? NVME_QUEUE_SEG_SIZE : size;
+		memset(segs[i], 0, len);
+		size -= len;
+	}
+}
+
+/*
+ * Reserve room for the submission queue
+ * in the controller memory buffer
+ */
+static int nvme_ctrlr_reserve_sq_in_cmb(struct nvme_ctrlr *ctrlr,
+					uint32_t entries,
+					uint64_t aligned, uint64_t *offset)
+{
+	uint64_t round_offset;
+	const uint64_t length = entries * sizeof(struct nvme_cmd);
+
+	round_offset = ctrlr->cmb_current_offset;
+	round_offset = (round_offset + (aligned - 1)) & ~(aligned - 1);
+
+	if (round_offset + length > ctrlr->cmb_size)
+		return -1;
+
+	*offset = round_offset;
+	ctrlr->cmb_current_offset = round_offset + length;
+
+	return 0;
+}
+
+/*
+ * Initialize a queue pair on the host side.
+ */
+int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
+			 enum nvme_qprio qprio,
+			 uint32_t entries, uint16_t trackers,
+			 unsigned int node_id)
+{
+	volatile uint32_t *doorbell_base;
+	struct nvme_tracker *tr;
+	unsigned int max_lists;
+	uint64_t offset;
 	uint16_t i;
 	int ret;
 
@@ -853,7 +1464,20 @@ int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
 	qpair->trackers = trackers;
 	qpair->qprio = qprio;
 	qpair->sq_in_cmb = false;
+	qpair->plugged = false;
+	qpair->cq_db_batch = 1;
+	qpair->backpressure = false;
+	qpair->nr_queued = 0;
+	qpair->max_queued = 0;
+	qpair->nr_queued_total = 0;
+	qpair->nr_rejected = 0;
+	qpair->rate_limited = false;
+	qpair->nr_throttled = 0;
+	qpair->cpl_recs_head = 0;
+	qpair->nr_cpl_recs = 0;
+	nvme_atomic_set(&qpair->reset_pending, 0);
 	qpair->ctrlr = ctrlr;
+	qpair->node_id = node_id;
 
 	if (ctrlr->opts.use_cmb_sqs) {
 		/*
@@ -878,29 +1502,32 @@ int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
 
 	if (qpair->sq_in_cmb == false) {
 
-		qpair->cmd =
-			nvme_mem_alloc_node(sizeof(struct nvme_cmd) * entries,
-				    sysconf(_SC_PAGESIZE), NVME_NODE_ID_ANY,
-				    (unsigned long *) &qpair->cmd_bus_addr);
-		if (!qpair->cmd) {
+		ret = nvme_qpair_alloc_queue(qpair,
+					     sizeof(struct nvme_cmd) * entries,
+					     (void **)&qpair->cmd,
+					     (void ***)&qpair->sq_segs,
+					     &qpair->sq_prp_list,
+					     &qpair->cmd_bus_addr);
+		if (ret != 0) {
 			nvme_err("Allocate qpair commands failed\n");
 			goto fail;
 		}
-		memset(qpair->cmd, 0, sizeof(struct nvme_cmd) * entries);
 
 		nvme_debug("Allocated qpair %d cmd %p / 0x%llx\n",
 			   qpair->id,
 			   qpair->cmd, qpair->cmd_bus_addr);
 	}
 
-	qpair->cpl = nvme_mem_alloc_node(sizeof(struct nvme_cpl) * entries,
-				 sysconf(_SC_PAGESIZE), NVME_NODE_ID_ANY,
-				 (unsigned long *) &qpair->cpl_bus_addr);
-	if (!qpair->cpl) {
+	ret = nvme_qpair_alloc_queue(qpair,
+				     sizeof(struct nvme_cpl) * entries,
+				     (void **)&qpair->cpl,
+				     (void ***)&qpair->cq_segs,
+				     &qpair->cq_prp_list,
+				     &qpair->cpl_bus_addr);
+	if (ret != 0) {
 		nvme_err("Allocate qpair completions failed\n");
 		goto fail;
 	}
-	memset(qpair->cpl, 0, sizeof(struct nvme_cpl) * entries);
 
 	nvme_debug("Allocated qpair %d cpl at %p / 0x%llx\n",
 		   qpair->id,
@@ -913,10 +1540,9 @@ int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
 	qpair->cq_hdbl = doorbell_base +
 		(2 * qpair->id + 1) * ctrlr->doorbell_stride_u32;
 
-	LIST_INIT(&qpair->free_tr);
-	LIST_INIT(&qpair->outstanding_tr);
 	STAILQ_INIT(&qpair->free_req);
 	STAILQ_INIT(&qpair->queued_req);
+	STAILQ_INIT(&qpair->throttled_req);
 
 	/* Request pool */
 	if (nvme_request_pool_construct(qpair)) {
@@ -925,31 +1551,54 @@ int nvme_qpair_construct(struct nvme_ctrlr *ctrlr, struct nvme_qpair *qpair,
 	}
 
 	/*
-	 * Reserve space for all of the trackers in a single allocation.
-	 * struct nvme_tracker must be padded so that its size is already
-	 * a power of 2. This ensures the PRP list embedded in the nvme_tracker
-	 * object will not span a 4KB boundary, while allowing access to
-	 * trackers in tr[] via normal array indexing.
+	 * Trackers are not accessed by the controller: PRP lists and
+	 * SGL descriptors are allocated separately from DMA-able memory.
 	 */
-	qpair->tr = nvme_mem_alloc_node(sizeof(struct nvme_tracker) * trackers,
-					sizeof(struct nvme_tracker),
-					NVME_NODE_ID_ANY, &phys_addr);
+	qpair->tr = nvme_mem_zalloc_host(sizeof(struct nvme_tracker) * trackers,
+					 node_id);
 	if (!qpair->tr) {
 		nvme_err("Allocate request trackers failed\n");
 		goto fail;
 	}
-	memset(qpair->tr, 0, sizeof(struct nvme_tracker) * trackers);
 
-	nvme_debug("Allocated qpair %d trackers at %p / 0x%lx\n",
-		   qpair->id, qpair->tr, phys_addr);
+	qpair->free_cids = nvme_mem_zalloc_host(sizeof(uint16_t) * trackers,
+						node_id);
+	qpair->active_cids =
+		nvme_mem_zalloc_host(sizeof(uint64_t) * ((trackers + 63) >> 6),
+				     node_id);
+	if (!qpair->free_cids || !qpair->active_cids) {
+		nvme_err("Allocate tracker command IDs failed\n");
+		goto fail;
+	}
 
+	/* Stack free command IDs so that CID 0 is used first */
+	qpair->nr_free_cids = trackers;
 	for (i = 0; i < trackers; i++) {
 		tr = &qpair->tr[i];
-		nvme_qpair_construct_tracker(tr, i, phys_addr);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
-		phys_addr += sizeof(struct nvme_tracker);
+		nvme_qpair_construct_tracker(tr, i);
+		qpair->free_cids[trackers - 1 - i] = i;
+	}
+
+	/*
+	 * PRP lists / SGL descriptors pool, with an initial chunk of lists.
+	 * The number of lists is rounded up to a number of chunks.
+	 */
+	max_lists = nvme_align_up(trackers, NVME_PRP_SGL_LISTS_CHUNK);
+	qpair->lists = nvme_mem_zalloc_host(sizeof(struct nvme_prp_sgl_list *)
+					    * max_lists, node_id);
+	qpair->lists_bus_addr =
+		nvme_mem_zalloc_host(sizeof(phys_addr_t) * max_lists, node_id);
+	qpair->free_lists =
+		nvme_mem_zalloc_host(sizeof(*qpair->free_lists) * max_lists,
+				     node_id);
+	if (!qpair->lists || !qpair->lists_bus_addr || !qpair->free_lists) {
+		nvme_err("Allocate PRP/SGL lists pool failed\n");
+		goto fail;
 	}
 
+	if (nvme_qpair_grow_lists(qpair) != 0)
+		goto fail;
+
 	nvme_qpair_reset(qpair);
 
 	return 0;
@@ -962,7 +1611,7 @@ fail:
 
 void nvme_qpair_destroy(struct nvme_qpair *qpair)
 {
-	if (nvme_qpair_is_admin_queue(qpair))
+	if (nvme_qpair_is_admin_queue(qpair) && qpair->active_cids)
 		_nvme_qpair_admin_qpair_destroy(qpair);
 
 	if (qpair->cmd && !qpair->sq_in_cmb) {
@@ -973,24 +1622,48 @@ void nvme_qpair_destroy(struct nvme_qpair *qpair)
 		nvme_free(qpair->cpl);
 		qpair->cpl = NULL;
 	}
-	if (qpair->tr) {
-		nvme_free(qpair->tr);
-		qpair->tr = NULL;
-	}
+	nvme_qpair_free_queue_segs((void **)qpair->sq_segs,
+				   qpair->sq_prp_list);
+	qpair->sq_segs = NULL;
+	qpair->sq_prp_list = NULL;
+	nvme_qpair_free_queue_segs((void **)qpair->cq_segs,
+				   qpair->cq_prp_list);
+	qpair->cq_segs = NULL;
+	qpair->cq_prp_list = NULL;
+	nvme_mem_free_host(qpair->tr);
+	qpair->tr = NULL;
+	nvme_qpair_free_lists(qpair);
+	free(qpair->tw);
+	qpair->tw = NULL;
+	nvme_mem_free_host(qpair->free_cids);
+	qpair->free_cids = NULL;
+	nvme_mem_free_host(qpair->active_cids);
+	qpair->active_cids = NULL;
+	nvme_mem_free_host(qpair->cpl_recs);
+	qpair->cpl_recs = NULL;
 	nvme_request_pool_destroy(qpair);
 
 }
 
 bool nvme_qpair_enabled(struct nvme_qpair *qpair)
 {
+	if (unlikely(nvme_atomic_read(&qpair->reset_pending)))
+		nvme_ctrlr_reset_qpair(qpair->ctrlr, qpair);
+
 	if (!qpair->enabled && !qpair->ctrlr->resetting)
 		nvme_qpair_enable(qpair);
 
 	return qpair->enabled;
 }
 
-int nvme_qpair_submit_request(struct nvme_qpair *qpair,
-			      struct nvme_request *req)
+/*
+ * Submit a request, or queue it if it cannot be submitted now.
+ * A request taken from the qpair request queue (@requeue is true)
+ * is put back at the head of the queue to keep submissions ordered.
+ */
+static int _nvme_qpair_submit_request(struct nvme_qpair *qpair,
+				      struct nvme_request *req,
+				      bool requeue)
 {
 	struct nvme_tracker *tr;
 	struct nvme_request *child_req, *tmp;
@@ -998,8 +1671,10 @@ int nvme_qpair_submit_request(struct nvme_qpair *qpair,
 	bool child_req_failed = false;
 	int ret = 0;
 
+	nvme_qpair_assert_owner(qpair);
+
 	if (ctrlr->failed) {
-		nvme_request_free(req);
+		nvme_qpair_free_request(req);
 		return -ENXIO;
 	}
 
@@ -1014,7 +1689,9 @@ int nvme_qpair_submit_request(struct nvme_qpair *qpair,
 		 */
 		TAILQ_FOREACH_SAFE(child_req, &req->children, child_tailq, tmp) {
 			if (!child_req_failed) {
-				ret = nvme_qpair_submit_request(qpair, child_req);
+				ret = _nvme_qpair_submit_request(qpair,
+								 child_req,
+								 requeue);
 				if (ret != 0)
 					child_req_failed = true;
 			} else {
@@ -1028,8 +1705,7 @@ int nvme_qpair_submit_request(struct nvme_qpair *qpair,
 		return ret;
 	}
 
-	tr = LIST_FIRST(&qpair->free_tr);
-	if (tr == NULL || !qpair->enabled) {
+	if (!qpair->nr_free_cids || !qpair->enabled) {
 		/*
 		 * No tracker is available, or the qpair is disabled due
 		 * to an in-progress controller-level reset.
@@ -1038,21 +1714,31 @@ int nvme_qpair_submit_request(struct nvme_qpair *qpair,
 		 * processed when a tracker frees up via a command
 		 * completion or when the controller reset is completed.
 		 */
-		STAILQ_INSERT_TAIL(&qpair->queued_req, req, stailq);
+		nvme_qpair_queue_request(qpair, req, requeue);
 		return 0;
 	}
 
-	/* remove tr from free_tr */
-	LIST_REMOVE(tr, list);
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
+	tr = nvme_qpair_get_tracker(qpair);
 	tr->req = req;
 	req->cmd.cid = tr->cid;
 
+	/*
+	 * The controller must always have room in the completion queue
+	 * for all outstanding commands: release deferred completion
+	 * queue entries if needed.
+	 */
+	if (unlikely(qpair->cq_head != qpair->cq_head_db) &&
+	    nvme_qpair_cq_unacked(qpair) + qpair->trackers -
+	    qpair->nr_free_cids >= qpair->entries)
+		nvme_qpair_ring_cq_doorbell(qpair);
+
 	if (req->payload_size == 0) {
 		/* Null payload - leave PRP fields zeroed */
 		ret = 0;
 	} else if (req->payload.type == NVME_PAYLOAD_TYPE_CONTIG) {
 		ret = _nvme_qpair_build_contig_request(qpair, req, tr);
+	} else if (req->payload.type == NVME_PAYLOAD_TYPE_BUF) {
+		ret = _nvme_qpair_build_buf_request(qpair, req, tr);
 	} else if (req->payload.type == NVME_PAYLOAD_TYPE_SGL) {
 		if (ctrlr->flags & NVME_CTRLR_SGL_SUPPORTED)
 			ret = _nvme_qpair_build_hw_sgl_request(qpair, req, tr);
@@ -1065,19 +1751,310 @@ int nvme_qpair_submit_request(struct nvme_qpair *qpair,
 		ret = -EINVAL;
 	}
 
+	if (ret == -EAGAIN) {
+		/*
+		 * No PRP list or SGL available: put the request back on
+		 * the qpair's request queue to be processed when a command
+		 * using a list completes.
+		 */
+		nvme_qpair_put_tracker(qpair, tr);
+		memset(&req->cmd.dptr, 0, sizeof(req->cmd.dptr));
+		nvme_qpair_queue_request(qpair, req, requeue);
+		return 0;
+	}
+
 	if (ret == 0)
 		nvme_qpair_submit_tracker(qpair, tr);
 
 	return ret;
 }
 
-unsigned int nvme_qpair_poll(struct nvme_qpair *qpair,
-			     unsigned int max_completions)
+/*
+ * In backpressure mode, do not queue requests that cannot be
+ * submitted immediately: reject them for the caller to retry once
+ * commands have completed. A splitted request is accepted only if all
+ * of its children can be submitted. Requests are still queued while
+ * the qpair is disabled by a controller reset.
+ * Return true if the request was rejected (and freed).
+ */
+static inline bool nvme_qpair_reject_request(struct nvme_qpair *qpair,
+					     struct nvme_request *req)
+{
+	if (unlikely(qpair->backpressure) &&
+	    !qpair->ctrlr->failed && nvme_qpair_enabled(qpair) &&
+	    (!STAILQ_EMPTY(&qpair->queued_req) ||
+	     qpair->nr_free_cids < (req->child_reqs ? req->child_reqs : 1))) {
+		nvme_qpair_free_request(req);
+		qpair->nr_rejected++;
+		return true;
+	}
+
+	return false;
+}
+
+static inline int nvme_qpair_submit_unlocked(struct nvme_qpair *qpair,
+					     struct nvme_request *req)
+{
+	if (nvme_qpair_reject_request(qpair, req))
+		return -EAGAIN;
+
+	return _nvme_qpair_submit_request(qpair, req, false);
+}
+
+int nvme_qpair_submit_request(struct nvme_qpair *qpair,
+			      struct nvme_request *req)
+{
+	int ret;
+
+	nvme_qpair_lock(qpair);
+	ret = nvme_qpair_submit_unlocked(qpair, req);
+	nvme_qpair_unlock(qpair);
+
+	return ret;
+}
+
+/*
+ * Check the rate limits of a qpair and of a namespace and, if the
+ * request can be submitted now, consume the request tokens.
+ */
+static bool nvme_qpair_rl_admit(struct nvme_qpair *qpair,
+				struct nvme_ns *ns,
+				struct nvme_request *req,
+				uint64_t now)
+{
+	bool admit;
+
+	if (qpair->rate_limited) {
+		nvme_rl_refill(&qpair->rl, now);
+		if (!nvme_rl_check(&qpair->rl))
+			return false;
+	}
+
+	if (ns && ns->rate_limited) {
+		nvme_spin_lock(&ns->rl_lock);
+		nvme_rl_refill(&ns->rl, now);
+		admit = nvme_rl_check(&ns->rl);
+		if (admit)
+			nvme_rl_consume(&ns->rl, req->payload_size);
+		nvme_spin_unlock(&ns->rl_lock);
+		if (!admit)
+			return false;
+	}
+
+	if (qpair->rate_limited)
+		nvme_rl_consume(&qpair->rl, req->payload_size);
+
+	return true;
+}
+
+/*
+ * Submit a request subject to the qpair and namespace rate limits:
+ * over the limits, the request is deferred until nvme_qpair_poll()
+ * finds enough tokens to submit it. The backpressure check is done
+ * first, so that a rejected request does not consume tokens.
+ * This is also the submission path of local qpairs, for which the
+ * rate limit state can only be checked with the qpair locked.
+ */
+int nvme_qpair_submit_limited_request(struct nvme_qpair *qpair,
+				      struct nvme_ns *ns,
+				      struct nvme_request *req)
+{
+	int ret = 0;
+
+	nvme_qpair_lock(qpair);
+
+	nvme_qpair_assert_owner(qpair);
+
+	if (nvme_qpair_reject_request(qpair, req)) {
+		ret = -EAGAIN;
+	} else if (STAILQ_EMPTY(&qpair->throttled_req) &&
+		   ((!qpair->rate_limited && !(ns && ns->rate_limited)) ||
+		    nvme_qpair_rl_admit(qpair, ns, req,
+					nvme_time_mono_nsec()))) {
+		ret = _nvme_qpair_submit_request(qpair, req, false);
+	} else {
+		req->ns = ns;
+		STAILQ_INSERT_TAIL(&qpair->throttled_req, req, stailq);
+		qpair->nr_throttled++;
+	}
+
+	nvme_qpair_unlock(qpair);
+
+	return ret;
+}
+
+/*
+ * Submit the requests deferred by rate limiting which are
+ * within the limits, as long as trackers are available.
+ */
+static void nvme_qpair_submit_throttled(struct nvme_qpair *qpair)
+{
+	struct nvme_request *req;
+	uint64_t now = nvme_time_mono_nsec();
+
+	while (!STAILQ_EMPTY(&qpair->throttled_req) &&
+	       qpair->nr_free_cids && !qpair->ctrlr->failed) {
+
+		req = STAILQ_FIRST(&qpair->throttled_req);
+		if (!nvme_qpair_rl_admit(qpair, req->ns, req, now))
+			break;
+
+		STAILQ_REMOVE_HEAD(&qpair->throttled_req, stailq);
+		qpair->nr_throttled--;
+		_nvme_qpair_submit_request(qpair, req, false);
+
+	}
+}
+
+/*
+ * Completion of the abort command of a timed out command.
+ */
+static void nvme_qpair_abort_cb(void *arg, const struct nvme_cpl *cpl)
+{
+	uint32_t cmd = (uintptr_t)arg;
+
+	if (nvme_cpl_is_error(cpl))
+		nvme_notice("qpair %u: abort command cid %u failed\n",
+			    cmd >> 16, cmd & 0xFFFF);
+	else if (cpl->cdw0 & 0x1)
+		nvme_notice("qpair %u: command cid %u not aborted\n",
+			    cmd >> 16, cmd & 0xFFFF);
+}
+
+/*
+ * Handle an expired command: the first time, call the timeout callback
+ * and abort the command. If the command is not completed a timeout
+ * period after being aborted, return true to reset the controller.
+ * The abort command is only submitted if the controller lock is free,
+ * so that the I/O path does not wait for admin commands: otherwise,
+ * the command is handled again on the next tick.
+ */
+static bool nvme_qpair_timeout_tracker(struct nvme_qpair *qpair,
+				       struct nvme_tracker *tr,
+				       uint64_t now)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
+	struct nvme_request *req = tr->req;
+	void *cmd_cb_arg;
+	int ret;
+
+	nvme_qpair_tw_del(qpair, tr);
+
+	if (tr->tw_state == NVME_TRACKER_TIMEOUT_ABORTED) {
+		nvme_err("qpair %u: aborted command cid %u not completed\n",
+			 qpair->id, tr->cid);
+		tr->tw_state = NVME_TRACKER_TIMEOUT_NONE;
+		tw->nr_aborts--;
+		return true;
+	}
+
+	if (pthread_mutex_trylock(&ctrlr->lock) != 0) {
+		nvme_qpair_tw_add(qpair, tr, now + 1);
+		return false;
+	}
+
+	nvme_notice("qpair %u: command cid %u timed out\n",
+		    qpair->id, tr->cid);
+
+	tr->tw_state = NVME_TRACKER_TIMEOUT_ABORTED;
+	tw->nr_aborts++;
+	nvme_qpair_tw_add(qpair, tr, now + tw->ticks);
+
+	/*
+	 * Do not wait for the abort command completion: if the
+	 * controller is not responding, the next timeout will
+	 * reset it.
+	 */
+	ret = nvme_admin_abort_cmd(ctrlr, tr->cid, qpair->id,
+				   nvme_qpair_abort_cb,
+				   (void *)(uintptr_t)((qpair->id << 16) | tr->cid));
+	pthread_mutex_unlock(&ctrlr->lock);
+	if (ret != 0)
+		nvme_notice("qpair %u: submit abort command for cid %u "
+			    "failed %d\n", qpair->id, tr->cid, ret);
+
+	/* The callback may use the controller lock */
+	if (tw->cb_fn) {
+		if (nvme_request_is_child(req))
+			cmd_cb_arg = req->parent->cb_arg;
+		else
+			cmd_cb_arg = req->cb_arg;
+		tw->cb_fn(tw->cb_arg, qpair, cmd_cb_arg);
+	}
+
+	return false;
+}
+
+/*
+ * Process the timer wheel ticks elapsed since the last check.
+ */
+static void nvme_qpair_check_timeouts(struct nvme_qpair *qpair)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
+	uint64_t now = nvme_qpair_tw_now(tw);
+	struct nvme_tracker *tr;
+	uint16_t cid;
+
+	if (now < tw->tick)
+		return;
+
+	/*
+	 * Process completions of abort commands (already completed
+	 * by the primary process for secondary processes).
+	 */
+	if (tw->nr_aborts && !ctrlr->secondary &&
+	    pthread_mutex_trylock(&ctrlr->lock) == 0) {
+		nvme_qpair_poll(&ctrlr->adminq, 0);
+		pthread_mutex_unlock(&ctrlr->lock);
+	}
+
+	/* Each slot needs to be processed at most once */
+	if (now - tw->tick >= NVME_TIMER_WHEEL_SLOTS)
+		tw->tick = now - NVME_TIMER_WHEEL_SLOTS + 1;
+
+	for (; tw->tick <= now; tw->tick++) {
+		cid = tw->slots[tw->tick & (NVME_TIMER_WHEEL_SLOTS - 1)];
+		while (cid != NVME_CID_NONE) {
+			tr = &qpair->tr[cid];
+			cid = tr->tw_next;
+			if ((int32_t)(tr->tw_expire - (uint32_t)now) <= 0 &&
+			    nvme_qpair_timeout_tracker(qpair, tr, now))
+				tw->reset = true;
+		}
+	}
+}
+
+/*
+ * Reset the controller after a command abort failed. This is called
+ * once the qpair poll is done, outside of completion processing and
+ * of the qpair lock: the other I/O qpairs are re-created by their owner
+ * (see nvme_ctrlr_reset_qpair()).
+ */
+static void nvme_qpair_timeout_reset(struct nvme_qpair *qpair)
+{
+	struct nvme_ctrlr *ctrlr = qpair->ctrlr;
+
+	qpair->tw->reset = false;
+
+	nvme_err("qpair %u: command abort failed, resetting controller\n",
+		 qpair->id);
+
+	pthread_mutex_lock(&ctrlr->lock);
+	nvme_ctrlr_reset(ctrlr);
+	pthread_mutex_unlock(&ctrlr->lock);
+}
+
+static unsigned int _nvme_qpair_poll(struct nvme_qpair *qpair,
+				     unsigned int max_completions)
 {
 	struct nvme_tracker *tr;
 	struct nvme_cpl	*cpl;
 	uint32_t num_completions = 0;
 
+	nvme_qpair_assert_owner(qpair);
+
 	if (!nvme_qpair_enabled(qpair))
 		/*
 		 * qpair is not enabled, likely because a controller reset is
@@ -1098,13 +2075,14 @@ unsigned int nvme_qpair_poll(struct nvme_qpair *qpair,
 
 	while (1) {
 
-		cpl = &qpair->cpl[qpair->cq_head];
+		cpl = nvme_qpair_cq_entry(qpair, qpair->cq_head);
 		if (cpl->status.p != qpair->phase)
 			break;
 
-		tr = &qpair->tr[cpl->cid];
-		if (tr->active) {
-			nvme_qpair_complete_tracker(qpair, tr, cpl, true);
+		if (nvme_qpair_cid_active(qpair, cpl->cid)) {
+			tr = &qpair->tr[cpl->cid];
+			nvme_qpair_complete_tracker(qpair, tr, cpl,
+						    true, false);
 		} else {
 			nvme_info("cpl does not map to outstanding cmd\n");
 			nvme_qpair_print_completion(qpair, cpl);
@@ -1120,15 +2098,339 @@ unsigned int nvme_qpair_poll(struct nvme_qpair *qpair,
 			break;
 	}
 
-	if (num_completions > 0)
-		nvme_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+	if (num_completions > 0 &&
+	    nvme_qpair_cq_unacked(qpair) >= qpair->cq_db_batch)
+		nvme_qpair_ring_cq_doorbell(qpair);
+
+	if (unlikely(!STAILQ_EMPTY(&qpair->throttled_req)))
+		nvme_qpair_submit_throttled(qpair);
+
+	if (unlikely(qpair->tw != NULL))
+		nvme_qpair_check_timeouts(qpair);
 
 	return num_completions;
 }
 
+/*
+ * Complete a tracker without calling the request callback function.
+ * Return true if the request is completed, with its callback argument
+ * and status in @rec, and the tracker can be released.
+ */
+static bool nvme_qpair_reap_tracker(struct nvme_qpair *qpair,
+				    struct nvme_tracker *tr,
+				    struct nvme_cpl *cpl,
+				    struct nvme_cpl_rec *rec,
+				    bool *have_rec)
+{
+	struct nvme_request *req = tr->req, *parent;
+
+	*have_rec = false;
+
+	if (!req) {
+		nvme_crit("tracker has no request\n");
+		return true;
+	}
+
+	if (nvme_cpl_is_error(cpl)) {
+		nvme_qpair_print_command(qpair, &req->cmd);
+		nvme_qpair_print_completion(qpair, cpl);
+		if (nvme_qpair_completion_retry(cpl) &&
+		    req->retries < NVME_MAX_RETRY_COUNT) {
+			req->retries++;
+			nvme_qpair_submit_tracker(qpair, tr);
+			return false;
+		}
+	}
+
+	if (cpl->cid != req->cmd.cid)
+		nvme_crit("cpl and command CID mismatch (%d / %d)\n",
+			  (int)cpl->cid, (int)req->cmd.cid);
+
+	if (nvme_request_is_child(req)) {
+		/* Only report completion of the parent request */
+		parent = nvme_request_complete_child(req, cpl);
+		if (parent) {
+			rec->cb_arg = parent->cb_arg;
+			rec->cdw0 = parent->parent_status.cdw0;
+			rec->status = parent->parent_status.status;
+			nvme_request_free(parent);
+			*have_rec = true;
+		}
+	} else {
+		rec->cb_arg = req->cb_arg;
+		rec->cdw0 = cpl->cdw0;
+		rec->status = cpl->status;
+		*have_rec = true;
+	}
+
+	nvme_request_free(req);
+
+	return true;
+}
+
+/*
+ * Maximum number of trackers released at once by nvme_qpair_reap().
+ */
+#define NVME_QPAIR_REAP_BATCH	64
+
+static unsigned int _nvme_qpair_reap(struct nvme_qpair *qpair,
+				     struct nvme_cpl_rec *recs,
+				     unsigned int max_recs)
+{
+	struct nvme_tracker *trs[NVME_QPAIR_REAP_BATCH];
+	struct nvme_tracker *tr;
+	struct nvme_cpl	*cpl;
+	unsigned int nr_trs = 0, nr_recs = 0, nr_cpls = 0;
+	bool enabled, have_rec;
+
+	nvme_qpair_assert_owner(qpair);
+
+	enabled = nvme_qpair_enabled(qpair);
+
+	/* Commands completed by the library come first */
+	while (qpair->nr_cpl_recs && nr_recs < max_recs) {
+		recs[nr_recs++] = qpair->cpl_recs[qpair->cpl_recs_head];
+		if (++qpair->cpl_recs_head == qpair->num_reqs)
+			qpair->cpl_recs_head = 0;
+		qpair->nr_cpl_recs--;
+	}
+
+	if (!enabled)
+		return nr_recs;
+
+	/*
+	 * As in nvme_qpair_poll(), process at most one queue
+	 * depth batch of completions.
+	 */
+	while (nr_recs < max_recs && nr_cpls < qpair->entries - 1U) {
+
+		cpl = nvme_qpair_cq_entry(qpair, qpair->cq_head);
+		if (cpl->status.p != qpair->phase)
+			break;
+
+		if (!nvme_qpair_cid_active(qpair, cpl->cid)) {
+			nvme_info("cpl does not map to outstanding cmd\n");
+			nvme_qpair_print_completion(qpair, cpl);
+			nvme_panic("received completion for unknown cmd\n");
+		}
+		tr = &qpair->tr[cpl->cid];
+
+		if (nvme_qpair_reap_tracker(qpair, tr, cpl,
+					    &recs[nr_recs], &have_rec)) {
+			trs[nr_trs++] = tr;
+			if (nr_trs == NVME_QPAIR_REAP_BATCH) {
+				nvme_qpair_release_trackers(qpair, trs, nr_trs);
+				nr_trs = 0;
+			}
+		}
+		if (have_rec)
+			nr_recs++;
+
+		if (++qpair->cq_head == qpair->entries) {
+			qpair->cq_head = 0;
+			qpair->phase = !qpair->phase;
+		}
+
+		nr_cpls++;
+	}
+
+	if (nr_trs)
+		nvme_qpair_release_trackers(qpair, trs, nr_trs);
+
+	if (nr_cpls > 0 &&
+	    nvme_qpair_cq_unacked(qpair) >= qpair->cq_db_batch)
+		nvme_qpair_ring_cq_doorbell(qpair);
+
+	if (unlikely(!STAILQ_EMPTY(&qpair->throttled_req)))
+		nvme_qpair_submit_throttled(qpair);
+
+	if (unlikely(qpair->tw != NULL))
+		nvme_qpair_check_timeouts(qpair);
+
+	return nr_recs;
+}
+
+unsigned int nvme_qpair_poll(struct nvme_qpair *qpair,
+			     unsigned int max_completions)
+{
+	unsigned int ret;
+
+	nvme_qpair_lock(qpair);
+	ret = _nvme_qpair_poll(qpair, max_completions);
+	nvme_qpair_unlock(qpair);
+
+	if (unlikely(qpair->tw != NULL) && qpair->tw->reset)
+		nvme_qpair_timeout_reset(qpair);
+
+	return ret;
+}
+
+unsigned int nvme_qpair_reap(struct nvme_qpair *qpair,
+			     struct nvme_cpl_rec *recs,
+			     unsigned int max_recs)
+{
+	unsigned int ret;
+
+	nvme_qpair_lock(qpair);
+	ret = _nvme_qpair_reap(qpair, recs, max_recs);
+	nvme_qpair_unlock(qpair);
+
+	if (unlikely(qpair->tw != NULL) && qpair->tw->reset)
+		nvme_qpair_timeout_reset(qpair);
+
+	return ret;
+}
+
+/*
+ * Start batching doorbell writes.
+ */
+void nvme_qpair_plug(struct nvme_qpair *qpair)
+{
+	nvme_qpair_lock(qpair);
+	nvme_qpair_assert_owner(qpair);
+
+	qpair->plugged = true;
+	nvme_qpair_unlock(qpair);
+}
+
+/*
+ * Stop batching doorbell writes and publish all pending
+ * submissions and processed completions to the controller.
+ */
+void nvme_qpair_unplug(struct nvme_qpair *qpair)
+{
+	nvme_qpair_lock(qpair);
+	nvme_qpair_assert_owner(qpair);
+
+	qpair->plugged = false;
+
+	nvme_qpair_ring_sq_doorbell(qpair);
+	nvme_qpair_ring_cq_doorbell(qpair);
+	nvme_qpair_unlock(qpair);
+}
+
+/*
+ * Set the number of processed completions after which the
+ * completion queue head doorbell is written.
+ */
+int nvme_qpair_set_cq_batch(struct nvme_qpair *qpair, unsigned int batch)
+{
+	unsigned int max_batch;
+
+	nvme_qpair_assert_owner(qpair);
+
+	/*
+	 * The submission path ensures that the controller always sees
+	 * enough free completion queue entries for all outstanding
+	 * commands, so any batch smaller than the queue size is fine.
+	 */
+	max_batch = qpair->entries - 1;
+	if (batch == 0)
+		batch = 1;
+	if (batch > max_batch) {
+		nvme_info("qpair %u: limiting completion doorbell batch "
+			  "to %u\n", qpair->id, max_batch);
+		batch = max_batch;
+	}
+
+	qpair->cq_db_batch = batch;
+
+	/* Release already deferred completion queue entries */
+	nvme_qpair_ring_cq_doorbell(qpair);
+
+	return batch;
+}
+
+/*
+ * Set the command timeout of a qpair. Outstanding commands
+ * are (re)armed with the new timeout.
+ */
+int nvme_qpair_set_timeout(struct nvme_qpair *qpair, unsigned int timeout_ms,
+			   nvme_timeout_cb cb_fn, void *cb_arg)
+{
+	struct nvme_timer_wheel *tw = qpair->tw;
+	struct nvme_tracker *tr;
+	uint64_t now;
+	unsigned int i;
+
+	nvme_qpair_assert_owner(qpair);
+
+	if (tw) {
+		nvme_qpair_foreach_active_tracker(qpair, tr) {
+			if (tr->tw_state != NVME_TRACKER_TIMEOUT_NONE)
+				nvme_qpair_disarm_timeout(qpair, tr);
+		}
+	}
+
+	if (!timeout_ms) {
+		free(tw);
+		qpair->tw = NULL;
+		return 0;
+	}
+
+	if (!tw) {
+		tw = calloc(1, sizeof(struct nvme_timer_wheel));
+		if (!tw) {
+			nvme_err("Allocate qpair timer wheel failed\n");
+			return -ENOMEM;
+		}
+		for (i = 0; i < NVME_TIMER_WHEEL_SLOTS; i++)
+			tw->slots[i] = NVME_CID_NONE;
+		qpair->tw = tw;
+	}
+
+	tw->cb_fn = cb_fn;
+	tw->cb_arg = cb_arg;
+	tw->timeout_ms = timeout_ms;
+	tw->tick_ms = nvme_max(timeout_ms / NVME_TIMER_WHEEL_TICKS, 1U);
+
+	/* Add one tick to account for the current tick being partial */
+	tw->ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms + 1;
+
+	now = nvme_qpair_tw_now(tw);
+	tw->tick = now;
+
+	nvme_qpair_foreach_active_tracker(qpair, tr) {
+		tr->tw_state = NVME_TRACKER_TIMEOUT_ARMED;
+		nvme_qpair_tw_add(qpair, tr, now + tw->ticks);
+	}
+
+	return 0;
+}
+
+/*
+ * Enable or disable the backpressure submission mode of a qpair.
+ * Requests already queued are kept and submitted as trackers free up.
+ */
+int nvme_qpair_set_backpressure(struct nvme_qpair *qpair, bool enable)
+{
+	nvme_qpair_assert_owner(qpair);
+
+	qpair->backpressure = enable;
+
+	return 0;
+}
+
+/*
+ * Set the IOPS and bandwidth limits of a qpair.
+ */
+int nvme_qpair_set_rate_limit(struct nvme_qpair *qpair,
+			      const struct nvme_rate_limit *limit)
+{
+	nvme_qpair_assert_owner(qpair);
+
+	qpair->rate_limited = nvme_rl_set(&qpair->rl, limit,
+					  nvme_time_mono_nsec());
+	if (!qpair->rate_limited && !STAILQ_EMPTY(&qpair->throttled_req))
+		nvme_qpair_submit_throttled(qpair);
+
+	return 0;
+}
+
 void nvme_qpair_reset(struct nvme_qpair *qpair)
 {
 	qpair->sq_tail = qpair->cq_head = 0;
+	qpair->sq_tail_db = qpair->cq_head_db = 0;
 
 	/*
 	 * First time through the completion queue, HW will set phase
@@ -1138,8 +2440,10 @@ void nvme_qpair_reset(struct nvme_qpair *qpair)
 	 */
 	qpair->phase = 1;
 
-	memset(qpair->cmd, 0, qpair->entries * sizeof(struct nvme_cmd));
-	memset(qpair->cpl, 0, qpair->entries * sizeof(struct nvme_cpl));
+	nvme_qpair_zero_queue(qpair->cmd, (void **)qpair->sq_segs,
+			      qpair->entries * sizeof(struct nvme_cmd));
+	nvme_qpair_zero_queue(qpair->cpl, (void **)qpair->cq_segs,
+			      qpair->entries * sizeof(struct nvme_cpl));
 }
 
 void nvme_qpair_enable(struct nvme_qpair *qpair)
@@ -1163,11 +2467,22 @@ void nvme_qpair_fail(struct nvme_qpair *qpair)
 	struct nvme_tracker *tr;
 	struct nvme_request *req;
 
+	while (!STAILQ_EMPTY(&qpair->throttled_req)) {
+
+		nvme_notice("Failing rate limited I/O command\n");
+		req = STAILQ_FIRST(&qpair->throttled_req);
+		STAILQ_REMOVE_HEAD(&qpair->throttled_req, stailq);
+		qpair->nr_throttled--;
+		nvme_qpair_manual_complete_request(qpair, req, NVME_SCT_GENERIC,
+						   NVME_SC_ABORTED_BY_REQUEST,
+						   true);
+
+	}
+
 	while (!STAILQ_EMPTY(&qpair->queued_req)) {
 
 		nvme_notice("Failing queued I/O command\n");
-		req = STAILQ_FIRST(&qpair->queued_req);
-		STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+		req = nvme_qpair_dequeue_request(qpair);
 		nvme_qpair_manual_complete_request(qpair, req, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST,
 						   true);
@@ -1175,14 +2490,13 @@ void nvme_qpair_fail(struct nvme_qpair *qpair)
 	}
 
 	/* Manually abort each outstanding I/O. */
-	while (!LIST_EMPTY(&qpair->outstanding_tr)) {
+	nvme_qpair_foreach_active_tracker(qpair, tr) {
 
 		/*
-		 * Do not remove the tracker. The abort_tracker path
+		 * Do not release the tracker. The abort_tracker path
 		 * will do that for us.
 		 */
 		nvme_notice("Failing outstanding I/O command\n");
-		tr = LIST_FIRST(&qpair->outstanding_tr);
 		nvme_qpair_manual_complete_tracker(qpair, tr, NVME_SCT_GENERIC,
 						   NVME_SC_ABORTED_BY_REQUEST,
 						   1, true);
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+#include "nvme_internal.h"
+
+/*
+ * Refill time is capped so that the token computation cannot overflow.
+ */
+#define NVME_RL_MAX_ELAPSED_NSEC	(NVME_RL_BURST_NSEC * 10)
+
+/*
+ * Initialize a token bucket.
+ */
+static void nvme_tb_set(struct nvme_token_bucket *tb, uint64_t rate)
+{
+	tb->rate = rate;
+	tb->rem = 0;
+
+	if (rate) {
+		tb->burst = nvme_max(rate * NVME_RL_BURST_NSEC / 1000000000ULL,
+				     1ULL);
+		tb->tokens = tb->burst;
+	} else {
+		/* No limit: tokens are never consumed */
+		tb->burst = 1;
+		tb->tokens = 1;
+	}
+}
+
+/*
+ * Add the tokens accumulated during @elapsed nanoseconds.
+ */
+static void nvme_tb_refill(struct nvme_token_bucket *tb, uint64_t elapsed)
+{
+	uint64_t acc;
+
+	if (!tb->rate || tb->tokens >= tb->burst)
+		return;
+
+	acc = elapsed * tb->rate + tb->rem;
+	tb->tokens += acc / 1000000000ULL;
+	tb->rem = acc % 1000000000ULL;
+
+	if (tb->tokens >= tb->burst) {
+		tb->tokens = tb->burst;
+		tb->rem = 0;
+	}
+}
+
+/*
+ * Set the limits of a rate limiter. Return true if any limit is set.
+ */
+bool nvme_rl_set(struct nvme_rate_limiter *rl,
+		 const struct nvme_rate_limit *limit, uint64_t now)
+{
+	nvme_tb_set(&rl->iops, limit ? limit->iops : 0);
+	nvme_tb_set(&rl->bps, limit ? limit->bps : 0);
+	rl->last = now;
+
+	return rl->iops.rate || rl->bps.rate;
+}
+
+/*
+ * Refill the token buckets of a rate limiter.
+ */
+void nvme_rl_refill(struct nvme_rate_limiter *rl, uint64_t now)
+{
+	uint64_t elapsed;
+
+	if (now <= rl->last)
+		return;
+
+	elapsed = nvme_min(now - rl->last, NVME_RL_MAX_ELAPSED_NSEC);
+	rl->last = now;
+
+	nvme_tb_refill(&rl->iops, elapsed);
+	nvme_tb_refill(&rl->bps, elapsed);
+}
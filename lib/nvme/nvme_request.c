@@ -40,19 +40,25 @@ static struct nvme_request *nvme_alloc_request(struct nvme_qpair *qpair)
 {
 	struct nvme_request *req;
 
+	nvme_qpair_lock(qpair);
 	req = STAILQ_FIRST(&qpair->free_req);
-	if (req) {
+	if (req)
 		STAILQ_REMOVE_HEAD(&qpair->free_req, stailq);
+	nvme_qpair_unlock(qpair);
+
+	if (req)
 		memset(&req->cmd, 0, sizeof(struct nvme_cmd));
-	}
 
 	return req;
 }
 
-static void nvme_request_cb_complete_child(void *child_arg,
-					   const struct nvme_cpl *cpl)
+/*
+ * Complete a child request. Return the parent request if the
+ * child was the last outstanding child of the parent, NULL otherwise.
+ */
+struct nvme_request *nvme_request_complete_child(struct nvme_request *child,
+						 const struct nvme_cpl *cpl)
 {
-	struct nvme_request *child = child_arg;
 	struct nvme_request *parent = child->parent;
 
 	nvme_request_remove_child(parent, child);
@@ -60,13 +66,33 @@ static void nvme_request_cb_complete_child(void *child_arg,
 	if (nvme_cpl_is_error(cpl))
 		memcpy(&parent->parent_status, cpl, sizeof(*cpl));
 
-	if (parent->child_reqs == 0) {
+	if (parent->child_reqs)
+		return NULL;
+
+	return parent;
+}
+
+static void nvme_request_cb_complete_child(void *child_arg,
+					   const struct nvme_cpl *cpl)
+{
+	struct nvme_request *parent;
+
+	parent = nvme_request_complete_child(child_arg, cpl);
+	if (parent) {
 		if (parent->cb_fn)
 			parent->cb_fn(parent->cb_arg, &parent->parent_status);
 		nvme_request_free(parent);
 	}
 }
 
+/*
+ * Test if a request is a child of a split request.
+ */
+bool nvme_request_is_child(struct nvme_request *req)
+{
+	return req->cb_fn == nvme_request_cb_complete_child;
+}
+
 void nvme_request_completion_poll_cb(void *arg, const struct nvme_cpl *cpl)
 {
 	struct nvme_completion_poll_status *status = arg;
@@ -80,8 +106,11 @@ int nvme_request_pool_construct(struct nvme_qpair *qpair)
 	struct nvme_request *req;
 	unsigned int i;
 
-	qpair->num_reqs = qpair->trackers * NVME_IO_ENTRIES_VS_TRACKERS_RATIO;
-	qpair->reqs = calloc(qpair->num_reqs, sizeof(struct nvme_request));
+	qpair->num_reqs = nvme_min((unsigned int)qpair->trackers *
+				   NVME_REQS_PER_TRACKER,
+				   qpair->trackers + NVME_IO_ENTRIES);
+	qpair->reqs = nvme_mem_zalloc_host(sizeof(struct nvme_request)
+					   * qpair->num_reqs, qpair->node_id);
 	if (!qpair->reqs) {
 		nvme_err("QPair %d: allocate %u requests failed\n",
 			 (int)qpair->id, qpair->num_reqs);
@@ -116,7 +145,9 @@ void nvme_request_pool_destroy(struct nvme_qpair *qpair)
 		nvme_err("QPair %d: Freed %d/%d requests\n",
 			 (int)qpair->id, n, (int)qpair->num_reqs);
 
-	free(qpair->reqs);
+	nvme_mem_free_host(qpair->reqs);
+	qpair->reqs = NULL;
+	qpair->num_reqs = 0;
 }
 
 struct nvme_request *nvme_request_allocate(struct nvme_qpair *qpair,
@@ -175,7 +206,9 @@ void nvme_request_free(struct nvme_request *req)
 
 	nvme_assert(req->child_reqs == 0, "Number of child request not 0\n");
 
+	nvme_qpair_lock(qpair);
 	STAILQ_INSERT_HEAD(&qpair->free_req, req, stailq);
+	nvme_qpair_unlock(qpair);
 }
 
 void nvme_request_add_child(struct nvme_request *parent,
@@ -0,0 +1,1131 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+#include "nvme_internal.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+
+/*
+ * A controller opened with the shared option is owned by the first
+ * process opening it, the primary process, which initializes the
+ * controller and listens for other processes on a socket named after
+ * the controller PCI slot. Processes opening the controller afterwards
+ * are secondary processes: they map the controller registers and use
+ * their own memory for their I/O qpairs, but the primary process
+ * allocates their I/O queue IDs and executes their admin commands.
+ * When the connection of a secondary process is closed without a
+ * detach request, the secondary process died: the primary process
+ * deletes its I/O queues and removes its hugepage files.
+ * Only processes of the primary process user (or of root) may connect,
+ * and secondary processes may only execute admin commands which do not
+ * change the controller state. When the primary process resets the
+ * controller, it notifies the secondary processes, whose I/O qpairs
+ * are then re-created by their owner like the primary process ones.
+ */
+
+/*
+ * Secondary processes requests, and primary process notifications.
+ */
+enum nvme_shared_op {
+	NVME_SHARED_ATTACH	= 1,
+	NVME_SHARED_DETACH,
+	NVME_SHARED_ADMIN,
+	NVME_SHARED_QPAIR_GET,
+	NVME_SHARED_QPAIR_PUT,
+	NVME_SHARED_RESET,
+};
+
+/*
+ * Request and reply message. For admin commands, the data transferred
+ * to the controller follows the request, and the data transferred from
+ * the controller follows the reply of a successful request. For I/O
+ * queue creation commands, addr is the queue virtual address in the
+ * secondary process.
+ */
+struct nvme_shared_msg {
+	uint32_t			op;
+	int32_t				status;
+	uint32_t			arg;
+	uint32_t			len;
+	uint64_t			addr;
+	struct nvme_cmd			cmd;
+	struct nvme_cpl			cpl;
+};
+
+/*
+ * A secondary process connected to the primary process,
+ * with the I/O qpairs it allocated.
+ */
+struct nvme_shared_client {
+	int				fd;
+	pid_t				pid;
+	bool				detached;
+	TAILQ_HEAD(, nvme_qpair)	qpairs;
+	LIST_ENTRY(nvme_shared_client)	link;
+};
+
+/*
+ * Shared controller state. In the primary process, fd is the
+ * listening socket, and lock protects the clients list and the
+ * messages sent to clients. In a secondary process, fd is the
+ * connection to the primary process, lock serializes requests and
+ * thread receives the replies and notifications of the primary process,
+ * passing replies to the requester under reply_lock.
+ */
+struct nvme_shared {
+	int				fd;
+	bool				broken;
+	pthread_mutex_t			lock;
+	pthread_t			thread;
+
+	int				stop_fd[2];
+	unsigned int			nr_clients;
+	LIST_HEAD(, nvme_shared_client)	clients;
+
+	pthread_mutex_t			reply_lock;
+	pthread_cond_t			reply_cond;
+	struct nvme_shared_msg		*reply;
+	void				*reply_buf;
+};
+
+/*
+ * Test if a request carries data to the controller.
+ */
+static inline bool nvme_shared_wdata(struct nvme_shared_msg *msg)
+{
+	return msg->op == NVME_SHARED_ADMIN && msg->len &&
+		(msg->cmd.opc & 0x1);
+}
+
+/*
+ * Test if the reply of a request carries data from the controller.
+ */
+static inline bool nvme_shared_rdata(struct nvme_shared_msg *msg)
+{
+	return msg->op == NVME_SHARED_ADMIN && msg->len &&
+		(msg->cmd.opc & 0x2);
+}
+
+/*
+ * Get the socket address of a controller primary process
+ * (in the abstract namespace).
+ */
+static socklen_t nvme_shared_addr(struct pci_device *pdev,
+				  struct sockaddr_un *addr)
+{
+	int n;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+		     "libnvme.%04x:%02x:%02x.%1u",
+		     pdev->domain, pdev->bus, pdev->dev, pdev->func);
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+/*
+ * Send a buffer on a connection.
+ */
+static int nvme_shared_send(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, p, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive a buffer from a connection.
+ */
+static int nvme_shared_recv(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(fd, p, len, 0);
+		if (ret == 0)
+			return -ECONNRESET;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Secondary process: the primary process is resetting the controller.
+ * The I/O qpairs are flagged for their owner to re-create them (see
+ * nvme_ctrlr_reset_qpair()). The controller lock cannot be taken here,
+ * as its holder may be waiting for a reply of the primary process.
+ */
+static void nvme_shared_reset_qpairs(struct nvme_ctrlr *ctrlr)
+{
+	unsigned int i;
+
+	nvme_notice("Controller reset by the primary process\n");
+
+	if (!ctrlr->ioq)
+		return;
+
+	for (i = 0; i < ctrlr->io_queues; i++)
+		nvme_atomic_set(&ctrlr->ioq[i].reset_pending, 1);
+}
+
+/*
+ * Secondary process: mark the connection to the primary process broken,
+ * waking up a requester waiting for a reply.
+ */
+static void nvme_shared_break(struct nvme_shared *sh)
+{
+	pthread_mutex_lock(&sh->reply_lock);
+	sh->broken = true;
+	pthread_cond_signal(&sh->reply_cond);
+	pthread_mutex_unlock(&sh->reply_lock);
+}
+
+/*
+ * Secondary process: receive the primary process messages.
+ */
+static void *nvme_shared_receiver(void *arg)
+{
+	struct nvme_ctrlr *ctrlr = arg;
+	struct nvme_shared *sh = ctrlr->shared;
+	struct nvme_shared_msg msg, *req;
+	bool broken;
+	int ret;
+
+	for (;;) {
+
+		ret = nvme_shared_recv(sh->fd, &msg,
+				       sizeof(struct nvme_shared_msg));
+		if (ret != 0)
+			break;
+
+		if (msg.op == NVME_SHARED_RESET) {
+			nvme_shared_reset_qpairs(ctrlr);
+			continue;
+		}
+
+		/* The reply must match the pending request */
+		pthread_mutex_lock(&sh->reply_lock);
+		req = sh->reply;
+		pthread_mutex_unlock(&sh->reply_lock);
+		if (!req || msg.op != req->op || msg.len != req->len) {
+			ret = -EPROTO;
+			break;
+		}
+
+		if (msg.status == 0 && nvme_shared_rdata(&msg)) {
+			ret = nvme_shared_recv(sh->fd, sh->reply_buf, msg.len);
+			if (ret != 0)
+				break;
+		}
+
+		pthread_mutex_lock(&sh->reply_lock);
+		memcpy(req, &msg, sizeof(struct nvme_shared_msg));
+		sh->reply = NULL;
+		pthread_cond_signal(&sh->reply_cond);
+		pthread_mutex_unlock(&sh->reply_lock);
+
+	}
+
+	pthread_mutex_lock(&sh->reply_lock);
+	broken = sh->broken;
+	pthread_mutex_unlock(&sh->reply_lock);
+
+	/* On detach, the connection is broken before being shut down */
+	if (!broken)
+		nvme_err("Connection to primary process lost %d (%s)\n",
+			 -ret, strerror(-ret));
+
+	nvme_shared_break(sh);
+
+	return NULL;
+}
+
+/*
+ * Secondary process: send a request to the primary process and wait for
+ * its reply. Return the request status, or -ENOTCONN if the connection
+ * to the primary process is lost.
+ */
+static int nvme_shared_request(struct nvme_shared *sh,
+			       struct nvme_shared_msg *msg, void *buf)
+{
+	int ret = -ENOTCONN;
+
+	pthread_mutex_lock(&sh->lock);
+
+	pthread_mutex_lock(&sh->reply_lock);
+	if (sh->broken) {
+		pthread_mutex_unlock(&sh->reply_lock);
+		goto out;
+	}
+	sh->reply = msg;
+	sh->reply_buf = buf;
+	pthread_mutex_unlock(&sh->reply_lock);
+
+	ret = nvme_shared_send(sh->fd, msg, sizeof(struct nvme_shared_msg));
+	if (ret == 0 && nvme_shared_wdata(msg))
+		ret = nvme_shared_send(sh->fd, buf, msg->len);
+	if (ret != 0) {
+		nvme_err("Send request to primary process failed %d (%s)\n",
+			 -ret, strerror(-ret));
+		nvme_shared_break(sh);
+	}
+
+	pthread_mutex_lock(&sh->reply_lock);
+	while (sh->reply && !sh->broken)
+		pthread_cond_wait(&sh->reply_cond, &sh->reply_lock);
+	ret = sh->reply ? -ENOTCONN : msg->status;
+	sh->reply = NULL;
+	pthread_mutex_unlock(&sh->reply_lock);
+
+out:
+	pthread_mutex_unlock(&sh->lock);
+
+	return ret;
+}
+
+/*
+ * Secondary process: attach to the primary process connected with fd.
+ * Return the number of I/O queues of the controller.
+ */
+int nvme_shared_connect(struct nvme_ctrlr *ctrlr, int fd)
+{
+	struct nvme_shared_msg msg;
+	struct nvme_shared *sh;
+	int ret;
+
+	sh = calloc(1, sizeof(struct nvme_shared));
+	if (!sh) {
+		nvme_err("Allocate shared controller failed\n");
+		close(fd);
+		return -ENOMEM;
+	}
+
+	sh->fd = fd;
+	pthread_mutex_init(&sh->lock, NULL);
+	pthread_mutex_init(&sh->reply_lock, NULL);
+	pthread_cond_init(&sh->reply_cond, NULL);
+	ctrlr->shared = sh;
+
+	ret = pthread_create(&sh->thread, NULL, nvme_shared_receiver, ctrlr);
+	if (ret != 0) {
+		nvme_err("Create shared controller thread failed %d (%s)\n",
+			 ret, strerror(ret));
+		ctrlr->shared = NULL;
+		close(fd);
+		pthread_cond_destroy(&sh->reply_cond);
+		pthread_mutex_destroy(&sh->reply_lock);
+		pthread_mutex_destroy(&sh->lock);
+		free(sh);
+		return -ret;
+	}
+
+	memset(&msg, 0, sizeof(struct nvme_shared_msg));
+	msg.op = NVME_SHARED_ATTACH;
+	ret = nvme_shared_request(sh, &msg, NULL);
+	if (ret != 0) {
+		nvme_err("Attach to primary process failed %d\n", ret);
+		return ret;
+	}
+
+	if (!msg.arg) {
+		nvme_err("Primary process has no I/O queue\n");
+		return -ENXIO;
+	}
+
+	nvme_info("Attached to primary process (%u I/O queues)\n", msg.arg);
+
+	return msg.arg;
+}
+
+/*
+ * Secondary process: have the primary process execute an admin
+ * command, calling cb_fn with the command completion.
+ */
+int nvme_shared_admin_cmd(struct nvme_ctrlr *ctrlr,
+			  struct nvme_cmd *cmd,
+			  void *buf, uint32_t len,
+			  nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	struct nvme_shared_msg msg;
+	struct nvme_qpair *qpair;
+	unsigned int qid = cmd->cdw10 & 0xFFFF;
+	int ret;
+
+	if (len > NVME_MAX_XFER_SIZE)
+		return -EINVAL;
+
+	memset(&msg, 0, sizeof(struct nvme_shared_msg));
+	msg.op = NVME_SHARED_ADMIN;
+	msg.len = buf ? len : 0;
+	memcpy(&msg.cmd, cmd, sizeof(struct nvme_cmd));
+
+	/*
+	 * The primary process checks that a queue is in this process
+	 * memory: only physically contiguous queues can be checked.
+	 */
+	if (qid && qid <= ctrlr->io_queues) {
+		qpair = &ctrlr->ioq[qid - 1];
+		if (cmd->opc == NVME_OPC_CREATE_IO_SQ && !qpair->sq_segs)
+			msg.addr = (uintptr_t)qpair->cmd;
+		else if (cmd->opc == NVME_OPC_CREATE_IO_CQ && !qpair->cq_segs)
+			msg.addr = (uintptr_t)qpair->cpl;
+	}
+
+	ret = nvme_shared_request(ctrlr->shared, &msg, buf);
+	if (ret != 0)
+		return ret;
+
+	cb_fn(cb_arg, &msg.cpl);
+
+	return 0;
+}
+
+/*
+ * Secondary process: get a free I/O qpair ID from the primary process.
+ */
+struct nvme_qpair *nvme_shared_qpair_get(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_shared_msg msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(struct nvme_shared_msg));
+	msg.op = NVME_SHARED_QPAIR_GET;
+
+	ret = nvme_shared_request(ctrlr->shared, &msg, NULL);
+	if (ret != 0)
+		return NULL;
+
+	if (!msg.arg || msg.arg > ctrlr->io_queues) {
+		nvme_err("Invalid I/O qpair ID %u\n", msg.arg);
+		return NULL;
+	}
+
+	return &ctrlr->ioq[msg.arg - 1];
+}
+
+/*
+ * Secondary process: return an I/O qpair ID to the primary process.
+ */
+void nvme_shared_qpair_put(struct nvme_ctrlr *ctrlr,
+			   struct nvme_qpair *qpair)
+{
+	struct nvme_shared_msg msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(struct nvme_shared_msg));
+	msg.op = NVME_SHARED_QPAIR_PUT;
+	msg.arg = qpair->id;
+
+	ret = nvme_shared_request(ctrlr->shared, &msg, NULL);
+	if (ret != 0)
+		nvme_notice("Release I/O qpair %u ID failed %d\n",
+			    qpair->id, ret);
+}
+
+/*
+ * Primary process: get a secondary process I/O qpair.
+ */
+static struct nvme_qpair *
+nvme_shared_client_qpair(struct nvme_shared_client *c, unsigned int qid)
+{
+	struct nvme_qpair *qpair;
+
+	TAILQ_FOREACH(qpair, &c->qpairs, tailq) {
+		if (qpair->id == qid)
+			return qpair;
+	}
+
+	return NULL;
+}
+
+/*
+ * Primary process: check that an I/O queue creation command of a
+ * secondary process describes a physically contiguous queue mapped
+ * at vaddr in the secondary process, so that the controller cannot
+ * be used to access memory not owned by the secondary process.
+ */
+static int nvme_shared_check_queue(struct nvme_shared_client *c,
+				   struct nvme_cmd *cmd, uint64_t vaddr)
+{
+	size_t entry_size, nr_pages, len, i;
+	uint64_t paddr = cmd->dptr.prp.prp1;
+	uint64_t *pfn;
+	char path[64];
+	int fd, ret = -EPERM;
+
+	if (cmd->opc == NVME_OPC_CREATE_IO_SQ)
+		entry_size = sizeof(struct nvme_cmd);
+	else
+		entry_size = sizeof(struct nvme_cpl);
+	nr_pages = ((((cmd->cdw10 >> 16) + 1) * entry_size) + PAGE_SIZE - 1)
+		>> PAGE_SHIFT;
+	len = nr_pages << NVME_PFN_SIZE_SHIFT;
+
+	if (!vaddr || (vaddr & (PAGE_SIZE - 1)) || (paddr & (PAGE_SIZE - 1)))
+		return -EPERM;
+
+	pfn = malloc(len);
+	if (!pfn)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", (int)c->pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		nvme_err("Open %s failed %d (%s)\n",
+			 path, errno, strerror(errno));
+		goto out;
+	}
+
+	if (pread(fd, pfn, len, (vaddr >> PAGE_SHIFT) << NVME_PFN_SIZE_SHIFT)
+	    != (ssize_t)len) {
+		nvme_err("Read %s failed\n", path);
+		goto close;
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		if (!(pfn[i] & NVME_PFN_PRESENT) ||
+		    ((pfn[i] & NVME_PFN_MASK) << PAGE_SHIFT) !=
+		    paddr + (i << PAGE_SHIFT))
+			goto close;
+	}
+
+	ret = 0;
+
+close:
+	close(fd);
+out:
+	free(pfn);
+
+	return ret;
+}
+
+/*
+ * Primary process: get the size of the data a secondary process
+ * Get Features command transfers from the controller, or -1 if the
+ * feature is not known.
+ */
+static int nvme_shared_feat_size(struct nvme_cmd *cmd)
+{
+	/* Supported capabilities are returned in the completion */
+	if (((cmd->cdw10 >> 8) & 0x7) == NVME_FEAT_SUPPORTED)
+		return 0;
+
+	switch (cmd->cdw10 & 0xFF) {
+	case NVME_FEAT_ARBITRATION:
+	case NVME_FEAT_POWER_MANAGEMENT:
+	case NVME_FEAT_TEMPERATURE_THRESHOLD:
+	case NVME_FEAT_ERROR_RECOVERY:
+	case NVME_FEAT_VOLATILE_WRITE_CACHE:
+	case NVME_FEAT_NUMBER_OF_QUEUES:
+	case NVME_FEAT_INTERRUPT_COALESCING:
+	case NVME_FEAT_INTERRUPT_VECTOR_CONFIGURATION:
+	case NVME_FEAT_WRITE_ATOMICITY:
+	case NVME_FEAT_ASYNC_EVENT_CONFIGURATION:
+	case NVME_FEAT_KEEP_ALIVE_TIMER:
+	case NVME_FEAT_SOFTWARE_PROGRESS_MARKER:
+	case NVME_FEAT_HOST_RESERVE_MASK:
+	case NVME_FEAT_HOST_RESERVE_PERSIST:
+		return 0;
+	case NVME_FEAT_LBA_RANGE_TYPE:
+	case NVME_FEAT_HOST_MEM_BUFFER:
+		return 4096;
+	case NVME_FEAT_AUTONOMOUS_POWER_STATE_TRANSITION:
+		return 256;
+	case NVME_FEAT_HOST_IDENTIFIER:
+		/* 64-bit or extended 128-bit host identifier */
+		return 16;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Primary process: check that a secondary process admin command
+ * does not change the controller state owned by the primary process
+ * nor access memory not owned by the secondary process. Only the
+ * commands listed here are permitted, and the data pointer of the
+ * command is cleared: the primary process sets it for the command
+ * data buffer.
+ */
+static int nvme_shared_check_admin(struct nvme_shared_client *c,
+				   struct nvme_shared_msg *msg)
+{
+	struct nvme_cmd *cmd = &msg->cmd;
+	unsigned int qid = cmd->cdw10 & 0xFFFF;
+	int64_t size = 0;
+	uint32_t flags;
+	int ret;
+
+	cmd->fuse = 0;
+	cmd->psdt = 0;
+	cmd->mptr = 0;
+
+	switch (cmd->opc) {
+	case NVME_OPC_CREATE_IO_SQ:
+		/* The completion queue must be the qpair one */
+		if ((cmd->cdw11 >> 16) != qid)
+			return -EPERM;
+		/* Fallthrough */
+	case NVME_OPC_CREATE_IO_CQ:
+		/*
+		 * Physically contiguous queue, with a priority
+		 * for submission queues and no interrupts.
+		 */
+		if (cmd->opc == NVME_OPC_CREATE_IO_SQ)
+			flags = cmd->cdw11 & 0xFFF9;
+		else
+			flags = cmd->cdw11;
+		if (flags != 0x1 || !nvme_shared_client_qpair(c, qid))
+			return -EPERM;
+		ret = nvme_shared_check_queue(c, cmd, msg->addr);
+		if (ret != 0)
+			return ret;
+		cmd->dptr.prp.prp2 = 0;
+		return 0;
+	case NVME_OPC_DELETE_IO_SQ:
+	case NVME_OPC_DELETE_IO_CQ:
+	case NVME_OPC_ABORT:
+		/* Own queues only */
+		if (!nvme_shared_client_qpair(c, qid))
+			return -EPERM;
+		break;
+	case NVME_OPC_IDENTIFY:
+		size = 4096;
+		break;
+	case NVME_OPC_GET_LOG_PAGE:
+		/* Number of dwords (0's based) */
+		size = (((uint64_t)(cmd->cdw11 & 0xFFFF) << 16 |
+			 (cmd->cdw10 >> 16)) + 1) << 2;
+		break;
+	case NVME_OPC_GET_FEATURES:
+		size = nvme_shared_feat_size(cmd);
+		if (size < 0)
+			return -EPERM;
+		break;
+	default:
+		return -EPERM;
+	}
+
+	/*
+	 * The controller must not transfer more data than
+	 * the buffer the primary process allocated.
+	 */
+	if (size > msg->len)
+		return -EPERM;
+
+	memset(&cmd->dptr, 0, sizeof(cmd->dptr));
+
+	return 0;
+}
+
+/*
+ * Primary process: execute a secondary process request.
+ */
+static int nvme_shared_serve(struct nvme_ctrlr *ctrlr,
+			     struct nvme_shared_client *c,
+			     struct nvme_shared_msg *msg, void *buf)
+{
+	struct nvme_qpair *qpair;
+	int ret = 0;
+
+	switch (msg->op) {
+
+	case NVME_SHARED_ATTACH:
+		msg->arg = ctrlr->io_queues;
+		nvme_info("Process %d attached\n", (int)c->pid);
+		break;
+
+	case NVME_SHARED_DETACH:
+		c->detached = true;
+		break;
+
+	case NVME_SHARED_ADMIN:
+		ret = nvme_shared_check_admin(c, msg);
+		if (ret != 0) {
+			nvme_notice("Process %d: admin command 0x%02x "
+				    "not permitted\n",
+				    (int)c->pid, msg->cmd.opc);
+			break;
+		}
+		pthread_mutex_lock(&ctrlr->lock);
+		ret = nvme_admin_passthru(ctrlr, &msg->cmd, buf, msg->len,
+					  &msg->cpl);
+		pthread_mutex_unlock(&ctrlr->lock);
+		break;
+
+	case NVME_SHARED_QPAIR_GET:
+		pthread_mutex_lock(&ctrlr->lock);
+		qpair = TAILQ_FIRST(&ctrlr->free_io_qpairs);
+		if (qpair) {
+			TAILQ_REMOVE(&ctrlr->free_io_qpairs, qpair, tailq);
+			TAILQ_INSERT_TAIL(&c->qpairs, qpair, tailq);
+			msg->arg = qpair->id;
+		} else {
+			ret = -EBUSY;
+		}
+		pthread_mutex_unlock(&ctrlr->lock);
+		break;
+
+	case NVME_SHARED_QPAIR_PUT:
+		qpair = nvme_shared_client_qpair(c, msg->arg);
+		if (!qpair) {
+			ret = -EINVAL;
+			break;
+		}
+		pthread_mutex_lock(&ctrlr->lock);
+		TAILQ_REMOVE(&c->qpairs, qpair, tailq);
+		TAILQ_INSERT_HEAD(&ctrlr->free_io_qpairs, qpair, tailq);
+		pthread_mutex_unlock(&ctrlr->lock);
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+
+	}
+
+	return ret;
+}
+
+/*
+ * Primary process: receive a secondary process request, execute it
+ * and send the reply. Return an error if the connection must be closed.
+ */
+static int nvme_shared_client_request(struct nvme_ctrlr *ctrlr,
+				      struct nvme_shared_client *c)
+{
+	struct nvme_shared_msg msg;
+	void *buf = NULL;
+	int ret;
+
+	ret = nvme_shared_recv(c->fd, &msg, sizeof(struct nvme_shared_msg));
+	if (ret != 0)
+		return ret;
+
+	if (nvme_shared_wdata(&msg) || nvme_shared_rdata(&msg)) {
+		if (msg.len > NVME_MAX_XFER_SIZE)
+			return -EINVAL;
+		buf = nvme_zmalloc(msg.len, PAGE_SIZE);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	if (nvme_shared_wdata(&msg)) {
+		ret = nvme_shared_recv(c->fd, buf, msg.len);
+		if (ret != 0)
+			goto out;
+	}
+
+	msg.status = nvme_shared_serve(ctrlr, c, &msg, buf);
+
+	/* Do not interleave the reply with a reset notification */
+	pthread_mutex_lock(&ctrlr->shared->lock);
+	ret = nvme_shared_send(c->fd, &msg, sizeof(struct nvme_shared_msg));
+	if (ret == 0 && msg.status == 0 && nvme_shared_rdata(&msg))
+		ret = nvme_shared_send(c->fd, buf, msg.len);
+	pthread_mutex_unlock(&ctrlr->shared->lock);
+
+out:
+	nvme_free(buf);
+
+	return ret;
+}
+
+/*
+ * Primary process: accept a secondary process connection.
+ */
+static void nvme_shared_accept(struct nvme_shared *sh)
+{
+	struct nvme_shared_client *c;
+	struct ucred cred;
+	socklen_t len = sizeof(struct ucred);
+	int fd;
+
+	fd = accept4(sh->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		nvme_err("Accept secondary process failed %d (%s)\n",
+			 errno, strerror(errno));
+		return;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		nvme_err("Get secondary process ID failed %d (%s)\n",
+			 errno, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	/* Secondary processes can access the controller memory */
+	if (cred.uid != geteuid() && cred.uid != 0) {
+		nvme_err("Process %d of user %u not permitted\n",
+			 (int)cred.pid, (unsigned int)cred.uid);
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(struct nvme_shared_client));
+	if (!c) {
+		nvme_err("Allocate secondary process failed\n");
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	c->pid = cred.pid;
+	TAILQ_INIT(&c->qpairs);
+
+	pthread_mutex_lock(&sh->lock);
+	LIST_INSERT_HEAD(&sh->clients, c, link);
+	sh->nr_clients++;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * Primary process: close a secondary process connection, deleting the
+ * I/O queues left by the secondary process. If the secondary process
+ * died, also remove its hugepage files once the controller stopped
+ * using its memory.
+ */
+static void nvme_shared_drop(struct nvme_ctrlr *ctrlr,
+			     struct nvme_shared_client *c, bool dead)
+{
+	struct nvme_shared *sh = ctrlr->shared;
+	struct nvme_qpair *qpair;
+
+	if (dead)
+		nvme_warning("Process %d died\n", (int)c->pid);
+	else if (c->detached)
+		nvme_info("Process %d detached\n", (int)c->pid);
+
+	while ((qpair = TAILQ_FIRST(&c->qpairs))) {
+
+		nvme_notice("Process %d: recovering I/O qpair %u\n",
+			    (int)c->pid, qpair->id);
+
+		/* The queues may not have been created */
+		pthread_mutex_lock(&ctrlr->lock);
+		nvme_admin_delete_ioq(ctrlr, qpair, NVME_IO_SUBMISSION_QUEUE);
+		nvme_admin_delete_ioq(ctrlr, qpair, NVME_IO_COMPLETION_QUEUE);
+		TAILQ_REMOVE(&c->qpairs, qpair, tailq);
+		TAILQ_INSERT_HEAD(&ctrlr->free_io_qpairs, qpair, tailq);
+		pthread_mutex_unlock(&ctrlr->lock);
+
+	}
+
+	if (dead)
+		nvme_mem_remove_pid(c->pid);
+
+	pthread_mutex_lock(&sh->lock);
+	close(c->fd);
+	LIST_REMOVE(c, link);
+	sh->nr_clients--;
+	pthread_mutex_unlock(&sh->lock);
+
+	free(c);
+}
+
+/*
+ * Primary process: notify the secondary processes of a controller reset
+ * or failure, for them to re-create or fail their I/O qpairs.
+ * The notification is not waited for: a secondary process which
+ * cannot receive it is disconnected.
+ */
+void nvme_shared_notify_reset(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_shared *sh = ctrlr->shared;
+	struct nvme_shared_client *c;
+	struct nvme_shared_msg msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(struct nvme_shared_msg));
+	msg.op = NVME_SHARED_RESET;
+
+	pthread_mutex_lock(&sh->lock);
+
+	LIST_FOREACH(c, &sh->clients, link) {
+		ret = send(c->fd, &msg, sizeof(struct nvme_shared_msg),
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret != sizeof(struct nvme_shared_msg)) {
+			nvme_err("Process %d: reset notification failed\n",
+				 (int)c->pid);
+			shutdown(c->fd, SHUT_RDWR);
+		}
+	}
+
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * Primary process: serve secondary processes requests.
+ */
+static void *nvme_shared_thread(void *arg)
+{
+	struct nvme_ctrlr *ctrlr = arg;
+	struct nvme_shared *sh = ctrlr->shared;
+	struct nvme_shared_client **cl = NULL, *c;
+	struct pollfd *pfd = NULL;
+	unsigned int i, nr_pfd, max_pfd = 0;
+	void *p;
+	int ret;
+
+	for (;;) {
+
+		/* Poll the stop pipe, the listening socket and clients */
+		nr_pfd = sh->nr_clients + 2;
+		if (nr_pfd > max_pfd) {
+			p = realloc(pfd, sizeof(struct pollfd) * nr_pfd);
+			if (!p)
+				break;
+			pfd = p;
+			p = realloc(cl, sizeof(*cl) * nr_pfd);
+			if (!p)
+				break;
+			cl = p;
+			max_pfd = nr_pfd;
+		}
+
+		pfd[0].fd = sh->stop_fd[0];
+		pfd[1].fd = sh->fd;
+		i = 2;
+		LIST_FOREACH(c, &sh->clients, link) {
+			cl[i] = c;
+			pfd[i++].fd = c->fd;
+		}
+		for (i = 0; i < nr_pfd; i++) {
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+
+		ret = poll(pfd, nr_pfd, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			nvme_crit("Poll secondary processes failed %d (%s)\n",
+				  errno, strerror(errno));
+			break;
+		}
+
+		if (pfd[0].revents)
+			break;
+
+		for (i = 2; i < nr_pfd; i++) {
+			if (!pfd[i].revents)
+				continue;
+			c = cl[i];
+			ret = nvme_shared_client_request(ctrlr, c);
+			if (ret != 0)
+				nvme_shared_drop(ctrlr, c, !c->detached);
+		}
+
+		if (pfd[1].revents & POLLIN)
+			nvme_shared_accept(sh);
+
+	}
+
+	if (nr_pfd > max_pfd)
+		nvme_crit("Allocate poll set failed\n");
+
+	free(pfd);
+	free(cl);
+
+	return NULL;
+}
+
+/*
+ * Primary process: start serving secondary processes on the
+ * listening socket fd.
+ */
+static int nvme_shared_start(struct nvme_ctrlr *ctrlr, int fd)
+{
+	struct nvme_shared *sh;
+	int ret;
+
+	sh = calloc(1, sizeof(struct nvme_shared));
+	if (!sh) {
+		nvme_err("Allocate shared controller failed\n");
+		return -ENOMEM;
+	}
+
+	sh->fd = fd;
+	pthread_mutex_init(&sh->lock, NULL);
+	LIST_INIT(&sh->clients);
+
+	if (pipe2(sh->stop_fd, O_CLOEXEC) < 0) {
+		ret = -errno;
+		nvme_err("Create pipe failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto err;
+	}
+
+	ctrlr->shared = sh;
+
+	ret = pthread_create(&sh->thread, NULL, nvme_shared_thread, ctrlr);
+	if (ret != 0) {
+		nvme_err("Create shared controller thread failed %d (%s)\n",
+			 ret, strerror(ret));
+		ctrlr->shared = NULL;
+		close(sh->stop_fd[0]);
+		close(sh->stop_fd[1]);
+		ret = -ret;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	pthread_mutex_destroy(&sh->lock);
+	free(sh);
+
+	return ret;
+}
+
+/*
+ * Detach a shared controller: in the primary process, stop serving the
+ * secondary processes, and in a secondary process, detach from the
+ * primary process.
+ */
+void nvme_shared_detach(struct nvme_ctrlr *ctrlr)
+{
+	struct nvme_shared *sh = ctrlr->shared;
+	struct nvme_shared_client *c;
+	struct nvme_shared_msg msg;
+	char stop = 0;
+
+	if (ctrlr->secondary) {
+		memset(&msg, 0, sizeof(struct nvme_shared_msg));
+		msg.op = NVME_SHARED_DETACH;
+		nvme_shared_request(sh, &msg, NULL);
+		nvme_shared_break(sh);
+		shutdown(sh->fd, SHUT_RDWR);
+		pthread_join(sh->thread, NULL);
+		pthread_cond_destroy(&sh->reply_cond);
+		pthread_mutex_destroy(&sh->reply_lock);
+	} else {
+		if (write(sh->stop_fd[1], &stop, 1) != 1)
+			nvme_err("Stop shared controller thread failed\n");
+		pthread_join(sh->thread, NULL);
+		close(sh->stop_fd[0]);
+		close(sh->stop_fd[1]);
+		if (sh->nr_clients)
+			nvme_warning("Detaching %u secondary processes\n",
+				     sh->nr_clients);
+		while ((c = LIST_FIRST(&sh->clients)))
+			nvme_shared_drop(ctrlr, c, false);
+	}
+
+	close(sh->fd);
+	pthread_mutex_destroy(&sh->lock);
+	free(sh);
+	ctrlr->shared = NULL;
+}
+
+/*
+ * Get the number of secondary processes of a primary process.
+ */
+unsigned int nvme_shared_nr_secondaries(struct nvme_ctrlr *ctrlr)
+{
+	if (!ctrlr->shared || ctrlr->secondary)
+		return 0;
+
+	return ctrlr->shared->nr_clients;
+}
+
+/*
+ * Attach a shared controller: become the controller primary process
+ * if no other process owns the controller, or attach to the primary
+ * process as a secondary process. The primary process socket is bound
+ * before initializing the controller, so that a process opening the
+ * controller meanwhile waits for the primary process to be ready.
+ */
+struct nvme_ctrlr *nvme_ctrlr_attach_shared(struct pci_device *pci_dev,
+					    struct nvme_ctrlr_opts *opts)
+{
+	struct nvme_ctrlr *ctrlr;
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		nvme_err("Create socket failed %d (%s)\n",
+			 errno, strerror(errno));
+		return NULL;
+	}
+
+	len = nvme_shared_addr(pci_dev, &addr);
+
+	if (bind(fd, (struct sockaddr *)&addr, len) == 0) {
+
+		if (listen(fd, 16) < 0) {
+			nvme_err("Listen on socket failed %d (%s)\n",
+				 errno, strerror(errno));
+			goto err;
+		}
+
+		ctrlr = nvme_ctrlr_attach(pci_dev, opts);
+		if (!ctrlr)
+			goto err;
+
+		if (nvme_shared_start(ctrlr, fd) != 0) {
+			nvme_ctrlr_detach(ctrlr);
+			goto err;
+		}
+
+		nvme_info("Primary process of controller %s\n",
+			  addr.sun_path + 1);
+
+		return ctrlr;
+
+	}
+
+	if (errno != EADDRINUSE) {
+		nvme_err("Bind socket failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto err;
+	}
+
+	/* Another process owns the controller */
+	if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+		nvme_err("Connect to primary process failed %d (%s)\n",
+			 errno, strerror(errno));
+		goto err;
+	}
+
+	nvme_info("Secondary process of controller %s\n",
+		  addr.sun_path + 1);
+
+	return nvme_ctrlr_attach_secondary(pci_dev, opts, fd);
+
+err:
+	close(fd);
+
+	return NULL;
+}
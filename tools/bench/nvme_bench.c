@@ -0,0 +1,1026 @@
+/*
+ * Copyright (c) 2017, Western Digital Corporation or its affiliates.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ * Please see COPYING file for license text.
+ */
+
+/*
+ * Micro-benchmarks of libnvme internals. These do not need any NVMe
+ * device: the benchmarks use a fake controller with its registers
+ * in host memory and synthesize command completions.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "nvme_internal.h"
+
+/*
+ * Benchmark parameters.
+ */
+static struct nvme_bench {
+	int			log_level;
+	int			cpu;
+	unsigned int		qd;
+	unsigned long long	cycles;
+	int			reap;
+	unsigned int		nr_qpairs;
+	unsigned int		nr_active;
+	unsigned int		budget;
+	int			loop;
+	unsigned int		timeout;
+	unsigned int		bs;
+	int			regbuf;
+	int			umem;
+	int			memreg;
+	int			local;
+	unsigned int		nr_threads;
+	unsigned int		nr_hp;
+} nb;
+
+static void nvme_bench_usage(char *cmd)
+{
+
+	printf("Usage: %s [options] <test>\n"
+	       "Tests:\n"
+	       "  qpair : I/O qpair command submission and completion\n"
+	       "          on a synthetic completion queue\n"
+	       "  pgroup: Poll group of I/O qpairs with synthetic completion\n"
+	       "          queues, only some of the qpairs being active\n"
+	       "  vtophys: Concurrent address translations of hugepage\n"
+	       "          memory\n"
+	       "  malloc: Concurrent nvme_malloc() + nvme_free() cycles\n"
+	       "          of -qd objects of -bs bytes (default: 4096 B)\n"
+	       "Options:\n"
+	       "  -h | --help : Print this message\n"
+	       "  -l <level>  : Specify a log level between 0 and 8\n"
+	       "  -cpu <id>   : Run on the specified CPU (default: 0)\n"
+	       "  -qd <num>   : Commands submitted before being completed\n"
+	       "                (default: 32)\n"
+	       "  -n <num>    : Number of submit + complete cycles\n"
+	       "                (default: 10000000)\n"
+	       "  -reap       : Reap completions instead of using callbacks\n"
+	       "  -timeout <ms>: Enable command timeouts\n"
+	       "  -bs <bytes> : qpair test read commands transfer size\n"
+	       "                (default: 0, flush commands without data)\n"
+	       "  -regbuf     : qpair test uses a registered data buffer\n"
+	       "  -umem       : qpair test data buffer is in user memory\n"
+	       "                instead of hugepages\n"
+	       "  -memreg     : register the user memory data buffer\n"
+	       "  -local      : qpair test uses a local qpair, shared by\n"
+	       "                threads and locked\n"
+	       "  -nq <num>   : pgroup test number of qpairs (default: 8)\n"
+	       "  -na <num>   : pgroup test number of active qpairs\n"
+	       "                (default: 1)\n"
+	       "  -b <num>    : pgroup test poll budget (default: 0, no limit)\n"
+	       "  -loop       : pgroup test polls each qpair instead of using\n"
+	       "                a poll group\n"
+	       "  -nt <num>   : vtophys and malloc tests number of threads\n"
+	       "                (default: 1)\n"
+	       "  -nhp <num>  : vtophys test number of hugepages\n"
+	       "                (default: 32)\n",
+	       cmd);
+
+	exit(1);
+}
+
+static char *nvme_bench_get_params(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2)
+		nvme_bench_usage(argv[0]);
+
+	/* Initialize defaults */
+	nb.log_level = -1;
+	nb.cpu = 0;
+	nb.qd = 32;
+	nb.cycles = 10000000ULL;
+	nb.nr_qpairs = 8;
+	nb.nr_active = 1;
+	nb.nr_threads = 1;
+	nb.nr_hp = 32;
+
+	/* Parse options */
+	for (i = 1; i < argc - 1; i++) {
+
+		if (strcmp(argv[i], "-h") == 0 ||
+		    strcmp(argv[i], "--help") == 0) {
+
+			nvme_bench_usage(argv[0]);
+
+		} else if (strcmp(argv[i], "-l") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.log_level = atoi(argv[i]);
+
+		} else if (strcmp(argv[i], "-cpu") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.cpu = atoi(argv[i]);
+
+		} else if (strcmp(argv[i], "-qd") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.qd = atoi(argv[i]);
+			if (!nb.qd) {
+				fprintf(stderr, "Invalid queue depth %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-n") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.cycles = strtoull(argv[i], NULL, 10);
+			if (!nb.cycles) {
+				fprintf(stderr, "Invalid number of cycles %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-reap") == 0) {
+
+			nb.reap = 1;
+
+		} else if (strcmp(argv[i], "-timeout") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.timeout = atoi(argv[i]);
+
+		} else if (strcmp(argv[i], "-bs") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.bs = atoi(argv[i]);
+
+		} else if (strcmp(argv[i], "-regbuf") == 0) {
+
+			nb.regbuf = 1;
+
+		} else if (strcmp(argv[i], "-umem") == 0) {
+
+			nb.umem = 1;
+
+		} else if (strcmp(argv[i], "-memreg") == 0) {
+
+			nb.umem = 1;
+			nb.memreg = 1;
+
+		} else if (strcmp(argv[i], "-local") == 0) {
+
+			nb.local = 1;
+
+		} else if (strcmp(argv[i], "-nq") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.nr_qpairs = atoi(argv[i]);
+			if (!nb.nr_qpairs) {
+				fprintf(stderr, "Invalid number of qpairs %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-na") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.nr_active = atoi(argv[i]);
+			if (!nb.nr_active) {
+				fprintf(stderr, "Invalid number of active qpairs %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-b") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.budget = atoi(argv[i]);
+
+		} else if (strcmp(argv[i], "-loop") == 0) {
+
+			nb.loop = 1;
+
+		} else if (strcmp(argv[i], "-nt") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.nr_threads = atoi(argv[i]);
+			if (!nb.nr_threads) {
+				fprintf(stderr, "Invalid number of threads %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-nhp") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_bench_usage(argv[0]);
+
+			nb.nr_hp = atoi(argv[i]);
+			if (!nb.nr_hp) {
+				fprintf(stderr, "Invalid number of hugepages %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else {
+
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			exit(1);
+
+		}
+
+	}
+
+	return argv[argc - 1];
+}
+
+static int nvme_bench_init(void)
+{
+	cpu_set_t cpu_mask;
+	int ret;
+
+	/* Pin down the process on the target CPU */
+	CPU_ZERO(&cpu_mask);
+	CPU_SET(nb.cpu, &cpu_mask);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				     &cpu_mask);
+	if (ret) {
+		fprintf(stderr, "pthread_setaffinity_np failed %d (%s)\n",
+			ret, strerror(ret));
+		return -1;
+	}
+	sched_yield();
+
+	ret = nvme_lib_init(nb.log_level, -1, NULL);
+	if (ret) {
+		fprintf(stderr, "libnvme init failed %d (%s)\n",
+			ret, strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate a fake controller with its registers in host memory.
+ */
+static struct nvme_ctrlr *nvme_bench_ctrlr_alloc(void)
+{
+	struct nvme_ctrlr *ctrlr;
+	void *regs;
+
+	if (posix_memalign((void **)&ctrlr, PAGE_SIZE,
+			   sizeof(struct nvme_ctrlr)))
+		return NULL;
+	memset(ctrlr, 0, sizeof(struct nvme_ctrlr));
+
+	if (posix_memalign(&regs, PAGE_SIZE, 2 * PAGE_SIZE)) {
+		free(ctrlr);
+		return NULL;
+	}
+	memset(regs, 0, 2 * PAGE_SIZE);
+
+	ctrlr->regs = regs;
+	ctrlr->doorbell_stride_u32 = 1;
+	TAILQ_INIT(&ctrlr->free_io_qpairs);
+	TAILQ_INIT(&ctrlr->active_io_qpairs);
+	pthread_mutex_init(&ctrlr->lock, NULL);
+
+	return ctrlr;
+}
+
+static void nvme_bench_ctrlr_free(struct nvme_ctrlr *ctrlr)
+{
+	pthread_mutex_destroy(&ctrlr->lock);
+	free((void *)ctrlr->regs);
+	free(ctrlr);
+}
+
+static void nvme_bench_qpair_free(struct nvme_qpair *qpair)
+{
+	nvme_qpair_destroy(qpair);
+	if (qpair->local)
+		pthread_mutex_destroy(&qpair->lock);
+	free(qpair);
+}
+
+/*
+ * Construct an I/O qpair on a fake controller.
+ */
+static struct nvme_qpair *nvme_bench_qpair_alloc(struct nvme_ctrlr *ctrlr,
+						 unsigned int qd)
+{
+	struct nvme_qpair *qpair;
+	unsigned int entries;
+
+	qpair = calloc(1, sizeof(struct nvme_qpair));
+	if (!qpair) {
+		fprintf(stderr, "Allocate qpair failed\n");
+		return NULL;
+	}
+
+	qpair->id = 1;
+	entries = nvme_min((__u64)NVME_IO_QUEUE_MAX_ENTRIES,
+			   nvme_align_pow2(qd + 1));
+	if (nvme_qpair_construct(ctrlr, qpair, 0, entries, entries - 1,
+				 NVME_NODE_ID_ANY)) {
+		fprintf(stderr, "Construct qpair failed\n");
+		free(qpair);
+		return NULL;
+	}
+	qpair->owner = pthread_self();
+	nvme_qpair_enable(qpair);
+
+	if (nb.local) {
+		pthread_mutexattr_t attr;
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&qpair->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		qpair->local = true;
+	}
+
+	if (nb.timeout &&
+	    nvme_qpair_set_timeout(qpair, nb.timeout, NULL, NULL)) {
+		fprintf(stderr, "Set qpair timeout failed\n");
+		nvme_bench_qpair_free(qpair);
+		return NULL;
+	}
+
+	return qpair;
+}
+
+static void nvme_bench_cpl_cb(void *arg, const struct nvme_cpl *cpl)
+{
+	unsigned long long *completed = arg;
+
+	(*completed)++;
+}
+
+/*
+ * Synthetic completion queue state: the "device" consumes submission
+ * queue entries in order and posts a completion for each of them.
+ */
+struct nvme_bench_dev {
+	uint32_t	sq_head;
+	uint32_t	cq_tail;
+	uint8_t		phase;
+};
+
+static void nvme_bench_complete(struct nvme_qpair *qpair,
+				struct nvme_bench_dev *dev,
+				unsigned int nr_cpls)
+{
+	struct nvme_cpl *cpl;
+	unsigned int i;
+
+	for (i = 0; i < nr_cpls; i++) {
+
+		cpl = nvme_qpair_cq_entry(qpair, dev->cq_tail);
+		memset(cpl, 0, sizeof(struct nvme_cpl));
+		cpl->sqid = qpair->id;
+		cpl->cid = nvme_qpair_sq_entry(qpair, dev->sq_head)->cid;
+
+		if (++dev->sq_head == qpair->entries)
+			dev->sq_head = 0;
+		cpl->sqhd = dev->sq_head;
+
+		cpl->status.p = dev->phase;
+		if (++dev->cq_tail == qpair->entries) {
+			dev->cq_tail = 0;
+			dev->phase = !dev->phase;
+		}
+
+	}
+}
+
+/*
+ * Data payload of a qpair test command.
+ */
+static void nvme_bench_payload(struct nvme_payload *payload,
+			       char *data, struct nvme_buf *buf,
+			       size_t offset)
+{
+	memset(payload, 0, sizeof(struct nvme_payload));
+	if (buf) {
+		payload->type = NVME_PAYLOAD_TYPE_BUF;
+		payload->u.buf.buf = buf;
+		payload->u.buf.offset = offset;
+	} else {
+		payload->type = NVME_PAYLOAD_TYPE_CONTIG;
+		payload->u.contig = data + offset;
+	}
+}
+
+/*
+ * I/O qpair submit + complete cycles.
+ */
+static int nvme_bench_qpair(void)
+{
+	struct nvme_bench_dev dev = { 0, 0, 1 };
+	struct nvme_cpl_rec *recs = NULL;
+	struct nvme_ctrlr *ctrlr;
+	struct nvme_qpair *qpair;
+	struct nvme_request *req;
+	struct nvme_payload payload;
+	struct nvme_buf *buf = NULL;
+	char *data = NULL;
+	unsigned long long completed = 0, submitted = 0;
+	unsigned long long start, elapsed, tsc;
+	unsigned int i, nr;
+	int ret = -1;
+
+	ctrlr = nvme_bench_ctrlr_alloc();
+	if (!ctrlr) {
+		fprintf(stderr, "Allocate controller failed\n");
+		return -1;
+	}
+
+	qpair = nvme_bench_qpair_alloc(ctrlr, nb.qd);
+	if (!qpair)
+		goto out_ctrlr;
+
+	if (nb.qd > qpair->trackers) {
+		printf("Limiting queue depth to %u\n", qpair->trackers);
+		nb.qd = qpair->trackers;
+	}
+
+	if (nb.reap) {
+		recs = calloc(nb.qd, sizeof(struct nvme_cpl_rec));
+		if (!recs) {
+			fprintf(stderr, "Allocate completion records failed\n");
+			goto out_destroy;
+		}
+	}
+
+	if (nb.bs) {
+		if (nb.umem) {
+			if (posix_memalign((void **)&data, PAGE_SIZE,
+					   (size_t)nb.bs * nb.qd))
+				data = NULL;
+			else
+				memset(data, 0, (size_t)nb.bs * nb.qd);
+		} else {
+			data = nvme_malloc((size_t)nb.bs * nb.qd, PAGE_SIZE);
+		}
+		if (!data) {
+			fprintf(stderr, "Allocate data buffer failed\n");
+			goto out_destroy;
+		}
+		if (nb.memreg &&
+		    nvme_mem_register(data, (size_t)nb.bs * nb.qd)) {
+			fprintf(stderr, "Register data memory failed\n");
+			goto out_destroy;
+		}
+		if (nb.regbuf) {
+			buf = nvme_buf_register(data, (size_t)nb.bs * nb.qd);
+			if (!buf) {
+				fprintf(stderr, "Register data buffer failed\n");
+				goto out_destroy;
+			}
+		}
+	}
+
+	printf("qpair test: %llu cycles, queue depth %u, %u entries%s, %s%s%s\n",
+	       nb.cycles, nb.qd, qpair->entries,
+	       qpair->sq_segs ? " (non-contiguous)" : "",
+	       nb.reap ? "reap" : "callbacks",
+	       nb.timeout ? ", timeouts" : "",
+	       nb.local ? ", local" : "");
+	if (nb.bs)
+		printf("  %u B reads, %s data buffer in %s\n",
+		       nb.bs, buf ? "registered" : "contiguous",
+		       nb.memreg ? "registered user memory" :
+		       (nb.umem ? "user memory" : "hugepages"));
+
+	start = nvme_time_nsec();
+	tsc = nvme_rdtsc();
+
+	while (completed < nb.cycles) {
+
+		/* Submit a batch of commands */
+		for (i = 0; i < nb.qd; i++) {
+			if (nb.bs) {
+				nvme_bench_payload(&payload, data, buf,
+						   (size_t)nb.bs * i);
+				req = nvme_request_allocate(qpair, &payload,
+							    nb.bs,
+							    nvme_bench_cpl_cb,
+							    &completed);
+			} else {
+				req = nvme_request_allocate_null(qpair,
+							nvme_bench_cpl_cb,
+							&completed);
+			}
+			if (!req) {
+				fprintf(stderr, "Allocate request failed\n");
+				goto out_destroy;
+			}
+			req->cmd.opc = nb.bs ? NVME_OPC_READ : NVME_OPC_FLUSH;
+			req->cmd.nsid = 1;
+			if (nvme_qpair_submit_request(qpair, req)) {
+				fprintf(stderr, "Submit request failed\n");
+				goto out_destroy;
+			}
+		}
+		submitted += nb.qd;
+
+		/* Complete them */
+		nvme_bench_complete(qpair, &dev, nb.qd);
+		if (nb.reap) {
+			nr = nvme_qpair_reap(qpair, recs, nb.qd);
+			completed += nr;
+		} else {
+			nvme_qpair_poll(qpair, 0);
+		}
+
+	}
+
+	tsc = nvme_rdtsc() - tsc;
+	elapsed = nvme_time_nsec() - start;
+
+	printf("-> %llu commands in %.03F secs\n"
+	       "    %.03F M cycles/sec\n"
+	       "    %.01F ns, %llu TSC ticks per submit + complete cycle\n",
+	       completed,
+	       (double)elapsed / 1000000000.0,
+	       (double)completed * 1000.0 / (double)elapsed,
+	       (double)elapsed / (double)completed,
+	       tsc / completed);
+
+	ret = 0;
+
+out_destroy:
+	nvme_buf_unregister(buf);
+	if (nb.umem) {
+		if (nb.memreg)
+			nvme_mem_unregister(data);
+		free(data);
+	} else {
+		nvme_free(data);
+	}
+	free(recs);
+	nvme_bench_qpair_free(qpair);
+out_ctrlr:
+	nvme_bench_ctrlr_free(ctrlr);
+
+	return ret;
+}
+
+/*
+ * Poll group: each qpair is on its own fake controller and
+ * only nr_active qpairs have commands to complete at any time.
+ */
+struct nvme_bench_pg_qpair {
+	struct nvme_ctrlr	*ctrlr;
+	struct nvme_qpair	*qpair;
+	struct nvme_bench_dev	dev;
+};
+
+#define NVME_BENCH_IDLE_POLLS	1000000
+
+static void nvme_bench_pgroup_poll(struct nvme_poll_group *pg,
+				   struct nvme_bench_pg_qpair *pgq)
+{
+	unsigned int i;
+
+	if (nb.loop) {
+		for (i = 0; i < nb.nr_qpairs; i++)
+			nvme_qpair_poll(pgq[i].qpair, nb.budget);
+	} else {
+		nvme_poll_group_poll(pg, nb.budget);
+	}
+}
+
+static int nvme_bench_pgroup(void)
+{
+	struct nvme_bench_pg_qpair *pgq;
+	struct nvme_poll_group *pg;
+	struct nvme_request *req;
+	struct nvme_qpair *qpair;
+	unsigned long long completed = 0, target;
+	unsigned long long start, elapsed, tsc, polls = 0;
+	unsigned long long poll_tsc = 0, idle_tsc, t;
+	unsigned int i, j, n, first = 0;
+	int ret = -1;
+
+	if (nb.nr_active > nb.nr_qpairs)
+		nb.nr_active = nb.nr_qpairs;
+
+	pgq = calloc(nb.nr_qpairs, sizeof(struct nvme_bench_pg_qpair));
+	if (!pgq) {
+		fprintf(stderr, "Allocate qpairs failed\n");
+		return -1;
+	}
+
+	pg = nvme_poll_group_create();
+	if (!pg) {
+		fprintf(stderr, "Create poll group failed\n");
+		goto out;
+	}
+
+	for (i = 0; i < nb.nr_qpairs; i++) {
+		pgq[i].ctrlr = nvme_bench_ctrlr_alloc();
+		if (!pgq[i].ctrlr) {
+			fprintf(stderr, "Allocate controller failed\n");
+			goto out;
+		}
+		pgq[i].qpair = nvme_bench_qpair_alloc(pgq[i].ctrlr, nb.qd);
+		if (!pgq[i].qpair)
+			goto out;
+		pgq[i].dev.phase = 1;
+		if (nvme_poll_group_add(pg, pgq[i].qpair)) {
+			fprintf(stderr, "Add qpair to poll group failed\n");
+			goto out;
+		}
+	}
+
+	if (nb.qd > pgq[0].qpair->trackers) {
+		printf("Limiting queue depth to %u\n", pgq[0].qpair->trackers);
+		nb.qd = pgq[0].qpair->trackers;
+	}
+
+	printf("pgroup test: %llu cycles, %u qpairs, %u active, "
+	       "queue depth %u, budget %u, %s\n",
+	       nb.cycles, nb.nr_qpairs, nb.nr_active, nb.qd, nb.budget,
+	       nb.loop ? "qpairs loop" : "poll group");
+
+	start = nvme_time_nsec();
+	tsc = nvme_rdtsc();
+
+	while (completed < nb.cycles) {
+
+		/* Submit and complete a batch of commands on active qpairs */
+		for (j = 0; j < nb.nr_active; j++) {
+			n = (first + j) % nb.nr_qpairs;
+			qpair = pgq[n].qpair;
+			for (i = 0; i < nb.qd; i++) {
+				req = nvme_request_allocate_null(qpair,
+							nvme_bench_cpl_cb,
+							&completed);
+				if (!req) {
+					fprintf(stderr, "Allocate request failed\n");
+					goto out;
+				}
+				req->cmd.opc = NVME_OPC_FLUSH;
+				req->cmd.nsid = 1;
+				if (nvme_qpair_submit_request(qpair, req)) {
+					fprintf(stderr, "Submit request failed\n");
+					goto out;
+				}
+			}
+			nvme_bench_complete(qpair, &pgq[n].dev, nb.qd);
+		}
+		first = (first + nb.nr_active) % nb.nr_qpairs;
+
+		/* Poll until all completions are processed */
+		target = completed + (unsigned long long)nb.qd * nb.nr_active;
+		t = nvme_rdtsc();
+		while (completed < target) {
+			nvme_bench_pgroup_poll(pg, pgq);
+			polls++;
+		}
+		poll_tsc += nvme_rdtsc() - t;
+
+	}
+
+	tsc = nvme_rdtsc() - tsc;
+	elapsed = nvme_time_nsec() - start;
+
+	/* Poll idle qpairs */
+	t = nvme_rdtsc();
+	for (i = 0; i < NVME_BENCH_IDLE_POLLS; i++)
+		nvme_bench_pgroup_poll(pg, pgq);
+	idle_tsc = nvme_rdtsc() - t;
+
+	printf("-> %llu commands in %.03F secs, %llu polls\n"
+	       "    %.01F ns, %llu TSC ticks of polling per completion\n"
+	       "    %.01F ns, %llu TSC ticks per idle poll\n",
+	       completed,
+	       (double)elapsed / 1000000000.0,
+	       polls,
+	       (double)poll_tsc * elapsed / tsc / completed,
+	       poll_tsc / completed,
+	       (double)idle_tsc * elapsed / tsc / NVME_BENCH_IDLE_POLLS,
+	       idle_tsc / NVME_BENCH_IDLE_POLLS);
+
+	ret = 0;
+
+out:
+	nvme_poll_group_destroy(pg);
+	for (i = 0; i < nb.nr_qpairs; i++) {
+		if (pgq[i].qpair)
+			nvme_bench_qpair_free(pgq[i].qpair);
+		if (pgq[i].ctrlr)
+			nvme_bench_ctrlr_free(pgq[i].ctrlr);
+	}
+	free(pgq);
+
+	return ret;
+}
+
+/*
+ * Address translation: each thread translates random addresses
+ * of buffers spread over nr_hp hugepages.
+ */
+struct nvme_bench_vtophys_thread {
+	pthread_t		thread;
+	unsigned int		id;
+	void			**bufs;
+	unsigned long long	elapsed;
+	unsigned long long	errors;
+};
+
+#define NVME_BENCH_HP_SIZE	(2UL * 1024 * 1024)
+
+static void *nvme_bench_vtophys_thread(void *arg)
+{
+	struct nvme_bench_vtophys_thread *vt = arg;
+	unsigned long long i, start;
+	cpu_set_t cpu_mask;
+	uint64_t x = 0x9e3779b97f4a7c15ULL * (vt->id + 1);
+	char *addr;
+
+	CPU_ZERO(&cpu_mask);
+	CPU_SET((nb.cpu + vt->id) % cpui.nr_cpus, &cpu_mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask);
+
+	start = nvme_time_nsec();
+
+	for (i = 0; i < nb.cycles; i++) {
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		addr = (char *)vt->bufs[x % nb.nr_hp] +
+			((x >> 32) & (NVME_BENCH_HP_SIZE - 1));
+		if (nvme_mem_vtophys(addr) == NVME_VTOPHYS_ERROR)
+			vt->errors++;
+	}
+
+	vt->elapsed = nvme_time_nsec() - start;
+
+	return NULL;
+}
+
+static int nvme_bench_vtophys(void)
+{
+	struct nvme_bench_vtophys_thread *vt;
+	unsigned long long elapsed = 0, errors = 0;
+	void **bufs;
+	unsigned int i;
+	int ret = -1;
+
+	bufs = calloc(nb.nr_hp, sizeof(void *));
+	vt = calloc(nb.nr_threads, sizeof(struct nvme_bench_vtophys_thread));
+	if (!bufs || !vt) {
+		fprintf(stderr, "Allocate test data failed\n");
+		goto out;
+	}
+
+	/* Each buffer uses a whole hugepage */
+	for (i = 0; i < nb.nr_hp; i++) {
+		bufs[i] = nvme_malloc(NVME_BENCH_HP_SIZE, NVME_BENCH_HP_SIZE);
+		if (!bufs[i]) {
+			fprintf(stderr, "Allocate hugepage %u failed\n", i);
+			goto out;
+		}
+	}
+
+	printf("vtophys test: %llu translations per thread, %u threads, "
+	       "%u hugepages\n",
+	       nb.cycles, nb.nr_threads, nb.nr_hp);
+
+	for (i = 0; i < nb.nr_threads; i++) {
+		vt[i].id = i;
+		vt[i].bufs = bufs;
+		if (pthread_create(&vt[i].thread, NULL,
+				   nvme_bench_vtophys_thread, &vt[i])) {
+			fprintf(stderr, "Create thread %u failed\n", i);
+			nb.nr_threads = i;
+			goto out_join;
+		}
+	}
+
+	ret = 0;
+
+out_join:
+	for (i = 0; i < nb.nr_threads; i++) {
+		pthread_join(vt[i].thread, NULL);
+		elapsed = nvme_max(elapsed, vt[i].elapsed);
+		errors += vt[i].errors;
+	}
+
+	if (ret == 0) {
+		printf("-> %llu translations in %.03F secs, %llu errors\n"
+		       "    %.03F M translations/sec\n"
+		       "    %.01F ns per translation per thread\n",
+		       nb.cycles * nb.nr_threads,
+		       (double)elapsed / 1000000000.0,
+		       errors,
+		       (double)nb.cycles * nb.nr_threads * 1000.0 /
+		       (double)elapsed,
+		       (double)elapsed / (double)nb.cycles);
+		if (errors)
+			ret = -1;
+	}
+
+out:
+	if (bufs) {
+		for (i = 0; i < nb.nr_hp; i++)
+			nvme_free(bufs[i]);
+	}
+	free(bufs);
+	free(vt);
+
+	return ret;
+}
+
+/*
+ * Memory allocation: each thread allocates qd objects and frees them.
+ */
+struct nvme_bench_malloc_thread {
+	pthread_t		thread;
+	unsigned int		id;
+	unsigned long long	elapsed;
+	unsigned long long	errors;
+};
+
+static void *nvme_bench_malloc_thread(void *arg)
+{
+	struct nvme_bench_malloc_thread *mt = arg;
+	unsigned long long n = 0, start;
+	size_t size = nb.bs ? nb.bs : 4096;
+	cpu_set_t cpu_mask;
+	unsigned int i;
+	void **objs;
+
+	CPU_ZERO(&cpu_mask);
+	CPU_SET((nb.cpu + mt->id) % cpui.nr_cpus, &cpu_mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask);
+
+	objs = calloc(nb.qd, sizeof(void *));
+	if (!objs) {
+		mt->errors++;
+		return NULL;
+	}
+
+	start = nvme_time_nsec();
+
+	while (n < nb.cycles) {
+		for (i = 0; i < nb.qd; i++) {
+			objs[i] = nvme_malloc(size, 0);
+			if (!objs[i])
+				mt->errors++;
+		}
+		for (i = 0; i < nb.qd; i++)
+			nvme_free(objs[i]);
+		n += nb.qd;
+	}
+
+	mt->elapsed = nvme_time_nsec() - start;
+
+	free(objs);
+
+	return NULL;
+}
+
+static int nvme_bench_malloc(void)
+{
+	struct nvme_bench_malloc_thread *mt;
+	unsigned long long elapsed = 0, errors = 0, n;
+	struct nvme_mempool_stats mps[64];
+	struct nvme_mem_stats ms;
+	unsigned int i;
+	int ret = -1, nr_mps;
+
+	mt = calloc(nb.nr_threads, sizeof(struct nvme_bench_malloc_thread));
+	if (!mt) {
+		fprintf(stderr, "Allocate test data failed\n");
+		return -1;
+	}
+
+	n = (nb.cycles + nb.qd - 1) / nb.qd * nb.qd;
+
+	printf("malloc test: %llu allocations per thread, %u threads, "
+	       "%u objects of %u B\n",
+	       n, nb.nr_threads, nb.qd, nb.bs ? nb.bs : 4096);
+
+	for (i = 0; i < nb.nr_threads; i++) {
+		mt[i].id = i;
+		if (pthread_create(&mt[i].thread, NULL,
+				   nvme_bench_malloc_thread, &mt[i])) {
+			fprintf(stderr, "Create thread %u failed\n", i);
+			nb.nr_threads = i;
+			goto out_join;
+		}
+	}
+
+	ret = 0;
+
+out_join:
+	for (i = 0; i < nb.nr_threads; i++) {
+		pthread_join(mt[i].thread, NULL);
+		elapsed = nvme_max(elapsed, mt[i].elapsed);
+		errors += mt[i].errors;
+	}
+
+	if (ret == 0) {
+		printf("-> %llu allocations in %.03F secs, %llu errors\n"
+		       "    %.03F M malloc + free/sec\n"
+		       "    %.01F ns per malloc + free per thread\n",
+		       n * nb.nr_threads,
+		       (double)elapsed / 1000000000.0,
+		       errors,
+		       (double)n * nb.nr_threads * 1000.0 / (double)elapsed,
+		       (double)elapsed / (double)n);
+		if (nvme_memstat(&ms, NVME_NODE_ID_ANY) == 0)
+			printf("    %zu hugepages, %zu B in pools, "
+			       "%zu B free, %zu B cached\n",
+			       ms.nr_hugepages, ms.total_bytes,
+			       ms.free_bytes, ms.cached_bytes);
+		nr_mps = nvme_min(nvme_mempool_stat(mps, 64, NVME_NODE_ID_ANY),
+				  64);
+		for (i = 0; (int)i < nr_mps; i++) {
+			if (!mps[i].nr_grows)
+				continue;
+			printf("    Node %u mempool %zu B: peak %zu / %zu objects, "
+			       "%llu grows, %llu shrinks, "
+			       "%llu / %llu contended locks\n",
+			       mps[i].node_id, mps[i].size,
+			       mps[i].peak_used_objs, mps[i].nr_objs,
+			       mps[i].nr_grows, mps[i].nr_shrinks,
+			       mps[i].nr_contended, mps[i].nr_locks);
+		}
+		if (errors)
+			ret = -1;
+	}
+
+	free(mt);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char *test;
+
+	test = nvme_bench_get_params(argc, argv);
+
+	if (nvme_bench_init())
+		return 1;
+
+	if (strcmp(test, "qpair") == 0)
+		return nvme_bench_qpair() ? 1 : 0;
+
+	if (strcmp(test, "pgroup") == 0)
+		return nvme_bench_pgroup() ? 1 : 0;
+
+	if (strcmp(test, "vtophys") == 0)
+		return nvme_bench_vtophys() ? 1 : 0;
+
+	if (strcmp(test, "malloc") == 0)
+		return nvme_bench_malloc() ? 1 : 0;
+
+	fprintf(stderr, "Unknown test %s\n", test);
+	nvme_bench_usage(argv[0]);
+
+	return 1;
+}
@@ -60,6 +60,10 @@ static int nvme_info_ctrlr(struct nvme_ctrlr *ctrlr,
 
 	printf("  Model name: %s\n", cstat->mn);
 	printf("  Serial number: %s\n", cstat->sn);
+	if (cstat->node_id == NVME_NODE_ID_ANY)
+		printf("  NUMA node: none\n");
+	else
+		printf("  NUMA node: %u\n", cstat->node_id);
 	printf("  HW maximum queue entries: %u\n", rdata.mqes + 1);
 	printf("  Maximum queue depth: %u\n", cstat->max_qd);
 
@@ -46,9 +46,9 @@ static inline unsigned long long nvme_perf_time_nsec(void)
 /*
  * Elapsed test time in seconds.
  */
-static inline int nvme_perf_elapsed_secs(void)
+static inline int nvme_perf_elapsed_secs(unsigned long long start)
 {
-	return (nvme_perf_time_nsec() - nt.start) / 1000000000;
+	return (nvme_perf_time_nsec() - start) / 1000000000;
 }
 
 static void nvme_perf_usage(char *cmd)
@@ -69,11 +69,33 @@ static void nvme_perf_usage(char *cmd)
 	       "                8 = debug (debug-level messages */\n"
 	       "  -t <secs>   : Set the run time (default: 10 seconds)\n"
 	       "  -cpu <id>   : Run on the specified CPU (default: 0)\n"
+	       "  -threads <num> : Run <num> I/O threads (default: 1)\n"
+	       "                Each thread uses its own I/O queue pair\n"
+	       "                and runs on CPU <id> + thread number\n"
 	       "  -ns <id>    : Access the specified namespace (default: 1)\n"
 	       "  -rw <perc>  : <perc> %% reads and (100 - <perc>) %% writes\n"
 	       "  -qd <num>   : Issue I/Os with queue depth of <num>\n"
 	       "                Default is 1, maximum depends on the device\n"
-	       "  -rnd        : Do random I/Os (default: sequential)\n",
+	       "  -rnd        : Do random I/Os (default: sequential)\n"
+	       "  -reap       : Reap completions instead of using callbacks\n"
+	       "  -plug       : Batch I/O submissions doorbell writes\n"
+	       "  -cqb <num>  : Write the completion doorbell every <num>\n"
+	       "                completions (default: 1)\n"
+	       "  -timeout <ms>: Abort I/Os not completed within <ms>\n"
+	       "                milliseconds\n"
+	       "  -bp         : Retry I/Os rejected by the qpair instead of\n"
+	       "                letting the driver queue them\n"
+	       "  -qprio <p>[,<p>...]: Use I/O qpairs of priority <p> (0:\n"
+	       "                urgent to 3: low), cycling over the list\n"
+	       "                for each thread (default: 0)\n"
+	       "  -wrr <h>,<m>,<l>: Set the high, medium and low priority\n"
+	       "                weighted round robin arbitration weights\n"
+	       "  -iops <num> : Limit each thread to <num> I/Os per second\n"
+	       "  -mbps <num> : Limit each thread to <num> MB per second\n"
+	       "  -nslimit    : Apply the -iops and -mbps limits to the\n"
+	       "                name space instead of each thread\n"
+	       "  -shared     : Share the controller with other processes\n"
+	       "                also using this option\n",
 	       cmd);
 
 	exit(1);
@@ -94,7 +116,7 @@ static void nvme_perf_get_params(int argc, char **argv)
 	nt.ns_id = 1;
 	nt.qd = 1;
 	nt.rw = 100;
-	srand(getpid());
+	nt.nr_threads = 1;
 
 	/* Parse options */
 	for (i = 1; i < argc - 1; i++) {
@@ -140,6 +162,20 @@ static void nvme_perf_get_params(int argc, char **argv)
 				exit(1);
 			}
 
+		} else if (strcmp(argv[i], "-threads") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.nr_threads = atoi(argv[i]);
+			if (nt.nr_threads <= 0) {
+				fprintf(stderr,
+					"Invalid number of threads %s\n",
+					argv[i]);
+				exit(1);
+			}
+
 		} else if (strcmp(argv[i], "-ns") == 0) {
 
 			i++;
@@ -186,6 +222,120 @@ static void nvme_perf_get_params(int argc, char **argv)
 
 			nt.rnd = 1;
 
+		} else if (strcmp(argv[i], "-shared") == 0) {
+
+			nt.shared = 1;
+
+		} else if (strcmp(argv[i], "-reap") == 0) {
+
+			nt.reap = 1;
+
+		} else if (strcmp(argv[i], "-plug") == 0) {
+
+			nt.plug = 1;
+
+		} else if (strcmp(argv[i], "-cqb") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.cq_batch = atoi(argv[i]);
+			if (nt.cq_batch <= 0) {
+				fprintf(stderr,
+					"Invalid completion batch %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-timeout") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.timeout = atoi(argv[i]);
+			if (nt.timeout <= 0) {
+				fprintf(stderr,
+					"Invalid timeout %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-bp") == 0) {
+
+			nt.backpressure = 1;
+
+		} else if (strcmp(argv[i], "-qprio") == 0) {
+
+			char *p;
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.nr_qprios = 0;
+			for (p = strtok(argv[i], ","); p; p = strtok(NULL, ",")) {
+				if (nt.nr_qprios == NVME_QOS_CLASSES)
+					goto err;
+				nt.qprio[nt.nr_qprios] = atoi(p);
+				if (nt.qprio[nt.nr_qprios] < NVME_QPRIO_URGENT ||
+				    nt.qprio[nt.nr_qprios] > NVME_QPRIO_LOW) {
+					fprintf(stderr,
+						"Invalid queue priority %s\n",
+						p);
+					exit(1);
+				}
+				nt.nr_qprios++;
+			}
+			if (!nt.nr_qprios)
+				goto err;
+
+		} else if (strcmp(argv[i], "-iops") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.limit.iops = strtoull(argv[i], NULL, 10);
+			if (!nt.limit.iops) {
+				fprintf(stderr,
+					"Invalid IOPS limit %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-mbps") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			nt.limit.bps = strtoull(argv[i], NULL, 10) * 1000000ULL;
+			if (!nt.limit.bps) {
+				fprintf(stderr,
+					"Invalid bandwidth limit %s\n",
+					argv[i]);
+				exit(1);
+			}
+
+		} else if (strcmp(argv[i], "-nslimit") == 0) {
+
+			nt.ns_limit = 1;
+
+		} else if (strcmp(argv[i], "-wrr") == 0) {
+
+			i++;
+			if (i == (argc - 1))
+				nvme_perf_usage(argv[0]);
+
+			if (sscanf(argv[i], "%u,%u,%u",
+				   &nt.arb.high_weight,
+				   &nt.arb.medium_weight,
+				   &nt.arb.low_weight) != 3)
+				goto err;
+			nt.wrr = 1;
+
 		} else if (argv[i][0] == '-') {
 
 			fprintf(stderr,
@@ -254,10 +404,13 @@ static int nvme_perf_open_device(struct nvme_ctrlr_opts *opts)
 	nt.nr_ns = cstat.nr_ns;
 	nt.max_qd = cstat.max_qd;
 
-	if (cstat.io_qpairs != opts->io_queues)
+	if (opts->io_queues && cstat.io_qpairs != opts->io_queues)
 		printf("Number of IO qpairs limited to %u\n",
 		       cstat.io_qpairs);
 
+	if (cstat.secondary)
+		printf("Attached as a secondary process\n");
+
 	sprintf(nt.ctrlr_name, "%s (%s)", cstat.mn,
 		cstat.sn);
 
@@ -298,10 +451,8 @@ nvme_perf_sigcatcher(int sig)
 static int
 nvme_perf_init(void)
 {
-	nvme_perf_io_t *io;
 	cpu_set_t cpu_mask;
 	struct nvme_ctrlr_opts opts;
-	struct nvme_qpair_stat qpstat;
 	int i, ret;
 
 	/* Setup signal handler */
@@ -332,15 +483,56 @@ nvme_perf_init(void)
 		exit(1);
 	}
 
-	/* Initialize the controller options */
+	if (nt.cpu + nt.nr_threads > get_nprocs()) {
+		fprintf(stderr,
+			"Not enough CPUs for %d threads starting from CPU %d\n",
+			nt.nr_threads, nt.cpu);
+		return -1;
+	}
+
+	/*
+	 * Initialize the controller options: one I/O qpair per thread,
+	 * or all I/O qpairs for a shared controller.
+	 */
 	memset(&opts, 0, sizeof(struct nvme_ctrlr_opts));
-	opts.io_queues = 1;
+	if (nt.shared)
+		opts.shared = true;
+	else
+		opts.io_queues = nt.nr_threads;
+	if (nt.wrr)
+		opts.arb_mechanism = NVME_CC_AMS_WRR;
+	for (i = 0; i < nt.nr_qprios; i++)
+		if (nt.qprio[i] != NVME_QPRIO_URGENT)
+			opts.arb_mechanism = NVME_CC_AMS_WRR;
 
 	/* Grab the device */
 	ret = nvme_perf_open_device(&opts);
 	if (ret)
 		return -1;
 
+	if (nt.ns_limit && (nt.limit.iops || nt.limit.bps)) {
+		ret = nvme_ns_set_rate_limit(nt.ns, &nt.limit);
+		if (ret) {
+			fprintf(stderr, "Set name space rate limit failed\n");
+			return -1;
+		}
+	}
+
+	if (nt.wrr) {
+		struct nvme_arbitration arb;
+
+		/* Keep the current arbitration burst */
+		ret = nvme_ctrlr_get_arbitration(nt.ctrlr, &arb);
+		if (ret == 0) {
+			nt.arb.burst = arb.burst;
+			ret = nvme_ctrlr_set_arbitration(nt.ctrlr, &nt.arb);
+		}
+		if (ret) {
+			fprintf(stderr, "Set arbitration weights failed\n");
+			return -1;
+		}
+	}
+
 	if (nt.io_size % nt.sectsize) {
 		fprintf(stderr,
 			"Invalid I/O size %zu B: must be a multiple "
@@ -358,77 +550,195 @@ nvme_perf_init(void)
 		return -1;
 	}
 
-	/* Get an I/O queue pair */
-	nt.qpair = nvme_ioqp_get(nt.ctrlr, 0, 0);
-	if (!nt.qpair) {
+	/* Allocate threads */
+	nt.threads = calloc(nt.nr_threads, sizeof(nvme_perf_thread_t));
+	if (!nt.threads) {
+		fprintf(stderr, "Allocate thread array failed\n");
+		return -1;
+	}
+
+	ret = pthread_barrier_init(&nt.barrier, NULL, nt.nr_threads);
+	if (ret) {
+		fprintf(stderr, "Initialize thread barrier failed\n");
+		free(nt.threads);
+		nt.threads = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+nvme_perf_end(void)
+{
+
+	if (nt.threads) {
+		pthread_barrier_destroy(&nt.barrier);
+		free(nt.threads);
+	}
+
+	/* Close device file */
+	if (nt.ctrlr) {
+
+		printf("Detaching NVMe controller %04x:%02x:%02x.%x\n",
+		       nt.slot.domain,
+		       nt.slot.bus,
+		       nt.slot.dev,
+		       nt.slot.func);
+
+		if (nt.ns)
+			nvme_ns_close(nt.ns);
+
+		nvme_ctrlr_close(nt.ctrlr);
+
+	}
+
+	return;
+}
+
+static void
+nvme_perf_io_timeout(void *arg, struct nvme_qpair *qpair, void *cmd_cb_arg)
+{
+	nvme_perf_thread_t *th = arg;
+
+	th->io_timeouts++;
+}
+
+static int
+nvme_perf_thread_init(nvme_perf_thread_t *th)
+{
+	nvme_perf_io_t *io;
+	cpu_set_t cpu_mask;
+	struct nvme_qpair_stat qpstat;
+	int i, ret;
+
+	/* Pin down the thread on its CPU */
+	CPU_ZERO(&cpu_mask);
+	CPU_SET(th->cpu, &cpu_mask);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				     &cpu_mask);
+	if (ret) {
+		fprintf(stderr,
+			"pthread_setaffinity_np failed %d (%s)\n",
+			ret,
+			strerror(ret));
+		return -1;
+	}
+	sched_yield();
+
+	/*
+	 * Get an I/O queue pair: getting it from this thread
+	 * makes this thread the owner of the queue pair.
+	 */
+	th->qpair = nvme_ioqp_get(nt.ctrlr,
+				  nt.nr_qprios ?
+				  nt.qprio[th->id % nt.nr_qprios] : 0,
+				  nt.qd + 1);
+	if (!th->qpair) {
 		fprintf(stderr, "Allocate I/O qpair failed\n");
 		return -1;
 	}
 
-	ret = nvme_qpair_stat(nt.qpair, &qpstat);
+	ret = nvme_qpair_stat(th->qpair, &qpstat);
 	if (ret) {
 		fprintf(stderr, "Get I/O qpair information failed\n");
 		return -1;
 	}
-	printf("Qpair %u, depth: %u\n", qpstat.id, qpstat.qd);
+	printf("Thread %d: CPU %d, qpair %u, depth: %u\n",
+	       th->id, th->cpu, qpstat.id, qpstat.qd);
+
+	if (nt.cq_batch) {
+		ret = nvme_ioqp_set_cq_batch(th->qpair, nt.cq_batch);
+		if (ret < 0) {
+			fprintf(stderr, "Set completion batch failed\n");
+			return -1;
+		}
+		if (ret != nt.cq_batch)
+			printf("Thread %d: completion batch limited to %d\n",
+			       th->id, ret);
+	}
+
+	if (nt.timeout) {
+		ret = nvme_ioqp_set_timeout(th->qpair, nt.timeout,
+					    nvme_perf_io_timeout, th);
+		if (ret) {
+			fprintf(stderr, "Set I/O timeout failed\n");
+			return -1;
+		}
+	}
+
+	if (!nt.ns_limit && (nt.limit.iops || nt.limit.bps)) {
+		ret = nvme_ioqp_set_rate_limit(th->qpair, &nt.limit);
+		if (ret) {
+			fprintf(stderr, "Set I/O rate limit failed\n");
+			return -1;
+		}
+	}
+
+	if (nt.backpressure) {
+		ret = nvme_ioqp_set_backpressure(th->qpair, true);
+		if (ret) {
+			fprintf(stderr, "Set backpressure mode failed\n");
+			return -1;
+		}
+	}
 
 	/* Allocate I/Os */
-	nt.io = calloc(nt.qd, sizeof(nvme_perf_io_t));
-	if (!nt.io) {
+	th->io = calloc(nt.qd, sizeof(nvme_perf_io_t));
+	if (!th->io) {
 		fprintf(stderr, "Allocate I/O array failed\n");
 		return -1;
 	}
 
 	/* Allocate I/O buffers */
 	for (i = 0; i < nt.qd; i++) {
-		io = &nt.io[i];
+		io = &th->io[i];
+		io->thread = th;
 		io->size = nt.io_size / nt.sectsize;
 		io->buf = nvme_zmalloc(nt.io_size, nt.sectsize);
 		if (!io->buf) {
 			fprintf(stderr, "io buffer allocation failed\n");
 			return -1;
 		}
-		nvme_perf_ioq_add(&nt.free_ioq, io);
+		nvme_perf_ioq_add(&th->free_ioq, io);
+	}
+
+	/* Allocate completion records */
+	if (nt.reap) {
+		th->recs = calloc(nt.qd, sizeof(struct nvme_cpl_rec));
+		if (!th->recs) {
+			fprintf(stderr, "Allocate completion records failed\n");
+			return -1;
+		}
 	}
 
+	/* Start sequential I/Os of each thread at a different offset */
+	th->seed = getpid() + th->id;
+	th->io_ofst = (nt.nr_sectors / nt.nr_threads) * th->id * nt.sectsize;
+	th->io_ofst -= th->io_ofst % nt.io_size;
+
 	return 0;
 }
 
 static void
-nvme_perf_end(void)
+nvme_perf_thread_end(nvme_perf_thread_t *th)
 {
 	nvme_perf_io_t *io;
 	int i;
 
-	/* Close device file */
-	if (nt.ctrlr) {
-
-		printf("Detaching NVMe controller %04x:%02x:%02x.%x\n",
-		       nt.slot.domain,
-		       nt.slot.bus,
-		       nt.slot.dev,
-		       nt.slot.func);
-
-		if (nt.qpair)
-			nvme_ioqp_release(nt.qpair);
-
-		if (nt.ns)
-			nvme_ns_close(nt.ns);
-
-		nvme_ctrlr_close(nt.ctrlr);
-
-	}
+	if (th->qpair)
+		nvme_ioqp_release(th->qpair);
 
-	if (nt.io) {
+	if (th->io) {
 		for (i = 0; i < nt.qd; i++) {
-			io = &nt.io[i];
+			io = &th->io[i];
 			if (io->buf)
 				nvme_free(io->buf);
 		}
-		free(nt.io);
+		free(th->io);
 	}
 
-	return;
+	free(th->recs);
 }
 
 static void
@@ -436,16 +746,17 @@ nvme_perf_io_end(void *arg,
 		 const struct nvme_cpl *cpl)
 {
 	nvme_perf_io_t *io = arg;
+	nvme_perf_thread_t *th = io->thread;
 
-	nvme_perf_ioq_remove(&nt.pend_ioq, io);
-	nvme_perf_ioq_add(&nt.free_ioq, io);
+	nvme_perf_ioq_remove(&th->pend_ioq, io);
+	nvme_perf_ioq_add(&th->free_ioq, io);
 
-	nt.io_count++;
-	nt.io_bytes += nt.io_size;
+	th->io_count++;
+	th->io_bytes += nt.io_size;
 }
 
 static int
-nvme_perf_set_io(nvme_perf_io_t *io)
+nvme_perf_set_io(nvme_perf_thread_t *th, nvme_perf_io_t *io)
 {
 	unsigned long long ofst;
 	int rw;
@@ -456,7 +767,7 @@ nvme_perf_set_io(nvme_perf_io_t *io)
 	} else if ( nt.rw == 0 ) {
 		rw = NVME_TEST_WRITE;
 	} else {
-		rw = (int)((100UL * (unsigned long)rand())
+		rw = (int)((100UL * (unsigned long)rand_r(&th->seed))
 			   / (unsigned long)RAND_MAX);
 		if (rw <= nt.rw)
 			rw = NVME_TEST_READ;
@@ -467,13 +778,13 @@ nvme_perf_set_io(nvme_perf_io_t *io)
 	/* Setup I/O offset */
 	if (nt.rnd)
 		/* Random I/O offset */
-		ofst = (double)(nt.nr_sectors - io->size) * (double) rand()
-			/ (double) RAND_MAX;
+		ofst = (double)(nt.nr_sectors - io->size)
+			* (double) rand_r(&th->seed) / (double) RAND_MAX;
 	else {
-		ofst = nt.io_ofst / nt.sectsize;
-		nt.io_ofst += nt.io_size;
-		if (nt.io_ofst >= nt.nr_sectors * nt.sectsize)
-			nt.io_ofst = 0;
+		ofst = th->io_ofst / nt.sectsize;
+		th->io_ofst += nt.io_size;
+		if (th->io_ofst >= nt.nr_sectors * nt.sectsize)
+			th->io_ofst = 0;
 	}
 	io->ofst = ofst;
 
@@ -481,82 +792,215 @@ nvme_perf_set_io(nvme_perf_io_t *io)
 }
 
 static int
-nvme_perf_submit_io(void)
+nvme_perf_submit_io(nvme_perf_thread_t *th)
 {
 	nvme_perf_io_t *io;
 	ssize_t ret;
 	int rw;
 
 	/* Prepare I/Os */
-	while ((io = (nvme_perf_io_t *) nvme_perf_ioq_get(&nt.free_ioq)) &&
+	while ((io = (nvme_perf_io_t *) nvme_perf_ioq_get(&th->free_ioq)) &&
 	       !nt.abort) {
 
-		nvme_perf_ioq_add(&nt.pend_ioq, io);
+		nvme_perf_ioq_add(&th->pend_ioq, io);
 
-		rw = nvme_perf_set_io(io);
+		rw = nvme_perf_set_io(th, io);
 		if (rw == NVME_TEST_READ)
-			ret = nvme_ns_read(nt.ns, nt.qpair,
+			ret = nvme_ns_read(nt.ns, th->qpair,
 					   io->buf,
 					   io->ofst,
 					   io->size,
 					   nvme_perf_io_end, io, 0);
 		else
-			ret = nvme_ns_write(nt.ns, nt.qpair,
+			ret = nvme_ns_write(nt.ns, th->qpair,
 					    io->buf,
 					    io->ofst,
 					    io->size,
 					    nvme_perf_io_end, io, 0);
 
+		if (ret == -EAGAIN) {
+			/* Qpair full: retry after polling */
+			nvme_perf_ioq_remove(&th->pend_ioq, io);
+			nvme_perf_ioq_add(&th->free_ioq, io);
+			th->io_eagain++;
+			return -EAGAIN;
+		}
+
 		if (ret) {
 			fprintf(stderr, "Submit I/O failed\n");
-			nvme_perf_ioq_remove(&nt.pend_ioq, io);
-			nvme_perf_ioq_add(&nt.free_ioq, io);
+			nvme_perf_ioq_remove(&th->pend_ioq, io);
+			nvme_perf_ioq_add(&th->free_ioq, io);
 			nt.abort = 1;
 			return -1;
 		}
 
 	}
 
+	if (io)
+		nvme_perf_ioq_add(&th->free_ioq, io);
+
 	return 0;
 }
 
+/*
+ * Process completed I/Os.
+ */
+static void
+nvme_perf_poll(nvme_perf_thread_t *th)
+{
+	unsigned int i, nr;
+
+	if (!nt.reap) {
+		nvme_ioqp_poll(th->qpair, nt.qd);
+		return;
+	}
+
+	nr = nvme_ioqp_reap(th->qpair, th->recs, nt.qd);
+	for (i = 0; i < nr; i++)
+		nvme_perf_io_end(th->recs[i].cb_arg, NULL);
+}
+
 /**
  * Run the test: do I/Os.
  */
 static void
-nvme_perf_run(void)
+nvme_perf_run(nvme_perf_thread_t *th)
 {
+	int ret;
 
 	/* Start */
-	nt.start = nvme_perf_time_nsec();
+	th->start = nvme_perf_time_nsec();
 
 	/* Run for requested time */
-	while(nvme_perf_elapsed_secs() < nt.run_secs &&
+	while(nvme_perf_elapsed_secs(th->start) < nt.run_secs &&
 	      !nt.abort) {
 
-		if (nvme_perf_submit_io() != 0)
+		if (nt.plug)
+			nvme_ioqp_plug(th->qpair);
+
+		ret = nvme_perf_submit_io(th);
+
+		if (nt.plug)
+			nvme_ioqp_unplug(th->qpair);
+
+		if (ret == -EAGAIN) {
+			nvme_perf_poll(th);
+			continue;
+		}
+
+		if (ret != 0)
 			break;
 
-		while (nvme_perf_ioq_empty(&nt.free_ioq))
-			nvme_ioqp_poll(nt.qpair, nt.qd);
+		while (nvme_perf_ioq_empty(&th->free_ioq))
+			nvme_perf_poll(th);
 
 	}
 
 	/* Wait for remaining started I/Os */
-	while (!nvme_perf_ioq_empty(&nt.pend_ioq))
-		nvme_ioqp_poll(nt.qpair, nt.qd);
+	while (!nvme_perf_ioq_empty(&th->pend_ioq))
+		nvme_perf_poll(th);
+
+	nvme_qpair_stat(th->qpair, &th->qpstat);
 
 	/* Stop */
-	nt.end = nvme_perf_time_nsec();
+	th->end = nvme_perf_time_nsec();
 }
 
-int main(int argc, char **argv)
+/*
+ * I/O thread: setup the thread I/O qpair and buffers,
+ * wait for all threads to be ready and run the test.
+ */
+static void *
+nvme_perf_thread(void *arg)
 {
-	unsigned long long elapsed;
+	nvme_perf_thread_t *th = arg;
+
+	th->ret = nvme_perf_thread_init(th);
+	if (th->ret)
+		nt.abort = 1;
+
+	pthread_barrier_wait(&nt.barrier);
+
+	if (!nt.abort)
+		nvme_perf_run(th);
+
+	nvme_perf_thread_end(th);
+
+	return NULL;
+}
+
+/*
+ * Start all threads and wait for them to complete.
+ */
+static int
+nvme_perf_run_threads(void)
+{
+	nvme_perf_thread_t *th;
+	int i, ret = 0;
+
+	for (i = 0; i < nt.nr_threads; i++) {
+		th = &nt.threads[i];
+		th->id = i;
+		th->cpu = nt.cpu + i;
+		ret = pthread_create(&th->thread, NULL, nvme_perf_thread, th);
+		if (ret) {
+			fprintf(stderr,
+				"Create thread %d failed %d (%s)\n",
+				i, ret, strerror(ret));
+			/* Threads started wait on the barrier: give up */
+			exit(1);
+		}
+	}
+
+	nt.start = ULLONG_MAX;
+	for (i = 0; i < nt.nr_threads; i++) {
+		th = &nt.threads[i];
+		pthread_join(th->thread, NULL);
+		if (th->ret)
+			ret = -1;
+
+		if (th->start < nt.start)
+			nt.start = th->start;
+		if (th->end > nt.end)
+			nt.end = th->end;
+		nt.io_count += th->io_count;
+		nt.io_bytes += th->io_bytes;
+	}
+
+	return ret;
+}
+
+static void
+nvme_perf_print_stats(const char *name,
+		      unsigned long long start,
+		      unsigned long long end,
+		      unsigned long long io_count,
+		      unsigned long long io_bytes)
+{
+	unsigned long long elapsed = end - start;
 	long long rate;
+
+	if (!elapsed || !io_count)
+		return;
+
+	rate = io_bytes * 1000000000 / elapsed;
+
+	printf("-> %s%lld I/Os in %.03F secs\n"
+	       "    %.03F MB/sec, %lld IOPS\n",
+	       name,
+	       io_count,
+	       (double)elapsed / 1000000000.0,
+	       (double)rate / 1000000.0,
+	       io_count * 1000000000 / elapsed);
+}
+
+int main(int argc, char **argv)
+{
+	nvme_perf_thread_t *th;
+	char name[32];
 	double sz;
 	char *unit;
-	int ret;
+	int i, ret;
 
 	/* Parse command line */
 	nvme_perf_get_params(argc, argv);
@@ -582,32 +1026,56 @@ int main(int argc, char **argv)
 	       nt.nr_sectors,
 	       nt.sectsize);
 
-	printf("Starting test on CPU %d for %d seconds:\n"
+	printf("Starting test with %d thread%s on CPU %d%s for %d seconds:\n"
 	       "    %d %% read I/O, %d %% write I/Os\n"
 	       "    %zu B I/O size, %s access, qd %d\n",
-	       nt.cpu, nt.run_secs,
+	       nt.nr_threads, (nt.nr_threads > 1) ? "s" : "",
+	       nt.cpu, (nt.nr_threads > 1) ? " and up" : "",
+	       nt.run_secs,
 	       nt.rw, 100 - nt.rw,
 	       nt.io_size,
 	       nt.rnd ? "random" : "sequential",
 	       nt.qd);
 
 	/* Run test */
-	nvme_perf_run();
-
-	elapsed = nt.end - nt.start;
-	if (elapsed && nt.io_count) {
-
-		rate = nt.io_bytes * 1000000000 / elapsed;
+	ret = nvme_perf_run_threads();
+	if (ret)
+		goto out;
 
-		printf("-> %lld I/Os in %.03F secs\n"
-		       "    %.03F MB/sec, %lld IOPS\n"
-		       "    %.03F usecs average I/O latency\n",
-		       nt.io_count,
-		       (double)elapsed / 1000000000.0,
-		       (double)rate / 1000000.0,
-		       nt.io_count * 1000000000 / elapsed,
-		       ((double)elapsed / nt.io_count) / 1000.0);
+	if (nt.nr_threads > 1) {
+		for (i = 0; i < nt.nr_threads; i++) {
+			th = &nt.threads[i];
+			sprintf(name, "Thread %d: ", i);
+			nvme_perf_print_stats(name, th->start, th->end,
+					      th->io_count, th->io_bytes);
+		}
+		nvme_perf_print_stats("Total: ", nt.start, nt.end,
+				      nt.io_count, nt.io_bytes);
+	} else {
+		nvme_perf_print_stats("", nt.start, nt.end,
+				      nt.io_count, nt.io_bytes);
+	}
 
+	if (nt.io_count)
+		printf("    %.03F usecs average I/O latency\n",
+		       ((double)(nt.end - nt.start) * nt.nr_threads
+			/ nt.io_count) / 1000.0);
+
+	for (i = 0; i < nt.nr_threads; i++)
+		if (nt.threads[i].io_timeouts)
+			printf("    Thread %d: %llu I/Os timed out\n",
+			       i, nt.threads[i].io_timeouts);
+
+	for (i = 0; i < nt.nr_threads; i++) {
+		th = &nt.threads[i];
+		if (th->qpstat.max_queued)
+			printf("    Thread %d: up to %u I/Os queued, "
+			       "%llu I/Os queued in total\n",
+			       i, th->qpstat.max_queued,
+			       th->qpstat.total_queued);
+		if (th->io_eagain)
+			printf("    Thread %d: %llu I/O submissions retried\n",
+			       i, th->io_eagain);
 	}
 
 out:
@@ -5,6 +5,8 @@
  * Please see COPYING file for license text.
  */
 
+#include <pthread.h>
+
 #include "libnvme/nvme.h"
 
 /*
@@ -27,6 +29,9 @@ typedef struct nvme_perf_io {
 	long long		ofst;
 	size_t			size;
 
+	/* Thread issuing the I/O */
+	struct nvme_perf_thread	*thread;
+
 } nvme_perf_io_t;
 
 /*
@@ -37,6 +42,41 @@ typedef struct nvme_perf_ioq {
 	nvme_perf_io_t		*tail;
 } nvme_perf_ioq_t;
 
+/*
+ * I/O thread: each thread uses its own I/O queue pair.
+ */
+typedef struct nvme_perf_thread {
+
+	int			id;
+	int			cpu;
+	pthread_t		thread;
+	int			ret;
+
+	struct nvme_qpair	*qpair;
+
+	/*
+	 * I/O control.
+	 */
+	unsigned int		seed;
+	unsigned long long	io_ofst;
+	nvme_perf_io_t		*io;
+	nvme_perf_ioq_t		free_ioq;
+	nvme_perf_ioq_t		pend_ioq;
+	struct nvme_cpl_rec	*recs;
+
+	/*
+	 * I/O stats.
+	 */
+	unsigned long long	start;
+	unsigned long long	end;
+	unsigned long long	io_count;
+	unsigned long long	io_bytes;
+	unsigned long long	io_timeouts;
+	unsigned long long	io_eagain;
+	struct nvme_qpair_stat	qpstat;
+
+} nvme_perf_thread_t;
+
 /*
  * Run parameters.
  */
@@ -64,6 +104,19 @@ typedef struct nvme_perf {
 	size_t			io_size;
 	int			run_secs;
 	int			memstat;
+	int			nr_threads;
+	int			plug;
+	int			reap;
+	int			cq_batch;
+	int			timeout;
+	int			backpressure;
+	int			nr_qprios;
+	int			qprio[NVME_QOS_CLASSES];
+	int			wrr;
+	struct nvme_arbitration	arb;
+	struct nvme_rate_limit	limit;
+	int			ns_limit;
+	int			shared;
 
 	/*
 	 * Device data.
@@ -77,15 +130,12 @@ typedef struct nvme_perf {
 
 	struct nvme_ctrlr	*ctrlr;
 	struct nvme_ns		*ns;
-	struct nvme_qpair	*qpair;
 
 	/*
-	 * I/O control.
+	 * I/O threads.
 	 */
-	unsigned long long	io_ofst;
-	nvme_perf_io_t		*io;
-	nvme_perf_ioq_t		free_ioq;
-	nvme_perf_ioq_t		pend_ioq;
+	nvme_perf_thread_t	*threads;
+	pthread_barrier_t	barrier;
 
 	/*
 	 * I/O stats.